@@ -46,6 +46,7 @@
 #include <asm/unistd_64.h>
 
 #include "oplogger.h"
+#include "pathdesc.h"
 #include "tabhash.h"
 #include "list.h"
 #include "avl.h"
@@ -59,6 +60,12 @@ struct lru_bucket {
 
 struct ns_cache {
     struct lru_bucket *buckets;
+    /* the same entries by the state of their parent path, to walk the children of a directory */
+    struct list_head *dir_buckets;
+    /* entries whose parent is not cached, which a walk from the parent can not reach */
+    int nr_orphans;
+    /* dirty entries displaced by a rename, kept until the next checkpoint */
+    struct list_head shadowed;
     TAB_hash hf;
     int count;
     size_t version;
@@ -68,9 +75,23 @@ struct ns_cache {
 
 struct ns_entry {
     struct list_head node;
+    struct list_head sibling;
     struct ethane_dentry dentry;
     size_t version;
     bool is_create;
+    /* an existing dentry linked under a new name, see sharedfs_ns_update_record_t */
+    bool is_move;
+    /* held by an in-progress batch lookup */
+    bool pinned;
+    /* dentry.flags or dentry.inline_data changed since the last checkpoint */
+    bool inline_dirty;
+    /* a tombstone for a whole subtree, see cachefs_rmtree() */
+    bool is_rmtree;
+    /* path state of full_path and of its parent path, see pathdesc.h */
+    uint64_t path_state, parent_state;
+    /* cached children, the entry is not evicted before them */
+    int nr_children;
+    bool orphan;
     char full_path[];
 };
 
@@ -102,6 +123,9 @@ struct cachefs {
      * and can be evicted.
      */
     size_t version;
+
+    cachefs_rename_cb_t rename_cb;
+    void *rename_cb_priv;
 };
 
 void cachefs_set_version(cachefs_t *cfs, size_t version) {
@@ -120,7 +144,7 @@ void cachefs_set_version(cachefs_t *cfs, size_t version) {
 /* Namespace Cache */
 
 static inline bool nsc_entry_evictable(struct ns_cache *cache, struct ns_entry *entry) {
-    return entry->version < cache->version;
+    return entry->version < cache->version && !entry->pinned && !entry->nr_children;
 }
 
 static inline int nsc_remove(struct ns_cache *cache, struct ns_entry *entry);
@@ -146,8 +170,8 @@ out:
     return nr_evicted;
 }
 
-static inline size_t full_path_hash(struct ns_cache *cache, const char *full_path, size_t len) {
-    return TAB_finalize(&cache->hf, TAB_process(&cache->hf, (const uint8_t *) full_path, len, 0));
+static inline size_t full_path_hash(struct ns_cache *cache, uint64_t path_state) {
+    return TAB_finalize(&cache->hf, path_state);
 }
 
 static inline void nsc_lru_update(struct lru_bucket *bucket, struct ns_entry *entry) {
@@ -164,7 +188,7 @@ static inline void nsc_lru_add(struct ns_cache *cache, struct lru_bucket *bucket
         nr_evict = nsc_entry_evict(cache, bucket, nr_evict);
         bucket->count -= nr_evict;
         cache->count -= nr_evict;
-        // pr_info("evicted %d entries from bucket %ld", nr_evict, full_path_hash(cache, entry->full_path, strlen(entry->full_path)) % cache->nr_buckets);
+        // pr_info("evicted %d entries from bucket %ld", nr_evict, full_path_hash(cache, entry->path_state) % cache->nr_buckets);
     }
 
     /* add to LRU list head */
@@ -182,14 +206,15 @@ static inline void nsc_lru_del(struct ns_cache *cache, struct lru_bucket *bucket
     cache->count--;
 }
 
-static inline struct ns_entry *nsc_lookup(struct ns_cache *cache, const char *full_path, size_t len) {
+/* Lookup without touching the LRU order, safe while a bucket is being evicted */
+static inline struct ns_entry *nsc_find(struct ns_cache *cache, const char *full_path, size_t len,
+                                        uint64_t path_state) {
     struct lru_bucket *bucket;
     struct ns_entry *entry;
 
-    bucket = &cache->buckets[full_path_hash(cache, full_path, len) % cache->nr_buckets];
+    bucket = &cache->buckets[full_path_hash(cache, path_state) % cache->nr_buckets];
     list_for_each_entry(entry, &bucket->head, node) {
         if (strlen(entry->full_path) == len && strncmp(entry->full_path, full_path, len) == 0) {
-            nsc_lru_update(bucket, entry);
             goto out;
         }
     }
@@ -200,11 +225,97 @@ out:
     return entry;
 }
 
-static inline int nsc_insert(struct ns_cache *cache, struct ns_entry *entry) {
-    int bucketn = full_path_hash(cache, entry->full_path, strlen(entry->full_path)) % cache->nr_buckets;
+static inline struct ns_entry *nsc_lookup(struct ns_cache *cache, const char *full_path, size_t len,
+                                          uint64_t path_state) {
+    struct ns_entry *entry = nsc_find(cache, full_path, len, path_state);
+    if (entry) {
+        nsc_lru_update(&cache->buckets[full_path_hash(cache, path_state) % cache->nr_buckets], entry);
+    }
+    return entry;
+}
+
+/* Length of the parent path of @full_path, 0 for the root itself */
+static inline size_t parent_path_len(const char *full_path) {
+    size_t len = strrchr(full_path, '/') - full_path;
+    return len || !full_path[1] ? len : 1;
+}
+
+/* Length of a directory path as a prefix of its children's paths, 0 for the root */
+static inline size_t dir_prefix_len(const char *dir, size_t len) {
+    return dir[1] ? len : 0;
+}
+
+static inline bool is_child_path(const char *path, const char *dir, size_t dir_len) {
+    dir_len = dir_prefix_len(dir, dir_len);
+    return strncmp(path, dir, dir_len) == 0 && path[dir_len] == '/' &&
+           path[dir_len + 1] && !strchr(path + dir_len + 1, '/');
+}
+
+static inline uint64_t parent_path_state(const char *full_path) {
+    return path_state(full_path, parent_path_len(full_path));
+}
+
+/* The entries whose parent path has the state @dir_state, along with some of other directories */
+static inline struct list_head *nsc_dir_bucket(struct ns_cache *cache, uint64_t dir_state) {
+    return &cache->dir_buckets[full_path_hash(cache, dir_state) % cache->nr_buckets];
+}
+
+/* The cached parent of @entry, NULL for the root and for orphans */
+static inline struct ns_entry *nsc_find_parent(struct ns_cache *cache, struct ns_entry *entry) {
+    size_t len = parent_path_len(entry->full_path);
+    return len ? nsc_find(cache, entry->full_path, len, entry->parent_state) : NULL;
+}
+
+/* Count @entry in its parent, or as an orphan if the parent is not cached. */
+static inline void nsc_link_parent(struct ns_cache *cache, struct ns_entry *entry) {
+    struct ns_entry *parent = nsc_find_parent(cache, entry);
+
+    if (parent) {
+        parent->nr_children++;
+    } else if (entry->full_path[1]) {
+        entry->orphan = true;
+        cache->nr_orphans++;
+    }
+}
+
+static inline void nsc_unlink_parent(struct ns_cache *cache, struct ns_entry *entry) {
+    struct ns_entry *parent;
+
+    if (entry->orphan) {
+        entry->orphan = false;
+        cache->nr_orphans--;
+    } else if ((parent = nsc_find_parent(cache, entry))) {
+        parent->nr_children--;
+    }
+}
+
+/* Set the cached children of @dir as orphans of it (@adopt = false) or as its children. */
+static inline void nsc_update_children(struct ns_cache *cache, struct ns_entry *dir, bool adopt) {
+    size_t len = strlen(dir->full_path);
+    struct ns_entry *child;
+
+    list_for_each_entry(child, nsc_dir_bucket(cache, dir->path_state), sibling) {
+        if (child == dir || child->orphan != adopt || !is_child_path(child->full_path, dir->full_path, len)) {
+            continue;
+        }
+        child->orphan = !adopt;
+        cache->nr_orphans += adopt ? -1 : 1;
+        dir->nr_children += adopt ? 1 : -1;
+    }
+}
+
+static inline int nsc_insert(struct ns_cache *cache, struct ns_entry *entry, uint64_t path_state) {
+    int bucketn = full_path_hash(cache, path_state) % cache->nr_buckets;
     struct lru_bucket *bucket;
+    entry->path_state = path_state;
+    entry->parent_state = parent_path_state(entry->full_path);
+    entry->nr_children = 0;
+    entry->orphan = false;
     bucket = &cache->buckets[bucketn];
     nsc_lru_add(cache, bucket, entry);
+    nsc_link_parent(cache, entry);
+    nsc_update_children(cache, entry, true);
+    list_add(&entry->sibling, nsc_dir_bucket(cache, entry->parent_state));
     pr_debug("bucket: %d; dentry: %lx(%s); path: %s; create: %d",
              bucketn, entry->dentry.remote_addr, get_de_ty_str(entry->dentry.type),
              entry->full_path, entry->is_create);
@@ -212,16 +323,45 @@ static inline int nsc_insert(struct ns_cache *cache, struct ns_entry *entry) {
 }
 
 static inline int nsc_remove(struct ns_cache *cache, struct ns_entry *entry) {
-    int bucketn = full_path_hash(cache, entry->full_path, strlen(entry->full_path)) % cache->nr_buckets;
+    int bucketn = full_path_hash(cache, entry->path_state) % cache->nr_buckets;
     struct lru_bucket *bucket;
     bucket = &cache->buckets[bucketn];
     nsc_lru_del(cache, bucket, entry);
+    list_del(&entry->sibling);
+    nsc_unlink_parent(cache, entry);
+    if (entry->nr_children) {
+        nsc_update_children(cache, entry, false);
+    }
     pr_debug("bucket: %d; dentry: %lx(%s); path: %s; create: %d",
              bucketn, entry->dentry.remote_addr, get_de_ty_str(entry->dentry.type),
              entry->full_path, entry->is_create);
     return 0;
 }
 
+/* Drop @entry from lookups; its pending update (if any) still goes to the next checkpoint. */
+static inline void nsc_shadow(struct ns_cache *cache, struct ns_entry *entry) {
+    nsc_remove(cache, entry);
+    if (entry->version < cache->version) {
+        free(entry);
+    } else {
+        list_add(&entry->node, &cache->shadowed);
+    }
+}
+
+/*
+ * Lookup the entry to reuse for a file made at the given path. A removed subtree waiting
+ * for the checkpoint is set aside instead, or its reclamation would be lost.
+ */
+static inline struct ns_entry *nsc_lookup_for_create(struct ns_cache *cache, const char *full_path, size_t len,
+                                                     uint64_t path_state) {
+    struct ns_entry *entry = nsc_lookup(cache, full_path, len, path_state);
+    if (entry && entry->is_rmtree && !entry->pinned) {
+        nsc_shadow(cache, entry);
+        entry = NULL;
+    }
+    return entry;
+}
+
 /* Block Mapping Cache */
 
 static inline bool bmc_entry_evictable(struct bm_cache *cache, struct bm_entry *entry) {
@@ -296,7 +436,7 @@ static inline bool bmc_evict(struct bm_cache *bmc, int nr) {
  * adjust entry's prev and next entry to remove intersection part with entry
  */
 static inline int bmc_insert_new(struct bm_cache *cache, struct bm_entry *entry) {
-    struct bm_entry *nearest, *prev = NULL, *next = NULL, *add;
+    struct bm_entry *nearest, *prev = NULL, *next = NULL, *add, *victim;
     int ret = 0;
 
     pr_debug("insert new block: dentry=%lx off=%lu size=%lu", entry->remote_dentry, entry->off, entry->size);
@@ -345,7 +485,7 @@ static inline int bmc_insert_new(struct bm_cache *cache, struct bm_entry *entry)
             add->remote_dentry = prev->remote_dentry;
             add->off = entry->off + entry->size;
             add->size = prev->off + prev->size - add->off;
-            add->blk_remote_addr = prev->blk_remote_addr;
+            add->blk_remote_addr = sharedfs_blk_addr_add(prev->blk_remote_addr, add->off - prev->off);
             add->version = prev->version;
             avl_tree_add(&cache->tree, add);
 
@@ -363,22 +503,31 @@ static inline int bmc_insert_new(struct bm_cache *cache, struct bm_entry *entry)
         }
     }
 
-    /* remove next's intersection part with entry */
-    if (next && next->off < entry->off + entry->size) {
+    /* remove the intersection part with entry of each next it reaches */
+    while (next && next->off < entry->off + entry->size) {
         /* has intersection */
         if (next->off + next->size > entry->off + entry->size) {
             /* next is partially covered by entry */
+            next->blk_remote_addr = sharedfs_blk_addr_add(next->blk_remote_addr,
+                                                          entry->off + entry->size - next->off);
+            next->size -= entry->off + entry->size - next->off;
             next->off = entry->off + entry->size;
-            next->size -= entry->size;
 
             pr_debug("next -> dentry=%lx off=%lu size=%lu", next->remote_dentry, next->off, next->size);
-        } else {
-            /* next is completely covered by entry */
-            avl_tree_remove(&cache->tree, next);
-            free(next);
+            break;
+        }
 
-            pr_debug("next is completely covered by entry, remove next");
+        /* next is completely covered by entry */
+        victim = next;
+        next = avl_tree_next(&cache->tree, next);
+        if (next && next->remote_dentry != entry->remote_dentry) {
+            next = NULL;
         }
+
+        avl_tree_remove(&cache->tree, victim);
+        free(victim);
+
+        pr_debug("next is completely covered by entry, remove next");
     }
 
     /* write interval */
@@ -438,6 +587,8 @@ static inline int bmc_insert_old(struct bm_cache *cache, struct bm_entry *entry)
         }
 
         /* prev partially covers entry */
+        entry->blk_remote_addr = sharedfs_blk_addr_add(entry->blk_remote_addr,
+                                                       prev->off + prev->size - entry->off);
         entry->size -= prev->off + prev->size - entry->off;
         entry->off = prev->off + prev->size;
         ethane_assert(entry->size > 0);
@@ -456,7 +607,7 @@ static inline int bmc_insert_old(struct bm_cache *cache, struct bm_entry *entry)
             add->remote_dentry = entry->remote_dentry;
             add->off = next->off + next->size;
             add->size = entry->off + entry->size - add->off;
-            add->blk_remote_addr = next->blk_remote_addr;
+            add->blk_remote_addr = sharedfs_blk_addr_add(entry->blk_remote_addr, add->off - entry->off);
             add->version = entry->version;
             avl_tree_add(&cache->tree, add);
 
@@ -483,41 +634,37 @@ static inline int bmc_remove(struct bm_cache *cache, struct bm_entry *entry) {
 
 atomic_uint_fast64_t total_fetch = 0;
 atomic_uint_fast64_t total_hit_in_cache = 0;
-static int fetch_path_prefixes_to_cache(cachefs_t *cfs, const char *path,
-                                        struct ns_entry **parent_ent, struct ns_entry **ent) {
+/* Point dentries[i] at the cached entry of each prefix of @pd, inserting placeholders for missing ones. */
+static int get_cached_prefixes(cachefs_t *cfs, const pathdesc_t *pd, struct ethane_dentry **dentries,
+                               bool *need_remote) {
     struct ns_cache *nsc = &cfs->nsc;
-    struct ethane_dentry **dentries;
-    int len, depth, ret = 0, i = 0;
     const char *component, *next;
-    dmptr_t parent = DMPTR_NULL;
-    bool need_remote = false;
+    const char *path = pd->path;
     struct ns_entry *entry;
+    uint64_t prefix_state;
+    int len, ret = 0, i = 0;
+    bool removed = false;
     size_t prefix_len;
 
-    depth = ethane_get_dir_depth(path);
-
-    dentries = calloc(depth, sizeof(struct ethane_dentry *));
-    if (unlikely(!dentries)) {
-        ret = -ENOMEM;
-        goto out;
-    }
-
     pr_debug("fetch path prefixes to cache, path=%s", path);
 
     ETHANE_ITER_COMPONENTS(path, component, next, len) {
         prefix_len = component + len - path;
+        prefix_state = pathdesc_state(pd, prefix_len);
 
         atomic_fetch_add(&total_fetch, 1);
-        if ((entry = nsc_lookup(nsc, path, prefix_len))) {
+        if ((entry = nsc_lookup(nsc, path, prefix_len, prefix_state))) {
         // if (0) {
             dentries[i] = &entry->dentry;
             atomic_fetch_add(&total_hit_in_cache, 1);
+            /* a cached tombstone acts for the whole prefix, nothing below needs a lookup */
+            removed |= entry->dentry.type == ETHANE_DENTRY_TOMBSTONE;
             pr_debug("component %d (%.*s) found in cache", i, (int) prefix_len, path);
         } else {
             entry = calloc(1, sizeof(*entry) + prefix_len + 1);
             if (unlikely(!entry)) {
                 ret = -ENOMEM;
-                goto out_free;
+                goto out;
             }
             dentries[i] = &entry->dentry;
 
@@ -525,9 +672,9 @@ static int fetch_path_prefixes_to_cache(cachefs_t *cfs, const char *path,
             entry->version = 0;
             strncpy(entry->full_path, path, prefix_len);
             entry->full_path[prefix_len] = '\0';
-            nsc_insert(nsc, entry);
+            nsc_insert(nsc, entry, prefix_state);
 
-            need_remote = true;
+            *need_remote |= !removed;
 
             pr_debug("component %d (%.*s) not present in cache, need_remote", i, (int) prefix_len, path);
         }
@@ -535,14 +682,18 @@ static int fetch_path_prefixes_to_cache(cachefs_t *cfs, const char *path,
         i++;
     }
 
-    if (need_remote) {
-        ret = sharedfs_ns_lookup_dentries(cfs->rfs, path, dentries);
-        if (unlikely(ret < 0)) {
-            goto out_free;
-        }
-    }
+out:
+    return ret;
+}
 
-    i = 0;
+/* Resolve the parent links of the prefixes of @pd after the remote lookup. */
+static void link_cached_prefixes(const pathdesc_t *pd, struct ethane_dentry **dentries) {
+    const char *component, *next;
+    const char *path = pd->path;
+    dmptr_t parent = DMPTR_NULL;
+    struct ns_entry *entry;
+    size_t prefix_len;
+    int len, i = 0;
 
     ETHANE_ITER_COMPONENTS(path, component, next, len) {
         prefix_len = component + len - path;
@@ -563,6 +714,60 @@ static int fetch_path_prefixes_to_cache(cachefs_t *cfs, const char *path,
 
         i++;
     }
+}
+
+/* Whether the prefixes of @pd but the last one are all resolved */
+static bool only_last_missing(const pathdesc_t *pd, struct ethane_dentry **dentries) {
+    int i;
+
+    for (i = 0; i < pd->depth - 1; i++) {
+        if (dentries[i]->remote_addr == DMPTR_NULL || dentries[i]->type == ETHANE_DENTRY_TOMBSTONE) {
+            return false;
+        }
+    }
+
+    return pd->depth > 1;
+}
+
+/*
+ * With @creating, @pd is about to be created and is most likely new, so if it is the only
+ * missing prefix the namespace filter is asked before the KV is probed for it.
+ */
+static int do_fetch_path_prefixes(cachefs_t *cfs, const pathdesc_t *pd, struct ns_entry **parent_ent,
+                                  struct ns_entry **ent, bool creating) {
+    struct ethane_dentry **dentries;
+    bool need_remote = false;
+    int depth, ret = 0;
+
+    depth = pd->depth;
+
+    dentries = calloc(depth, sizeof(struct ethane_dentry *));
+    if (unlikely(!dentries)) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    ret = get_cached_prefixes(cfs, pd, dentries, &need_remote);
+    if (unlikely(ret < 0)) {
+        goto out_free;
+    }
+
+    if (need_remote && creating && only_last_missing(pd, dentries)) {
+        ret = sharedfs_ns_may_exist(cfs->rfs, pd->path, pd, dentries[depth - 2]->remote_addr);
+        if (unlikely(ret < 0)) {
+            goto out_free;
+        }
+        need_remote = ret;
+    }
+
+    if (need_remote) {
+        ret = sharedfs_ns_lookup_dentries(cfs->rfs, pd->path, pd, dentries);
+        if (unlikely(ret < 0)) {
+            goto out_free;
+        }
+    }
+
+    link_cached_prefixes(pd, dentries);
 
     ethane_assert(depth > 0);
     if (ent) {
@@ -579,6 +784,63 @@ out:
     return ret;
 }
 
+static inline int fetch_path_prefixes_to_cache(cachefs_t *cfs, const pathdesc_t *pd,
+                                               struct ns_entry **parent_ent, struct ns_entry **ent) {
+    return do_fetch_path_prefixes(cfs, pd, parent_ent, ent, false);
+}
+
+/*
+ * Fetch the prefixes of several paths with a single remote lookup. Entries collected
+ * for earlier paths are pinned so that placeholders inserted for later ones can not
+ * evict them, and a prefix shared by several paths is only looked up once.
+ */
+static int fetch_paths_prefixes_to_cache(cachefs_t *cfs, int nr_paths, const pathdesc_t **pds) {
+    int i, j, nr_comps = 0, off, ret = 0;
+    struct ethane_dentry **dentries;
+    bool need_remote = false;
+
+    for (i = 0; i < nr_paths; i++) {
+        nr_comps += pds[i]->depth;
+    }
+
+    dentries = calloc(nr_comps, sizeof(struct ethane_dentry *));
+    if (unlikely(!dentries)) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    for (i = 0, off = 0; i < nr_paths; off += pds[i++]->depth) {
+        ret = get_cached_prefixes(cfs, pds[i], dentries + off, &need_remote);
+        if (unlikely(ret < 0)) {
+            nr_comps = off;
+            goto out_unpin;
+        }
+        for (j = 0; j < pds[i]->depth; j++) {
+            container_of(dentries[off + j], struct ns_entry, dentry)->pinned = true;
+        }
+    }
+
+    if (need_remote) {
+        ret = sharedfs_ns_lookup_dentries_batch(cfs->rfs, nr_paths, pds, dentries);
+        if (unlikely(ret < 0)) {
+            goto out_unpin;
+        }
+    }
+
+    for (i = 0, off = 0; i < nr_paths; off += pds[i++]->depth) {
+        link_cached_prefixes(pds[i], dentries + off);
+    }
+
+out_unpin:
+    for (i = 0; i < nr_comps; i++) {
+        container_of(dentries[i], struct ns_entry, dentry)->pinned = false;
+    }
+    free(dentries);
+
+out:
+    return ret;
+}
+
 enum perm_action {
     PERM_R,
     PERM_W,
@@ -623,8 +885,10 @@ static int check_permission(cachefs_ctx_t *ctx, struct ethane_perm *perm, enum p
     ethane_assert(0);
 }
 
-static int check_prefix_components(cachefs_t *cfs, cachefs_ctx_t *ctx, const char *path, enum perm_action last_action) {
-    size_t prefix_len, path_len = strlen(path);
+static int check_prefix_components(cachefs_t *cfs, cachefs_ctx_t *ctx, const pathdesc_t *pd,
+                                   enum perm_action last_action) {
+    size_t prefix_len, path_len = pd->len;
+    const char *path = pd->path;
     struct ns_entry *entry = NULL;
     const char *component, *next;
     int len, ret;
@@ -637,7 +901,8 @@ static int check_prefix_components(cachefs_t *cfs, cachefs_ctx_t *ctx, const cha
             break;
         }
 
-        if (unlikely(!(entry = nsc_lookup(&cfs->nsc, path, prefix_len)) || entry->dentry.type == ETHANE_DENTRY_TOMBSTONE)) {
+        entry = nsc_lookup(&cfs->nsc, path, prefix_len, pathdesc_state(pd, prefix_len));
+        if (unlikely(!entry || entry->dentry.type == ETHANE_DENTRY_TOMBSTONE)) {
             ret = -ENOENT;
             goto out;
         }
@@ -660,24 +925,37 @@ out:
     return ret;
 }
 
-static int do_mkdir(cachefs_t *cfs, const char *path, mode_t mode,
-                    dmptr_t remote_dentry, dmptr_t parent_remote_addr, size_t version) {
-    struct ethane_dentry *dentry;
-    bool need_insert = false;
+int cachefs_get_first_missing(cachefs_t *cfs, cachefs_ctx_t *ctx, const char *path, dmptr_t *parent) {
+    const char *component, *next;
     struct ns_entry *entry;
-    int ret = 0;
+    const pathdesc_t *pd;
+    size_t prefix_len;
+    pathdesc_t tmp;
+    int len, i = 0;
 
-    entry = nsc_lookup(&cfs->nsc, path, strlen(path));
-    if (!entry) {
-        entry = calloc(1, sizeof(*entry) + strlen(path) + 1);
-        if (unlikely(!entry)) {
-            ret = -ENOMEM;
-            goto out;
+    pd = pathdesc_get(ctx->pd, path, &tmp);
+    *parent = DMPTR_NULL;
+
+    ETHANE_ITER_COMPONENTS(path, component, next, len) {
+        prefix_len = component + len - path;
+
+        entry = nsc_lookup(&cfs->nsc, path, prefix_len, pathdesc_state(pd, prefix_len));
+        if (!entry || entry->dentry.type != ETHANE_DENTRY_DIR) {
+            break;
         }
-        need_insert = true;
+
+        *parent = entry->dentry.remote_addr;
+        i++;
     }
 
-    dentry = &entry->dentry;
+    return i;
+}
+
+/* @path[0, @len) is the full path of @entry */
+static void fill_dir_entry(struct ns_entry *entry, const char *path, size_t len, mode_t mode,
+                           dmptr_t remote_dentry, dmptr_t parent_remote_addr, size_t version) {
+    struct ethane_dentry *dentry = &entry->dentry;
+
     dentry->type = ETHANE_DENTRY_DIR;
     dentry->remote_addr = remote_dentry;
     dentry->parent = parent_remote_addr;
@@ -687,13 +965,37 @@ static int do_mkdir(cachefs_t *cfs, const char *path, mode_t mode,
     /* FIXME: */
     dentry->perm.owner.uid = 0;
     dentry->perm.owner.gid = 0;
+    dentry->flags = 0;
 
     entry->version = version;
     entry->is_create = true;
-    strcpy(entry->full_path, path);
+    entry->is_move = false;
+    entry->inline_dirty = false;
+    memcpy(entry->full_path, path, len);
+    entry->full_path[len] = '\0';
+}
+
+static int do_mkdir(cachefs_t *cfs, const pathdesc_t *pd, mode_t mode,
+                    dmptr_t remote_dentry, dmptr_t parent_remote_addr, size_t version) {
+    const char *path = pd->path;
+    bool need_insert = false;
+    struct ns_entry *entry;
+    int ret = 0;
+
+    entry = nsc_lookup_for_create(&cfs->nsc, path, pd->len, pd->state);
+    if (!entry) {
+        entry = calloc(1, sizeof(*entry) + strlen(path) + 1);
+        if (unlikely(!entry)) {
+            ret = -ENOMEM;
+            goto out;
+        }
+        need_insert = true;
+    }
+
+    fill_dir_entry(entry, path, pd->len, mode, remote_dentry, parent_remote_addr, version);
 
     if (need_insert) {
-        nsc_insert(&cfs->nsc, entry);
+        nsc_insert(&cfs->nsc, entry, pd->state);
     }
 
     pr_debug("do_mkdir: %lx (parent: %lx)", remote_dentry, parent_remote_addr);
@@ -702,12 +1004,37 @@ out:
     return ret;
 }
 
-int cachefs_prefetch_metadata(cachefs_t *cfs, const char *path) {
-    return fetch_path_prefixes_to_cache(cfs, path, NULL, NULL);
+int cachefs_prefetch_metadata(cachefs_t *cfs, cachefs_ctx_t *ctx, const char *path) {
+    pathdesc_t tmp;
+    return do_fetch_path_prefixes(cfs, pathdesc_get(ctx->pd, path, &tmp), NULL, NULL, true);
+}
+
+dmptr_t cachefs_get_cached_parent(cachefs_t *cfs, cachefs_ctx_t *ctx, const char *path) {
+    const char *last_slash = strrchr(path, '/');
+    struct ns_entry *entry;
+    uint64_t state;
+
+    if (unlikely(!last_slash)) {
+        return DMPTR_NULL;
+    }
+
+    if (pathdesc_match(ctx->pd, path)) {
+        state = pathdesc_parent_state(ctx->pd);
+    } else {
+        state = path_state(path, last_slash - path);
+    }
+
+    entry = nsc_lookup(&cfs->nsc, path, last_slash - path, state);
+    if (!entry || entry->dentry.type != ETHANE_DENTRY_DIR) {
+        return DMPTR_NULL;
+    }
+
+    return entry->dentry.remote_addr;
 }
 
-static struct ns_entry *check_mkdir_and_get_parent(cachefs_t *cfs, cachefs_ctx_t *ctx, const char *path) {
-    size_t path_len = strlen(path);
+static struct ns_entry *check_mkdir_and_get_parent(cachefs_t *cfs, cachefs_ctx_t *ctx, const pathdesc_t *pd) {
+    const char *path = pd->path;
+    size_t path_len = pd->len;
     struct bench_timer timer;
     struct ns_entry *parent;
     struct ns_entry *entry;
@@ -715,20 +1042,20 @@ static struct ns_entry *check_mkdir_and_get_parent(cachefs_t *cfs, cachefs_ctx_t
 
     bench_timer_start(&timer);
 
-    ret = fetch_path_prefixes_to_cache(cfs, path, &parent, NULL);
+    ret = do_fetch_path_prefixes(cfs, pd, &parent, NULL, true);
     if (unlikely(IS_ERR(ret))) {
         parent = ERR_PTR(ret);
         goto out;
     }
 
-    ret = check_prefix_components(cfs, ctx, path, PERM_W);
+    ret = check_prefix_components(cfs, ctx, pd, PERM_W);
     if (unlikely(IS_ERR(ret))) {
         parent = ERR_PTR(ret);
         goto out;
     }
 
     /* the last component must be non-existent */
-    entry = nsc_lookup(&cfs->nsc, path, path_len);
+    entry = nsc_lookup(&cfs->nsc, path, path_len, pd->state);
     if (unlikely(entry && entry->dentry.type != ETHANE_DENTRY_TOMBSTONE)) {
         parent = ERR_PTR(-EEXIST);
         goto out;
@@ -742,12 +1069,16 @@ out:
 
 int cachefs_mkdir(cachefs_t *cfs, cachefs_ctx_t *ctx, const char *path, uint64_t *res,
                   mode_t mode, dmptr_t remote_dentry, size_t version) {
+    const pathdesc_t *pd;
+    pathdesc_t tmp;
     dmptr_t parent_remote_addr;
     struct ns_entry *parent;
     int ret;
 
+    pd = pathdesc_get(ctx->pd, path, &tmp);
+
     if (*res == OP_RESULT_UNDETERMINED) {
-        parent = check_mkdir_and_get_parent(cfs, ctx, path);
+        parent = check_mkdir_and_get_parent(cfs, ctx, pd);
         if (unlikely(IS_ERR(parent))) {
             *res = OP_RESULT_CANCELED;
             ret = PTR_ERR(parent);
@@ -759,92 +1090,494 @@ int cachefs_mkdir(cachefs_t *cfs, cachefs_ctx_t *ctx, const char *path, uint64_t
         parent_remote_addr = *res;
     }
 
-    ret = do_mkdir(cfs, path, mode, remote_dentry, parent_remote_addr, version);
+    ret = do_mkdir(cfs, pd, mode, remote_dentry, parent_remote_addr, version);
 
 out:
     return ret;
 }
 
-static struct ns_entry *check_rmdir_and_get_ent(cachefs_t *cfs, cachefs_ctx_t *ctx, const char *path) {
-    size_t path_len = strlen(path);
+/*
+ * Return the index of the first missing component of @pd, or pd->depth if the whole
+ * path exists. The components before it must be directories we may search, and we
+ * must be able to write into the last of them, which is returned in @parent.
+ */
+static int check_mkdir_recursive(cachefs_t *cfs, cachefs_ctx_t *ctx, const pathdesc_t *pd,
+                                 struct ns_entry **parent) {
+    const char *path = pd->path, *component, *next;
     struct ns_entry *entry;
-    int ret;
+    size_t prefix_len;
+    int len, ret, i = 0;
 
-    ret = fetch_path_prefixes_to_cache(cfs, path, NULL, NULL);
-    if (unlikely(ret < 0)) {
-        entry = ERR_PTR(ret);
-        goto out;
-    }
+    *parent = NULL;
 
-    ret = check_prefix_components(cfs, ctx, path, PERM_W);
+    ret = fetch_path_prefixes_to_cache(cfs, pd, NULL, NULL);
     if (unlikely(ret < 0)) {
-        entry = ERR_PTR(ret);
-        goto out;
-    }
-
-    /* the last component must be existent */
-    entry = nsc_lookup(&cfs->nsc, path, path_len);
-    if (unlikely(!entry || entry->dentry.type == ETHANE_DENTRY_TOMBSTONE)) {
-        entry = ERR_PTR(-ENOENT);
-        goto out;
-    }
-
-    /* the last component must be directory */
-    if (unlikely(entry->dentry.type != ETHANE_DENTRY_DIR)) {
-        entry = ERR_PTR(-ENOTDIR);
         goto out;
     }
 
-    /* ... and it must be empty */
-    if (unlikely(entry->dentry.nr_children > 0)) {
-        entry = ERR_PTR(-ENOTEMPTY);
-        goto out;
-    }
+    ETHANE_ITER_COMPONENTS(path, component, next, len) {
+        prefix_len = component + len - path;
 
-out:
-    return entry;
-}
+        if (*parent) {
+            ret = check_permission(ctx, &(*parent)->dentry.perm, PERM_EX);
+            if (unlikely(ret < 0)) {
+                goto out;
+            }
+        }
 
-static int do_rmdir(cachefs_t *cfs, const char *path, size_t version, dmptr_t dentry_remote_addr) {
-    bool need_insert = false;
-    struct ns_entry *entry;
-    int ret = 0;
+        entry = nsc_lookup(&cfs->nsc, path, prefix_len, pathdesc_state(pd, prefix_len));
+        if (!entry || entry->dentry.type == ETHANE_DENTRY_TOMBSTONE) {
+            break;
+        }
 
-    entry = nsc_lookup(&cfs->nsc, path, strlen(path));
-    if (!entry) {
-        entry = calloc(1, sizeof(*entry) + strlen(path) + 1);
-        if (unlikely(!entry)) {
-            ret = -ENOMEM;
+        if (unlikely(entry->dentry.type != ETHANE_DENTRY_DIR)) {
+            ret = next ? -ENOTDIR : -EEXIST;
             goto out;
         }
-        need_insert = true;
-    }
 
-    entry->dentry.remote_addr = dentry_remote_addr;
-    entry->dentry.type = ETHANE_DENTRY_TOMBSTONE;
+        *parent = entry;
+        i++;
+    }
 
-    entry->is_create = false;
-    entry->version = version;
+    if (i == pd->depth) {
+        ret = i;
+        goto out;
+    }
 
-    strcpy(entry->full_path, path);
+    /* the root is always there */
+    ethane_assert(*parent);
 
-    if (need_insert) {
-        nsc_insert(&cfs->nsc, entry);
+    ret = check_permission(ctx, &(*parent)->dentry.perm, PERM_W);
+    if (likely(ret == 0)) {
+        ret = i;
     }
 
-    pr_debug("do_rmdir: %s %lx", path, dentry_remote_addr);
-
+out:
+    return ret;
+}
+
+int cachefs_mkdir_recursive(cachefs_t *cfs, cachefs_ctx_t *ctx, const char *path, uint64_t *res, mode_t mode,
+                            int first, int nr, const dmptr_t *remote_dentries, size_t version) {
+    struct ns_entry *parent, **entries = NULL;
+    const char *component, *next;
+    dmptr_t parent_remote_addr;
+    uint64_t need_insert = 0;
+    const pathdesc_t *pd;
+    size_t prefix_len;
+    int len, ret, i, k;
+    pathdesc_t tmp;
+
+    pd = pathdesc_get(ctx->pd, path, &tmp);
+    ethane_assert(first + nr == pd->depth && pd->depth <= PATHDESC_MAX_DEPTH);
+
+    if (*res == OP_RESULT_UNDETERMINED) {
+        k = check_mkdir_recursive(cfs, ctx, pd, &parent);
+        if (unlikely(k < 0 || k == pd->depth)) {
+            /* mkdir -p of an existing directory succeeds */
+            *res = OP_RESULT_CANCELED;
+            ret = min(k, 0);
+            goto out;
+        }
+        if (unlikely(k < first)) {
+            /* an ancestor the issuer saw has gone, it has to allocate more dentries and retry */
+            *res = OP_RESULT_CANCELED;
+            ret = -EAGAIN;
+            goto out;
+        }
+        parent_remote_addr = parent->dentry.remote_addr;
+        ethane_assert(!(parent_remote_addr & MKDIR_RECURSIVE_IDX_MASK));
+        *res = parent_remote_addr | k;
+    } else {
+        ethane_assert(*res != OP_RESULT_CANCELED);
+        parent_remote_addr = *res & ~(uint64_t) MKDIR_RECURSIVE_IDX_MASK;
+        k = (int) (*res & MKDIR_RECURSIVE_IDX_MASK);
+    }
+
+    entries = calloc(pd->depth - k, sizeof(*entries));
+    if (unlikely(!entries)) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    /*
+     * Get all the entries first, so that running out of memory leaves the cache as it
+     * was, and pin them so that inserting the new ones can not evict the others.
+     */
+    i = 0;
+    ETHANE_ITER_COMPONENTS(path, component, next, len) {
+        prefix_len = component + len - path;
+
+        if (i >= k) {
+            entries[i - k] = nsc_lookup_for_create(&cfs->nsc, path, prefix_len, pathdesc_state(pd, prefix_len));
+            if (!entries[i - k]) {
+                entries[i - k] = calloc(1, sizeof(struct ns_entry) + prefix_len + 1);
+                if (unlikely(!entries[i - k])) {
+                    ret = -ENOMEM;
+                    goto out_release;
+                }
+                need_insert |= 1ul << (i - k);
+            }
+            entries[i - k]->pinned = true;
+        }
+
+        i++;
+    }
+
+    i = 0;
+    ETHANE_ITER_COMPONENTS(path, component, next, len) {
+        prefix_len = component + len - path;
+
+        if (i >= k) {
+            /* intermediate directories are made searchable and writable by us, like mkdir -p does */
+            fill_dir_entry(entries[i - k], path, prefix_len, next ? mode | S_IWUSR | S_IXUSR : mode,
+                           remote_dentries[i - first], parent_remote_addr, version);
+            if (need_insert & (1ul << (i - k))) {
+                nsc_insert(&cfs->nsc, entries[i - k], pathdesc_state(pd, prefix_len));
+            }
+            parent_remote_addr = remote_dentries[i - first];
+        }
+
+        i++;
+    }
+
+    need_insert = 0;
+    ret = 0;
+
+    pr_debug("do_mkdir_recursive: %s from component %d", path, k);
+
+out_release:
+    for (i = 0; i < pd->depth - k && entries[i]; i++) {
+        entries[i]->pinned = false;
+        if (need_insert & (1ul << i)) {
+            free(entries[i]);
+        }
+    }
+    free(entries);
+
+out:
+    return ret;
+}
+
+static struct ns_entry *check_rmdir_and_get_ent(cachefs_t *cfs, cachefs_ctx_t *ctx, const pathdesc_t *pd) {
+    const char *path = pd->path;
+    size_t path_len = pd->len;
+    struct ns_entry *entry;
+    int ret;
+
+    ret = fetch_path_prefixes_to_cache(cfs, pd, NULL, NULL);
+    if (unlikely(ret < 0)) {
+        entry = ERR_PTR(ret);
+        goto out;
+    }
+
+    ret = check_prefix_components(cfs, ctx, pd, PERM_W);
+    if (unlikely(ret < 0)) {
+        entry = ERR_PTR(ret);
+        goto out;
+    }
+
+    /* the last component must be existent */
+    entry = nsc_lookup(&cfs->nsc, path, path_len, pd->state);
+    if (unlikely(!entry || entry->dentry.type == ETHANE_DENTRY_TOMBSTONE)) {
+        entry = ERR_PTR(-ENOENT);
+        goto out;
+    }
+
+    /* the last component must be directory */
+    if (unlikely(entry->dentry.type != ETHANE_DENTRY_DIR)) {
+        entry = ERR_PTR(-ENOTDIR);
+        goto out;
+    }
+
+    /* ... and it must be empty */
+    if (unlikely(entry->dentry.nr_children > 0)) {
+        entry = ERR_PTR(-ENOTEMPTY);
+        goto out;
+    }
+
+out:
+    return entry;
+}
+
+static int do_rmdir(cachefs_t *cfs, const pathdesc_t *pd, size_t version, dmptr_t dentry_remote_addr) {
+    const char *path = pd->path;
+    bool need_insert = false;
+    struct ns_entry *entry;
+    int ret = 0;
+
+    entry = nsc_lookup(&cfs->nsc, path, pd->len, pd->state);
+    if (!entry) {
+        entry = calloc(1, sizeof(*entry) + strlen(path) + 1);
+        if (unlikely(!entry)) {
+            ret = -ENOMEM;
+            goto out;
+        }
+        need_insert = true;
+    }
+
+    entry->dentry.remote_addr = dentry_remote_addr;
+    entry->dentry.type = ETHANE_DENTRY_TOMBSTONE;
+
+    entry->is_create = false;
+    entry->is_move = false;
+    entry->version = version;
+
+    strcpy(entry->full_path, path);
+
+    if (need_insert) {
+        nsc_insert(&cfs->nsc, entry, pd->state);
+    }
+
+    pr_debug("do_rmdir: %s %lx", path, dentry_remote_addr);
+
 out:
     return ret;
 }
 
 int cachefs_rmdir(cachefs_t *cfs, cachefs_ctx_t *ctx, const char *path, uint64_t *res, size_t version) {
+    const pathdesc_t *pd;
+    pathdesc_t tmp;
+    dmptr_t dentry_remote_addr;
+    struct ns_entry *entry;
+    int ret;
+
+    pd = pathdesc_get(ctx->pd, path, &tmp);
+
+    if (*res == OP_RESULT_UNDETERMINED) {
+        entry = check_rmdir_and_get_ent(cfs, ctx, pd);
+        if (unlikely(IS_ERR(entry))) {
+            *res = OP_RESULT_CANCELED;
+            ret = PTR_ERR(entry);
+            goto out;
+        }
+        *res = dentry_remote_addr = entry->dentry.remote_addr;
+    } else {
+        dentry_remote_addr = *res;
+    }
+
+    ethane_assert(*res != OP_RESULT_CANCELED);
+    ret = do_rmdir(cfs, pd, version, dentry_remote_addr);
+
+out:
+    return ret;
+}
+
+static inline bool is_subpath(const char *path, const char *dir, size_t dir_len) {
+    return strncmp(path, dir, dir_len) == 0 && path[dir_len] == '/';
+}
+
+static int push_entry(struct ns_entry ***arr, int *nr, int *cap, struct ns_entry *entry) {
+    struct ns_entry **tmp;
+
+    if (*nr == *cap) {
+        *cap = *cap ? *cap * 2 : 16;
+        tmp = realloc(*arr, *cap * sizeof(*tmp));
+        if (unlikely(!tmp)) {
+            return -ENOMEM;
+        }
+        *arr = tmp;
+    }
+
+    (*arr)[(*nr)++] = entry;
+    return 0;
+}
+
+/*
+ * Collect the cached entries below the directory @pd by walking down the directory buckets,
+ * or by a scan of the whole cache while some entry is an orphan that no walk reaches.
+ * Returns their number, the array is the caller's to free.
+ */
+static int nsc_collect_descendants(struct ns_cache *cache, const pathdesc_t *pd, struct ns_entry ***out) {
+    struct ns_entry **arr = NULL, *entry;
+    int i, nr = 0, cap = 0, ret = 0;
+
+    if (cache->nr_orphans) {
+        for (i = 0; i < cache->nr_buckets && !ret; i++) {
+            list_for_each_entry(entry, &cache->buckets[i].head, node) {
+                if (is_subpath(entry->full_path, pd->path, pd->len)) {
+                    ret = push_entry(&arr, &nr, &cap, entry);
+                    if (unlikely(ret < 0)) {
+                        break;
+                    }
+                }
+            }
+        }
+        goto out;
+    }
+
+    list_for_each_entry(entry, nsc_dir_bucket(cache, pd->state), sibling) {
+        if (is_child_path(entry->full_path, pd->path, pd->len)) {
+            ret = push_entry(&arr, &nr, &cap, entry);
+            if (unlikely(ret < 0)) {
+                goto out;
+            }
+        }
+    }
+
+    /* the ones collected so far are walked in turn, the array grows behind */
+    for (i = 0; i < nr; i++) {
+        if (!arr[i]->nr_children) {
+            continue;
+        }
+        list_for_each_entry(entry, nsc_dir_bucket(cache, arr[i]->path_state), sibling) {
+            if (is_child_path(entry->full_path, arr[i]->full_path, strlen(arr[i]->full_path))) {
+                ret = push_entry(&arr, &nr, &cap, entry);
+                if (unlikely(ret < 0)) {
+                    goto out;
+                }
+            }
+        }
+    }
+
+out:
+    if (unlikely(ret < 0)) {
+        free(arr);
+    } else {
+        *out = arr;
+        ret = nr;
+    }
+    return ret;
+}
+
+static struct ns_entry *check_rmtree_and_get_ent(cachefs_t *cfs, cachefs_ctx_t *ctx, const pathdesc_t *pd) {
+    struct ns_entry *entry;
+    int ret;
+
+    /* descendants keep their (parent, name) keys until reclaimed, see sharedfs.c */
+    if (unlikely(sharedfs_get_ns_key_mode(cfs->rfs) != SHAREDFS_NS_KEY_PARENT)) {
+        entry = ERR_PTR(-EOPNOTSUPP);
+        goto out;
+    }
+
+    if (unlikely(pd->depth < 2)) {
+        entry = ERR_PTR(-EBUSY);
+        goto out;
+    }
+
+    ret = fetch_path_prefixes_to_cache(cfs, pd, NULL, &entry);
+    if (unlikely(ret < 0)) {
+        entry = ERR_PTR(ret);
+        goto out;
+    }
+
+    /* only the parent is checked, like for a rename of the directory */
+    ret = check_prefix_components(cfs, ctx, pd, PERM_W);
+    if (unlikely(ret < 0)) {
+        entry = ERR_PTR(ret);
+        goto out;
+    }
+
+    if (unlikely(entry->dentry.type == ETHANE_DENTRY_TOMBSTONE)) {
+        entry = ERR_PTR(-ENOENT);
+        goto out;
+    }
+
+    if (unlikely(entry->dentry.type != ETHANE_DENTRY_DIR)) {
+        entry = ERR_PTR(-ENOTDIR);
+        goto out;
+    }
+
+out:
+    return entry;
+}
+
+/*
+ * Cached entries below a removed directory. Those the checkpoint has not put yet are just
+ * dropped, and so are the ones from lookups, whose keys are reclaimed with the subtree. A
+ * directory moved in is not in the child index of the subtree, so it is removed as a
+ * subtree of its own.
+ */
+static int drop_cached_descendants(cachefs_t *cfs, const pathdesc_t *pd, size_t version) {
+    struct ns_entry **descs, *entry;
+    int i, nr;
+
+    nr = nsc_collect_descendants(&cfs->nsc, pd, &descs);
+    if (unlikely(nr < 0)) {
+        return nr;
+    }
+
+    for (i = 0; i < nr; i++) {
+        entry = descs[i];
+
+        if (entry->pinned || entry->dentry.type == ETHANE_DENTRY_TOMBSTONE) {
+            continue;
+        }
+
+        if (!entry->is_move) {
+            nsc_remove(&cfs->nsc, entry);
+            free(entry);
+            continue;
+        }
+
+        entry->is_rmtree = entry->dentry.type == ETHANE_DENTRY_DIR;
+        entry->dentry.type = ETHANE_DENTRY_TOMBSTONE;
+        entry->is_create = false;
+        entry->is_move = false;
+        entry->version = version;
+    }
+
+    free(descs);
+    return 0;
+}
+
+static int do_rmtree(cachefs_t *cfs, const pathdesc_t *pd, size_t version, dmptr_t dentry_remote_addr) {
+    const char *path = pd->path;
+    bool need_insert = false;
+    struct ns_entry *entry;
+    int ret = 0;
+
+    entry = nsc_lookup(&cfs->nsc, path, pd->len, pd->state);
+    if (!entry) {
+        entry = calloc(1, sizeof(*entry) + strlen(path) + 1);
+        if (unlikely(!entry)) {
+            ret = -ENOMEM;
+            goto out;
+        }
+        need_insert = true;
+    }
+
+    entry->pinned = true;
+    ret = drop_cached_descendants(cfs, pd, version);
+    entry->pinned = false;
+    if (unlikely(ret < 0)) {
+        if (need_insert) {
+            free(entry);
+        }
+        goto out;
+    }
+
+    entry->dentry.remote_addr = dentry_remote_addr;
+    entry->dentry.type = ETHANE_DENTRY_TOMBSTONE;
+
+    /* a directory not checkpointed yet has nothing to reclaim */
+    entry->is_rmtree = !entry->is_create || entry->is_move;
+    entry->is_create = false;
+    entry->is_move = false;
+    entry->version = version;
+
+    strcpy(entry->full_path, path);
+
+    if (need_insert) {
+        nsc_insert(&cfs->nsc, entry, pd->state);
+    }
+
+    pr_debug("do_rmtree: %s %lx", path, dentry_remote_addr);
+
+out:
+    return ret;
+}
+
+int cachefs_rmtree(cachefs_t *cfs, cachefs_ctx_t *ctx, const char *path, uint64_t *res, size_t version) {
+    const pathdesc_t *pd;
+    pathdesc_t tmp;
     dmptr_t dentry_remote_addr;
     struct ns_entry *entry;
     int ret;
 
+    pd = pathdesc_get(ctx->pd, path, &tmp);
+
     if (*res == OP_RESULT_UNDETERMINED) {
-        entry = check_rmdir_and_get_ent(cfs, ctx, path);
+        entry = check_rmtree_and_get_ent(cfs, ctx, pd);
         if (unlikely(IS_ERR(entry))) {
             *res = OP_RESULT_CANCELED;
             ret = PTR_ERR(entry);
@@ -856,31 +1589,32 @@ int cachefs_rmdir(cachefs_t *cfs, cachefs_ctx_t *ctx, const char *path, uint64_t
     }
 
     ethane_assert(*res != OP_RESULT_CANCELED);
-    ret = do_rmdir(cfs, path, version, dentry_remote_addr);
+    ret = do_rmtree(cfs, pd, version, dentry_remote_addr);
 
 out:
     return ret;
 }
 
-static struct ns_entry *check_unlink_and_get_ent(cachefs_t *cfs, cachefs_ctx_t *ctx, const char *path) {
-    size_t path_len = strlen(path);
+static struct ns_entry *check_unlink_and_get_ent(cachefs_t *cfs, cachefs_ctx_t *ctx, const pathdesc_t *pd) {
+    const char *path = pd->path;
+    size_t path_len = pd->len;
     struct ns_entry *entry;
     int ret;
 
-    ret = fetch_path_prefixes_to_cache(cfs, path, NULL, NULL);
+    ret = fetch_path_prefixes_to_cache(cfs, pd, NULL, NULL);
     if (unlikely(ret < 0)) {
         entry = ERR_PTR(ret);
         goto out;
     }
 
-    ret = check_prefix_components(cfs, ctx, path, PERM_W);
+    ret = check_prefix_components(cfs, ctx, pd, PERM_W);
     if (unlikely(ret < 0)) {
         entry = ERR_PTR(ret);
         goto out;
     }
 
     /* the last component must be existent */
-    entry = nsc_lookup(&cfs->nsc, path, path_len);
+    entry = nsc_lookup(&cfs->nsc, path, path_len, pd->state);
     if (unlikely(!entry || entry->dentry.type == ETHANE_DENTRY_TOMBSTONE)) {
         entry = ERR_PTR(-ENOENT);
         goto out;
@@ -896,12 +1630,13 @@ out:
     return entry;
 }
 
-static int do_unlink(cachefs_t *cfs, const char *path, size_t version, dmptr_t dentry_remote_addr) {
+static int do_unlink(cachefs_t *cfs, const pathdesc_t *pd, size_t version, dmptr_t dentry_remote_addr) {
+    const char *path = pd->path;
     bool need_insert = false;
     struct ns_entry *entry;
     int ret = 0;
 
-    entry = nsc_lookup(&cfs->nsc, path, strlen(path));
+    entry = nsc_lookup(&cfs->nsc, path, pd->len, pd->state);
     if (!entry) {
         entry = calloc(1, sizeof(*entry) + strlen(path) + 1);
         if (unlikely(!entry)) {
@@ -915,12 +1650,13 @@ static int do_unlink(cachefs_t *cfs, const char *path, size_t version, dmptr_t d
     entry->dentry.type = ETHANE_DENTRY_TOMBSTONE;
 
     entry->is_create = false;
+    entry->is_move = false;
     entry->version = version;
 
     strcpy(entry->full_path, path);
 
     if (need_insert) {
-        nsc_insert(&cfs->nsc, entry);
+        nsc_insert(&cfs->nsc, entry, pd->state);
     }
 
     pr_debug("do_unlink: %s %lx", path, dentry_remote_addr);
@@ -930,12 +1666,16 @@ out:
 }
 
 int cachefs_unlink(cachefs_t *cfs, cachefs_ctx_t *ctx, const char *path, uint64_t *res, size_t version) {
+    const pathdesc_t *pd;
+    pathdesc_t tmp;
     dmptr_t dentry_remote_addr;
     struct ns_entry *entry;
     int ret;
 
+    pd = pathdesc_get(ctx->pd, path, &tmp);
+
     if (*res == OP_RESULT_UNDETERMINED) {
-        entry = check_unlink_and_get_ent(cfs, ctx, path);
+        entry = check_unlink_and_get_ent(cfs, ctx, pd);
         if (unlikely(IS_ERR(entry))) {
             ret = PTR_ERR(entry);
             *res = OP_RESULT_CANCELED;
@@ -947,32 +1687,33 @@ int cachefs_unlink(cachefs_t *cfs, cachefs_ctx_t *ctx, const char *path, uint64_
     }
 
     ethane_assert(*res != OP_RESULT_CANCELED);
-    ret = do_unlink(cfs, path, version, dentry_remote_addr);
+    ret = do_unlink(cfs, pd, version, dentry_remote_addr);
 
 out:
     return ret;
 }
 
-static struct ns_entry *check_create_and_get_parent(cachefs_t *cfs, cachefs_ctx_t *ctx, const char *path) {
-    size_t path_len = strlen(path);
+static struct ns_entry *check_create_and_get_parent(cachefs_t *cfs, cachefs_ctx_t *ctx, const pathdesc_t *pd) {
+    const char *path = pd->path;
+    size_t path_len = pd->len;
     struct ns_entry *parent;
     struct ns_entry *entry;
     int ret;
 
-    ret = fetch_path_prefixes_to_cache(cfs, path, &parent, NULL);
+    ret = do_fetch_path_prefixes(cfs, pd, &parent, NULL, true);
     if (unlikely(ret < 0)) {
         parent = ERR_PTR(ret);
         goto out;
     }
 
-    ret = check_prefix_components(cfs, ctx, path, PERM_W);
+    ret = check_prefix_components(cfs, ctx, pd, PERM_W);
     if (unlikely(ret < 0)) {
         parent = ERR_PTR(ret);
         goto out;
     }
 
     /* the last component must be non-existent */
-    entry = nsc_lookup(&cfs->nsc, path, path_len);
+    entry = nsc_lookup(&cfs->nsc, path, path_len, pd->state);
     if (unlikely(entry && entry->dentry.type != ETHANE_DENTRY_TOMBSTONE)) {
         parent = ERR_PTR(-EEXIST);
         goto out;
@@ -984,14 +1725,15 @@ out:
     return parent;
 }
 
-static int do_create(cachefs_t *cfs, const char *path, mode_t mode, dmptr_t remote_dentry, dmptr_t parent_remote_addr,
+static int do_create(cachefs_t *cfs, const pathdesc_t *pd, mode_t mode, dmptr_t remote_dentry, dmptr_t parent_remote_addr,
                      struct ethane_open_file *file, size_t version) {
+    const char *path = pd->path;
     struct ethane_dentry *dentry;
     bool need_insert = false;
     struct ns_entry *entry;
     int ret = 0;
 
-    entry = nsc_lookup(&cfs->nsc, path, strlen(path));
+    entry = nsc_lookup_for_create(&cfs->nsc, path, pd->len, pd->state);
     if (!entry) {
         entry = calloc(1, sizeof(*entry) + strlen(path) + 1);
         if (unlikely(!entry)) {
@@ -1010,13 +1752,18 @@ static int do_create(cachefs_t *cfs, const char *path, mode_t mode, dmptr_t remo
     /* FIXME: */
     dentry->perm.owner.uid = 0;
     dentry->perm.owner.gid = 0;
+    /* new files start inline, compact dentries have no room for it */
+    dentry->flags = sharedfs_get_dentry_format(cfs->rfs) == ETHANE_DENTRY_FMT_FULL ? ETHANE_DENTRY_INLINE_DATA : 0;
+    memset(dentry->inline_data, 0, sizeof(dentry->inline_data));
 
     entry->version = version;
     entry->is_create = true;
+    entry->is_move = false;
+    entry->inline_dirty = false;
     strcpy(entry->full_path, path);
 
     if (need_insert) {
-        nsc_insert(&cfs->nsc, entry);
+        nsc_insert(&cfs->nsc, entry, pd->state);
     }
 
     if (file) {
@@ -1033,12 +1780,16 @@ out:
 int cachefs_create(cachefs_t *cfs, cachefs_ctx_t *ctx,
                    const char *path, uint64_t *res, mode_t mode, dmptr_t remote_dentry, struct ethane_open_file *file,
                    size_t version) {
+    const pathdesc_t *pd;
+    pathdesc_t tmp;
     dmptr_t parent_remote_addr;
     struct ns_entry *parent;
     int ret;
 
+    pd = pathdesc_get(ctx->pd, path, &tmp);
+
     if (*res == OP_RESULT_UNDETERMINED) {
-        parent = check_create_and_get_parent(cfs, ctx, path);
+        parent = check_create_and_get_parent(cfs, ctx, pd);
         if (unlikely(IS_ERR(parent))) {
             *res = OP_RESULT_CANCELED;
             ret = PTR_ERR(parent);
@@ -1050,29 +1801,268 @@ int cachefs_create(cachefs_t *cfs, cachefs_ctx_t *ctx,
         parent_remote_addr = *res;
     }
 
-    ret = do_create(cfs, path, mode, remote_dentry, parent_remote_addr, file, version);
+    ret = do_create(cfs, pd, mode, remote_dentry, parent_remote_addr, file, version);
+
+out:
+    return ret;
+}
+
+static int check_rename(cachefs_t *cfs, cachefs_ctx_t *ctx, const pathdesc_t *old_pd, const pathdesc_t *new_pd) {
+    struct ns_entry *entry;
+    int fmt, ret;
+
+    ret = check_prefix_components(cfs, ctx, old_pd, PERM_W);
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
+
+    ret = check_prefix_components(cfs, ctx, new_pd, PERM_W);
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
+
+    /* the source must be existent */
+    entry = nsc_lookup(&cfs->nsc, old_pd->path, old_pd->len, old_pd->state);
+    if (unlikely(!entry || entry->dentry.type == ETHANE_DENTRY_TOMBSTONE)) {
+        ret = -ENOENT;
+        goto out;
+    }
+
+    if (entry->dentry.type == ETHANE_DENTRY_DIR) {
+        /* full path keys would have to be rewritten for the whole subtree */
+        if (unlikely(sharedfs_get_ns_key_mode(cfs->rfs) != SHAREDFS_NS_KEY_PARENT)) {
+            ret = -EOPNOTSUPP;
+            goto out;
+        }
+
+        /* ... and it can not be moved into itself */
+        if (unlikely(is_subpath(new_pd->path, old_pd->path, old_pd->len))) {
+            ret = -EINVAL;
+            goto out;
+        }
+    }
+
+    /*
+     * The new name must fit the dentry slot, which is at least the one of the
+     * current name (slots are sized to the name only in the compact format).
+     */
+    fmt = sharedfs_get_dentry_format(cfs->rfs);
+    if (unlikely(ethane_dentry_size(fmt, strlen(ethane_get_filename(new_pd->path))) >
+                 ethane_dentry_size(fmt, strlen(ethane_get_filename(old_pd->path))))) {
+        ret = -ENAMETOOLONG;
+        goto out;
+    }
+
+    /* the target must be non-existent */
+    entry = nsc_lookup(&cfs->nsc, new_pd->path, new_pd->len, new_pd->state);
+    if (unlikely(entry && entry->dentry.type != ETHANE_DENTRY_TOMBSTONE)) {
+        ret = -EEXIST;
+        goto out;
+    }
+
+out:
+    return ret;
+}
+
+/* Re-key the cached descendants of @old_pd under @new_pd. */
+static int move_cached_descendants(cachefs_t *cfs, const pathdesc_t *old_pd, const pathdesc_t *new_pd) {
+    struct ns_entry *entry, *moved, *stale, **olds, **news = NULL;
+    int i, n = 0, nr_olds, ret = 0;
+    size_t len;
+
+    nr_olds = nsc_collect_descendants(&cfs->nsc, old_pd, &olds);
+    if (unlikely(nr_olds < 0)) {
+        ret = nr_olds;
+        goto out;
+    }
+
+    if (!nr_olds) {
+        goto out_free;
+    }
+
+    news = calloc(nr_olds, sizeof(*news));
+    if (unlikely(!news)) {
+        ret = -ENOMEM;
+        goto out_free;
+    }
+
+    /* allocate everything first so that a failure leaves the cache untouched */
+    for (n = 0; n < nr_olds; n++) {
+        entry = olds[n];
+        len = new_pd->len + strlen(entry->full_path + old_pd->len);
+        news[n] = malloc(sizeof(*entry) + len + 1);
+        if (unlikely(!news[n])) {
+            ret = -ENOMEM;
+            goto out_unpin;
+        }
+        /* inserting the moved ones must not evict the rest */
+        entry->pinned = true;
+    }
+
+    for (i = 0; i < n; i++) {
+        entry = olds[i];
+        moved = news[i];
+        news[i] = NULL;
+
+        memcpy(moved, entry, sizeof(*entry));
+        moved->pinned = false;
+        memcpy(moved->full_path, new_pd->path, new_pd->len);
+        strcpy(moved->full_path + new_pd->len, entry->full_path + old_pd->len);
+        len = strlen(moved->full_path);
+
+        nsc_remove(&cfs->nsc, entry);
+        free(entry);
+
+        stale = nsc_lookup(&cfs->nsc, moved->full_path, len, path_state(moved->full_path, len));
+        if (stale) {
+            nsc_shadow(&cfs->nsc, stale);
+        }
+
+        nsc_insert(&cfs->nsc, moved, path_state(moved->full_path, len));
+    }
+
+    n = 0;
+
+out_unpin:
+    for (i = 0; i < n; i++) {
+        olds[i]->pinned = false;
+    }
+
+out_free:
+    for (i = 0; i < nr_olds && news; i++) {
+        free(news[i]);
+    }
+    free(olds);
+    free(news);
+
+out:
+    return ret;
+}
+
+static int do_rename(cachefs_t *cfs, const pathdesc_t *old_pd, const pathdesc_t *new_pd, size_t version,
+                     dmptr_t dentry_remote_addr) {
+    struct ns_entry *old, *new, *parent, *target;
+    const char *last_slash;
+    int ret = 0;
+
+    old = nsc_lookup(&cfs->nsc, old_pd->path, old_pd->len, old_pd->state);
+    if (unlikely(!old || old->dentry.type == ETHANE_DENTRY_TOMBSTONE ||
+                 old->dentry.remote_addr != dentry_remote_addr)) {
+        pr_err("rename: source %s (%lx) not found", old_pd->path, dentry_remote_addr);
+        ret = -ENOENT;
+        goto out;
+    }
+
+    last_slash = strrchr(new_pd->path, '/');
+    ethane_assert(last_slash);
+    parent = nsc_lookup(&cfs->nsc, new_pd->path, last_slash - new_pd->path, pathdesc_parent_state(new_pd));
+    if (unlikely(!parent || parent->dentry.type != ETHANE_DENTRY_DIR)) {
+        pr_err("rename: target parent of %s not found", new_pd->path);
+        ret = -ENOENT;
+        goto out;
+    }
+
+    new = calloc(1, sizeof(*new) + new_pd->len + 1);
+    if (unlikely(!new)) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    if (old->dentry.type == ETHANE_DENTRY_DIR) {
+        old->pinned = parent->pinned = true;
+        ret = move_cached_descendants(cfs, old_pd, new_pd);
+        old->pinned = parent->pinned = false;
+        if (unlikely(ret < 0)) {
+            free(new);
+            goto out;
+        }
+    }
+
+    new->dentry = old->dentry;
+    new->dentry.parent = parent->dentry.remote_addr;
+    new->version = version;
+    new->is_create = true;
+    /* a dentry not checkpointed yet is simply created under its new name */
+    new->is_move = !old->is_create || old->is_move;
+    new->inline_dirty = old->inline_dirty;
+    strcpy(new->full_path, new_pd->path);
+
+    /* the source's old parent and name are still needed to drop its key */
+    old->dentry.type = ETHANE_DENTRY_TOMBSTONE;
+    old->is_create = false;
+    old->is_move = false;
+    old->version = version;
+
+    target = nsc_lookup(&cfs->nsc, new_pd->path, new_pd->len, new_pd->state);
+    if (target) {
+        nsc_shadow(&cfs->nsc, target);
+    }
+    nsc_insert(&cfs->nsc, new, new_pd->state);
+
+    if (cfs->rename_cb) {
+        cfs->rename_cb(cfs->rename_cb_priv, old_pd->path, new_pd->path);
+    }
+
+    pr_debug("do_rename: %s -> %s %lx", old_pd->path, new_pd->path, dentry_remote_addr);
+
+out:
+    return ret;
+}
+
+int cachefs_rename(cachefs_t *cfs, cachefs_ctx_t *ctx, const char *old_path, const char *new_path,
+                   uint64_t *res, size_t version) {
+    const pathdesc_t *pds[2];
+    pathdesc_t tmps[2];
+    struct ns_entry *entry;
+    int ret;
+
+    pds[0] = pathdesc_get(ctx->pd, old_path, &tmps[0]);
+    pds[1] = pathdesc_get(ctx->pd, new_path, &tmps[1]);
+
+    /* both are needed even when replaying, to re-link the source's dentry */
+    ret = fetch_paths_prefixes_to_cache(cfs, 2, pds);
+    if (unlikely(ret < 0)) {
+        if (*res == OP_RESULT_UNDETERMINED) {
+            *res = OP_RESULT_CANCELED;
+        }
+        goto out;
+    }
+
+    if (*res == OP_RESULT_UNDETERMINED) {
+        ret = check_rename(cfs, ctx, pds[0], pds[1]);
+        if (unlikely(ret < 0)) {
+            *res = OP_RESULT_CANCELED;
+            goto out;
+        }
+        entry = nsc_lookup(&cfs->nsc, old_path, pds[0]->len, pds[0]->state);
+        *res = entry->dentry.remote_addr;
+    }
+
+    ethane_assert(*res != OP_RESULT_CANCELED);
+    ret = do_rename(cfs, pds[0], pds[1], version, *res);
 
 out:
     return ret;
 }
 
-static int check_chmod(cachefs_t *cfs, cachefs_ctx_t *ctx, const char *path) {
-    size_t path_len = strlen(path);
+static int check_chmod(cachefs_t *cfs, cachefs_ctx_t *ctx, const pathdesc_t *pd) {
+    const char *path = pd->path;
+    size_t path_len = pd->len;
     struct ns_entry *entry;
     int ret;
 
-    ret = fetch_path_prefixes_to_cache(cfs, path, NULL, NULL);
+    ret = fetch_path_prefixes_to_cache(cfs, pd, NULL, NULL);
     if (unlikely(ret < 0)) {
         goto out;
     }
 
-    ret = check_prefix_components(cfs, ctx, path, PERM_EX);
+    ret = check_prefix_components(cfs, ctx, pd, PERM_EX);
     if (unlikely(ret < 0)) {
         goto out;
     }
 
     /* the last component must be existent */
-    if (unlikely(!(entry = nsc_lookup(&cfs->nsc, path, path_len)))) {
+    if (unlikely(!(entry = nsc_lookup(&cfs->nsc, path, path_len, pd->state)))) {
         ret = -ENOENT;
         goto out;
     }
@@ -1084,19 +2074,24 @@ out:
     return ret;
 }
 
-static int do_chmod(cachefs_t *cfs, const char *path, mode_t mode, size_t version) {
+static int do_chmod(cachefs_t *cfs, const pathdesc_t *pd, mode_t mode, size_t version) {
+    const char *path = pd->path;
     struct ns_entry *entry;
-    entry = nsc_lookup(&cfs->nsc, path, strlen(path));
+    entry = nsc_lookup(&cfs->nsc, path, pd->len, pd->state);
     entry->dentry.perm.mode = mode;
     entry->version = version;
     return 0;
 }
 
 int cachefs_chmod(cachefs_t *cfs, cachefs_ctx_t *ctx, const char *path, uint64_t *res, mode_t mode, size_t version) {
+    const pathdesc_t *pd;
+    pathdesc_t tmp;
     int ret;
 
+    pd = pathdesc_get(ctx->pd, path, &tmp);
+
     if (*res == OP_RESULT_UNDETERMINED) {
-        ret = check_chmod(cfs, ctx, path);
+        ret = check_chmod(cfs, ctx, pd);
         if (unlikely(ret < 0)) {
             *res = OP_RESULT_CANCELED;
             goto out;
@@ -1105,29 +2100,30 @@ int cachefs_chmod(cachefs_t *cfs, cachefs_ctx_t *ctx, const char *path, uint64_t
     }
 
     ethane_assert(*res != OP_RESULT_CANCELED);
-    ret = do_chmod(cfs, path, mode, version);
+    ret = do_chmod(cfs, pd, mode, version);
 
 out:
     return ret;
 }
 
-static int check_chown(cachefs_t *cfs, cachefs_ctx_t *ctx, const char *path) {
-    size_t path_len = strlen(path);
+static int check_chown(cachefs_t *cfs, cachefs_ctx_t *ctx, const pathdesc_t *pd) {
+    const char *path = pd->path;
+    size_t path_len = pd->len;
     struct ns_entry *entry;
     int ret;
 
-    ret = fetch_path_prefixes_to_cache(cfs, path, NULL, NULL);
+    ret = fetch_path_prefixes_to_cache(cfs, pd, NULL, NULL);
     if (unlikely(ret < 0)) {
         goto out;
     }
 
-    ret = check_prefix_components(cfs, ctx, path, PERM_EX);
+    ret = check_prefix_components(cfs, ctx, pd, PERM_EX);
     if (unlikely(ret < 0)) {
         goto out;
     }
 
     /* the last component must be existent */
-    if (unlikely(!(entry = nsc_lookup(&cfs->nsc, path, path_len)))) {
+    if (unlikely(!(entry = nsc_lookup(&cfs->nsc, path, path_len, pd->state)))) {
         ret = -ENOENT;
         goto out;
     }
@@ -1139,57 +2135,218 @@ out:
     return ret;
 }
 
-static int do_chown(cachefs_t *cfs, const char *path, uid_t uid, gid_t gid, size_t version) {
+static int do_chown(cachefs_t *cfs, const pathdesc_t *pd, uid_t uid, gid_t gid, size_t version) {
+    const char *path = pd->path;
     struct ns_entry *entry;
-    entry = nsc_lookup(&cfs->nsc, path, strlen(path));
+    entry = nsc_lookup(&cfs->nsc, path, pd->len, pd->state);
     entry->dentry.perm.owner.uid = uid;
     entry->dentry.perm.owner.gid = gid;
     entry->version = version;
     return 0;
 }
 
-int cachefs_chown(cachefs_t *cfs, cachefs_ctx_t *ctx, const char *path, uint64_t *res, uid_t uid, gid_t gid,
-                  size_t version) {
-    int ret;
+int cachefs_chown(cachefs_t *cfs, cachefs_ctx_t *ctx, const char *path, uint64_t *res, uid_t uid, gid_t gid,
+                  size_t version) {
+    const pathdesc_t *pd;
+    pathdesc_t tmp;
+    int ret;
+
+    pd = pathdesc_get(ctx->pd, path, &tmp);
+
+    if (*res == OP_RESULT_UNDETERMINED) {
+        ret = check_chown(cfs, ctx, pd);
+        if (unlikely(ret < 0)) {
+            *res = OP_RESULT_CANCELED;
+            goto out;
+        }
+        *res = OP_RESULT_DO_UPDATE;
+    }
+
+    ethane_assert(*res != OP_RESULT_CANCELED);
+    ret = do_chown(cfs, pd, uid, gid, version);
+
+out:
+    return ret;
+}
+
+int cachefs_open(cachefs_t *cfs, cachefs_ctx_t *ctx, const char *path, struct ethane_open_file *file) {
+    const pathdesc_t *pd;
+    pathdesc_t tmp;
+    struct ns_entry *nse;
+    int ret;
+
+    pd = pathdesc_get(ctx->pd, path, &tmp);
+
+    ret = fetch_path_prefixes_to_cache(cfs, pd, NULL, NULL);
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
+
+    ret = check_prefix_components(cfs, ctx, pd, PERM_EX);
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
+
+    nse = nsc_lookup(&cfs->nsc, path, pd->len, pd->state);
+    if (unlikely(!nse || nse->dentry.type == ETHANE_DENTRY_TOMBSTONE)) {
+        ret = -ENOENT;
+        goto out;
+    }
+
+    if (unlikely(nse->dentry.type != ETHANE_DENTRY_FILE)) {
+        ret = -EISDIR;
+        goto out;
+    }
+
+    ret = check_permission(ctx, &nse->dentry.perm, PERM_R);
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
+
+    file->remote_dentry_addr = nse->dentry.remote_addr;
+    strcpy(file->full_path, path);
+    pr_debug("open: %s (%lx)", path, file->remote_dentry_addr);
+
+out:
+    return ret;
+}
+
+int cachefs_close(cachefs_t *cfs, cachefs_ctx_t *ctx, struct ethane_open_file *file) {
+    return 0;
+}
+
+static int do_getattr(cachefs_t *cfs, cachefs_ctx_t *ctx, const pathdesc_t *pd, struct stat *stbuf) {
+    struct ns_entry *nse;
+    int ret;
+
+    ret = check_prefix_components(cfs, ctx, pd, PERM_EX);
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
+
+    nse = nsc_lookup(&cfs->nsc, pd->path, pd->len, pd->state);
+    if (unlikely(!nse || nse->dentry.type == ETHANE_DENTRY_TOMBSTONE)) {
+        ret = -ENOENT;
+        goto out;
+    }
+
+    ret = check_permission(ctx, &nse->dentry.perm, PERM_R);
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
+
+    /* TODO: fill more fields */
+    stbuf->st_size = (__off_t) nse->dentry.file_size;
+
+out:
+    return ret;
+}
+
+int cachefs_getattr(cachefs_t *cfs, cachefs_ctx_t *ctx, const char *path, struct stat *stbuf) {
+    const pathdesc_t *pd;
+    pathdesc_t tmp;
+    int ret;
+
+    pd = pathdesc_get(ctx->pd, path, &tmp);
+
+    ret = fetch_path_prefixes_to_cache(cfs, pd, NULL, NULL);
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
+
+    ret = do_getattr(cfs, ctx, pd, stbuf);
+
+out:
+    return ret;
+}
+
+int cachefs_getattr_batch(cachefs_t *cfs, cachefs_ctx_t *ctx, int nr_paths, const struct pathdesc **pds,
+                          struct stat *stbufs, int *rets) {
+    int i, ret;
+
+    ret = fetch_paths_prefixes_to_cache(cfs, nr_paths, pds);
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
+
+    for (i = 0; i < nr_paths; i++) {
+        rets[i] = do_getattr(cfs, ctx, pds[i], &stbufs[i]);
+    }
+
+out:
+    return ret;
+}
+
+struct readdir_ctx {
+    const char *dir;
+    size_t dir_len;
+    struct ns_entry **cached;
+    int nr_cached;
+    int (*filler)(void *priv, const char *filename);
+    void *priv;
+};
+
+static int ns_entry_path_cmp(const void *a, const void *b) {
+    return strcmp((*(struct ns_entry **) a)->full_path, (*(struct ns_entry **) b)->full_path);
+}
+
+static int fill_remote_child(void *priv, const char *filename) {
+    struct readdir_ctx *rctx = priv;
+    struct ns_entry *key, **found;
+    size_t len = strlen(filename);
+    int ret = 0;
+
+    key = malloc(sizeof(*key) + rctx->dir_len + len + 2);
+    if (unlikely(!key)) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    memcpy(key->full_path, rctx->dir, rctx->dir_len);
+    key->full_path[rctx->dir_len] = '/';
+    memcpy(key->full_path + rctx->dir_len + 1, filename, len + 1);
+
+    found = bsearch(&key, rctx->cached, rctx->nr_cached, sizeof(*rctx->cached), ns_entry_path_cmp);
+    free(key);
 
-    if (*res == OP_RESULT_UNDETERMINED) {
-        ret = check_chown(cfs, ctx, path);
-        if (unlikely(ret < 0)) {
-            *res = OP_RESULT_CANCELED;
-            goto out;
-        }
-        *res = OP_RESULT_DO_UPDATE;
+    /* the cached entry is newer */
+    if (!found) {
+        ret = rctx->filler(rctx->priv, filename);
     }
 
-    ethane_assert(*res != OP_RESULT_CANCELED);
-    ret = do_chown(cfs, path, uid, gid, version);
-
 out:
     return ret;
 }
 
-int cachefs_open(cachefs_t *cfs, cachefs_ctx_t *ctx, const char *path, struct ethane_open_file *file) {
-    struct ns_entry *nse;
-    int ret;
+int cachefs_readdir(cachefs_t *cfs, cachefs_ctx_t *ctx, const char *path,
+                    int (*filler)(void *priv, const char *filename), void *priv) {
+    struct readdir_ctx rctx = { .filler = filler, .priv = priv };
+    struct list_head *dir_bucket;
+    struct ns_entry *nse, *entry;
+    const pathdesc_t *pd;
+    int i, nr = 0, ret;
+    pathdesc_t tmp;
 
-    ret = fetch_path_prefixes_to_cache(cfs, path, NULL, NULL);
+    pd = pathdesc_get(ctx->pd, path, &tmp);
+
+    ret = fetch_path_prefixes_to_cache(cfs, pd, NULL, NULL);
     if (unlikely(ret < 0)) {
         goto out;
     }
 
-    ret = check_prefix_components(cfs, ctx, path, PERM_EX);
+    ret = check_prefix_components(cfs, ctx, pd, PERM_EX);
     if (unlikely(ret < 0)) {
         goto out;
     }
 
-    nse = nsc_lookup(&cfs->nsc, path, strlen(path));
+    nse = nsc_lookup(&cfs->nsc, path, pd->len, pd->state);
     if (unlikely(!nse || nse->dentry.type == ETHANE_DENTRY_TOMBSTONE)) {
         ret = -ENOENT;
         goto out;
     }
 
-    if (unlikely(nse->dentry.type != ETHANE_DENTRY_FILE)) {
-        ret = -EISDIR;
+    if (unlikely(nse->dentry.type != ETHANE_DENTRY_DIR)) {
+        ret = -ENOTDIR;
         goto out;
     }
 
@@ -1198,56 +2355,59 @@ int cachefs_open(cachefs_t *cfs, cachefs_ctx_t *ctx, const char *path, struct et
         goto out;
     }
 
-    file->remote_dentry_addr = nse->dentry.remote_addr;
-    strcpy(file->full_path, path);
-    pr_debug("open: %s (%lx)", path, file->remote_dentry_addr);
-
-out:
-    return ret;
-}
-
-int cachefs_close(cachefs_t *cfs, cachefs_ctx_t *ctx, struct ethane_open_file *file) {
-    return 0;
-}
+    rctx.dir = path;
+    rctx.dir_len = dir_prefix_len(path, pd->len);
+    dir_bucket = nsc_dir_bucket(&cfs->nsc, pd->state);
 
-int cachefs_getattr(cachefs_t *cfs, cachefs_ctx_t *ctx, const char *path, struct stat *stbuf) {
-    struct ns_entry *nse;
-    int ret;
+    /* children not checkpointed yet (or removed since) only live in cache */
+    list_for_each_entry(entry, dir_bucket, sibling) {
+        nr += is_child_path(entry->full_path, path, pd->len);
+    }
 
-    ret = fetch_path_prefixes_to_cache(cfs, path, NULL, NULL);
-    if (unlikely(ret < 0)) {
+    rctx.cached = malloc((nr + 1) * sizeof(*rctx.cached));
+    if (unlikely(!rctx.cached)) {
+        ret = -ENOMEM;
         goto out;
     }
 
-    ret = check_prefix_components(cfs, ctx, path, PERM_EX);
-    if (unlikely(ret < 0)) {
-        goto out;
+    list_for_each_entry(entry, dir_bucket, sibling) {
+        if (is_child_path(entry->full_path, path, pd->len)) {
+            rctx.cached[rctx.nr_cached++] = entry;
+        }
     }
 
-    nse = nsc_lookup(&cfs->nsc, path, strlen(path));
-    if (unlikely(!nse || nse->dentry.type == ETHANE_DENTRY_TOMBSTONE)) {
-        ret = -ENOENT;
-        goto out;
+    qsort(rctx.cached, rctx.nr_cached, sizeof(*rctx.cached), ns_entry_path_cmp);
+
+    ret = sharedfs_ns_read_dir(cfs->rfs, nse->dentry.remote_addr,
+                               rctx.nr_cached ? fill_remote_child : filler,
+                               rctx.nr_cached ? (void *) &rctx : priv);
+    if (ret) {
+        goto out_free;
     }
 
-    ret = check_permission(ctx, &nse->dentry.perm, PERM_R);
-    if (unlikely(ret < 0)) {
-        goto out;
+    for (i = 0; i < rctx.nr_cached; i++) {
+        if (rctx.cached[i]->dentry.type == ETHANE_DENTRY_TOMBSTONE) {
+            continue;
+        }
+        ret = filler(priv, rctx.cached[i]->full_path + rctx.dir_len + 1);
+        if (ret) {
+            break;
+        }
     }
 
-    /* TODO: fill more fields */
-    stbuf->st_size = (__off_t) nse->dentry.file_size;
+out_free:
+    free(rctx.cached);
 
 out:
     return ret;
 }
 
-static inline struct ns_entry *nsc_lookup_by_remote_dentry_addr(cachefs_t *cfs,
+static inline struct ns_entry *nsc_lookup_by_remote_dentry_addr(cachefs_t *cfs, cachefs_ctx_t *ctx,
                                                                 const char *path, dmptr_t remote_dentry_addr) {
     struct ns_entry *entry;
     int ret;
 
-    entry = nsc_lookup(&cfs->nsc, path, strlen(path));
+    entry = nsc_lookup(&cfs->nsc, path, strlen(path), pathdesc_path_state(ctx->pd, path));
     if (entry) {
         ethane_assert(entry->dentry.type != ETHANE_DENTRY_TOMBSTONE);
         goto out;
@@ -1274,12 +2434,122 @@ out:
     return entry;
 }
 
+/* Read in the inline data of a dentry synthesized from an inline ns KV value. */
+static int load_inline_data(cachefs_t *cfs, struct ns_entry *nse) {
+    struct ethane_dentry de;
+    int ret = 0;
+
+    if (likely(!(nse->dentry.flags & ETHANE_DENTRY_PARTIAL))) {
+        goto out;
+    }
+
+    if (sharedfs_get_dentry_format(cfs->rfs) != ETHANE_DENTRY_FMT_FULL) {
+        nse->dentry.flags = 0;
+        goto out;
+    }
+
+    ret = sharedfs_ns_get_dentry(cfs->rfs, nse->dentry.remote_addr, &de, 0);
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
+
+    nse->dentry.flags = de.flags;
+    memcpy(nse->dentry.inline_data, de.inline_data, sizeof(de.inline_data));
+
+out:
+    return ret;
+}
+
+/* The file no longer keeps its data inline, e.g. a block is written. */
+static inline void drop_inline_data(struct ns_entry *nse) {
+    if (nse->dentry.flags & (ETHANE_DENTRY_INLINE_DATA | ETHANE_DENTRY_PARTIAL)) {
+        nse->dentry.flags = 0;
+        memset(nse->dentry.inline_data, 0, sizeof(nse->dentry.inline_data));
+        nse->inline_dirty = true;
+    }
+}
+
+/* Map the blocks [@off, @off + @size) of the file to @blk_remote_addr, e.g. the zero block. */
+static int bmc_map(cachefs_t *cfs, struct ns_entry *nse, size_t off, size_t size, dmptr_t blk_remote_addr,
+                   size_t version) {
+    struct bm_entry *bme;
+
+    bme = calloc(1, sizeof(*bme));
+    if (unlikely(!bme)) {
+        return -ENOMEM;
+    }
+
+    bme->off = off;
+    bme->size = size;
+    bme->remote_dentry = nse->dentry.remote_addr;
+    bme->blk_remote_addr = blk_remote_addr;
+
+    bme->version = version;
+
+    bmc_insert_new(&cfs->bmc, bme);
+
+    return 0;
+}
+
 int cachefs_truncate(cachefs_t *cfs, cachefs_ctx_t *ctx,
                      const char *path, dmptr_t remote_dentry_addr, size_t size, size_t version) {
+    size_t hole_off, hole_end;
     struct ns_entry *nse;
     int ret;
 
-    nse = nsc_lookup_by_remote_dentry_addr(cfs, path, remote_dentry_addr);
+    nse = nsc_lookup_by_remote_dentry_addr(cfs, ctx, path, remote_dentry_addr);
+    if (unlikely(IS_ERR(nse))) {
+        ret = PTR_ERR(nse);
+        goto out;
+    }
+
+    if (unlikely(nse->dentry.type != ETHANE_DENTRY_FILE)) {
+        ret = -EISDIR;
+        goto out;
+    }
+
+    ret = check_permission(ctx, &nse->dentry.perm, PERM_W);
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
+
+    /* bytes cut off must read as zeros if the file grows again */
+    if (size < nse->dentry.file_size && size < ETHANE_INLINE_DATA_MAX) {
+        ret = load_inline_data(cfs, nse);
+        if (unlikely(ret < 0)) {
+            goto out;
+        }
+        if (nse->dentry.flags & ETHANE_DENTRY_INLINE_DATA) {
+            memset(nse->dentry.inline_data + size, 0, ETHANE_INLINE_DATA_MAX - size);
+            nse->inline_dirty = true;
+        }
+    }
+
+    /* map the whole blocks cut off to the zero block, the caller zeroed the tail of the last one */
+    hole_off = ALIGN_UP(size, BLK_SIZE);
+    hole_end = ALIGN_UP(nse->dentry.file_size, BLK_SIZE);
+    if (hole_off < hole_end && !(nse->dentry.flags & ETHANE_DENTRY_INLINE_DATA)) {
+        ret = bmc_map(cfs, nse, hole_off, hole_end - hole_off, SHAREDFS_ZERO_BLK_ADDR, version);
+        if (unlikely(ret < 0)) {
+            goto out;
+        }
+    }
+
+    nse->dentry.file_size = size;
+
+    nse->version = version;
+
+out:
+    return ret;
+}
+
+int cachefs_clone(cachefs_t *cfs, cachefs_ctx_t *ctx, const char *path, dmptr_t remote_dentry_addr, size_t size,
+                  int nr_blks, const cachefs_blk_t *blks, size_t version) {
+    size_t off, old_end;
+    struct ns_entry *nse;
+    int i, ret;
+
+    nse = nsc_lookup_by_remote_dentry_addr(cfs, ctx, path, remote_dentry_addr);
     if (unlikely(IS_ERR(nse))) {
         ret = PTR_ERR(nse);
         goto out;
@@ -1295,6 +2565,24 @@ int cachefs_truncate(cachefs_t *cfs, cachefs_ctx_t *ctx,
         goto out;
     }
 
+    drop_inline_data(nse);
+
+    /* nothing of the old data survives, the extents then go over the hole */
+    old_end = ALIGN_UP(nse->dentry.file_size, BLK_SIZE);
+    if (old_end) {
+        ret = bmc_map(cfs, nse, 0, old_end, SHAREDFS_ZERO_BLK_ADDR, version);
+        if (unlikely(ret < 0)) {
+            goto out;
+        }
+    }
+
+    for (i = 0, off = 0; i < nr_blks; off += blks[i++].size) {
+        ret = bmc_map(cfs, nse, off, ALIGN_UP(blks[i].size, BLK_SIZE), blks[i].blk_remote_addr, version);
+        if (unlikely(ret < 0)) {
+            goto out;
+        }
+    }
+
     nse->dentry.file_size = size;
 
     nse->version = version;
@@ -1311,7 +2599,7 @@ long cachefs_write(cachefs_t* cfs, cachefs_ctx_t* ctx,
     long write_size;
     int ret;
 
-    nse = nsc_lookup_by_remote_dentry_addr(cfs, path, remote_dentry_addr);
+    nse = nsc_lookup_by_remote_dentry_addr(cfs, ctx, path, remote_dentry_addr);
     if (unlikely(IS_ERR(nse))) {
         write_size = PTR_ERR(nse);
         goto out;
@@ -1328,13 +2616,7 @@ long cachefs_write(cachefs_t* cfs, cachefs_ctx_t* ctx,
         goto out;
     }
 
-    write_size = min(nse->dentry.file_size, blk->size);
-
-    /* FIXME: */
-    if (write_size != IO_SIZE || off % IO_SIZE != 0) {
-        pr_err("only support io size %lu, and off(=%lu) must be multipler of it!", IO_SIZE, off);
-        abort();
-    }
+    write_size = blk->size;
 
     bme = calloc(1, sizeof(*bme));
     if (unlikely(!bme)) {
@@ -1342,8 +2624,9 @@ long cachefs_write(cachefs_t* cfs, cachefs_ctx_t* ctx,
         goto out;
     }
 
-    bme->off = off;
-    bme->size = write_size;
+    /* the data block holds the whole blocks the write touches */
+    bme->off = ALIGN_DOWN(off, BLK_SIZE);
+    bme->size = ALIGN_UP(off + write_size, BLK_SIZE) - bme->off;
     bme->remote_dentry = nse->dentry.remote_addr;
     bme->blk_remote_addr = blk->blk_remote_addr;
 
@@ -1351,6 +2634,61 @@ long cachefs_write(cachefs_t* cfs, cachefs_ctx_t* ctx,
 
     bmc_insert_new(&cfs->bmc, bme);
 
+    drop_inline_data(nse);
+
+    nse->dentry.file_size = max(nse->dentry.file_size, off + write_size);
+
+    nse->version = version;
+
+out:
+    return write_size;
+}
+
+long cachefs_write_inline(cachefs_t *cfs, cachefs_ctx_t *ctx,
+                          const char *path, dmptr_t remote_dentry_addr, size_t off, const void *data, size_t size,
+                          size_t version) {
+    struct ns_entry *nse;
+    long write_size;
+    int ret;
+
+    nse = nsc_lookup_by_remote_dentry_addr(cfs, ctx, path, remote_dentry_addr);
+    if (unlikely(IS_ERR(nse))) {
+        write_size = PTR_ERR(nse);
+        goto out;
+    }
+
+    if (unlikely(nse->dentry.type != ETHANE_DENTRY_FILE)) {
+        write_size = -EISDIR;
+        goto out;
+    }
+
+    ret = check_permission(ctx, &nse->dentry.perm, PERM_W);
+    if (unlikely(ret < 0)) {
+        write_size = ret;
+        goto out;
+    }
+
+    ret = load_inline_data(cfs, nse);
+    if (unlikely(ret < 0)) {
+        write_size = ret;
+        goto out;
+    }
+
+    /* the same on every replayer, as it only depends on the ops before */
+    if (!(nse->dentry.flags & ETHANE_DENTRY_INLINE_DATA) || off + size > ETHANE_INLINE_DATA_MAX) {
+        write_size = -ENODATA;
+        goto out;
+    }
+
+    memcpy(nse->dentry.inline_data + off, data, size);
+    nse->inline_dirty = true;
+
+    nse->dentry.file_size = max(nse->dentry.file_size, off + size);
+
+    nse->version = version;
+
+    write_size = (long) size;
+
 out:
     return write_size;
 }
@@ -1362,7 +2700,7 @@ long cachefs_append(cachefs_t* cfs, cachefs_ctx_t* ctx,
     long write_size;
     int ret;
 
-    nse = nsc_lookup_by_remote_dentry_addr(cfs, path, remote_dentry_addr);
+    nse = nsc_lookup_by_remote_dentry_addr(cfs, ctx, path, remote_dentry_addr);
     if (unlikely(IS_ERR(nse))) {
         write_size = PTR_ERR(nse);
         goto out;
@@ -1396,6 +2734,8 @@ long cachefs_append(cachefs_t* cfs, cachefs_ctx_t* ctx,
 
     bmc_insert_new(&cfs->bmc, bme);
 
+    drop_inline_data(nse);
+
     nse->dentry.file_size += write_size;
 
 out:
@@ -1405,7 +2745,7 @@ out:
 static struct bm_entry *get_extent(cachefs_t *cfs, struct ethane_dentry *dentry, size_t off) {
     dmptr_t remote_blk_addr;
     struct bm_entry *entry;
-    size_t size;
+    size_t loff, size;
     int ret;
 
 retry:
@@ -1415,7 +2755,7 @@ retry:
         goto out;
     }
 
-    ret = sharedfs_bm_get_extent(cfs->rfs, &remote_blk_addr, &size, dentry, off);
+    ret = sharedfs_bm_get_extent(cfs->rfs, &remote_blk_addr, &loff, &size, dentry, off);
     if (unlikely(ret)) {
         pr_debug("no bm found");
         goto out;
@@ -1426,7 +2766,7 @@ retry:
         goto out;
     }
 
-    entry->off = off;
+    entry->off = loff;
     entry->size = size;
     entry->remote_dentry = dentry->remote_addr;
     entry->blk_remote_addr = remote_blk_addr;
@@ -1441,14 +2781,16 @@ out:
 }
 
 long cachefs_read(cachefs_t* cfs, cachefs_ctx_t* ctx,
-                  const char* path, dmptr_t remote_dentry_addr, cachefs_blk_t* blks, size_t off, size_t size) {
+                  const char* path, dmptr_t remote_dentry_addr, cachefs_blk_t* blks, int *nr_blks,
+                  size_t off, size_t size) {
+    int max_nr_blks = *nr_blks;
     size_t blk_size, end;
     struct ns_entry *nse;
     struct bm_entry *bme;
     long read_size = 0;
     int ret;
 
-    nse = nsc_lookup_by_remote_dentry_addr(cfs, path, remote_dentry_addr);
+    nse = nsc_lookup_by_remote_dentry_addr(cfs, ctx, path, remote_dentry_addr);
     if (unlikely(IS_ERR(nse))) {
         ret = PTR_ERR(nse);
         goto out;
@@ -1467,27 +2809,107 @@ long cachefs_read(cachefs_t* cfs, cachefs_ctx_t* ctx,
 
     end = min(off + size, nse->dentry.file_size);
 
-    while (off < end) {
+    *nr_blks = 0;
+
+    while (off < end && *nr_blks < max_nr_blks) {
         bme = get_extent(cfs, &nse->dentry, off);
         if (unlikely(!bme)) {
             read_size = -ENOMEM;
             goto out;
         }
 
-        blk_size = min(bme->size, end - off);
+        blk_size = min(bme->off + bme->size - off, end - off);
 
         ethane_assert(blk_size > 0);
 
-        blks->blk_remote_addr = bme->blk_remote_addr + (off - bme->off);
-        blks->size = bme->off + bme->size - off;
+        blks->blk_remote_addr = sharedfs_blk_addr_add(bme->blk_remote_addr, off - bme->off);
+        blks->size = blk_size;
 
         pr_debug("read range [%lx, %lx) (blk: %lx, size: %lx)", off, off + blk_size, blks->blk_remote_addr, blks->size);
 
-        off = bme->off + bme->size;
+        off += blk_size;
         read_size += blk_size;
         blks++;
+        (*nr_blks)++;
+    }
+
+out:
+    return read_size;
+}
+
+int cachefs_is_inline(cachefs_t *cfs, cachefs_ctx_t *ctx, const char *path, dmptr_t remote_dentry_addr) {
+    struct ns_entry *nse;
+    int ret;
+
+    nse = nsc_lookup_by_remote_dentry_addr(cfs, ctx, path, remote_dentry_addr);
+    if (unlikely(IS_ERR(nse))) {
+        ret = PTR_ERR(nse);
+        goto out;
+    }
+
+    ret = load_inline_data(cfs, nse);
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
+
+    ret = !!(nse->dentry.flags & ETHANE_DENTRY_INLINE_DATA);
+
+out:
+    return ret;
+}
+
+long cachefs_read_inline(cachefs_t *cfs, cachefs_ctx_t *ctx,
+                         const char *path, dmptr_t remote_dentry_addr, void *buf, size_t off, size_t size) {
+    size_t end, inline_end;
+    struct ns_entry *nse;
+    long read_size;
+    int ret;
+
+    nse = nsc_lookup_by_remote_dentry_addr(cfs, ctx, path, remote_dentry_addr);
+    if (unlikely(IS_ERR(nse))) {
+        read_size = PTR_ERR(nse);
+        goto out;
+    }
+
+    if (unlikely(nse->dentry.type != ETHANE_DENTRY_FILE)) {
+        read_size = -EISDIR;
+        goto out;
+    }
+
+    ret = check_permission(ctx, &nse->dentry.perm, PERM_R);
+    if (unlikely(ret < 0)) {
+        read_size = ret;
+        goto out;
+    }
+
+    ret = load_inline_data(cfs, nse);
+    if (unlikely(ret < 0)) {
+        read_size = ret;
+        goto out;
+    }
+
+    if (!(nse->dentry.flags & ETHANE_DENTRY_INLINE_DATA)) {
+        read_size = -ENODATA;
+        goto out;
+    }
+
+    end = min(off + size, nse->dentry.file_size);
+    if (off >= end) {
+        read_size = 0;
+        goto out;
+    }
+
+    inline_end = min(end, ETHANE_INLINE_DATA_MAX);
+    if (off < inline_end) {
+        memcpy(buf, nse->dentry.inline_data + off, inline_end - off);
+    }
+    if (end > ETHANE_INLINE_DATA_MAX) {
+        inline_end = max(off, ETHANE_INLINE_DATA_MAX);
+        memset((char *) buf + (inline_end - off), 0, end - inline_end);
     }
 
+    read_size = (long) (end - off);
+
 out:
     return read_size;
 }
@@ -1500,6 +2922,9 @@ static inline int count_ns_entries(cachefs_t *cfs) {
             count++;
         }
     }
+    list_for_each_entry(entry, &cfs->nsc.shadowed, node) {
+        count++;
+    }
     return count;
 }
 
@@ -1524,7 +2949,17 @@ static void clear_ns_cache(cachefs_t *cfs) {
         }
     }
 
+    list_for_each_entry_safe(entry, tmp, &cfs->nsc.shadowed, node) {
+        list_del(&entry->node);
+        free(entry);
+    }
+
+    for (i = 0; i < cfs->nsc.nr_buckets; i++) {
+        INIT_LIST_HEAD(&cfs->nsc.dir_buckets[i]);
+    }
+
     cfs->nsc.count = 0;
+    cfs->nsc.nr_orphans = 0;
 }
 
 static void clear_bm_cache(cachefs_t *cfs) {
@@ -1540,9 +2975,19 @@ static void clear_bm_cache(cachefs_t *cfs) {
     cfs->bmc.clock_hand = NULL;
 }
 
+static void add_ns_update_record(sharedfs_ns_update_record_t *record, struct ns_entry *entry) {
+    record->full_path = entry->full_path;
+    record->path_state = entry->path_state;
+    record->dentry = &entry->dentry;
+    record->is_create = entry->is_create;
+    record->is_move = entry->is_move;
+    record->inline_dirty = entry->inline_dirty;
+    record->is_rmtree = entry->is_rmtree;
+}
+
 static sharedfs_ns_update_record_t *get_ns_update_records(cachefs_t *cfs, int *nr_records) {
-    sharedfs_ns_update_record_t *records, *record;
     struct ns_entry *entry;
+    sharedfs_ns_update_record_t *records;
     int i, count;
 
     count = count_ns_entries(cfs);
@@ -1559,13 +3004,14 @@ static sharedfs_ns_update_record_t *get_ns_update_records(cachefs_t *cfs, int *n
                 continue;
             }
 
-            record = &records[(*nr_records)++];
-            record->full_path = entry->full_path;
-            record->dentry = &entry->dentry;
-            record->is_create = entry->is_create;
+            add_ns_update_record(&records[(*nr_records)++], entry);
         }
     }
 
+    list_for_each_entry(entry, &cfs->nsc.shadowed, node) {
+        add_ns_update_record(&records[(*nr_records)++], entry);
+    }
+
 out:
     return records;
 }
@@ -1589,11 +3035,28 @@ static sharedfs_bm_update_record_t *get_bm_update_records(cachefs_t *cfs, int *n
             continue;
         }
 
+        /*
+         * Coalesce extents adjacent both in the file and in the data blocks (or both
+         * holes), so that
+         * sharedfs stores them as the largest interval nodes that fit. The extents of a
+         * file are checkpointed in log order, so anything already checkpointed is older
+         * than all of them and the merged one can take the newest version.
+         */
+        record = *nr_records ? &records[*nr_records - 1] : NULL;
+        if (record && record->dentry_remote_addr == entry->remote_dentry &&
+            record->loff + record->size == entry->off &&
+            sharedfs_blk_addr_add(record->blk_remote_addr, record->size) == entry->blk_remote_addr) {
+            record->size += entry->size;
+            record->version = max(record->version, entry->version);
+            continue;
+        }
+
         record = &records[(*nr_records)++];
         record->dentry_remote_addr = entry->remote_dentry;
         record->loff = entry->off;
         record->size = entry->size;
         record->blk_remote_addr = entry->blk_remote_addr;
+        record->version = entry->version;
     }
 
 out:
@@ -1686,13 +3149,18 @@ cachefs_t *cachefs_init(struct dmcontext *dmcontext, struct dmm_cli *dmm, struct
                                                      * cfs->nsc.nr_ent_high_watermark
                                                      / cfs->nsc.nr_ent_max);
     cfs->nsc.buckets = calloc(cfs->nsc.nr_buckets, sizeof(*cfs->nsc.buckets));
-    if (unlikely(!cfs->nsc.buckets)) {
+    cfs->nsc.dir_buckets = calloc(cfs->nsc.nr_buckets, sizeof(*cfs->nsc.dir_buckets));
+    if (unlikely(!cfs->nsc.buckets || !cfs->nsc.dir_buckets)) {
+        free(cfs->nsc.buckets);
+        free(cfs->nsc.dir_buckets);
         free(cfs);
         cfs = NULL;
         goto out;
     }
+    INIT_LIST_HEAD(&cfs->nsc.shadowed);
     for (i = 0; i < cfs->nsc.nr_buckets; i++) {
         INIT_LIST_HEAD(&cfs->nsc.buckets[i].head);
+        INIT_LIST_HEAD(&cfs->nsc.dir_buckets[i]);
     }
 #if 0
     printf("CacheFS namespace cache:\n");
@@ -1724,6 +3192,11 @@ out:
     return cfs;
 }
 
+void cachefs_set_rename_cb(cachefs_t *cfs, cachefs_rename_cb_t cb, void *priv) {
+    cfs->rename_cb = cb;
+    cfs->rename_cb_priv = priv;
+}
+
 void cachefs_dump(cachefs_t *cfs) {
     struct ns_entry *nse;
     struct bm_entry *bme;
@@ -31,9 +31,14 @@ typedef struct cachefs cachefs_t;
 typedef struct cachefs_ctx cachefs_ctx_t;
 typedef struct cachefs_blk cachefs_blk_t;
 
+struct pathdesc;
+
 struct cachefs_ctx {
     uid_t uid;
     gid_t gid;
+
+    /* Optional descriptor of the op's path, reused instead of rehashing it */
+    const struct pathdesc *pd;
 };
 
 struct cachefs_blk {
@@ -52,13 +57,49 @@ cachefs_t *cachefs_init(struct dmcontext *dmcontext, struct dmm_cli *dmm, struct
 
 void cachefs_clean(cachefs_t *cfs);
 
-int cachefs_prefetch_metadata(cachefs_t *cfs, const char *path);
+/* Called with the old and new path of each rename the cache applies, logged here or replayed */
+typedef void (*cachefs_rename_cb_t)(void *priv, const char *old_path, const char *new_path);
+void cachefs_set_rename_cb(cachefs_t *cfs, cachefs_rename_cb_t cb, void *priv);
+
+/* Fetch the prefixes of @path, which is about to be created, into the cache. */
+int cachefs_prefetch_metadata(cachefs_t *cfs, cachefs_ctx_t *ctx, const char *path);
+/* Remote address of the parent directory of @path if it is cached, DMPTR_NULL otherwise */
+dmptr_t cachefs_get_cached_parent(cachefs_t *cfs, cachefs_ctx_t *ctx, const char *path);
+/*
+ * Index of the first component of @path not cached as a directory (its depth if there
+ * is none), @parent is set to the remote address of the one before it.
+ */
+int cachefs_get_first_missing(cachefs_t *cfs, cachefs_ctx_t *ctx, const char *path, dmptr_t *parent);
 int cachefs_mkdir(cachefs_t *cfs, cachefs_ctx_t *ctx, const char *path, uint64_t *res, mode_t mode, dmptr_t remote_file,
                   size_t version);
+/*
+ * Make the missing directories of @path at once. @remote_dentries holds the dentries of
+ * components [@first, @first + @nr), the missing ones must be among them (-EAGAIN if not).
+ */
+/*
+ * The result of a recursive mkdir is the remote address of the deepest existing
+ * directory, with the index of the first component to make in its low bits, which
+ * are always clear as dentries are aligned.
+ */
+#define MKDIR_RECURSIVE_IDX_MASK    (DENTRY_COMPACT_ALIGN - 1)
+
+static inline int cachefs_mkdir_recursive_first_made(uint64_t res) {
+    return (int) (res & MKDIR_RECURSIVE_IDX_MASK);
+}
+
+int cachefs_mkdir_recursive(cachefs_t *cfs, cachefs_ctx_t *ctx, const char *path, uint64_t *res, mode_t mode,
+                            int first, int nr, const dmptr_t *remote_dentries, size_t version);
 int cachefs_rmdir(cachefs_t *cfs, cachefs_ctx_t *ctx, const char *path, uint64_t *res, size_t version);
+/*
+ * Remove the directory @path with everything below it. Cached descendants are dropped and
+ * the lookups below @path fail from then on, the checkpoint reclaims the rest.
+ */
+int cachefs_rmtree(cachefs_t *cfs, cachefs_ctx_t *ctx, const char *path, uint64_t *res, size_t version);
 int cachefs_unlink(cachefs_t *cfs, cachefs_ctx_t *ctx, const char *path, uint64_t *res, size_t version);
 int cachefs_create(cachefs_t *cfs, cachefs_ctx_t *ctx, const char *path, uint64_t *res, mode_t mode, dmptr_t remote_file,
                    struct ethane_open_file *file, size_t version);
+int cachefs_rename(cachefs_t *cfs, cachefs_ctx_t *ctx, const char *old_path, const char *new_path,
+                   uint64_t *res, size_t version);
 int cachefs_chmod(cachefs_t *cfs, cachefs_ctx_t *ctx, const char *path, uint64_t *res, mode_t mode, size_t version);
 int cachefs_chown(cachefs_t *cfs, cachefs_ctx_t *ctx, const char *path, uint64_t *res, uid_t uid, gid_t gid,
                   size_t version);
@@ -66,10 +107,26 @@ int cachefs_chown(cachefs_t *cfs, cachefs_ctx_t *ctx, const char *path, uint64_t
 int cachefs_open(cachefs_t *cfs, cachefs_ctx_t *ctx, const char *path, struct ethane_open_file *file);
 int cachefs_close(cachefs_t *cfs, cachefs_ctx_t *ctx, struct ethane_open_file *file);
 int cachefs_getattr(cachefs_t *cfs, cachefs_ctx_t *ctx, const char *path, struct stat *stbuf);
+/* Getattr of each path described by @pds, with one remote lookup for all of them; results go to @rets. */
+int cachefs_getattr_batch(cachefs_t *cfs, cachefs_ctx_t *ctx, int nr_paths, const struct pathdesc **pds,
+                          struct stat *stbufs, int *rets);
+/*
+ * Call @filler with the name of each child of directory @path: the checkpointed child
+ * index merged with the entries in cache that are not checkpointed yet.
+ */
+int cachefs_readdir(cachefs_t *cfs, cachefs_ctx_t *ctx, const char *path,
+                    int (*filler)(void *priv, const char *filename), void *priv);
 
 int cachefs_truncate(cachefs_t *cfs, cachefs_ctx_t *ctx,
                      const char *path, dmptr_t remote_dentry_addr, size_t size, size_t version);
+/* Replace the data of the file with the blocks of @blks, back to back from offset 0, and set its size */
+int cachefs_clone(cachefs_t *cfs, cachefs_ctx_t *ctx, const char *path, dmptr_t remote_dentry_addr, size_t size,
+                  int nr_blks, const cachefs_blk_t *blks, size_t version);
 
+/*
+ * Write blk->size bytes at @off. The data block holds the whole blocks the write touches,
+ * starting from ALIGN_DOWN(@off, BLK_SIZE).
+ */
 long cachefs_write(cachefs_t* cfs, cachefs_ctx_t* ctx,
                    const char* path, dmptr_t remote_dentry_addr, size_t off, const cachefs_blk_t* blk,
                    size_t version);
@@ -77,8 +134,25 @@ long cachefs_write(cachefs_t* cfs, cachefs_ctx_t* ctx,
 long cachefs_append(cachefs_t* cfs, cachefs_ctx_t* ctx,
                     const char* path, dmptr_t remote_dentry_addr, const cachefs_blk_t* blk, size_t version);
 
+/* Map up to *nr_blks ranges of [@off, @off + @size) into @blks, set *nr_blks to the number mapped. */
 long cachefs_read(cachefs_t* cfs, cachefs_ctx_t* ctx,
-                  const char* path, dmptr_t remote_dentry_addr, cachefs_blk_t* blks, size_t off, size_t size);
+                  const char* path, dmptr_t remote_dentry_addr, cachefs_blk_t* blks, int *nr_blks,
+                  size_t off, size_t size);
+
+/*
+ * Write @size bytes of @data at @off into the data kept in the dentry. Returns -ENODATA
+ * if the file has no inline data or the range goes beyond ETHANE_INLINE_DATA_MAX.
+ */
+long cachefs_write_inline(cachefs_t *cfs, cachefs_ctx_t *ctx,
+                          const char *path, dmptr_t remote_dentry_addr, size_t off, const void *data, size_t size,
+                          size_t version);
+
+/* Whether the file keeps its data in the dentry (a file never goes back once spilled to blocks) */
+int cachefs_is_inline(cachefs_t *cfs, cachefs_ctx_t *ctx, const char *path, dmptr_t remote_dentry_addr);
+
+/* Read [@off, @off + @size) of a file with inline data into @buf, -ENODATA if it has none. */
+long cachefs_read_inline(cachefs_t *cfs, cachefs_ctx_t *ctx,
+                         const char *path, dmptr_t remote_dentry_addr, void *buf, size_t off, size_t size);
 
 bool cachefs_reached_high_watermark(cachefs_t *cfs);
 bool cachefs_reached_max_size(cachefs_t *cfs);
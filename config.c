@@ -55,6 +55,38 @@ static const cyaml_schema_field_t ethane_fs_sharedfs_config_schema[] = {
         "kv_nr_shards",
         CYAML_FLAG_DEFAULT,
         struct ethane_fs_sharedfs_config, kv_nr_shards),
+    CYAML_FIELD_UINT(
+        "namespace_kv_bucket_nr_slots",
+        CYAML_FLAG_DEFAULT,
+        struct ethane_fs_sharedfs_config, namespace_kv_bucket_nr_slots),
+    CYAML_FIELD_UINT(
+        "block_mapping_kv_bucket_nr_slots",
+        CYAML_FLAG_DEFAULT,
+        struct ethane_fs_sharedfs_config, block_mapping_kv_bucket_nr_slots),
+    CYAML_FIELD_UINT(
+        "kv_max_kick_depth",
+        CYAML_FLAG_DEFAULT,
+        struct ethane_fs_sharedfs_config, kv_max_kick_depth),
+    CYAML_FIELD_UINT(
+        "kv_stash_nr_slots",
+        CYAML_FLAG_DEFAULT,
+        struct ethane_fs_sharedfs_config, kv_stash_nr_slots),
+    CYAML_FIELD_UINT(
+        "namespace_key_mode",
+        CYAML_FLAG_DEFAULT,
+        struct ethane_fs_sharedfs_config, namespace_key_mode),
+    CYAML_FIELD_UINT(
+        "namespace_kv_inline_dentry",
+        CYAML_FLAG_DEFAULT,
+        struct ethane_fs_sharedfs_config, namespace_kv_inline_dentry),
+    CYAML_FIELD_UINT(
+        "dentry_format",
+        CYAML_FLAG_DEFAULT,
+        struct ethane_fs_sharedfs_config, dentry_format),
+    CYAML_FIELD_UINT(
+        "namespace_filter_size_mb",
+        CYAML_FLAG_DEFAULT,
+        struct ethane_fs_sharedfs_config, namespace_filter_size_mb),
     CYAML_FIELD_END
 };
 
@@ -119,6 +151,10 @@ static const cyaml_schema_field_t ethane_cli_dmm_config_schema[] = {
         "pmem_initial_alloc_size_mb",
         CYAML_FLAG_DEFAULT,
         struct ethane_cli_dmm_config, pmem_initial_alloc_size_mb),
+    CYAML_FIELD_UINT(
+        "dentry_extent_nr_dentries",
+        CYAML_FLAG_DEFAULT,
+        struct ethane_cli_dmm_config, dentry_extent_nr_dentries),
     CYAML_FIELD_END
 };
 
@@ -147,6 +183,14 @@ static const cyaml_schema_field_t ethane_cli_sharedfs_config_schema[] = {
         "nr_max_outstanding_updates",
         CYAML_FLAG_DEFAULT,
         struct ethane_cli_sharedfs_config, nr_max_outstanding_updates),
+    CYAML_FIELD_UINT(
+        "kv_cache_nr_ents",
+        CYAML_FLAG_DEFAULT,
+        struct ethane_cli_sharedfs_config, kv_cache_nr_ents),
+    CYAML_FIELD_UINT(
+        "kv_cache_staleness_us",
+        CYAML_FLAG_DEFAULT,
+        struct ethane_cli_sharedfs_config, kv_cache_staleness_us),
     CYAML_FIELD_END
 };
 
@@ -217,12 +261,29 @@ static const cyaml_schema_field_t ethane_logd_checkpoint_config_schema[] = {
     CYAML_FIELD_END
 };
 
+static const cyaml_schema_field_t ethane_logd_kv_resize_config_schema[] = {
+    CYAML_FIELD_UINT(
+        "max_load_factor_pct",
+        CYAML_FLAG_DEFAULT,
+        struct ethane_logd_kv_resize_config, max_load_factor_pct),
+    CYAML_FIELD_UINT(
+        "check_interval_ms",
+        CYAML_FLAG_DEFAULT,
+        struct ethane_logd_kv_resize_config, check_interval_ms),
+    CYAML_FIELD_END
+};
+
 static const cyaml_schema_field_t ethane_logd_config_schema[] = {
     CYAML_FIELD_MAPPING(
         "checkpoint",
         CYAML_FLAG_DEFAULT,
         struct ethane_logd_config, checkpoint,
         ethane_logd_checkpoint_config_schema),
+    CYAML_FIELD_MAPPING(
+        "kv_resize",
+        CYAML_FLAG_DEFAULT,
+        struct ethane_logd_config, kv_resize,
+        ethane_logd_kv_resize_config_schema),
     CYAML_FIELD_END
 };
 
@@ -22,6 +22,14 @@ struct ethane_fs_sharedfs_config {
     int *interval_node_nr_blks;
     int interval_node_nr_blks_count;
     int kv_nr_shards;
+    int namespace_kv_bucket_nr_slots;
+    int block_mapping_kv_bucket_nr_slots;
+    int kv_max_kick_depth;
+    int kv_stash_nr_slots;
+    int namespace_key_mode;
+    int namespace_kv_inline_dentry;
+    int dentry_format;
+    size_t namespace_filter_size_mb;
 };
 
 struct ethane_fs_logger_config {
@@ -55,6 +63,7 @@ struct ethane_cli_net_config {
 
 struct ethane_cli_dmm_config {
     size_t pmem_initial_alloc_size_mb;
+    int dentry_extent_nr_dentries;
 };
 
 struct ethane_cli_cachefs_config {
@@ -66,6 +75,8 @@ struct ethane_cli_cachefs_config {
 
 struct ethane_cli_sharedfs_config {
     int nr_max_outstanding_updates;
+    int kv_cache_nr_ents;
+    long kv_cache_staleness_us;
 };
 
 struct ethane_cli_logger_config {
@@ -107,8 +118,14 @@ struct ethane_logd_checkpoint_config {
     int nr_shards;
 };
 
+struct ethane_logd_kv_resize_config {
+    int max_load_factor_pct;
+    int check_interval_ms;
+};
+
 struct ethane_logd_config {
     struct ethane_logd_checkpoint_config checkpoint;
+    struct ethane_logd_kv_resize_config kv_resize;
 };
 
 #endif //ETHANE_CONFIG_H
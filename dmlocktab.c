@@ -23,6 +23,7 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <unistd.h>
+#include <errno.h>
 
 #include "dmlocktab.h"
 
@@ -166,3 +167,32 @@ int dmlock_release(dmlocktab_t *locktab, uint64_t oid) {
 out:
     return ret;
 }
+
+int dmlock_read_seq(dmlocktab_t *locktab, uint64_t oid, uint64_t *seq) {
+    struct dmlock *lock;
+    dmptr_t lock_addr;
+    int ret;
+
+    lock_addr = get_lock_addr(locktab, oid);
+
+    dm_mark(locktab->ctx);
+
+    lock = dm_push(locktab->ctx, NULL, sizeof(*lock));
+
+    ret = dm_copy_from_remote(locktab->ctx, lock, lock_addr, sizeof(*lock), DMFLAG_ACK);
+    if (unlikely(ret)) {
+        goto out;
+    }
+
+    ret = dm_wait_ack(locktab->ctx, 1);
+    if (unlikely(ret)) {
+        goto out;
+    }
+
+    *seq = lock->val;
+    ret = lock->next_ticket == lock->now_serving ? 0 : -EBUSY;
+
+out:
+    dm_pop(locktab->ctx);
+    return ret;
+}
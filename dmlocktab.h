@@ -18,5 +18,11 @@ typedef struct dmlocktab dmlocktab_t;
 dmlocktab_t *dmlocktab_init(dmcontext_t *ctx, int nr_locks_order);
 int dmlock_acquire(dmlocktab_t *locktab, uint64_t oid);
 int dmlock_release(dmlocktab_t *locktab, uint64_t oid);
+/*
+ * Read the ticket word of the lock of @oid into @seq, -EBUSY if the lock is held. Every
+ * acquire bumps the word, so lock-free readers can tell that nobody took the lock between
+ * two reads that return the same word.
+ */
+int dmlock_read_seq(dmlocktab_t *locktab, uint64_t oid, uint64_t *seq);
 
 #endif //ETHANE_DMLOCKTAB_H
@@ -20,6 +20,7 @@
 
 #include <errno.h>
 #include <string.h>
+#include <immintrin.h>
 
 #include "ethane.h"
 #include "debug.h"
@@ -32,6 +33,7 @@
 #define DMM_BFREE_RPC_ID     2
 #define DMM_BZERO_RPC_ID     3
 #define DMM_BCLEAR_RPC_ID    4
+#define DMM_BCOPY_RPC_ID     5
 
 #define DMM_NR_ISOLATE_MNS   0
 
@@ -114,6 +116,20 @@ static void do_mn_bzero(dmm_mn_t *dmm, dmptr_t addr, size_t size) {
     memset_nt(dmm->mem_buf + DMPTR_OFF(addr), 0, size);
 }
 
+/* Copy within the pool with non-temporal stores, so that the copy bypasses (and does not pollute) the cache. */
+static void do_mn_bcopy(dmm_mn_t *dmm, dmptr_t dst, dmptr_t src, size_t size) {
+    long long *d = dmm->mem_buf + DMPTR_OFF(dst);
+    const long long *s = dmm->mem_buf + DMPTR_OFF(src);
+    size_t i;
+
+    for (i = 0; i + sizeof(*d) <= size; i += sizeof(*d)) {
+        _mm_stream_si64(d++, *s++);
+    }
+    memcpy(d, s, size - i);
+
+    _mm_sfence();
+}
+
 size_t dmm_cb(dmm_mn_t *dmm, void *rv, const void *pr) {
     const size_t *args;
     size_t off;
@@ -138,6 +154,10 @@ size_t dmm_cb(dmm_mn_t *dmm, void *rv, const void *pr) {
             do_mn_bclear(dmm);
             return 0;
 
+        case DMM_BCOPY_RPC_ID:
+            do_mn_bcopy(dmm, args[1], args[2], args[3]);
+            return 0;
+
         default:
             break;
     }
@@ -241,6 +261,28 @@ static void mn_bzero(dmm_cli_t *dmm, dmptr_t ptr, size_t size) {
     }
 }
 
+static int mn_bcopy(dmm_cli_t *dmm, dmptr_t dst, dmptr_t src, size_t size) {
+    size_t *args;
+    int ret;
+
+    dm_mark(dmm->ctx);
+
+    args = dm_push(dmm->ctx, NULL, 4 * sizeof(size_t));
+    args[0] = DMM_BCOPY_RPC_ID;
+    args[1] = dst;
+    args[2] = src;
+    args[3] = size;
+
+    ret = dm_rpc(dmm->ctx, dst, args, 4 * sizeof(size_t));
+    if (unlikely(ret < 0)) {
+        pr_err("dm_rpc failed");
+    }
+
+    dm_pop(dmm->ctx);
+
+    return ret;
+}
+
 /*
  * TODO: The allocation implementation is too naive
  */
@@ -389,6 +431,23 @@ dmptr_t dmm_balloc(dmm_cli_t *dmm, size_t size, size_t align, dmptr_t locality_h
     return do_balloc(list, size, align);
 }
 
+dmptr_t dmm_balloc_near(dmm_cli_t *dmm, size_t size, size_t align, dmptr_t near) {
+    struct free_blk_list *list;
+    dmptr_t addr = -ENOMEM;
+    if (!align) {
+        align = BLK_SIZE;
+    }
+    list = get_list(dmm, DMPTR_MN_ID(near));
+    if (list) {
+        addr = do_balloc(list, size, align);
+    }
+    if (IS_ERR(addr)) {
+        /* no (more) pool on that MN */
+        addr = do_balloc(&dmm->free_blk_lists[0], size, align);
+    }
+    return addr;
+}
+
 static inline void find_neighbour_free_blks(struct free_blk_list *list,
                                             struct free_blk **prev, struct free_blk **next,
                                             dmptr_t start_addr, dmptr_t end_addr) {
@@ -452,7 +511,7 @@ static void do_bfree(struct free_blk_list *list, dmptr_t addr, size_t size) {
 }
 
 void dmm_bfree(dmm_cli_t *dmm, dmptr_t addr, size_t size) {
-    struct free_blk_list *list = get_list(dmm, addr);
+    struct free_blk_list *list = get_list(dmm, DMPTR_MN_ID(addr));
     ethane_assert(list);
     do_bfree(list, addr, size);
 }
@@ -466,6 +525,13 @@ void dmm_bzero(dmm_cli_t *dmm, dmptr_t addr, size_t size, bool mn_side) {
     }
 }
 
+int dmm_bcopy(dmm_cli_t *dmm, dmptr_t dst, dmptr_t src, size_t size) {
+    if (unlikely(DMPTR_MN_ID(dst) != DMPTR_MN_ID(src))) {
+        return -EXDEV;
+    }
+    return mn_bcopy(dmm, dst, src, size);
+}
+
 void dmm_bclear(dmm_cn_t *dmm, dmcontext_t *ctx) {
     mn_bclear(dmm, ctx);
 }
@@ -28,8 +28,12 @@ dmm_cn_t *dmm_cn_init(dmpool_t *pool);
 dmm_cli_t *dmm_cli_init(dmm_cn_t *dmm_cn, dmcontext_t *ctx, size_t init_pool_size);
 
 dmptr_t dmm_balloc(dmm_cli_t *dmm, size_t size, size_t align, dmptr_t locality_hint);
+/* Allocate on the MN of @near if possible, falling back to the default pool. */
+dmptr_t dmm_balloc_near(dmm_cli_t *dmm, size_t size, size_t align, dmptr_t near);
 void dmm_bfree(dmm_cli_t *dmm, dmptr_t ptr, size_t size);
 void dmm_bzero(dmm_cli_t *dmm, dmptr_t addr, size_t size, bool mn_side);
+/* Copy @size bytes from @src to @dst at their memory node, -EXDEV if they are on different ones. */
+int dmm_bcopy(dmm_cli_t *dmm, dmptr_t dst, dmptr_t src, size_t size);
 void dmm_bclear(dmm_cn_t *dmm, dmcontext_t *ctx);
 
 int dmm_get_interleave_nr(dmm_cli_t *dmm);
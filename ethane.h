@@ -127,6 +127,16 @@ struct ethane_perm {
     mode_t mode;
 };
 
+/*
+ * Small files keep their data in the dentry (FULL format only) until a write
+ * goes beyond ETHANE_INLINE_DATA_MAX; the bytes past it read as zeros.
+ */
+#define ETHANE_INLINE_DATA_MAX      128
+
+#define ETHANE_DENTRY_INLINE_DATA   0x1
+/* in-memory only: synthesized from an inline ns KV value, flags and inline_data not read in */
+#define ETHANE_DENTRY_PARTIAL       0x80000000u
+
 struct ethane_dentry {
     ethane_de_type_t type;
 
@@ -136,7 +146,21 @@ struct ethane_dentry {
     struct ethane_perm perm;
 
     size_t file_size;
-    char _pad[212];
+
+    /*
+     * Owned by sharedfs: the head of a directory's child index, the
+     * index slot holding this dentry, and the interval size classes of
+     * a file's extents. Never written back from cacheFS.
+     */
+    dmptr_t child_index;
+    dmptr_t index_slot;
+    uint64_t bm_hint;
+
+    /* ETHANE_DENTRY_INLINE_DATA: a file whose data lives in inline_data */
+    uint32_t flags;
+    char inline_data[ETHANE_INLINE_DATA_MAX];
+
+    char _pad[56];
 
     /* only for ETHANE_DENTRY_DIR */
     int nr_children;
@@ -144,6 +168,49 @@ struct ethane_dentry {
     char filename[0];
 };
 
+/* On-PM dentry layouts, chosen at format time */
+enum {
+    ETHANE_DENTRY_FMT_FULL,
+    ETHANE_DENTRY_FMT_COMPACT
+};
+
+#define DENTRY_COMPACT_ALIGN        64
+#define DENTRY_COMPACT_VERSION      1
+
+/*
+ * Compact dentry: a 64 B header followed by the filename (and an optional extension
+ * area), in a slot rounded up to DENTRY_COMPACT_ALIGN. Its address is not stored.
+ */
+struct ethane_dentry_compact {
+    /* written back from cacheFS (the name length only on a move) */
+    dmptr_t parent;
+    uint64_t file_size;
+    struct ethane_perm perm;
+    uint8_t type;
+    uint8_t version;
+    uint16_t filename_len;
+
+    /* never written back from cacheFS, see struct ethane_dentry */
+    int32_t nr_children;
+    dmptr_t child_index;
+    dmptr_t index_slot;
+    uint64_t bm_hint;
+
+    /* length of the extension area following the filename */
+    uint16_t ext_len;
+    char _rsvd[6];
+
+    char filename[0];
+};
+
+/* Size of the slot of a dentry named with @filename_len bytes */
+static inline size_t ethane_dentry_size(int fmt, size_t filename_len) {
+    if (fmt == ETHANE_DENTRY_FMT_COMPACT) {
+        return ALIGN_UP(sizeof(struct ethane_dentry_compact) + filename_len + 1, DENTRY_COMPACT_ALIGN);
+    }
+    return DENTRY_SIZE;
+}
+
 struct ethane_super {
     unsigned long magic;
 
@@ -23,6 +23,7 @@
 #include <pthread.h>
 #include <unistd.h>
 #include <errno.h>
+#include <limits.h>
 
 #include <prom.h>
 #include <promhttp.h>
@@ -46,17 +47,28 @@
 #include "cachefs.h"
 #include "logger.h"
 #include "oplogger.h"
+#include "pathdesc.h"
+#include "hash.h"
+#include "list.h"
 
 #define CHECK_CHKPT_VER_INTERVAL_US     100000
 
 #define CHKPT_GC_INTERVAL   1024
 
+/* descendants of removed subtrees reclaimed per checkpoint loop round */
+#define RECLAIM_NR_KEYS_PER_ROUND   256
+
 #define STAT_REQ_INTERVAL   32
 
 #define REQ_LAT_HIST_BUCKETS   16, 10.0, 20.0, 30.0, 40.0, 50.0, 60.0, 70.0, 80.0, 100.0, 125.0, 150.0, 175.0, 200.0, 250.0, 300.0, 400.0
 
 #define MAX_READ_NR_EXTS    128
 
+/* bytes of file data moved through the op buffer per read or write round */
+#define MAX_IO_ROUND_SIZE   (4 * 1024 * 1024ul)
+
+#define COPY_RANGE_BUF_SIZE IO_SIZE
+
 int debug_mode = 0;
 
 struct ethanefs {
@@ -68,6 +80,16 @@ struct ethanefs {
     struct MHD_Daemon *prom_daemon;
 };
 
+#define NR_DENTRY_EXTENTS_ORDER 8
+
+#define GETATTR_BATCH_SIZE  64
+
+struct dentry_extent {
+    dmptr_t parent;
+    /* [next, end) are still free */
+    dmptr_t next, end;
+};
+
 struct ethanefs_cli {
     ethanefs_t *fs;
 
@@ -83,6 +105,10 @@ struct ethanefs_cli {
 
     dmlocktab_t *locktab;
 
+    /* per-directory dentry extents (direct-mapped by parent), see alloc_dentry() */
+    int dentry_extent_nr_dentries;
+    struct dentry_extent *dentry_exts;
+
     uid_t uid;
     gid_t gid;
 
@@ -90,12 +116,45 @@ struct ethanefs_cli {
 
     dmptr_t chkpt_ver_remote_addr;
 
+    /* open files, whose full_path the renames applied to the cache keep current */
+    struct list_head open_files;
+
     char path[PATH_MAX];
     size_t cwd_len;
 
     char label[64];
 };
 
+struct ethanefs_open_file {
+    struct list_head node;
+    /* full_path has room for PATH_MAX bytes, a rename may make it longer */
+    struct ethane_open_file open_file;
+};
+
+/* Move the open files at or below @old_path under @new_path. */
+static void rename_open_files(void *priv, const char *old_path, const char *new_path) {
+    size_t old_len = strlen(old_path), new_len = strlen(new_path), rest;
+    ethanefs_cli_t *cli = priv;
+    ethanefs_open_file_t *of;
+    char *path;
+
+    list_for_each_entry(of, &cli->open_files, node) {
+        path = of->open_file.full_path;
+        if (strncmp(path, old_path, old_len) || (path[old_len] && path[old_len] != '/')) {
+            continue;
+        }
+
+        rest = strlen(path + old_len);
+        if (unlikely(new_len + rest >= PATH_MAX)) {
+            pr_warn("open file %s: renamed path too long", path);
+            continue;
+        }
+
+        memmove(path + new_len, path + old_len, rest + 1);
+        memcpy(path, new_path, new_len);
+    }
+}
+
 static prom_histogram_t *prom_req_lat;
 static prom_histogram_t *prom_req_log_insert_lat;
 static prom_histogram_t *prom_req_cfs_prefetch_lat;
@@ -233,7 +292,8 @@ ethanefs_cli_t *ethanefs_cli_init(ethanefs_t *fs, struct ethane_cli_config *conf
 
     /* init sharedfs */
     cli->rfs = sharedfs_init(ctx, dmm_ctx, cli->locktab,
-                             super->sharedfs_remote_addr, config->sharedfs.nr_max_outstanding_updates);
+                             super->sharedfs_remote_addr, config->sharedfs.nr_max_outstanding_updates,
+                             config->sharedfs.kv_cache_nr_ents, config->sharedfs.kv_cache_staleness_us);
     if (unlikely(IS_ERR(cli->rfs))) {
         cli = ERR_PTR(PTR_ERR(cli->rfs));
         goto out;
@@ -267,6 +327,18 @@ ethanefs_cli_t *ethanefs_cli_init(ethanefs_t *fs, struct ethane_cli_config *conf
         goto out;
     }
 
+    INIT_LIST_HEAD(&cli->open_files);
+    cachefs_set_rename_cb(cli->cfs, rename_open_files, cli);
+
+    cli->dentry_extent_nr_dentries = config->dmm.dentry_extent_nr_dentries;
+    if (cli->dentry_extent_nr_dentries) {
+        cli->dentry_exts = calloc(1 << NR_DENTRY_EXTENTS_ORDER, sizeof(*cli->dentry_exts));
+        if (unlikely(!cli->dentry_exts)) {
+            cli = ERR_PTR(-ENOMEM);
+            goto out;
+        }
+    }
+
     cli->chkpt_ver_remote_addr = ETHANE_SB_REMOTE_ADDR + offsetof(struct ethane_super, chkpt_ver);
 
     sprintf(cli->label, "cli%06d", dm_get_cli_id(ctx));
@@ -315,7 +387,15 @@ int ethanefs_format(zhandle_t *zh, struct ethane_fs_config *config) {
                                            config->sharedfs.interval_node_nr_blks,
                                            config->sharedfs.namespace_kv_size_mb * 1024 * 1024,
                                            config->sharedfs.block_mapping_kv_size_mb * 1024 * 1024,
-                                           config->sharedfs.kv_nr_shards);
+                                           config->sharedfs.kv_nr_shards,
+                                           config->sharedfs.namespace_kv_bucket_nr_slots,
+                                           config->sharedfs.block_mapping_kv_bucket_nr_slots,
+                                           config->sharedfs.kv_max_kick_depth,
+                                           config->sharedfs.kv_stash_nr_slots,
+                                           config->sharedfs.namespace_key_mode,
+                                           config->sharedfs.namespace_kv_inline_dentry,
+                                           config->sharedfs.dentry_format,
+                                           config->sharedfs.namespace_filter_size_mb * 1024 * 1024);
 
     /* create logger */
     logger_remote_addr = logger_create(ctx, dmm_ctx,
@@ -346,10 +426,12 @@ out:
     return ret;
 }
 
-static inline void get_oplogger_ctx(ethanefs_cli_t *cli, oplogger_t *oplogger, oplogger_ctx_t *oplogger_ctx) {
+static inline void get_oplogger_ctx(ethanefs_cli_t *cli, oplogger_t *oplogger, oplogger_ctx_t *oplogger_ctx,
+                                    const pathdesc_t *pd) {
     memset(oplogger_ctx, 0, sizeof(*oplogger_ctx));
 
     oplogger_ctx->oplogger = oplogger;
+    oplogger_ctx->pd = pd;
 
     oplogger_ctx->uid = cli->uid;
     oplogger_ctx->gid = cli->gid;
@@ -381,86 +463,184 @@ static inline void set_replay_cb(ethanefs_cli_t *cli, oplogger_ctx_t *oplogger_c
     oplogger_ctx->replay_ctx = replay_ctx;
 }
 
-static inline void get_cachefs_ctx(ethanefs_cli_t *cli, cachefs_ctx_t *cachefs_ctx) {
+static inline void get_cachefs_ctx(ethanefs_cli_t *cli, cachefs_ctx_t *cachefs_ctx, const pathdesc_t *pd) {
     cachefs_ctx->uid = cli->uid;
     cachefs_ctx->gid = cli->gid;
+    cachefs_ctx->pd = pd;
 }
 
-static inline dmptr_t alloc_dentry(ethanefs_cli_t *cli) {
+/*
+ * Dentries of a directory's children are carved from an extent reserved on the MN of the
+ * parent dentry, so that siblings are contiguous in remote memory. Without a (cached)
+ * parent, or with extents disabled, we fall back to an arbitrary block of our pool.
+ * Compact dentries take slots sized to their name.
+ */
+static inline dmptr_t alloc_dentry(ethanefs_cli_t *cli, dmptr_t parent, const char *path) {
+    int fmt = sharedfs_get_dentry_format(cli->rfs);
+    size_t size = ethane_dentry_size(fmt, strlen(ethane_get_filename(path)));
+    size_t align = fmt == ETHANE_DENTRY_FMT_COMPACT ? DENTRY_COMPACT_ALIGN : DENTRY_SIZE;
     dmm_cli_t *dmm_th = cli->dmm;
+    struct dentry_extent *ext;
+    size_t extent_size;
     dmptr_t addr;
-    addr = dmm_balloc(dmm_th, DENTRY_SIZE, DENTRY_SIZE, DMPTR_NULL);
+
+    if (!cli->dentry_extent_nr_dentries || parent == DMPTR_NULL) {
+        addr = dmm_balloc(dmm_th, size, align, DMPTR_NULL);
+        goto out;
+    }
+
+    ext = &cli->dentry_exts[hash_64(parent, NR_DENTRY_EXTENTS_ORDER)];
+    if (ext->parent != parent || ext->next + size > ext->end) {
+        /* give back what is left of the extent of the evicted directory (or too small a tail) */
+        if (ext->next != ext->end) {
+            dmm_bfree(dmm_th, ext->next, ext->end - ext->next);
+        }
+
+        extent_size = (size_t) cli->dentry_extent_nr_dentries * DENTRY_SIZE;
+        addr = dmm_balloc_near(dmm_th, extent_size, align, parent);
+        if (unlikely(IS_ERR(addr))) {
+            ext->parent = ext->next = ext->end = DMPTR_NULL;
+            goto out;
+        }
+
+        ext->parent = parent;
+        ext->next = addr;
+        ext->end = addr + extent_size;
+    }
+
+    addr = ext->next;
+    ext->next += size;
+
+out:
     if (unlikely(IS_ERR(addr))) {
         pr_err("alloc dentry page failed: %ld", PTR_ERR(addr));
     }
     return addr;
 }
 
-static inline int read_data(ethanefs_cli_t *cli, void *user_buf, size_t read_size, cachefs_blk_t *blks) {
+/* Read the extents of @blks into @user_buf back to back, all in one round; holes are zero-filled. */
+static inline int read_data(ethanefs_cli_t *cli, void *user_buf, int nr_blks, cachefs_blk_t *blks) {
     dmcontext_t *ctx = cli->ctx;
-    void *buf;
-    int ret;
+    void *bufs[nr_blks];
+    int i, ret = 0;
 
-    /* FIXME: */
-    ethane_assert(read_size == blks->size);
+    dm_mark(cli->ctx);
 
-    pr_debug("read_data: %p, %zu", user_buf, read_size);
+    for (i = 0; i < nr_blks; i++) {
+        pr_debug("read_data: %lx size=%lu", blks[i].blk_remote_addr, blks[i].size);
 
-    dm_mark(cli->ctx);
+        if (blks[i].blk_remote_addr == SHAREDFS_ZERO_BLK_ADDR) {
+            bufs[i] = NULL;
+            continue;
+        }
 
-    buf = dm_push(ctx, NULL, read_size);
+        bufs[i] = dm_push(ctx, NULL, blks[i].size);
+        if (unlikely(!bufs[i])) {
+            ret = -ENOMEM;
+            goto out_wait;
+        }
 
-    ret = dm_copy_from_remote(ctx, buf, blks->blk_remote_addr, read_size, DMFLAG_ACK);
-    if (unlikely(IS_ERR(ret))) {
-        goto out;
+        ret = dm_copy_from_remote(ctx, bufs[i], blks[i].blk_remote_addr, blks[i].size, 0);
+        if (unlikely(IS_ERR(ret))) {
+            goto out_wait;
+        }
     }
 
     /* wait */
-    ret = dm_wait_ack(ctx, 1);
+    ret = dm_wait_ack(ctx, dm_set_ack_all(ctx));
     if (unlikely(IS_ERR(ret))) {
         goto out;
     }
 
-    memcpy(user_buf, buf, read_size);
+    for (i = 0; i < nr_blks; i++) {
+        if (bufs[i]) {
+            memcpy(user_buf, bufs[i], blks[i].size);
+        } else {
+            memset(user_buf, 0, blks[i].size);
+        }
+        user_buf += blks[i].size;
+    }
+
+    goto out;
+
+out_wait:
+    /* the reads already posted still land in the op buffer */
+    dm_wait_ack(ctx, dm_set_ack_all(ctx));
 
 out:
     dm_pop(cli->ctx);
     return ret;
 }
 
-static dmptr_t alloc_and_write_data(ethanefs_cli_t *cli, size_t size, const char *data) {
+static inline bool is_zero_data(const char *data, size_t size) {
+    return !data[0] && !memcmp(data, data + 1, size - 1);
+}
+
+/* The data of a write round, in up to 3 pieces (see get_write_pieces()) */
+#define MAX_NR_WRITE_PIECES     3
+
+static bool is_zero_pieces(int nr_pieces, const char **pieces, const size_t *lens) {
+    int i;
+
+    for (i = 0; i < nr_pieces; i++) {
+        if (!is_zero_data(pieces[i], lens[i])) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Write the pieces back to back to newly allocated blocks. */
+static dmptr_t alloc_and_write_data(ethanefs_cli_t *cli, int nr_pieces, const char **pieces, const size_t *lens) {
     dmm_cli_t *dmm_th = cli->dmm;
     dmptr_t remote_addr;
+    size_t size = 0, off;
     void *buf;
-    int ret;
+    int i, ret;
+
+    for (i = 0; i < nr_pieces; i++) {
+        size += lens[i];
+    }
 
     dm_mark(cli->ctx);
 
     remote_addr = dmm_balloc(dmm_th, ALIGN_UP(size, BLK_SIZE), BLK_SIZE, 0);
     if (unlikely(IS_ERR(remote_addr))) {
         pr_err("failed to alloc data block: %ld", PTR_ERR(remote_addr));
-        ret = PTR_ERR(remote_addr);
         goto out;
     }
 
     pr_debug("alloc and write data: remote_addr=%lx@%d size=%lu", remote_addr, DMPTR_MN_ID(remote_addr), size);
 
-    buf = dm_push(cli->ctx, data, size);
+    for (i = 0, off = 0; i < nr_pieces; off += lens[i++]) {
+        buf = dm_push(cli->ctx, pieces[i], lens[i]);
+        if (unlikely(!buf)) {
+            ret = -ENOMEM;
+            goto out_free;
+        }
 
-    ret = dm_copy_to_remote(cli->ctx, remote_addr, buf, size, 0);
-    if (unlikely(IS_ERR(ret))) {
-        remote_addr = ret;
-        goto out;
+        ret = dm_copy_to_remote(cli->ctx, remote_addr + off, buf, lens[i], 0);
+        if (unlikely(IS_ERR(ret))) {
+            goto out_free;
+        }
     }
 
     ret = dm_flush(cli->ctx, remote_addr, DMFLAG_ACK);
     if (unlikely(IS_ERR(ret))) {
-        remote_addr = ret;
-        goto out;
+        goto out_free;
     }
 
     /* We do not wait for ACK here, wait after dlog append to gain more parallelism. */
 
+    goto out;
+
+out_free:
+    /* let the writes already posted finish before their blocks and buffers go */
+    dm_wait_ack(cli->ctx, dm_set_ack_all(cli->ctx));
+    dmm_bfree(dmm_th, remote_addr, ALIGN_UP(size, BLK_SIZE));
+    remote_addr = ret;
+
 out:
     dm_pop(cli->ctx);
     return remote_addr;
@@ -487,16 +667,18 @@ static const char *get_path(ethanefs_cli_t *cli, const char *path) {
 
 int ethanefs_getattr(ethanefs_cli_t *cli, const char *path, struct stat *stbuf) {
     oplogger_ctx_t oplogger_ctx;
+    pathdesc_t pd;
     cachefs_ctx_t cachefs_ctx;
     long old_v;
     int ret;
 
     path = get_path(cli, path);
+    pathdesc_init(&pd, path);
 
     check_cachefs_full(cli);
 
-    get_oplogger_ctx(cli, cli->oplogger, &oplogger_ctx);
-    get_cachefs_ctx(cli, &cachefs_ctx);
+    get_oplogger_ctx(cli, cli->oplogger, &oplogger_ctx, &pd);
+    get_cachefs_ctx(cli, &cachefs_ctx, &pd);
 
     // old_v = oplogger_snapshot_begin(cli->oplogger, &oplogger_ctx);
 
@@ -519,6 +701,52 @@ out:
     return ret;
 }
 
+static int do_getattr_batch(ethanefs_cli_t *cli, const char **paths, int n, struct stat *stbufs, int *rets) {
+    const pathdesc_t *pds_ptr[n];
+    cachefs_ctx_t cachefs_ctx;
+    char *full_paths[n];
+    pathdesc_t pds[n];
+    int i, ret = 0;
+
+    memset(full_paths, 0, sizeof(full_paths));
+
+    for (i = 0; i < n; i++) {
+        /* get_path() resolves relative paths into a shared buffer */
+        full_paths[i] = strdup(get_path(cli, paths[i]));
+        if (unlikely(!full_paths[i])) {
+            ret = -ENOMEM;
+            goto out;
+        }
+        pathdesc_init(&pds[i], full_paths[i]);
+        pds_ptr[i] = &pds[i];
+    }
+
+    check_cachefs_full(cli);
+
+    get_cachefs_ctx(cli, &cachefs_ctx, NULL);
+
+    ret = cachefs_getattr_batch(cli->cfs, &cachefs_ctx, n, pds_ptr, stbufs, rets);
+
+out:
+    for (i = 0; i < n; i++) {
+        free(full_paths[i]);
+    }
+    return ret;
+}
+
+int ethanefs_getattr_batch(ethanefs_cli_t *cli, const char **paths, int n, struct stat *stbufs, int *rets) {
+    int i, ret = 0;
+
+    for (i = 0; i < n; i += GETATTR_BATCH_SIZE) {
+        ret = do_getattr_batch(cli, paths + i, min(n - i, GETATTR_BATCH_SIZE), stbufs + i, rets + i);
+        if (unlikely(ret < 0)) {
+            break;
+        }
+    }
+
+    return ret;
+}
+
 int ethanefs_mkdir(ethanefs_cli_t *cli, const char *path, mode_t mode) {
     long log_insert_duration, log_replay_duration, cfs_prefetch_duration, cfs_duration, duration;
     long log_read_duration, log_fetch_duration;
@@ -526,11 +754,13 @@ int ethanefs_mkdir(ethanefs_cli_t *cli, const char *path, mode_t mode) {
     struct bench_timer timer, op_timer;
     dmptr_t dentry_remote_addr, log;
     oplogger_ctx_t oplogger_ctx;
+    pathdesc_t pd;
     cachefs_ctx_t cachefs_ctx;
     int ret, nr_read_logs;
     size_t ver;
 
     path = get_path(cli, path);
+    pathdesc_init(&pd, path);
 
     bench_timer_start(&op_timer);
 
@@ -540,10 +770,10 @@ int ethanefs_mkdir(ethanefs_cli_t *cli, const char *path, mode_t mode) {
 
     check_cachefs_full(cli);
 
-    dentry_remote_addr = alloc_dentry(cli);
+    get_oplogger_ctx(cli, cli->oplogger, &oplogger_ctx, &pd);
+    get_cachefs_ctx(cli, &cachefs_ctx, &pd);
 
-    get_oplogger_ctx(cli, cli->oplogger, &oplogger_ctx);
-    get_cachefs_ctx(cli, &cachefs_ctx);
+    dentry_remote_addr = alloc_dentry(cli, cachefs_get_cached_parent(cli->cfs, &cachefs_ctx, path), path);
 
     bench_timer_start(&timer);
 
@@ -561,7 +791,7 @@ int ethanefs_mkdir(ethanefs_cli_t *cli, const char *path, mode_t mode) {
 
     bench_timer_start(&timer);
 
-    cachefs_prefetch_metadata(cli->cfs, path);
+    cachefs_prefetch_metadata(cli->cfs, &cachefs_ctx, path);
 
     cfs_prefetch_duration = bench_timer_end(&timer);
 
@@ -610,20 +840,151 @@ out:
     return ret;
 }
 
+/* Free the dentries @addrs of components [@from, @to) of a chain starting at component @first. */
+static void free_dentry_chain(ethanefs_cli_t *cli, const char *path, int first, int from, int to,
+                              const dmptr_t *addrs) {
+    int fmt = sharedfs_get_dentry_format(cli->rfs);
+    const char *component, *next;
+    int len, i = 0;
+
+    ETHANE_ITER_COMPONENTS(path, component, next, len) {
+        if (i >= from && i < to && addrs[i - first] != DMPTR_NULL) {
+            dmm_bfree(cli->dmm, addrs[i - first], ethane_dentry_size(fmt, len));
+        }
+        i++;
+    }
+}
+
+/*
+ * Dentries of a chain of new directories, each the parent of the next, are allocated one
+ * by one, each near its parent, so that those a racing mkdir made first can be freed alone.
+ * @addrs gets those of components [@first, depth).
+ */
+static int alloc_dentry_chain(ethanefs_cli_t *cli, dmptr_t parent, const char *path, int first, dmptr_t *addrs) {
+    int fmt = sharedfs_get_dentry_format(cli->rfs);
+    size_t align = fmt == ETHANE_DENTRY_FMT_COMPACT ? DENTRY_COMPACT_ALIGN : DENTRY_SIZE;
+    const char *component, *next;
+    int len, i = 0, ret = 0;
+    dmptr_t addr;
+
+    ETHANE_ITER_COMPONENTS(path, component, next, len) {
+        if (i >= first) {
+            addr = parent == DMPTR_NULL ? dmm_balloc(cli->dmm, ethane_dentry_size(fmt, len), align, DMPTR_NULL)
+                                        : dmm_balloc_near(cli->dmm, ethane_dentry_size(fmt, len), align, parent);
+            if (unlikely(IS_ERR(addr))) {
+                pr_err("alloc dentry chain failed: %ld", PTR_ERR(addr));
+                free_dentry_chain(cli, path, first, first, i, addrs);
+                ret = (int) PTR_ERR(addr);
+                break;
+            }
+            addrs[i - first] = parent = addr;
+        }
+        i++;
+    }
+
+    return ret;
+}
+
+int ethanefs_mkdir_recursive(ethanefs_cli_t *cli, const char *path, mode_t mode) {
+    dmptr_t *addrs, parent, log;
+    oplogger_ctx_t oplogger_ctx;
+    cachefs_ctx_t cachefs_ctx;
+    int ret, first, made;
+    uint64_t result;
+    pathdesc_t pd;
+    size_t ver;
+
+    path = get_path(cli, path);
+    pathdesc_init(&pd, path);
+
+    /* the index of the first new component has to fit in the op result */
+    if (unlikely(pd.depth > PATHDESC_MAX_DEPTH)) {
+        ret = -ENAMETOOLONG;
+        goto out;
+    }
+
+    addrs = calloc(pd.depth, sizeof(*addrs));
+    if (unlikely(!addrs)) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    check_cachefs_full(cli);
+
+    get_oplogger_ctx(cli, cli->oplogger, &oplogger_ctx, &pd);
+    get_cachefs_ctx(cli, &cachefs_ctx, &pd);
+
+    cachefs_prefetch_metadata(cli->cfs, &cachefs_ctx, path);
+
+    do {
+        result = OP_RESULT_UNDETERMINED;
+
+        /* the root is always there */
+        first = max(cachefs_get_first_missing(cli->cfs, &cachefs_ctx, path, &parent), 1);
+
+        ret = alloc_dentry_chain(cli, parent, path, first, addrs);
+        if (unlikely(ret < 0)) {
+            goto out_free;
+        }
+
+        /* append log */
+        log = oplogger_mkdir_recursive(cli->oplogger, &oplogger_ctx, path, mode, first, pd.depth - first, addrs);
+        if (unlikely(IS_ERR(log))) {
+            free_dentry_chain(cli, path, first, first, pd.depth, addrs);
+            ret = PTR_ERR(log);
+            goto out_free;
+        }
+
+        /* get current system version */
+        ver = oplogger_get_version(cli->oplogger, &oplogger_ctx);
+
+        /* replay until the newly appended log */
+        ret = oplogger_replay_mkdir_recursive(cli->oplogger, &oplogger_ctx, path, true, 1);
+        if (unlikely(ret < 0)) {
+            goto out_free;
+        }
+
+        /* perform the actual operation */
+        ret = cachefs_mkdir_recursive(cli->cfs, &cachefs_ctx, path, &result, mode, first, pd.depth - first, addrs,
+                                      ver);
+
+        /* change result async */
+        oplogger_set_result_async(cli->oplogger, log, result);
+
+        /* nobody refers to the dentries of a canceled op, nor to those of components a racing mkdir made */
+        if (result == OP_RESULT_CANCELED) {
+            free_dentry_chain(cli, path, first, first, pd.depth, addrs);
+        } else if (result != OP_RESULT_UNDETERMINED) {
+            made = cachefs_mkdir_recursive_first_made(result);
+            free_dentry_chain(cli, path, first, first, made, addrs);
+        }
+
+        /* the replay has brought in what made our view stale, so just try again */
+    } while (ret == -EAGAIN);
+
+out_free:
+    free(addrs);
+
+out:
+    return ret;
+}
+
 int ethanefs_rmdir(ethanefs_cli_t *cli, const char *path) {
     uint64_t result = OP_RESULT_UNDETERMINED;
     oplogger_ctx_t oplogger_ctx;
+    pathdesc_t pd;
     cachefs_ctx_t cachefs_ctx;
     dmptr_t log;
     size_t ver;
     int ret;
 
     path = get_path(cli, path);
+    pathdesc_init(&pd, path);
 
     check_cachefs_full(cli);
 
-    get_oplogger_ctx(cli, cli->oplogger, &oplogger_ctx);
-    get_cachefs_ctx(cli, &cachefs_ctx);
+    get_oplogger_ctx(cli, cli->oplogger, &oplogger_ctx, &pd);
+    get_cachefs_ctx(cli, &cachefs_ctx, &pd);
 
     /* append log */
     log = oplogger_rmdir(cli->oplogger, &oplogger_ctx, path);
@@ -651,20 +1012,65 @@ out:
     return ret;
 }
 
+int ethanefs_rmtree(ethanefs_cli_t *cli, const char *path) {
+    uint64_t result = OP_RESULT_UNDETERMINED;
+    oplogger_ctx_t oplogger_ctx;
+    pathdesc_t pd;
+    cachefs_ctx_t cachefs_ctx;
+    dmptr_t log;
+    size_t ver;
+    int ret;
+
+    path = get_path(cli, path);
+    pathdesc_init(&pd, path);
+
+    check_cachefs_full(cli);
+
+    get_oplogger_ctx(cli, cli->oplogger, &oplogger_ctx, &pd);
+    get_cachefs_ctx(cli, &cachefs_ctx, &pd);
+
+    /* append log */
+    log = oplogger_rmtree(cli->oplogger, &oplogger_ctx, path);
+    if (unlikely(IS_ERR(log))) {
+        ret = PTR_ERR(log);
+        goto out;
+    }
+
+    /* get current system version */
+    ver = oplogger_get_version(cli->oplogger, &oplogger_ctx);
+
+    /* replay until the newly appended log */
+    ret = oplogger_replay_rmtree(cli->oplogger, &oplogger_ctx, path, true, 1);
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
+
+    /* perform the actual operation */
+    ret = cachefs_rmtree(cli->cfs, &cachefs_ctx, path, &result, ver);
+
+    /* change result async */
+    oplogger_set_result_async(cli->oplogger, log, result);
+
+out:
+    return ret;
+}
+
 int ethanefs_unlink(ethanefs_cli_t *cli, const char *path) {
     uint64_t result = OP_RESULT_UNDETERMINED;
     oplogger_ctx_t oplogger_ctx;
+    pathdesc_t pd;
     cachefs_ctx_t cachefs_ctx;
     dmptr_t log;
     size_t ver;
     int ret;
 
     path = get_path(cli, path);
+    pathdesc_init(&pd, path);
 
     check_cachefs_full(cli);
 
-    get_oplogger_ctx(cli, cli->oplogger, &oplogger_ctx);
-    get_cachefs_ctx(cli, &cachefs_ctx);
+    get_oplogger_ctx(cli, cli->oplogger, &oplogger_ctx, &pd);
+    get_cachefs_ctx(cli, &cachefs_ctx, &pd);
 
     /* append log */
     log = oplogger_unlink(cli->oplogger, &oplogger_ctx, path);
@@ -692,9 +1098,87 @@ out:
     return ret;
 }
 
-struct ethanefs_open_file {
-    struct ethane_open_file open_file;
-};
+/* Poll interval while the checkpointers catch up with a rename */
+#define RENAME_CHKPT_POLL_US    1000
+
+/*
+ * Ops logged below the old name before a rename carry fingerprints of the old paths, so
+ * readers of the new ones would never replay them. Have the checkpointers apply the log
+ * up to and including the rename at @pos before it takes effect: readers then find those
+ * ops in sharedfs, under the new names.
+ */
+static void wait_rename_checkpointed(ethanefs_cli_t *cli, size_t pos) {
+    ethanefs_force_checkpoint(cli);
+
+    while (logger_get_head(cli->logger) <= pos) {
+        coro_delay(RENAME_CHKPT_POLL_US);
+    }
+}
+
+int ethanefs_rename(ethanefs_cli_t *cli, const char *old_path, const char *new_path) {
+    uint64_t result = OP_RESULT_UNDETERMINED;
+    oplogger_ctx_t oplogger_ctx;
+    cachefs_ctx_t cachefs_ctx;
+    char *old_full_path;
+    pathdesc_t pd;
+    dmptr_t log;
+    size_t ver;
+    int ret;
+
+    /* get_path() resolves relative paths into a shared buffer */
+    old_full_path = strdup(get_path(cli, old_path));
+    if (unlikely(!old_full_path)) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    new_path = get_path(cli, new_path);
+
+    /* the root can not be renamed, nor anything be renamed to it */
+    if (unlikely(!old_full_path[0] || !old_full_path[1] || !new_path[0] || !new_path[1])) {
+        ret = -EBUSY;
+        goto out_free;
+    }
+
+    pathdesc_init(&pd, old_full_path);
+
+    check_cachefs_full(cli);
+
+    get_oplogger_ctx(cli, cli->oplogger, &oplogger_ctx, &pd);
+    get_cachefs_ctx(cli, &cachefs_ctx, &pd);
+
+    /* append log */
+    log = oplogger_rename(cli->oplogger, &oplogger_ctx, old_full_path, new_path);
+    if (unlikely(IS_ERR(log))) {
+        ret = PTR_ERR(log);
+        goto out_free;
+    }
+
+    /* get current system version */
+    ver = oplogger_get_version(cli->oplogger, &oplogger_ctx);
+
+    /* replay until the newly appended log */
+    ret = oplogger_replay_rename(cli->oplogger, &oplogger_ctx, old_full_path, new_path, true, 1);
+    if (unlikely(ret < 0)) {
+        goto out_free;
+    }
+
+    /* perform the actual operation */
+    ret = cachefs_rename(cli->cfs, &cachefs_ctx, old_full_path, new_path, &result, ver);
+
+    /* readers replaying the rename wait for its result */
+    if (result != OP_RESULT_CANCELED) {
+        wait_rename_checkpointed(cli, ver);
+    }
+
+    /* change result async */
+    oplogger_set_result_async(cli->oplogger, log, result);
+
+out_free:
+    free(old_full_path);
+
+out:
+    return ret;
+}
 
 // ethanefs_open_file_t *ethanefs_create(ethanefs_cli_t *cli, const char *path, mode_t mode) {
 //     uint64_t result = OP_RESULT_UNDETERMINED;
@@ -773,21 +1257,22 @@ struct ethanefs_open_file {
 ethanefs_open_file_t *ethanefs_create(ethanefs_cli_t *cli, const char *path, mode_t mode) {
     uint64_t result = OP_RESULT_UNDETERMINED;
     dmptr_t dentry_remote_addr, log;
-    struct ethane_open_file *file;
     oplogger_ctx_t oplogger_ctx;
+    pathdesc_t pd;
     cachefs_ctx_t cachefs_ctx;
     ethanefs_open_file_t *of;
     size_t ver;
     int ret;
 
     path = get_path(cli, path);
+    pathdesc_init(&pd, path);
 
     check_cachefs_full(cli);
 
-    dentry_remote_addr = alloc_dentry(cli);
+    get_oplogger_ctx(cli, cli->oplogger, &oplogger_ctx, &pd);
+    get_cachefs_ctx(cli, &cachefs_ctx, &pd);
 
-    get_oplogger_ctx(cli, cli->oplogger, &oplogger_ctx);
-    get_cachefs_ctx(cli, &cachefs_ctx);
+    dentry_remote_addr = alloc_dentry(cli, cachefs_get_cached_parent(cli->cfs, &cachefs_ctx, path), path);
 
     /* append log */
     log = oplogger_create(cli->oplogger, &oplogger_ctx, path, mode, dentry_remote_addr);
@@ -807,19 +1292,18 @@ ethanefs_open_file_t *ethanefs_create(ethanefs_cli_t *cli, const char *path, mod
     }
 
     /* create open file */
-    file = malloc(sizeof(struct ethane_open_file) + strlen(path) + 1);
-
-    /* perform the actual operation */
-    ret = cachefs_create(cli->cfs, &cachefs_ctx, path, &result, mode, dentry_remote_addr, file, ver);
-    if (unlikely(ret < 0)) {
-        of = ERR_PTR(ret);
+    of = malloc(sizeof(*of) + PATH_MAX);
+    if (unlikely(!of)) {
+        of = ERR_PTR(-ENOMEM);
         goto out;
     }
 
-    if (!ret) {
-        of = (ethanefs_open_file_t *) file;
+    /* perform the actual operation */
+    ret = cachefs_create(cli->cfs, &cachefs_ctx, path, &result, mode, dentry_remote_addr, &of->open_file, ver);
+    if (likely(!ret)) {
+        list_add(&of->node, &cli->open_files);
     } else {
-        free(file);
+        free(of);
         of = ERR_PTR(ret);
     }
 
@@ -831,22 +1315,20 @@ out:
 }
 
 ethanefs_open_file_t *ethanefs_open(ethanefs_cli_t *cli, const char *path) {
-    struct ethane_open_file *file;
     oplogger_ctx_t oplogger_ctx;
+    pathdesc_t pd;
     cachefs_ctx_t cachefs_ctx;
     ethanefs_open_file_t *of;
     long old_v;
     int ret;
 
     path = get_path(cli, path);
+    pathdesc_init(&pd, path);
 
     check_cachefs_full(cli);
 
-    get_oplogger_ctx(cli, cli->oplogger, &oplogger_ctx);
-    get_cachefs_ctx(cli, &cachefs_ctx);
-
-    /* create open file */
-    file = malloc(sizeof(struct ethane_open_file) + strlen(path) + 1);
+    get_oplogger_ctx(cli, cli->oplogger, &oplogger_ctx, &pd);
+    get_cachefs_ctx(cli, &cachefs_ctx, &pd);
 
     old_v = oplogger_snapshot_begin(cli->oplogger, &oplogger_ctx);
 
@@ -864,17 +1346,19 @@ ethanefs_open_file_t *ethanefs_open(ethanefs_cli_t *cli, const char *path) {
         goto out;
     }
 
-    /* perform the actual operation */
-    ret = cachefs_open(cli->cfs, &cachefs_ctx, path, file);
-    if (unlikely(ret < 0)) {
-        of = ERR_PTR(ret);
+    /* create open file */
+    of = malloc(sizeof(*of) + PATH_MAX);
+    if (unlikely(!of)) {
+        of = ERR_PTR(-ENOMEM);
         goto out;
     }
 
-    if (!ret) {
-        of = (ethanefs_open_file_t *) file;
+    /* perform the actual operation */
+    ret = cachefs_open(cli->cfs, &cachefs_ctx, path, &of->open_file);
+    if (likely(!ret)) {
+        list_add(&of->node, &cli->open_files);
     } else {
-        free(file);
+        free(of);
         of = ERR_PTR(ret);
     }
 
@@ -883,136 +1367,1168 @@ out:
 }
 
 int ethanefs_close(ethanefs_cli_t *cli, ethanefs_open_file_t *file) {
+    list_del(&file->node);
     free(file);
     return 0;
 }
 
-long ethanefs_read(ethanefs_cli_t *cli, ethanefs_open_file_t *file, char *buf, size_t size, off_t off) {
-    oplogger_ctx_t oplogger_ctx;
-    cachefs_ctx_t cachefs_ctx;
-    cachefs_blk_t blk;
-    long read_size;
+struct ethanefs_dir {
+    int nr_ents, max_nr_ents, pos;
+    char **names;
+};
+
+static int dir_add_ent(void *priv, const char *filename) {
+    ethanefs_dir_t *dir = priv;
+    char **names;
+
+    if (dir->nr_ents == dir->max_nr_ents) {
+        dir->max_nr_ents = dir->max_nr_ents ? dir->max_nr_ents * 2 : 16;
+        names = realloc(dir->names, dir->max_nr_ents * sizeof(*names));
+        if (unlikely(!names)) {
+            return -ENOMEM;
+        }
+        dir->names = names;
+    }
+
+    dir->names[dir->nr_ents] = strdup(filename);
+    if (unlikely(!dir->names[dir->nr_ents])) {
+        return -ENOMEM;
+    }
+    dir->nr_ents++;
+
+    return 0;
+}
+
+ethanefs_dir_t *ethanefs_opendir(ethanefs_cli_t *cli, const char *path) {
+    oplogger_ctx_t oplogger_ctx;
+    cachefs_ctx_t cachefs_ctx;
+    ethanefs_dir_t *dir;
+    char *dir_path;
+    pathdesc_t pd;
     long old_v;
+    size_t len;
+    int ret;
+
+    path = get_path(cli, path);
+
+    /* the root directory is the empty prefix */
+    for (len = strlen(path); len && path[len - 1] == '/'; len--);
+    dir_path = strndup(path, len);
+    dir = calloc(1, sizeof(*dir));
+    if (unlikely(!dir_path || !dir)) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    pathdesc_init(&pd, dir_path);
+
+    check_cachefs_full(cli);
+
+    get_oplogger_ctx(cli, cli->oplogger, &oplogger_ctx, &pd);
+    get_cachefs_ctx(cli, &cachefs_ctx, &pd);
+
+    old_v = oplogger_snapshot_begin(cli->oplogger, &oplogger_ctx);
+
+    ret = oplogger_replay_readdir(cli->oplogger, &oplogger_ctx, dir_path, false, 0);
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
+
+    oplogger_snapshot_end(cli->oplogger, &oplogger_ctx, old_v);
+
+    ret = oplogger_replay_readdir(cli->oplogger, &oplogger_ctx, dir_path, false, 0);
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
+
+    /* snapshot the entries, readdir() then walks them locally */
+    ret = cachefs_readdir(cli->cfs, &cachefs_ctx, dir_path, dir_add_ent, dir);
+
+out:
+    free(dir_path);
+    if (unlikely(ret < 0)) {
+        if (dir) {
+            ethanefs_closedir(cli, dir);
+        }
+        dir = ERR_PTR(ret);
+    }
+    return dir;
+}
+
+const char *ethanefs_readdir(ethanefs_cli_t *cli, ethanefs_dir_t *dir) {
+    return dir->pos < dir->nr_ents ? dir->names[dir->pos++] : NULL;
+}
+
+int ethanefs_closedir(ethanefs_cli_t *cli, ethanefs_dir_t *dir) {
+    int i;
+    for (i = 0; i < dir->nr_ents; i++) {
+        free(dir->names[i]);
+    }
+    free(dir->names);
+    free(dir);
+    return 0;
+}
+
+/* Replay the ops logged on the file so far, so that the cached state is up to date. */
+static int sync_for_read(ethanefs_cli_t *cli, oplogger_ctx_t *oplogger_ctx, const char *path) {
+    long old_v;
+    int ret;
+
+    old_v = oplogger_snapshot_begin(cli->oplogger, oplogger_ctx);
+
+    ret = oplogger_replay_read(cli->oplogger, oplogger_ctx, path, false, 0);
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
+
+    oplogger_snapshot_end(cli->oplogger, oplogger_ctx, old_v);
+
+    ret = oplogger_replay_read(cli->oplogger, oplogger_ctx, path, false, 0);
+
+out:
+    return ret;
+}
+
+/* Read [@off, @off + @size) of the file, up to MAX_READ_NR_EXTS extents and MAX_IO_ROUND_SIZE bytes per round. */
+static long read_file(ethanefs_cli_t *cli, cachefs_ctx_t *cachefs_ctx, ethanefs_open_file_t *file,
+                      char *buf, size_t size, off_t off) {
+    cachefs_blk_t blks[MAX_READ_NR_EXTS];
+    long read_size, len;
+    int nr_blks, ret;
+
+    /* served by the dentry itself */
+    read_size = cachefs_read_inline(cli->cfs, cachefs_ctx, file->open_file.full_path,
+                                    file->open_file.remote_dentry_addr, buf, off, size);
+    if (read_size != -ENODATA) {
+        goto out;
+    }
+
+    read_size = 0;
+
+    while ((size_t) read_size < size) {
+        nr_blks = MAX_READ_NR_EXTS;
+        len = cachefs_read(cli->cfs, cachefs_ctx, file->open_file.full_path, file->open_file.remote_dentry_addr,
+                           blks, &nr_blks, off + read_size, min(size - read_size, MAX_IO_ROUND_SIZE));
+        if (unlikely(IS_ERR(len))) {
+            read_size = len;
+            goto out;
+        }
+
+        /* reached EOF */
+        if (!len) {
+            break;
+        }
+
+        ret = read_data(cli, buf + read_size, nr_blks, blks);
+        if (unlikely(IS_ERR(ret))) {
+            read_size = ret;
+            goto out;
+        }
+
+        read_size += len;
+    }
+
+out:
+    return read_size;
+}
+
+long ethanefs_read(ethanefs_cli_t *cli, ethanefs_open_file_t *file, char *buf, size_t size, off_t off) {
+    oplogger_ctx_t oplogger_ctx;
+    pathdesc_t pd;
+    cachefs_ctx_t cachefs_ctx;
+    long read_size;
+    int ret;
+
+    pr_debug("use open file: path=%s dentry=%lx", file->open_file.full_path, file->open_file.remote_dentry_addr);
+
+    check_cachefs_full(cli);
+
+    pathdesc_init(&pd, file->open_file.full_path);
+
+    get_oplogger_ctx(cli, cli->oplogger, &oplogger_ctx, &pd);
+    get_cachefs_ctx(cli, &cachefs_ctx, &pd);
+
+    ret = sync_for_read(cli, &oplogger_ctx, file->open_file.full_path);
+    if (unlikely(ret < 0)) {
+        read_size = ret;
+        goto out;
+    }
+
+    /* perform the actual operation */
+    read_size = read_file(cli, &cachefs_ctx, file, buf, size, off);
+
+out:
+    return read_size;
+}
+
+/* A write round: the user data of [off, off + size) fills the blocks [blk_off, blk_off + blk_size). */
+struct write_round {
+    const char *buf;
+    off_t off;
+    size_t size;
+    size_t blk_off, blk_size;
+
+    /* read-modify-written copies of the partially written first and last blocks, or NULL */
+    char *head, *tail;
+};
+
+static inline void init_write_round(struct write_round *wr, const char *buf, size_t size, off_t off) {
+    wr->buf = buf;
+    wr->off = off;
+    wr->size = size;
+    wr->blk_off = ALIGN_DOWN(off, BLK_SIZE);
+    wr->blk_size = ALIGN_UP(off + size, BLK_SIZE) - wr->blk_off;
+    wr->head = wr->tail = NULL;
+}
+
+static inline bool write_round_is_partial(const struct write_round *wr) {
+    return wr->off != wr->blk_off || wr->size != wr->blk_size;
+}
+
+/*
+ * Fill the partially written blocks at both ends of @wr with the current file data and the
+ * user data over it, in @edges (two blocks). A concurrent write to one of these blocks may be
+ * lost, as with any read-modify-write.
+ */
+static int fill_partial_blocks(ethanefs_cli_t *cli, oplogger_ctx_t *oplogger_ctx, cachefs_ctx_t *cachefs_ctx,
+                               ethanefs_open_file_t *file, struct write_round *wr, char *edges) {
+    size_t end = wr->off + wr->size, tail_off = wr->blk_off + wr->blk_size - BLK_SIZE;
+    long ret;
+
+    ret = sync_for_read(cli, oplogger_ctx, file->open_file.full_path);
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
+
+    if (wr->off != wr->blk_off) {
+        wr->head = edges;
+    }
+    if (end % BLK_SIZE) {
+        /* a single block is both */
+        wr->tail = wr->blk_size == BLK_SIZE && wr->head ? wr->head : edges + BLK_SIZE;
+    }
+
+    /* past EOF reads as zeros */
+    if (wr->head) {
+        memset(wr->head, 0, BLK_SIZE);
+        ret = read_file(cli, cachefs_ctx, file, wr->head, BLK_SIZE, (off_t) wr->blk_off);
+        if (unlikely(IS_ERR(ret))) {
+            goto out;
+        }
+        memcpy(wr->head + (wr->off - wr->blk_off), wr->buf, min(wr->size, BLK_SIZE - (wr->off - wr->blk_off)));
+    }
+
+    if (wr->tail && wr->tail != wr->head) {
+        memset(wr->tail, 0, BLK_SIZE);
+        ret = read_file(cli, cachefs_ctx, file, wr->tail, BLK_SIZE, (off_t) tail_off);
+        if (unlikely(IS_ERR(ret))) {
+            goto out;
+        }
+        memcpy(wr->tail, wr->buf + (tail_off - wr->off), end - tail_off);
+    }
+
+    ret = 0;
+
+out:
+    return (int) ret;
+}
+
+/* Split the blocks of @wr into the first block, the fully written middle and the last block. */
+static int get_write_pieces(const struct write_round *wr, const char **pieces, size_t *lens) {
+    size_t start = wr->blk_off, end = wr->blk_off + wr->blk_size;
+    bool sep_tail = wr->tail && wr->tail != wr->head;
+    int n = 0;
+
+    if (wr->head) {
+        pieces[n] = wr->head;
+        lens[n++] = BLK_SIZE;
+        start += BLK_SIZE;
+    }
+    if (sep_tail) {
+        end -= BLK_SIZE;
+    }
+    if (end > start) {
+        pieces[n] = wr->buf + (start - wr->off);
+        lens[n++] = end - start;
+    }
+    if (sep_tail) {
+        pieces[n] = wr->tail;
+        lens[n++] = BLK_SIZE;
+    }
+
+    return n;
+}
+
+/* Log a write of the blocks at @remote_addr holding [@off, @off + @size) and apply it. */
+static long write_blocks(ethanefs_cli_t *cli, oplogger_ctx_t *oplogger_ctx, cachefs_ctx_t *cachefs_ctx,
+                         ethanefs_open_file_t *file, dmptr_t remote_addr, size_t size, off_t off) {
+    cachefs_blk_t blk;
+    long write_size;
+    dmptr_t log;
+    size_t ver;
+    int ret;
+
+    blk.blk_remote_addr = remote_addr;
+    blk.size = size;
+
+    /* append log */
+    log = oplogger_write(cli->oplogger, oplogger_ctx,
+                         file->open_file.full_path, file->open_file.remote_dentry_addr, remote_addr, size, off);
+    if (unlikely(IS_ERR(log))) {
+        write_size = PTR_ERR(log);
+        goto out;
+    }
+
+    /* get current system version */
+    ver = oplogger_get_version(cli->oplogger, oplogger_ctx);
+
+    /* replay until the newly appended log */
+    ret = oplogger_replay_write(cli->oplogger, oplogger_ctx, file->open_file.full_path, true, 1);
+    if (unlikely(ret < 0)) {
+        write_size = ret;
+        goto out;
+    }
+
+    /* perform the actual operation */
+    write_size = cachefs_write(cli->cfs, cachefs_ctx,
+                               file->open_file.full_path, file->open_file.remote_dentry_addr, off, &blk, ver);
+
+out:
+    return write_size;
+}
+
+/* Log a write into the data kept in the dentry and apply it, -ENODATA if the file has spilled since. */
+static long write_inline(ethanefs_cli_t *cli, oplogger_ctx_t *oplogger_ctx, cachefs_ctx_t *cachefs_ctx,
+                         ethanefs_open_file_t *file, const char *buf, size_t size, off_t off) {
+    long write_size;
+    dmptr_t log;
+    size_t ver;
     int ret;
 
-    /* FIXME: */
-    if (size != IO_SIZE || off % IO_SIZE != 0) {
-        pr_err("only support io size %lu, and off(=%lu) must be multipler of it!", IO_SIZE, off);
-        abort();
+    log = oplogger_write_inline(cli->oplogger, oplogger_ctx,
+                                file->open_file.full_path, file->open_file.remote_dentry_addr, buf, size, off);
+    if (unlikely(IS_ERR(log))) {
+        write_size = PTR_ERR(log);
+        goto out;
+    }
+
+    ver = oplogger_get_version(cli->oplogger, oplogger_ctx);
+
+    ret = oplogger_replay_write(cli->oplogger, oplogger_ctx, file->open_file.full_path, true, 1);
+    if (unlikely(ret < 0)) {
+        write_size = ret;
+        goto out;
+    }
+
+    write_size = cachefs_write_inline(cli->cfs, cachefs_ctx, file->open_file.full_path,
+                                      file->open_file.remote_dentry_addr, off, buf, size, ver);
+
+out:
+    return write_size;
+}
+
+/* Move the inline data of the file to a data block, before a write that does not fit in. */
+static int spill_inline_data(ethanefs_cli_t *cli, oplogger_ctx_t *oplogger_ctx, cachefs_ctx_t *cachefs_ctx,
+                             ethanefs_open_file_t *file) {
+    dmptr_t remote_addr;
+    char *data;
+    long ret;
+
+    data = calloc(1, BLK_SIZE);
+    if (unlikely(!data)) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    ret = cachefs_read_inline(cli->cfs, cachefs_ctx, file->open_file.full_path, file->open_file.remote_dentry_addr,
+                              data, 0, ETHANE_INLINE_DATA_MAX);
+    /* already spilled, or nothing to keep */
+    if (ret == -ENODATA || !ret) {
+        ret = 0;
+        goto out_free;
+    }
+    if (unlikely(IS_ERR(ret))) {
+        goto out_free;
+    }
+
+    remote_addr = alloc_and_write_data(cli, 1, (const char *[]) { data }, (size_t[]) { BLK_SIZE });
+    if (unlikely(IS_ERR(remote_addr))) {
+        ret = PTR_ERR(remote_addr);
+        goto out_free;
+    }
+
+    ret = write_blocks(cli, oplogger_ctx, cachefs_ctx, file, remote_addr, ret, 0);
+    if (likely(!IS_ERR(ret))) {
+        ret = 0;
+    }
+
+out_free:
+    free(data);
+
+out:
+    return (int) ret;
+}
+
+/* Write one round of at most MAX_IO_ROUND_SIZE bytes of blocks, logged as a block write of its own. */
+static long write_round(ethanefs_cli_t *cli, oplogger_ctx_t *oplogger_ctx, cachefs_ctx_t *cachefs_ctx,
+                        ethanefs_open_file_t *file, struct write_round *wr, char *edges) {
+    const char *pieces[MAX_NR_WRITE_PIECES];
+    size_t lens[MAX_NR_WRITE_PIECES];
+    dmptr_t remote_addr;
+    int nr_pieces, ret;
+
+    /* read-modify-write only the blocks the write covers partially */
+    if (write_round_is_partial(wr)) {
+        ret = fill_partial_blocks(cli, oplogger_ctx, cachefs_ctx, file, wr, edges);
+        if (unlikely(ret < 0)) {
+            return ret;
+        }
+    }
+
+    nr_pieces = get_write_pieces(wr, pieces, lens);
+
+    /* all-zero blocks are recorded as a hole, with no data block at all */
+    if (is_zero_pieces(nr_pieces, pieces, lens)) {
+        remote_addr = SHAREDFS_ZERO_BLK_ADDR;
+    } else {
+        remote_addr = alloc_and_write_data(cli, nr_pieces, pieces, lens);
+    }
+    if (unlikely(IS_ERR(remote_addr))) {
+        return PTR_ERR(remote_addr);
+    }
+
+    return write_blocks(cli, oplogger_ctx, cachefs_ctx, file, remote_addr, wr->size, wr->off);
+}
+
+long ethanefs_write(ethanefs_cli_t *cli, ethanefs_open_file_t *file, const char *buf, size_t size, off_t off) {
+    size_t blk_off = ALIGN_DOWN(off, BLK_SIZE), len;
+    oplogger_ctx_t oplogger_ctx;
+    pathdesc_t pd;
+    cachefs_ctx_t cachefs_ctx;
+    long write_size, ret;
+    struct write_round wr;
+    char *edges = NULL;
+    int is_inline;
+
+    pr_debug("use open file: path=%s dentry=%lx", file->open_file.full_path, file->open_file.remote_dentry_addr);
+
+    if (unlikely(!size)) {
+        write_size = 0;
+        goto out;
+    }
+
+    check_cachefs_full(cli);
+
+    pathdesc_init(&pd, file->open_file.full_path);
+
+    get_oplogger_ctx(cli, cli->oplogger, &oplogger_ctx, &pd);
+    get_cachefs_ctx(cli, &cachefs_ctx, &pd);
+
+    /* a file never goes back to inline, so only an inline one needs the latest state */
+    is_inline = cachefs_is_inline(cli->cfs, &cachefs_ctx, file->open_file.full_path,
+                                  file->open_file.remote_dentry_addr);
+    ret = is_inline > 0 ? sync_for_read(cli, &oplogger_ctx, file->open_file.full_path) : is_inline;
+    if (unlikely(ret < 0)) {
+        write_size = ret;
+        goto out;
+    }
+
+    if (is_inline && off + size <= ETHANE_INLINE_DATA_MAX) {
+        write_size = write_inline(cli, &oplogger_ctx, &cachefs_ctx, file, buf, size, off);
+        if (write_size != -ENODATA) {
+            goto out;
+        }
+    } else if (is_inline && blk_off) {
+        /* the read-modify-write below keeps the inline bytes if it covers block 0 */
+        ret = spill_inline_data(cli, &oplogger_ctx, &cachefs_ctx, file);
+        if (unlikely(ret < 0)) {
+            write_size = ret;
+            goto out;
+        }
+    }
+
+    /* rounds after the first start on a block boundary, so only the first and last are partial */
+    for (write_size = 0; (size_t) write_size < size; write_size += len) {
+        len = min(size - write_size, ALIGN_DOWN(off + write_size, BLK_SIZE) + MAX_IO_ROUND_SIZE - (off + write_size));
+
+        init_write_round(&wr, buf + write_size, len, off + write_size);
+
+        if (write_round_is_partial(&wr) && !edges) {
+            edges = malloc(2 * BLK_SIZE);
+            if (unlikely(!edges)) {
+                ret = -ENOMEM;
+                goto out_partial;
+            }
+        }
+
+        ret = write_round(cli, &oplogger_ctx, &cachefs_ctx, file, &wr, edges);
+        if (unlikely(IS_ERR(ret))) {
+            goto out_partial;
+        }
+    }
+
+    goto out;
+
+out_partial:
+    /* the rounds done stay written */
+    if (!write_size) {
+        write_size = ret;
+    }
+
+out:
+    free(edges);
+    return write_size;
+}
+
+/* Copy through a local buffer with plain reads and writes, stop at the source's EOF. */
+static long copy_range_buffered(ethanefs_cli_t *cli, ethanefs_open_file_t *src, off_t src_off,
+                                ethanefs_open_file_t *dst, off_t dst_off, size_t size) {
+    long copied = 0, len, ret;
+    size_t chunk;
+    char *buf;
+
+    buf = malloc(min(size, COPY_RANGE_BUF_SIZE));
+    if (unlikely(!buf)) {
+        copied = -ENOMEM;
+        goto out;
+    }
+
+    while ((size_t) copied < size) {
+        chunk = min(size - copied, COPY_RANGE_BUF_SIZE);
+
+        len = ethanefs_read(cli, src, buf, chunk, src_off + copied);
+        if (unlikely(IS_ERR(len))) {
+            copied = len;
+            goto out_free;
+        }
+        if (!len) {
+            break;
+        }
+
+        ret = ethanefs_write(cli, dst, buf, len, dst_off + copied);
+        if (unlikely(IS_ERR(ret))) {
+            copied = ret;
+            goto out_free;
+        }
+
+        copied += len;
+
+        if ((size_t) len < chunk) {
+            break;
+        }
+    }
+
+out_free:
+    free(buf);
+
+out:
+    return copied;
+}
+
+/* Copy between memory nodes through the local buffer, if no block was left on the source's MN. */
+static int copy_data_via_cn(ethanefs_cli_t *cli, dmptr_t dst, dmptr_t src, size_t size) {
+    size_t off, len;
+    int ret = 0;
+    void *buf;
+
+    for (off = 0; off < size; off += len) {
+        len = min(size - off, COPY_RANGE_BUF_SIZE);
+
+        dm_mark(cli->ctx);
+
+        buf = dm_push(cli->ctx, NULL, len);
+
+        ret = dm_copy_from_remote(cli->ctx, buf, src + off, len, 0);
+        if (unlikely(ret < 0)) {
+            goto out_pop;
+        }
+
+        ret = dm_wait_ack(cli->ctx, dm_set_ack_all(cli->ctx));
+        if (unlikely(ret < 0)) {
+            goto out_pop;
+        }
+
+        ret = dm_copy_to_remote(cli->ctx, dst + off, buf, len, 0);
+        if (unlikely(ret < 0)) {
+            goto out_pop;
+        }
+
+        ret = dm_flush(cli->ctx, dst + off, 0);
+        if (unlikely(ret < 0)) {
+            goto out_pop;
+        }
+
+        ret = dm_wait_ack(cli->ctx, dm_set_ack_all(cli->ctx));
+
+out_pop:
+        dm_pop(cli->ctx);
+
+        if (unlikely(ret < 0)) {
+            break;
+        }
     }
 
-    pr_debug("use open file: path=%s dentry=%lx", file->open_file.full_path, file->open_file.remote_dentry_addr);
+    return ret;
+}
 
-    check_cachefs_full(cli);
+/* Copy the data of @blk into a new block on the same MN if possible, holes stay holes. */
+static int copy_extent(ethanefs_cli_t *cli, dmptr_t *dst_addr, const cachefs_blk_t *blk) {
+    size_t size = ALIGN_UP(blk->size, BLK_SIZE);
+    dmptr_t addr;
+    int ret = 0;
 
-    get_oplogger_ctx(cli, cli->oplogger, &oplogger_ctx);
-    get_cachefs_ctx(cli, &cachefs_ctx);
+    if (blk->blk_remote_addr == SHAREDFS_ZERO_BLK_ADDR) {
+        *dst_addr = SHAREDFS_ZERO_BLK_ADDR;
+        goto out;
+    }
 
-    old_v = oplogger_snapshot_begin(cli->oplogger, &oplogger_ctx);
+    addr = dmm_balloc_near(cli->dmm, size, BLK_SIZE, blk->blk_remote_addr);
+    if (unlikely(IS_ERR(addr))) {
+        ret = PTR_ERR(addr);
+        goto out;
+    }
 
-    ret = oplogger_replay_read(cli->oplogger, &oplogger_ctx, file->open_file.full_path, false, 0);
+    ret = dmm_bcopy(cli->dmm, addr, blk->blk_remote_addr, size);
+    if (ret == -EXDEV) {
+        ret = copy_data_via_cn(cli, addr, blk->blk_remote_addr, size);
+    }
     if (unlikely(ret < 0)) {
-        read_size = ret;
         goto out;
     }
 
-    oplogger_snapshot_end(cli->oplogger, &oplogger_ctx, old_v);
+    *dst_addr = addr;
+
+out:
+    return ret;
+}
+
+/* A copy within one file must not overwrite the range it reads from. */
+static inline bool is_overlapping_copy(ethanefs_open_file_t *src, off_t src_off,
+                                       ethanefs_open_file_t *dst, off_t dst_off, size_t size) {
+    return src->open_file.remote_dentry_addr == dst->open_file.remote_dentry_addr &&
+           (size_t) labs(src_off - dst_off) < size;
+}
+
+/* Free the blocks copied for the first @nr extents of a round that was not logged. */
+static void free_copied_extents(ethanefs_cli_t *cli, int nr, const oplogger_extent_t *exts) {
+    int i;
+
+    for (i = 0; i < nr; i++) {
+        if (exts[i].blk_remote_addr != SHAREDFS_ZERO_BLK_ADDR) {
+            dmm_bfree(cli->dmm, exts[i].blk_remote_addr, ALIGN_UP(exts[i].size, BLK_SIZE));
+        }
+    }
+}
+
+/*
+ * Copy the whole blocks of [@src_off, @src_off + @size) to @dst_off, both block-aligned,
+ * at the memory nodes. Each round of source extents is logged as a single write-range
+ * op on @dst. Returns -ENODATA if the source keeps its data inline.
+ */
+static long copy_range_offload(ethanefs_cli_t *cli, ethanefs_open_file_t *src, off_t src_off,
+                               ethanefs_open_file_t *dst, off_t dst_off, size_t size) {
+    oplogger_ctx_t src_oplogger_ctx, dst_oplogger_ctx;
+    cachefs_ctx_t src_cachefs_ctx, dst_cachefs_ctx;
+    oplogger_extent_t exts[MAX_READ_NR_EXTS];
+    cachefs_blk_t blks[MAX_READ_NR_EXTS];
+    pathdesc_t src_pd, dst_pd;
+    long copied = 0, len;
+    int nr_blks, i, ret;
+    size_t off, ver;
+    dmptr_t log;
 
-    ret = oplogger_replay_read(cli->oplogger, &oplogger_ctx, file->open_file.full_path, false, 0);
+    if (unlikely(is_overlapping_copy(src, src_off, dst, dst_off, size))) {
+        copied = -EINVAL;
+        goto out;
+    }
+
+    pathdesc_init(&src_pd, src->open_file.full_path);
+    pathdesc_init(&dst_pd, dst->open_file.full_path);
+
+    get_oplogger_ctx(cli, cli->oplogger, &src_oplogger_ctx, &src_pd);
+    get_oplogger_ctx(cli, cli->oplogger, &dst_oplogger_ctx, &dst_pd);
+    get_cachefs_ctx(cli, &src_cachefs_ctx, &src_pd);
+    get_cachefs_ctx(cli, &dst_cachefs_ctx, &dst_pd);
+
+    ret = cachefs_is_inline(cli->cfs, &src_cachefs_ctx, src->open_file.full_path, src->open_file.remote_dentry_addr);
+    if (ret != 0) {
+        copied = ret > 0 ? -ENODATA : ret;
+        goto out;
+    }
+
+    /* the inline bytes of the destination outside the range must survive */
+    ret = cachefs_is_inline(cli->cfs, &dst_cachefs_ctx, dst->open_file.full_path, dst->open_file.remote_dentry_addr);
+    if (ret > 0) {
+        ret = sync_for_read(cli, &dst_oplogger_ctx, dst->open_file.full_path);
+        if (likely(ret == 0)) {
+            ret = spill_inline_data(cli, &dst_oplogger_ctx, &dst_cachefs_ctx, dst);
+        }
+    }
     if (unlikely(ret < 0)) {
-        read_size = ret;
+        copied = ret;
         goto out;
     }
 
-    /* perform the actual operation */
-    read_size = cachefs_read(cli->cfs, &cachefs_ctx, file->open_file.full_path,
-                             file->open_file.remote_dentry_addr, &blk, off, size);
-    if (unlikely(IS_ERR(read_size))) {
+    ret = sync_for_read(cli, &src_oplogger_ctx, src->open_file.full_path);
+    if (unlikely(ret < 0)) {
+        copied = ret;
+        goto out;
+    }
+
+    while ((size_t) copied < size) {
+        nr_blks = MAX_READ_NR_EXTS;
+        len = cachefs_read(cli->cfs, &src_cachefs_ctx, src->open_file.full_path, src->open_file.remote_dentry_addr,
+                           blks, &nr_blks, src_off + copied, size - copied);
+        if (unlikely(IS_ERR(len))) {
+            copied = len;
+            goto out;
+        }
+
+        /* reached EOF */
+        if (!len) {
+            break;
+        }
+
+        for (i = 0, off = dst_off + copied; i < nr_blks; off += blks[i].size, i++) {
+            exts[i].off = off;
+            exts[i].size = blks[i].size;
+            ret = copy_extent(cli, &exts[i].blk_remote_addr, &blks[i]);
+            if (unlikely(ret < 0)) {
+                free_copied_extents(cli, i, exts);
+                copied = ret;
+                goto out;
+            }
+        }
+
+        /* append log */
+        log = oplogger_write_range(cli->oplogger, &dst_oplogger_ctx, dst->open_file.full_path,
+                                   dst->open_file.remote_dentry_addr, nr_blks, exts);
+        if (unlikely(IS_ERR(log))) {
+            free_copied_extents(cli, nr_blks, exts);
+            copied = PTR_ERR(log);
+            goto out;
+        }
+
+        /* from here on the logged op owns the blocks, every replayer maps them */
+
+        ver = oplogger_get_version(cli->oplogger, &dst_oplogger_ctx);
+
+        ret = oplogger_replay_write(cli->oplogger, &dst_oplogger_ctx, dst->open_file.full_path, true, 1);
+        if (unlikely(ret < 0)) {
+            copied = ret;
+            goto out;
+        }
+
+        for (i = 0; i < nr_blks; i++) {
+            blks[i].blk_remote_addr = exts[i].blk_remote_addr;
+            len = cachefs_write(cli->cfs, &dst_cachefs_ctx, dst->open_file.full_path,
+                                dst->open_file.remote_dentry_addr, exts[i].off, &blks[i], ver);
+            if (unlikely(IS_ERR(len))) {
+                copied = len;
+                goto out;
+            }
+        }
+
+        copied = (long) (off - dst_off);
+    }
+
+out:
+    return copied;
+}
+
+long ethanefs_copy_file_range(ethanefs_cli_t *cli, ethanefs_open_file_t *src, off_t src_off,
+                              ethanefs_open_file_t *dst, off_t dst_off, size_t size) {
+    size_t head, mid;
+    long copied = 0, ret;
+
+    pr_debug("copy range: %s@%ld -> %s@%ld size=%lu", src->open_file.full_path, src_off,
+             dst->open_file.full_path, dst_off, size);
+
+    if (unlikely(!size)) {
+        goto out;
+    }
+
+    if (unlikely(is_overlapping_copy(src, src_off, dst, dst_off, size))) {
+        copied = -EINVAL;
+        goto out;
+    }
+
+    check_cachefs_full(cli);
+
+    /* source blocks map to destination blocks only at the same offset within a block */
+    if ((src_off - dst_off) % BLK_SIZE) {
+        copied = copy_range_buffered(cli, src, src_off, dst, dst_off, size);
+        goto out;
+    }
+
+    head = min(ALIGN_UP(dst_off, BLK_SIZE) - dst_off, size);
+    mid = ALIGN_DOWN(size - head, BLK_SIZE);
+
+    if (head) {
+        copied = copy_range_buffered(cli, src, src_off, dst, dst_off, head);
+        if (IS_ERR(copied) || (size_t) copied < head) {
+            goto out;
+        }
+    }
+
+    if (mid) {
+        ret = copy_range_offload(cli, src, src_off + (off_t) head, dst, dst_off + (off_t) head, mid);
+        if (ret == -ENODATA) {
+            ret = copy_range_buffered(cli, src, src_off + (off_t) head, dst, dst_off + (off_t) head, mid);
+        }
+        if (IS_ERR(ret)) {
+            copied = ret;
+            goto out;
+        }
+        copied += ret;
+        if ((size_t) ret < mid) {
+            goto out;
+        }
+    }
+
+    if (size > head + mid) {
+        ret = copy_range_buffered(cli, src, src_off + copied, dst, dst_off + copied, size - head - mid);
+        copied = IS_ERR(ret) ? ret : copied + ret;
+    }
+
+out:
+    return copied;
+}
+
+/*
+ * Collect the extents of [0, @size) of @file, back to back from offset 0, into *@blks.
+ * Returns their number, the array is the caller's to free.
+ */
+static int read_all_extents(ethanefs_cli_t *cli, cachefs_ctx_t *cachefs_ctx, ethanefs_open_file_t *file,
+                            size_t size, cachefs_blk_t **blks) {
+    cachefs_blk_t *arr = NULL, *tmp;
+    int nr = 0, cap = 0, nr_blks;
+    size_t off = 0;
+    long len;
+
+    while (off < size) {
+        if (cap - nr < MAX_READ_NR_EXTS) {
+            cap += MAX_READ_NR_EXTS;
+            tmp = realloc(arr, cap * sizeof(*arr));
+            if (unlikely(!tmp)) {
+                nr = -ENOMEM;
+                goto out_free;
+            }
+            arr = tmp;
+        }
+
+        nr_blks = MAX_READ_NR_EXTS;
+        len = cachefs_read(cli->cfs, cachefs_ctx, file->open_file.full_path, file->open_file.remote_dentry_addr,
+                           arr + nr, &nr_blks, off, size - off);
+        if (unlikely(IS_ERR(len))) {
+            nr = (int) len;
+            goto out_free;
+        }
+
+        /* reached EOF */
+        if (!len) {
+            break;
+        }
+
+        nr += nr_blks;
+        off += len;
+    }
+
+    *blks = arr;
+    goto out;
+
+out_free:
+    free(arr);
+
+out:
+    return nr;
+}
+
+/* Copy the inline data of @file to a new block, the single extent of a clone of it. */
+static int inline_data_to_extent(ethanefs_cli_t *cli, cachefs_ctx_t *cachefs_ctx, ethanefs_open_file_t *file,
+                                 size_t size, cachefs_blk_t *blk) {
+    dmptr_t remote_addr;
+    char *data;
+    long ret;
+
+    data = calloc(1, BLK_SIZE);
+    if (unlikely(!data)) {
+        ret = -ENOMEM;
         goto out;
     }
 
-    /* read data */
-    ret = read_data(cli, buf, read_size, &blk);
+    /* -ENODATA if it has spilled since */
+    ret = cachefs_read_inline(cli->cfs, cachefs_ctx, file->open_file.full_path, file->open_file.remote_dentry_addr,
+                              data, 0, ETHANE_INLINE_DATA_MAX);
     if (unlikely(IS_ERR(ret))) {
-        read_size = ret;
+        goto out_free;
+    }
+
+    if (is_zero_data(data, BLK_SIZE)) {
+        remote_addr = SHAREDFS_ZERO_BLK_ADDR;
+    } else {
+        remote_addr = alloc_and_write_data(cli, 1, (const char *[]) { data }, (size_t[]) { BLK_SIZE });
+    }
+    if (unlikely(IS_ERR(remote_addr))) {
+        ret = PTR_ERR(remote_addr);
+        goto out_free;
+    }
+
+    blk->blk_remote_addr = remote_addr;
+    blk->size = size;
+    ret = 0;
+
+out_free:
+    free(data);
+
+out:
+    return (int) ret;
+}
+
+/*
+ * Write the extent list of a clone that does not fit in its log entry to a block of its
+ * own, for the replayers to read. Like overwritten data blocks, it is never reclaimed.
+ */
+static dmptr_t write_extent_list(ethanefs_cli_t *cli, int nr_blks, const cachefs_blk_t *blks) {
+    size_t size = nr_blks * sizeof(*blks), off, len;
+    dmptr_t remote_addr;
+    void *buf;
+    int ret = 0;
+
+    remote_addr = dmm_balloc(cli->dmm, ALIGN_UP(size, BLK_SIZE), BLK_SIZE, 0);
+    if (unlikely(IS_ERR(remote_addr))) {
+        pr_err("failed to alloc extent list block: %ld", PTR_ERR(remote_addr));
         goto out;
     }
 
+    for (off = 0; off < size; off += len) {
+        len = min(size - off, COPY_RANGE_BUF_SIZE);
+
+        dm_mark(cli->ctx);
+
+        buf = dm_push(cli->ctx, (const char *) blks + off, len);
+        if (unlikely(!buf)) {
+            ret = -ENOMEM;
+            goto out_pop;
+        }
+
+        ret = dm_copy_to_remote(cli->ctx, remote_addr + off, buf, len, 0);
+        if (unlikely(ret < 0)) {
+            goto out_pop;
+        }
+
+        ret = dm_flush(cli->ctx, remote_addr + off, 0);
+        if (unlikely(ret < 0)) {
+            goto out_pop;
+        }
+
+        /* the list must be in place before the log entry that points at it */
+        ret = dm_wait_ack(cli->ctx, dm_set_ack_all(cli->ctx));
+
+out_pop:
+        dm_pop(cli->ctx);
+
+        if (unlikely(ret < 0)) {
+            break;
+        }
+    }
+
+    if (unlikely(ret < 0)) {
+        dmm_bfree(cli->dmm, remote_addr, ALIGN_UP(size, BLK_SIZE));
+        remote_addr = ret;
+    }
+
 out:
-    return read_size;
+    return remote_addr;
 }
 
-long ethanefs_write(ethanefs_cli_t *cli, ethanefs_open_file_t *file, const char *buf, size_t size, off_t off) {
-    oplogger_ctx_t oplogger_ctx;
-    cachefs_ctx_t cachefs_ctx;
-    dmptr_t log, remote_addr;
-    cachefs_blk_t blk;
-    long write_size;
+/*
+ * Blocks are never written in place (a write always goes to a fresh block), so @dst can
+ * simply map @src's blocks: a later write to either file breaks the sharing of the
+ * blocks it touches, and the clone costs O(extents) metadata and no data movement.
+ * Inline source data is copied to a block first. The clone is a single OP_CLONE; an
+ * extent list too long for the log entry is written out of line and the op points at it.
+ */
+int ethanefs_clone(ethanefs_cli_t *cli, ethanefs_open_file_t *src, ethanefs_open_file_t *dst) {
+    oplogger_ctx_t src_oplogger_ctx, dst_oplogger_ctx;
+    cachefs_ctx_t src_cachefs_ctx, dst_cachefs_ctx;
+    cachefs_blk_t inline_blk, *blks = NULL;
+    dmptr_t log, list = DMPTR_NULL, shared[2];
+    pathdesc_t src_pd, dst_pd;
+    struct stat stbuf;
+    int nr_blks = 0;
     size_t ver;
-    int ret;
+    long ret;
 
-    /* FIXME: */
-    if (size != IO_SIZE || off % IO_SIZE != 0) {
-        pr_err("only support io size %lu, and off(=%lu) must be multipler of it!", IO_SIZE, off);
-        abort();
-    }
+    pr_debug("clone: %s -> %s", src->open_file.full_path, dst->open_file.full_path);
 
-    pr_debug("use open file: path=%s dentry=%lx", file->open_file.full_path, file->open_file.remote_dentry_addr);
+    /* the clone would wipe the source */
+    if (unlikely(is_overlapping_copy(src, 0, dst, 0, LONG_MAX))) {
+        ret = -EINVAL;
+        goto out;
+    }
 
     check_cachefs_full(cli);
 
-    remote_addr = alloc_and_write_data(cli, size, buf);
-    blk.blk_remote_addr = remote_addr;
-    blk.size = size;
+    pathdesc_init(&src_pd, src->open_file.full_path);
+    pathdesc_init(&dst_pd, dst->open_file.full_path);
+
+    get_oplogger_ctx(cli, cli->oplogger, &src_oplogger_ctx, &src_pd);
+    get_oplogger_ctx(cli, cli->oplogger, &dst_oplogger_ctx, &dst_pd);
+    get_cachefs_ctx(cli, &src_cachefs_ctx, &src_pd);
+    get_cachefs_ctx(cli, &dst_cachefs_ctx, &dst_pd);
+
+    ret = sync_for_read(cli, &src_oplogger_ctx, src->open_file.full_path);
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
+
+    ret = cachefs_getattr(cli->cfs, &src_cachefs_ctx, src->open_file.full_path, &stbuf);
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
+
+    /* inline data has no blocks to share */
+    ret = cachefs_is_inline(cli->cfs, &src_cachefs_ctx, src->open_file.full_path, src->open_file.remote_dentry_addr);
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
+
+    if (ret > 0 && stbuf.st_size) {
+        ret = inline_data_to_extent(cli, &src_cachefs_ctx, src, stbuf.st_size, &inline_blk);
+        if (unlikely(ret < 0)) {
+            goto out;
+        }
+        blks = &inline_blk;
+        nr_blks = 1;
+    } else if (!ret && stbuf.st_size) {
+        /* neither file frees the shared blocks when reclaimed */
+        shared[0] = src->open_file.remote_dentry_addr;
+        shared[1] = dst->open_file.remote_dentry_addr;
+        ret = sharedfs_bm_mark_shared(cli->rfs, 2, shared);
+        if (unlikely(ret < 0)) {
+            goto out;
+        }
 
-    get_oplogger_ctx(cli, cli->oplogger, &oplogger_ctx);
-    get_cachefs_ctx(cli, &cachefs_ctx);
+        nr_blks = read_all_extents(cli, &src_cachefs_ctx, src, stbuf.st_size, &blks);
+        if (unlikely(nr_blks < 0)) {
+            ret = nr_blks;
+            goto out;
+        }
+    }
 
     /* append log */
-    log = oplogger_write(cli->oplogger, &oplogger_ctx,
-                         file->open_file.full_path, file->open_file.remote_dentry_addr, remote_addr, size, off);
+    log = oplogger_clone(cli->oplogger, &dst_oplogger_ctx, dst->open_file.full_path,
+                         dst->open_file.remote_dentry_addr, stbuf.st_size, nr_blks, blks, DMPTR_NULL);
+    if (PTR_ERR(log) == -E2BIG) {
+        list = write_extent_list(cli, nr_blks, blks);
+        if (unlikely(IS_ERR(list))) {
+            ret = PTR_ERR(list);
+            goto out_free;
+        }
+        log = oplogger_clone(cli->oplogger, &dst_oplogger_ctx, dst->open_file.full_path,
+                             dst->open_file.remote_dentry_addr, stbuf.st_size, nr_blks, blks, list);
+        if (unlikely(IS_ERR(log))) {
+            dmm_bfree(cli->dmm, list, ALIGN_UP(nr_blks * sizeof(*blks), BLK_SIZE));
+        }
+    }
     if (unlikely(IS_ERR(log))) {
-        write_size = PTR_ERR(log);
-        goto out;
+        /* nobody maps the copy of the inline data */
+        if (blks == &inline_blk && inline_blk.blk_remote_addr != SHAREDFS_ZERO_BLK_ADDR) {
+            dmm_bfree(cli->dmm, inline_blk.blk_remote_addr, BLK_SIZE);
+        }
+        ret = PTR_ERR(log);
+        goto out_free;
     }
 
     /* get current system version */
-    ver = oplogger_get_version(cli->oplogger, &oplogger_ctx);
+    ver = oplogger_get_version(cli->oplogger, &dst_oplogger_ctx);
 
     /* replay until the newly appended log */
-    ret = oplogger_replay_write(cli->oplogger, &oplogger_ctx, file->open_file.full_path, true, 1);
+    ret = oplogger_replay_write(cli->oplogger, &dst_oplogger_ctx, dst->open_file.full_path, true, 1);
     if (unlikely(ret < 0)) {
-        write_size = ret;
-        goto out;
+        goto out_free;
     }
 
     /* perform the actual operation */
-    write_size = cachefs_write(cli->cfs, &cachefs_ctx,
-                               file->open_file.full_path, file->open_file.remote_dentry_addr, off, &blk, ver);
+    ret = cachefs_clone(cli->cfs, &dst_cachefs_ctx, dst->open_file.full_path, dst->open_file.remote_dentry_addr,
+                        stbuf.st_size, nr_blks, blks, ver);
+
+out_free:
+    if (blks != &inline_blk) {
+        free(blks);
+    }
 
 out:
-    return write_size;
+    return IS_ERR(ret) ? (int) ret : 0;
+}
+
+/*
+ * Zero [@size, end of its block) of a block-mapped file that is cut down to @size, as the block
+ * stays mapped. This is a write of its own, logged before the truncate.
+ */
+static int zero_partial_tail(ethanefs_cli_t *cli, oplogger_ctx_t *oplogger_ctx, cachefs_ctx_t *cachefs_ctx,
+                             ethanefs_open_file_t *file, size_t size) {
+    static const char zeros[BLK_SIZE];
+    struct write_round wr;
+    char *edges = NULL;
+    struct stat stbuf;
+    long ret;
+
+    ret = sync_for_read(cli, oplogger_ctx, file->open_file.full_path);
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
+
+    /* cachefs_truncate() zeroes inline data itself */
+    ret = cachefs_is_inline(cli->cfs, cachefs_ctx, file->open_file.full_path, file->open_file.remote_dentry_addr);
+    if (ret) {
+        goto out;
+    }
+
+    ret = cachefs_getattr(cli->cfs, cachefs_ctx, file->open_file.full_path, &stbuf);
+    if (unlikely(ret < 0) || (size_t) stbuf.st_size <= size) {
+        goto out;
+    }
+
+    edges = malloc(2 * BLK_SIZE);
+    if (unlikely(!edges)) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    init_write_round(&wr, zeros, min(ALIGN_UP(size, BLK_SIZE), (size_t) stbuf.st_size) - size, (off_t) size);
+
+    ret = write_round(cli, oplogger_ctx, cachefs_ctx, file, &wr, edges);
+
+out:
+    free(edges);
+    return ret < 0 ? (int) ret : 0;
 }
 
 int ethanefs_truncate(ethanefs_cli_t *cli, ethanefs_open_file_t *file, off_t size) {
     oplogger_ctx_t oplogger_ctx;
+    pathdesc_t pd;
     cachefs_ctx_t cachefs_ctx;
     dmptr_t log;
     size_t ver;
     int ret;
 
-    /* FIXME: */
-    if (size % IO_SIZE != 0) {
-        pr_err("only support io size %lu, and size(=%lu) must be multipler of it!", IO_SIZE, size);
-        abort();
-    }
-
     pr_debug("use open file: path=%s dentry=%lx", file->open_file.full_path, file->open_file.remote_dentry_addr);
 
     check_cachefs_full(cli);
 
-    get_oplogger_ctx(cli, cli->oplogger, &oplogger_ctx);
-    get_cachefs_ctx(cli, &cachefs_ctx);
+    pathdesc_init(&pd, file->open_file.full_path);
+
+    get_oplogger_ctx(cli, cli->oplogger, &oplogger_ctx, &pd);
+    get_cachefs_ctx(cli, &cachefs_ctx, &pd);
+
+    if (size % BLK_SIZE) {
+        ret = zero_partial_tail(cli, &oplogger_ctx, &cachefs_ctx, file, size);
+        if (unlikely(ret < 0)) {
+            goto out;
+        }
+    }
 
     /* append log */
     log = oplogger_truncate(cli->oplogger, &oplogger_ctx,
@@ -1042,17 +2558,19 @@ out:
 int ethanefs_chmod(ethanefs_cli_t *cli, const char *path, mode_t mode) {
     uint64_t result = OP_RESULT_UNDETERMINED;
     oplogger_ctx_t oplogger_ctx;
+    pathdesc_t pd;
     cachefs_ctx_t cachefs_ctx;
     dmptr_t log;
     size_t ver;
     int ret;
 
     path = get_path(cli, path);
+    pathdesc_init(&pd, path);
 
     check_cachefs_full(cli);
 
-    get_oplogger_ctx(cli, cli->oplogger, &oplogger_ctx);
-    get_cachefs_ctx(cli, &cachefs_ctx);
+    get_oplogger_ctx(cli, cli->oplogger, &oplogger_ctx, &pd);
+    get_cachefs_ctx(cli, &cachefs_ctx, &pd);
 
     /* append log */
     log = oplogger_chmod(cli->oplogger, &oplogger_ctx, path, mode);
@@ -1082,17 +2600,19 @@ out:
 int ethanefs_chown(ethanefs_cli_t *cli, const char *path, uid_t uid, gid_t gid) {
     uint64_t result = OP_RESULT_UNDETERMINED;
     oplogger_ctx_t oplogger_ctx;
+    pathdesc_t pd;
     cachefs_ctx_t cachefs_ctx;
     dmptr_t log;
     size_t ver;
     int ret;
 
     path = get_path(cli, path);
+    pathdesc_init(&pd, path);
 
     check_cachefs_full(cli);
 
-    get_oplogger_ctx(cli, cli->oplogger, &oplogger_ctx);
-    get_cachefs_ctx(cli, &cachefs_ctx);
+    get_oplogger_ctx(cli, cli->oplogger, &oplogger_ctx, &pd);
+    get_cachefs_ctx(cli, &cachefs_ctx, &pd);
 
     /* append log */
     log = oplogger_chown(cli->oplogger, &oplogger_ctx, path, uid, gid);
@@ -1241,6 +2761,23 @@ _Noreturn void ethanefs_logger_cache_fetcher_loop(ethanefs_cli_t *cli, ethanefs_
     logger_cache_fetcher_loop(cli->logger);
 }
 
+_Noreturn void ethanefs_kv_resize_loop(ethanefs_cli_t *cli, ethanefs_logd_config_t *config) {
+    int ret;
+
+    pr_info("kv resizer started, max_load_factor=%d%%", config->kv_resize.max_load_factor_pct);
+
+    for (;;) {
+        ret = sharedfs_resize(cli->rfs, config->kv_resize.max_load_factor_pct);
+        if (unlikely(ret < 0)) {
+            pr_err("kv resize failed: %d", ret);
+        } else if (ret > 0) {
+            pr_info("kv resize: %d shards doubled", ret);
+        }
+
+        usleep(config->kv_resize.check_interval_ms * 1000);
+    }
+}
+
 _Noreturn void ethanefs_checkpoint_loop(ethanefs_cli_t *cli, ethanefs_logd_config_t *config) {
     struct replay_ctx replay_ctx = { 0 };
     zhandle_t *zh = cli->fs->zh;
@@ -1259,7 +2796,7 @@ _Noreturn void ethanefs_checkpoint_loop(ethanefs_cli_t *cli, ethanefs_logd_confi
     shard = atoi(path + strlen(DM_ZK_PREFIX "checkpoint_clis/shard"));
     pr_info("checkpoint shard: %d started", shard);
 
-    get_oplogger_ctx(cli, cli->oplogger, &oplogger_ctx);
+    get_oplogger_ctx(cli, cli->oplogger, &oplogger_ctx, NULL);
 
     set_oplogger_shard(cli, &oplogger_ctx, config->checkpoint.nr_shards, shard);
     set_replay_cb(cli, &oplogger_ctx, replay_cb, &replay_ctx);
@@ -1284,6 +2821,14 @@ _Noreturn void ethanefs_checkpoint_loop(ethanefs_cli_t *cli, ethanefs_logd_confi
         if (duration >= CHECK_CHKPT_VER_INTERVAL_US * 1000) {
             replay_ctx.chkpt_ver_remote = get_chkpt_ver(cli);
             check_gc(&oplogger_ctx, &replay_ctx, false);
+
+            /* subtrees removed by our checkpoints are reclaimed a little at a time */
+            ret = sharedfs_ns_reclaim(cli->rfs, RECLAIM_NR_KEYS_PER_ROUND, logger_get_head(cli->logger),
+                                      oplogger_get_version(cli->oplogger, &oplogger_ctx));
+            if (unlikely(ret < 0)) {
+                pr_err("reclaim removed subtrees failed: %d", ret);
+            }
+
             bench_timer_start(&timer);
         }
     }
@@ -1438,5 +2983,5 @@ void ethanefs_test_remote_path_walk(ethanefs_cli_t *cli, const char *path) {
             dentries[i]= calloc(1, sizeof(*dentries[i]));
         }
     }
-    sharedfs_ns_lookup_dentries(cli->rfs, path, dentries);
+    sharedfs_ns_lookup_dentries(cli->rfs, path, NULL, dentries);
 }
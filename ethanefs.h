@@ -13,6 +13,7 @@
 typedef struct ethanefs ethanefs_t;
 typedef struct ethanefs_cli ethanefs_cli_t;
 typedef struct ethanefs_open_file ethanefs_open_file_t;
+typedef struct ethanefs_dir ethanefs_dir_t;
 
 typedef struct ethane_fs_config ethanefs_fs_config_t;
 typedef struct ethane_memd_config ethanefs_memd_config_t;
@@ -32,15 +33,34 @@ ethanefs_cli_t *ethanefs_cli_init(ethanefs_t *fs, struct ethane_cli_config *conf
 void ethanefs_set_user(ethanefs_cli_t *cli, uid_t uid, gid_t gid);
 
 int ethanefs_getattr(ethanefs_cli_t *cli, const char *path, struct stat *stbuf);
+/* Getattr of @n paths with amortised remote lookups; per-path results go to @rets. */
+int ethanefs_getattr_batch(ethanefs_cli_t *cli, const char **paths, int n, struct stat *stbufs, int *rets);
 int ethanefs_mkdir(ethanefs_cli_t *cli, const char *path, mode_t mode);
+/* Like mkdir -p, the missing directories of @path are made by a single op */
+int ethanefs_mkdir_recursive(ethanefs_cli_t *cli, const char *path, mode_t mode);
 int ethanefs_rmdir(ethanefs_cli_t *cli, const char *path);
+/* Like rm -rf, the directory and everything below it go in a single op */
+int ethanefs_rmtree(ethanefs_cli_t *cli, const char *path);
 int ethanefs_unlink(ethanefs_cli_t *cli, const char *path);
+int ethanefs_rename(ethanefs_cli_t *cli, const char *old_path, const char *new_path);
 ethanefs_open_file_t *ethanefs_create(ethanefs_cli_t *cli, const char *path, mode_t mode);
 ethanefs_open_file_t *ethanefs_open(ethanefs_cli_t *cli, const char *path);
 int ethanefs_close(ethanefs_cli_t *cli, ethanefs_open_file_t *file);
+ethanefs_dir_t *ethanefs_opendir(ethanefs_cli_t *cli, const char *path);
+/* Return the next entry name of @dir, or NULL at its end */
+const char *ethanefs_readdir(ethanefs_cli_t *cli, ethanefs_dir_t *dir);
+int ethanefs_closedir(ethanefs_cli_t *cli, ethanefs_dir_t *dir);
 long ethanefs_read(ethanefs_cli_t *cli, ethanefs_open_file_t *file, char *buf, size_t size, off_t off);
 long ethanefs_write(ethanefs_cli_t *cli, ethanefs_open_file_t *file, const char *buf, size_t size, off_t off);
+/* Copy @size bytes of @src at @src_off to @dst at @dst_off, whole blocks are copied at the memory nodes. */
+long ethanefs_copy_file_range(ethanefs_cli_t *cli, ethanefs_open_file_t *src, off_t src_off,
+                              ethanefs_open_file_t *dst, off_t dst_off, size_t size);
 int ethanefs_truncate(ethanefs_cli_t *cli, ethanefs_open_file_t *file, off_t size);
+/*
+ * Make @dst a copy of @src that shares its data blocks until either one is written. It is a
+ * single op, so readers of @dst see either none or all of it.
+ */
+int ethanefs_clone(ethanefs_cli_t *cli, ethanefs_open_file_t *src, ethanefs_open_file_t *dst);
 int ethanefs_chmod(ethanefs_cli_t *cli, const char *path, mode_t mode);
 int ethanefs_chown(ethanefs_cli_t *cli, const char *path, uid_t uid, gid_t gid);
 
@@ -48,6 +68,7 @@ int ethanefs_get_cli_id(ethanefs_cli_t *cli);
 
 _Noreturn void ethanefs_logger_cache_fetcher_loop(ethanefs_cli_t *cli, ethanefs_logd_config_t *config);
 _Noreturn void ethanefs_checkpoint_loop(ethanefs_cli_t *cli, ethanefs_logd_config_t *config);
+_Noreturn void ethanefs_kv_resize_loop(ethanefs_cli_t *cli, ethanefs_logd_config_t *config);
 
 ethanefs_fs_config_t *ethanefs_config_parse_fs(const char *yaml_path);
 ethanefs_memd_config_t *ethanefs_config_parse_memd(const char *yaml_path);
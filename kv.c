@@ -21,10 +21,11 @@
  * The data-plane key-value supports:
  * (1) Concurrent read/write
  * (2) Concurrent writes **across** shards
- * (3) Non-concurrent writes **within** a shard
+ * (3) Lock-free writes **within** a shard (cuckoo moves and resizing take the shard lock)
  * (read=get, write=put/(get+del))
  */
 
+#include <unistd.h>
 #include <errno.h>
 
 #include "dmlocktab.h"
@@ -33,6 +34,7 @@
 #include "debug.h"
 #include "coro.h"
 #include "rand.h"
+#include "pathdesc.h"
 #include "kv.h"
 
 #include <prom_collector_registry.h>
@@ -42,31 +44,92 @@
 
 #define STAT_GET_INTERVAL   32
 
+/* Max number of buckets visited by a single BFS cuckoo path search */
+#define MAX_BFS_NR_NODES    256
+
+/* Hash bits kept in slot headers allow a shard to be doubled this many times */
+#define MAX_NR_DOUBLINGS    8
+
+/* Index of the per-shard stash among the candidate locations of a key */
+#define STASH_HT            2
+#define MAX_NR_CANDS        3
+
 #define LAT_HIST_BUCKETS   16, 10.0, 20.0, 30.0, 40.0, 50.0, 60.0, 70.0, 80.0, 100.0, 125.0, 150.0, 175.0, 200.0, 250.0, 300.0, 400.0
 
 struct slot_hdr {
     bool used : 1;
-    int ver : 31;
+    /* odd while the slot is being written */
+    uint32_t ver : 15;
+    /*
+     * Bits of the two hashes above the initial number of buckets (8 bits per table),
+     * used to split the entry when its shard doubles.
+     */
+    uint32_t hash_ext : 16;
     /* Position in another hash table */
     uint32_t pair_pos;
 };
 
+/*
+ * Per-shard directory entry
+ * A shard starts in its slice of the interleaved tables (ht == DMPTR_NULL), and moves to
+ * dedicated tables when doubled. ver is odd while the shard is being migrated. Readers
+ * and lock-free writers validate the entry with ver, locked writers re-read it after
+ * taking the shard lock. nr_items is maintained by FAAs of writers, and never written
+ * as a part of the entry.
+ */
+struct kv_shard_dir {
+    uint32_t ver;
+    int nr_doublings;
+    size_t nr_buckets;
+    dmptr_t ht[2];
+    long nr_items;
+    char _pad[24];
+};
+
 struct kv_info {
     size_t ht_nr_ents;
     size_t val_len;
     int nr_shards;
+    int bucket_nr_slots;
+    int max_kick_depth;
+    int stash_nr_slots;
+    dmptr_t shard_dir;
     TAB_hash hf[2];
     TAB_hash shard_hf;
+    dmptr_t dir_acks;
+    /* two hash tables, then the stash region */
     dmptr_t ht[];
 };
 
+/*
+ * Client-side slot cache
+ * Remembers the candidate slots (address and content) found by a get, keyed by the two
+ * hashes of the key. A hit is validated by re-reading only these slots instead of all the
+ * candidate buckets: any write to a slot changes its header word. Within staleness_us of
+ * being filled (if non-zero), a hit is served without any remote read. Misses are not cached.
+ * Neither are gets whose slots all turn out to be foreign (same fingerprint, other key): a key
+ * inserted later into another slot of the buckets would go unseen. So an entry is only served
+ * once the caller has confirmed (kv_cache_confirm) that one of its slots holds the key.
+ * Gets with more than KV_CACHE_NR_SLOTS candidates are not cached either.
+ */
+#define KV_CACHE_NR_SLOTS   2
+
+struct kv_cache_ent {
+    uint64_t hashes[2];
+    uint32_t dir_ver;
+    bool confirmed;
+    int nr_slots;
+    dmptr_t addrs[KV_CACHE_NR_SLOTS];
+    struct bench_timer filled;
+};
+
 struct kv {
     dmcontext_t *ctx;
     dmm_cli_t *dmm;
     dmlocktab_t *locktab;
 
-    /* Hash tables and hash functions */
-    dmptr_t *ht[2];
+    /* Hash tables (and stash) and hash functions */
+    dmptr_t *ht[MAX_NR_CANDS];
     TAB_hash hf[2];
     TAB_hash shard_hf;
 
@@ -75,27 +138,80 @@ struct kv {
     size_t slot_len;
     int interleave_nr;
 
+    /* A bucket holds bucket_nr_slots adjacent slots and is fetched by a single read */
+    int bucket_nr_slots;
+    size_t bucket_len;
+
+    /* Cuckoo path length limit, and per-shard overflow stash for failed inserts */
+    int max_kick_depth;
+    int stash_nr_slots;
+    size_t stash_len;
+    int nr_cands;
+
     int nr_shards;
 
+    /* initial shard geometry */
     size_t ht_nr_ents_per_shard;
+    size_t ht_nr_buckets_per_shard;
+
+    /* shard directory (cached) */
+    dmptr_t shard_dir;
+    struct kv_shard_dir *dirs;
+
+    /* directory generation acknowledged (see kv_ack_dirs()) */
+    dmptr_t dir_acks;
+    uint64_t dir_gen;
+    int cli_id;
+    int nr_ops_since_ack;
+
+    /* tables replaced by a doubling, freed once every client has acknowledged it */
+    int nr_retired;
+    struct kv_retired_tabs *retired;
 
     unsigned int rnd_seed;
 
     int nr_max_outstanding_reqs;
 
     int nr_get_reqs;
+    kv_key_matcher_t key_matcher;
+
+    /* slot cache, and the slot copies of each entry */
+    int cache_nr_ents;
+    long cache_staleness_us;
+    struct kv_cache_ent *cache;
+    void *cache_slots;
 
     char label[64];
 };
 
-dmptr_t kv_create(dmcontext_t *ctx, dmm_cli_t *dmm, size_t size, size_t val_len, int nr_shards) {
-    size_t ht_nr_ents, slot_len, info_size;
+/*
+ * Directory acknowledgement
+ *   Word 0 of the dir_acks region is the directory generation, bumped by every shard
+ * doubling after it publishes the new tables. Word 1 + i is the generation client i has
+ * acknowledged (0 if it never registered): it has refreshed all its cached directory
+ * entries since it read that generation, so it no longer touches any table retired before.
+ */
+#define KV_DIR_ACKS_SIZE        ((1 + MAX_NR_CLIS) * sizeof(uint64_t))
+
+/* acknowledge a newer generation every this many KV ops */
+#define KV_DIR_ACK_INTERVAL     64
+
+struct kv_retired_tabs {
+    dmptr_t ht[2];
+    size_t size;
+    uint64_t gen;
+};
+
+dmptr_t kv_create(dmcontext_t *ctx, dmm_cli_t *dmm, size_t size, size_t val_len, int nr_shards,
+                  int bucket_nr_slots, int max_kick_depth, int stash_nr_slots) {
+    size_t ht_nr_ents, slot_len, bucket_len, stash_len, info_size;
     dmptr_t kv_info_remote_addr, *ht;
+    struct kv_shard_dir *dirs;
     struct kv_info *info;
     TAB_generator gen;
     int i, ret;
 
-    info_size = sizeof(*info) + 2 * dmm_get_interleave_nr(dmm) * sizeof(dmptr_t);
+    info_size = sizeof(*info) + MAX_NR_CANDS * dmm_get_interleave_nr(dmm) * sizeof(dmptr_t);
 
     info = dm_push(ctx, NULL, info_size);
     if (unlikely(!info)) {
@@ -103,18 +219,31 @@ dmptr_t kv_create(dmcontext_t *ctx, dmm_cli_t *dmm, size_t size, size_t val_len,
         goto out;
     }
 
+    /* a get must be able to return every candidate slot */
+    ethane_assert(bucket_nr_slots <= KV_MAX_BUCKET_NR_SLOTS && stash_nr_slots <= KV_MAX_STASH_NR_SLOTS);
+
     info->val_len = val_len;
     info->nr_shards = nr_shards;
+    info->bucket_nr_slots = bucket_nr_slots;
+    info->max_kick_depth = max_kick_depth;
+    info->stash_nr_slots = stash_nr_slots;
 
     slot_len = val_len + sizeof(struct slot_hdr);
+    bucket_len = slot_len * bucket_nr_slots;
+    stash_len = slot_len * stash_nr_slots;
     ht_nr_ents = DIV_ROUND_UP(size, slot_len) / 2;
     info->ht_nr_ents = ht_nr_ents;
-    pr_info("kv_create: ht_nr_ents=%lu, slot_len=%lu", ht_nr_ents, slot_len);
+    pr_info("kv_create: ht_nr_ents=%lu, slot_len=%lu, bucket_nr_slots=%d", ht_nr_ents, slot_len, bucket_nr_slots);
     ethane_assert(ht_nr_ents % nr_shards == 0);
+    ethane_assert((ht_nr_ents / nr_shards) % bucket_nr_slots == 0);
 
     /* TODO: handle cacheline-unaligned case */
     ethane_assert(slot_len % 64 == 0 || 64 % slot_len == 0);
 
+    /* a bucket must never straddle two interleaved strips */
+    ethane_assert(BLK_SIZE % bucket_len == 0);
+    ethane_assert(!stash_nr_slots || BLK_SIZE % stash_len == 0);
+
     /* alloc and clear hash table blocks */
     for (i = 0; i < 2; i++) {
         ht = info->ht + i * dmm_get_interleave_nr(dmm);
@@ -122,6 +251,61 @@ dmptr_t kv_create(dmcontext_t *ctx, dmm_cli_t *dmm, size_t size, size_t val_len,
         dmm_bzero_interleaved(dmm, ht, ht_nr_ents * slot_len, true);
     }
 
+    /* alloc and clear stash blocks */
+    ht = info->ht + STASH_HT * dmm_get_interleave_nr(dmm);
+    if (stash_nr_slots) {
+        dmm_balloc_interleaved(dmm, ht, nr_shards * stash_len, 0);
+        dmm_bzero_interleaved(dmm, ht, nr_shards * stash_len, true);
+    } else {
+        memset(ht, 0, dmm_get_interleave_nr(dmm) * sizeof(dmptr_t));
+    }
+
+    /* init shard directory */
+    dirs = dm_push(ctx, NULL, nr_shards * sizeof(*dirs));
+    if (unlikely(!dirs)) {
+        kv_info_remote_addr = PTR_ERR(-ENOMEM);
+        goto out;
+    }
+    memset(dirs, 0, nr_shards * sizeof(*dirs));
+    for (i = 0; i < nr_shards; i++) {
+        dirs[i].nr_buckets = ht_nr_ents / nr_shards / bucket_nr_slots;
+    }
+
+    info->shard_dir = dmm_balloc(dmm, ALIGN_UP(nr_shards * sizeof(*dirs), BLK_SIZE), BLK_SIZE, 0);
+    if (unlikely(IS_ERR(info->shard_dir))) {
+        kv_info_remote_addr = info->shard_dir;
+        goto out;
+    }
+
+    ret = dm_copy_to_remote(ctx, info->shard_dir, dirs, nr_shards * sizeof(*dirs), DMFLAG_ACK);
+    if (unlikely(ret < 0)) {
+        kv_info_remote_addr = ret;
+        goto out;
+    }
+
+    ret = dm_wait_ack(ctx, 1);
+    if (unlikely(ret < 0)) {
+        kv_info_remote_addr = ret;
+        goto out;
+    }
+
+    /* directory generations start at 1, 0 is an unregistered client */
+    info->dir_acks = dmm_balloc(dmm, ALIGN_UP(KV_DIR_ACKS_SIZE, BLK_SIZE), BLK_SIZE, 0);
+    if (unlikely(IS_ERR(info->dir_acks))) {
+        kv_info_remote_addr = info->dir_acks;
+        goto out;
+    }
+    dmm_bzero(dmm, info->dir_acks, ALIGN_UP(KV_DIR_ACKS_SIZE, BLK_SIZE), true);
+
+    ret = dm_write(ctx, info->dir_acks, (uint64_t) 1, DMFLAG_ACK);
+    if (likely(ret >= 0)) {
+        ret = dm_wait_ack(ctx, 1);
+    }
+    if (unlikely(ret < 0)) {
+        kv_info_remote_addr = ret;
+        goto out;
+    }
+
     /* init two (nearly) independent hash functions */
     TAB_init_generator(&gen, TAB_DEFAULT_SEED);
     for (i = 0; i < 2; i++) {
@@ -157,6 +341,38 @@ out:
 
 static prom_histogram_t *prom_get_latency;
 
+static int read_dir_gen(kv_t *kv, uint64_t *gen) {
+    uint64_t *buf;
+    int ret;
+
+    dm_mark(kv->ctx);
+
+    ret = dm_read(kv->ctx, buf, kv->dir_acks, DMFLAG_ACK);
+    if (likely(ret >= 0)) {
+        ret = dm_wait_ack(kv->ctx, 1);
+    }
+    if (likely(ret >= 0)) {
+        *gen = *buf;
+    }
+
+    dm_pop(kv->ctx);
+    return ret;
+}
+
+static int write_dir_ack(kv_t *kv, uint64_t gen) {
+    int ret;
+
+    dm_mark(kv->ctx);
+
+    ret = dm_write(kv->ctx, kv->dir_acks + (1 + kv->cli_id) * sizeof(uint64_t), gen, DMFLAG_ACK);
+    if (likely(ret >= 0)) {
+        ret = dm_wait_ack(kv->ctx, 1);
+    }
+
+    dm_pop(kv->ctx);
+    return ret;
+}
+
 void ethanefs_kv_init_global() {
     prom_get_latency = prom_histogram_new("ethanefs_kv_get_latency",
                                           "ethanefs_kv_get_latency",
@@ -167,13 +383,15 @@ void ethanefs_kv_init_global() {
 }
 
 kv_t *kv_init(const char *name, dmcontext_t *ctx, dmm_cli_t *dmm, dmlocktab_t *locktab,
-              dmptr_t kv_info_remote_addr, int nr_max_outstanding_reqs) {
+              dmptr_t kv_info_remote_addr, int nr_max_outstanding_reqs,
+              int cache_nr_ents, long cache_staleness_us) {
+    struct kv_shard_dir *dirs;
     struct kv_info *info;
     size_t info_size;
     int i, ret;
     kv_t *kv;
 
-    info_size = sizeof(*info) + 2 * dmm_get_interleave_nr(dmm) * sizeof(dmptr_t);
+    info_size = sizeof(*info) + MAX_NR_CANDS * dmm_get_interleave_nr(dmm) * sizeof(dmptr_t);
 
     info = dm_push(ctx, NULL, info_size);
     if (unlikely(!info)) {
@@ -203,13 +421,19 @@ kv_t *kv_init(const char *name, dmcontext_t *ctx, dmm_cli_t *dmm, dmlocktab_t *l
     kv->ht_nr_ents = info->ht_nr_ents;
     kv->val_len = info->val_len;
     kv->slot_len = kv->val_len + sizeof(struct slot_hdr);
+    kv->bucket_nr_slots = info->bucket_nr_slots;
+    kv->bucket_len = kv->slot_len * kv->bucket_nr_slots;
+    kv->max_kick_depth = info->max_kick_depth;
+    kv->stash_nr_slots = info->stash_nr_slots;
+    kv->stash_len = kv->slot_len * kv->stash_nr_slots;
+    kv->nr_cands = kv->stash_nr_slots ? MAX_NR_CANDS : 2;
     memcpy(kv->hf, info->hf, sizeof(info->hf));
     memcpy(&kv->shard_hf, &info->shard_hf, sizeof(info->shard_hf));
 
     /* allocate hash tables in an interleaved manner (to gain parallelism) */
     kv->interleave_nr = dmm_get_interleave_nr(dmm);
 
-    for (i = 0; i < 2; i++) {
+    for (i = 0; i < MAX_NR_CANDS; i++) {
         kv->ht[i] = malloc(kv->interleave_nr * sizeof(dmptr_t));
         if (unlikely(!kv->ht[i])) {
             return NULL;
@@ -222,505 +446,2344 @@ kv_t *kv_init(const char *name, dmcontext_t *ctx, dmm_cli_t *dmm, dmlocktab_t *l
 
     ethane_assert(kv->ht_nr_ents % kv->nr_shards == 0);
     kv->ht_nr_ents_per_shard = kv->ht_nr_ents / kv->nr_shards;
+    kv->ht_nr_buckets_per_shard = kv->ht_nr_ents_per_shard / kv->bucket_nr_slots;
+
+    kv->shard_dir = info->shard_dir;
+    kv->dirs = malloc(kv->nr_shards * sizeof(*kv->dirs));
+    if (unlikely(!kv->dirs)) {
+        return NULL;
+    }
+
+    /* register before reading the directory, so no doubling retires tables we may hold */
+    kv->dir_acks = info->dir_acks;
+    kv->cli_id = dm_get_cli_id(ctx);
+    ethane_assert(kv->cli_id >= 0 && kv->cli_id < MAX_NR_CLIS);
+
+    ret = read_dir_gen(kv, &kv->dir_gen);
+    if (likely(ret >= 0)) {
+        ret = write_dir_ack(kv, kv->dir_gen);
+    }
+    if (unlikely(ret < 0)) {
+        return NULL;
+    }
+
+    dirs = dm_push(ctx, NULL, kv->nr_shards * sizeof(*dirs));
+    if (unlikely(!dirs)) {
+        return NULL;
+    }
+
+    ret = dm_copy_from_remote(ctx, dirs, kv->shard_dir, kv->nr_shards * sizeof(*dirs), DMFLAG_ACK);
+    if (unlikely(ret < 0)) {
+        return NULL;
+    }
+
+    ret = dm_wait_ack(ctx, 1);
+    if (unlikely(ret < 0)) {
+        return NULL;
+    }
+
+    memcpy(kv->dirs, dirs, kv->nr_shards * sizeof(*dirs));
 
     kv->nr_max_outstanding_reqs = nr_max_outstanding_reqs;
 
+    kv->cache_nr_ents = cache_nr_ents;
+    kv->cache_staleness_us = cache_staleness_us;
+    if (cache_nr_ents) {
+        kv->cache = calloc(cache_nr_ents, sizeof(*kv->cache));
+        kv->cache_slots = malloc(cache_nr_ents * KV_CACHE_NR_SLOTS * kv->slot_len);
+        if (unlikely(!kv->cache || !kv->cache_slots)) {
+            return NULL;
+        }
+    }
+
     kv->rnd_seed = get_rand_seed();
 
     sprintf(kv->label, "cli%06d", dm_get_cli_id(ctx));
 
-    pr_info("init done: kv=%s,entn=%lu,shardn=%d", name, kv->ht_nr_ents, kv->nr_shards);
+    pr_info("init done: kv=%s,entn=%lu,shardn=%d,bucket_slotn=%d,kick_depth=%d,stash_slotn=%d,cache_entn=%d",
+            name, kv->ht_nr_ents, kv->nr_shards, kv->bucket_nr_slots, kv->max_kick_depth, kv->stash_nr_slots,
+            kv->cache_nr_ents);
 
     return kv;
 }
 
-static inline uint32_t get_pos_by_hash(kv_t *kv, uint64_t hash) {
-    return hash % kv->ht_nr_ents_per_shard;
+/* Keys are hashed once into a path state (see pathdesc.h), then finalized per use. */
+static inline uint64_t get_key_state(kv_vec_item_t *item) {
+    return item->has_key_state ? item->key_state : path_state(item->key, item->key_len);
+}
+
+static inline uint64_t get_key_hash(kv_t *kv, int ht, uint64_t state) {
+    return TAB_finalize(&kv->hf[ht], state);
+}
+
+/* Positions are bucket indices within a shard. */
+static inline uint32_t get_pos_by_hash(kv_t *kv, uint64_t hash, int shard) {
+    return hash % kv->dirs[shard].nr_buckets;
+}
+
+/*
+ * Since the number of buckets of a shard is always ht_nr_buckets_per_shard * 2^k,
+ * hash % nr_buckets == hash % ht_nr_buckets_per_shard + ht_nr_buckets_per_shard * (ext % 2^k),
+ * where ext = hash / ht_nr_buckets_per_shard.
+ */
+static inline uint32_t get_hash_ext(kv_t *kv, const uint64_t hashes[2]) {
+    return ((hashes[0] / kv->ht_nr_buckets_per_shard) & 0xff) |
+           (((hashes[1] / kv->ht_nr_buckets_per_shard) & 0xff) << 8);
+}
+
+static inline int hash_ext_bit(uint32_t hash_ext, int ht, int k) {
+    return (int) ((hash_ext >> (8 * ht + k)) & 1);
 }
 
-static inline dmptr_t loc_by_pos(kv_t *kv, dmptr_t *ht, uint32_t pos, int shard) {
+static inline dmptr_t loc_by_pos(kv_t *kv, int ht, uint32_t pos, int shard) {
     size_t start, off;
+    if (kv->dirs[shard].ht[ht] != DMPTR_NULL) {
+        return kv->dirs[shard].ht[ht] + pos * kv->bucket_len;
+    }
     start = shard * kv->ht_nr_ents_per_shard * kv->slot_len;
-    off = pos * kv->slot_len;
-    return dmm_get_ptr_interleaved(kv->dmm, ht, kv->ht_nr_ents * kv->slot_len, start + off);
+    off = pos * kv->bucket_len;
+    return dmm_get_ptr_interleaved(kv->dmm, kv->ht[ht], kv->ht_nr_ents * kv->slot_len, start + off);
 }
 
-static inline int get_key_shard(kv_t *kv, const char *key, size_t key_len) {
-    uint64_t hash;
-    hash = TAB_finalize(&kv->shard_hf, TAB_process(&kv->shard_hf, (const uint8_t *) key, key_len, 0));
-    return (int) (hash % kv->nr_shards);
+/* Number of bytes starting from bucket @pos which are contiguous in remote memory */
+static inline size_t contig_len_by_pos(kv_t *kv, int ht, uint32_t pos, int shard) {
+    size_t strip_size, off, len;
+    len = (kv->dirs[shard].nr_buckets - pos) * kv->bucket_len;
+    if (kv->dirs[shard].ht[ht] != DMPTR_NULL) {
+        return len;
+    }
+    strip_size = dmm_get_strip_size(kv->dmm, kv->ht_nr_ents * kv->slot_len);
+    off = shard * kv->ht_nr_ents_per_shard * kv->slot_len + pos * kv->bucket_len;
+    return min(len, strip_size - off % strip_size);
 }
 
-static int kv_put_at(kv_t *kv, int dst_ht, uint32_t dst_pos, uint32_t pair_pos,
-                     const char *root_key, const void *val, int shard) {
-    struct slot_hdr *dst_slot_hdr, new_dst_slot_hdr;
-    uint32_t dst_pair_slot_pos;
-    dmptr_t dst_slot_addr;
-    int ret, cli_id;
-    void *buf;
+static inline dmptr_t loc_shard_dir(kv_t *kv, int shard) {
+    return kv->shard_dir + shard * sizeof(struct kv_shard_dir);
+}
 
-    dst_slot_hdr = buf = dm_push(kv->ctx, NULL, kv->slot_len);
-    if (unlikely(!buf)) {
-        ret = -ENOMEM;
-        goto out;
-    }
+static int refresh_shard_dir(kv_t *kv, int shard) {
+    struct kv_shard_dir *dir;
+    int ret;
 
-    dst_slot_addr = loc_by_pos(kv, kv->ht[dst_ht], dst_pos, shard);
+    dm_mark(kv->ctx);
 
-    /* read the original slot */
-    ret = dm_copy_from_remote(kv->ctx, dst_slot_hdr, dst_slot_addr, kv->slot_len, DMFLAG_ACK);
+    ret = dm_read(kv->ctx, dir, loc_shard_dir(kv, shard), DMFLAG_ACK);
     if (unlikely(ret < 0)) {
-        pr_err("kv_put: failed to read data");
         goto out;
     }
 
-    /* wait for data read completion */
     ret = dm_wait_ack(kv->ctx, 1);
     if (unlikely(ret < 0)) {
-        pr_err("kv_put: failed to wait for data read completion");
         goto out;
     }
 
-    /* kick out if used */
-    if (unlikely(dst_slot_hdr->used)) {
-        dst_pair_slot_pos = dst_slot_hdr->pair_pos;
-
-        ret = kv_put_at(kv, 1 - dst_ht, dst_pair_slot_pos, dst_pos, root_key, dst_slot_hdr + 1, shard);
-        if (unlikely(ret < 0)) {
-            pr_err("kv_put: failed to put data");
-            goto out;
-        }
+    if (dir->ver != kv->dirs[shard].ver) {
+        pr_debug("shard %d dir updated: ver=%u,nr_buckets=%lu", shard, dir->ver, dir->nr_buckets);
     }
+    kv->dirs[shard] = *dir;
 
-    /* prepare new slot hdr */
-    new_dst_slot_hdr.used = true;
-    new_dst_slot_hdr.ver = dst_slot_hdr->ver + 1;
-    new_dst_slot_hdr.pair_pos = pair_pos;
+out:
+    dm_pop(kv->ctx);
+    return ret;
+}
 
-    memcpy(buf, &new_dst_slot_hdr, sizeof(new_dst_slot_hdr));
-    memcpy(buf + sizeof(new_dst_slot_hdr), val, kv->val_len);
+static int refresh_all_shard_dirs(kv_t *kv) {
+    struct kv_shard_dir *dirs;
+    int ret;
 
-    /* atomic put */
-    ret = dm_copy_to_remote(kv->ctx, dst_slot_addr, buf, kv->slot_len, DMFLAG_ACK);
+    dm_mark(kv->ctx);
+
+    dirs = dm_push(kv->ctx, NULL, kv->nr_shards * sizeof(*dirs));
+    if (unlikely(!dirs)) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    ret = dm_copy_from_remote(kv->ctx, dirs, kv->shard_dir, kv->nr_shards * sizeof(*dirs), DMFLAG_ACK);
     if (unlikely(ret < 0)) {
-        pr_err("kv_put: failed to write data");
         goto out;
     }
 
-    /* wait for data write completion */
     ret = dm_wait_ack(kv->ctx, 1);
     if (unlikely(ret < 0)) {
-        pr_err("kv_put: failed to wait for data write completion");
         goto out;
     }
 
-    cli_id = dm_get_cli_id(kv->ctx);
-    tracepoint_sample(ethane, kv_put_at, cli_id, shard, root_key, dst_ht, dst_pos, pair_pos);
+    memcpy(kv->dirs, dirs, kv->nr_shards * sizeof(*dirs));
 
 out:
+    dm_pop(kv->ctx);
     return ret;
 }
 
-static int kv_put_single(kv_t *kv, kv_vec_item_t *item) {
-    int i, dst_ht, shard, ret, cli_id;
-    uint32_t poses[2];
-    const char *key;
-    const void *val;
-    size_t key_len;
-    char *dup;
-
-    key = item->key;
-    key_len = item->key_len;
-    val = item->val;
-
-    dup = strndup(key, key_len);
-
-    shard = get_key_shard(kv, key, key_len);
+/*
+ * Once a doubling has bumped the directory generation, refresh every cached directory entry
+ * and acknowledge the generation, checked every KV_DIR_ACK_INTERVAL ops. Called at the start
+ * of an op, when no access through an older entry is in flight.
+ */
+static int kv_ack_dirs(kv_t *kv) {
+    uint64_t gen;
+    int ret = 0;
 
-    /* compute hashes and poses */
-    for (i = 0; i < KV_NR_POSSIBLE_VALS; i++) {
-        poses[i] = get_pos_by_hash(kv, TAB_finalize(&kv->hf[i],
-                                                    TAB_process(&kv->hf[i], (const uint8_t *) key, key_len, 0)));
+    if (++kv->nr_ops_since_ack < KV_DIR_ACK_INTERVAL) {
+        goto out;
     }
+    kv->nr_ops_since_ack = 0;
 
-    /* choose dst table */
-    dst_ht = rand_r(&kv->rnd_seed) % 2;
-
-    dmlock_acquire(kv->locktab, shard);
+    ret = read_dir_gen(kv, &gen);
+    if (unlikely(ret < 0) || gen == kv->dir_gen) {
+        goto out;
+    }
 
-    /* put into dst table */
-    ret = kv_put_at(kv, dst_ht, poses[dst_ht], poses[1 - dst_ht], dup, val, shard);
+    ret = refresh_all_shard_dirs(kv);
     if (unlikely(ret < 0)) {
-        pr_err("kv_put: failed to put data");
         goto out;
     }
 
-    dmlock_release(kv->locktab, shard);
-
-    item->err = 0;
-
-    cli_id = dm_get_cli_id(kv->ctx);
-    tracepoint_sample(ethane, kv_op, cli_id, shard, TRACE_KV_OP_PUT, dup, poses[0], poses[1]);
+    ret = write_dir_ack(kv, gen);
+    if (likely(ret >= 0)) {
+        kv->dir_gen = gen;
+    }
 
 out:
-    free(dup);
     return ret;
 }
 
-int kv_put_batch(kv_t *kv, int vec_len, kv_vec_item_t *kv_vec) {
-    int i, ret = 0;
-    for (i = 0; i < vec_len; i++) {
-        ret = kv_put_single(kv, kv_vec + i);
-        if (unlikely(ret < 0)) {
-            goto out;
-        }
-    }
-out:
-    return ret;
+static inline dmptr_t loc_stash(kv_t *kv, int shard) {
+    return dmm_get_ptr_interleaved(kv->dmm, kv->ht[STASH_HT], kv->nr_shards * kv->stash_len, shard * kv->stash_len);
 }
 
-static int kv_upd_single(kv_t *kv, kv_vec_item_t *item, void *(*updater)(void *, void *)) {
-    dmptr_t hdr_addr, addrs[2], poses[2];
-    int ret, shard, i, cli_id;
-    struct slot_hdr *hdr[2];
-    const char *key;
-    size_t key_len;
-    uint64_t hash;
-    void *update;
-    char *dup;
+/* Location of the @ht-th candidate bucket (or the stash) of a key */
+static inline dmptr_t loc_cand(kv_t *kv, int ht, uint32_t poses[2], int shard) {
+    return ht == STASH_HT ? loc_stash(kv, shard) : loc_by_pos(kv, ht, poses[ht], shard);
+}
 
-    key = item->key;
-    key_len = item->key_len;
+static inline int cand_nr_slots(kv_t *kv, int ht) {
+    return ht == STASH_HT ? kv->stash_nr_slots : kv->bucket_nr_slots;
+}
 
-    shard = get_key_shard(kv, key, key_len);
+static inline size_t cand_len(kv_t *kv, int ht) {
+    return ht == STASH_HT ? kv->stash_len : kv->bucket_len;
+}
 
-    pr_debug("kv_upd: shard=%d key=%.*s", shard, (int) key_len, key);
+static inline struct slot_hdr *get_slot(kv_t *kv, void *bucket, int i) {
+    return bucket + i * kv->slot_len;
+}
 
-    /* Hash calculation */
-    for (i = 0; i < 2; i++) {
-        hash = TAB_finalize(&kv->hf[i],
-                            TAB_process(&kv->hf[i], (const uint8_t *) key, key_len, 0));
-        poses[i] = get_pos_by_hash(kv, hash);
-        addrs[i] = loc_by_pos(kv, kv->ht[i], poses[i], shard);
-    }
+/*
+ * Slot versions
+ * A writer claims a slot by a CAS on its header word which makes the version odd (busy),
+ * and releases it by writing the slot back with the next (even) version. Busy slots are
+ * neither taken as free nor updated by others, and readers seeing one retry.
+ */
+static inline bool slot_is_busy(struct slot_hdr *hdr) {
+    return hdr->ver & 1;
+}
 
-    dmlock_acquire(kv->locktab, shard);
+static inline bool slot_is_free(struct slot_hdr *hdr) {
+    return !hdr->used && !slot_is_busy(hdr);
+}
 
-    for (i = 0; i < 2; i++) {
-        hdr[i] = dm_push(kv->ctx, NULL, kv->slot_len);
-        if (unlikely(!hdr[i])) {
-            ret = -ENOMEM;
-            goto out;
-        }
+/* Header words are compared as a whole, as the RNIC does */
+static inline bool slot_hdr_eq(const struct slot_hdr *a, const struct slot_hdr *b) {
+    return !memcmp(a, b, sizeof(*a));
+}
 
-        ret = dm_copy_from_remote(kv->ctx, hdr[i], addrs[i], kv->slot_len, 0);
-        if (unlikely(ret < 0)) {
-            goto out;
+static inline int find_free_slot_n(kv_t *kv, void *bucket, int nr_slots) {
+    int i;
+    for (i = 0; i < nr_slots; i++) {
+        if (slot_is_free(get_slot(kv, bucket, i))) {
+            return i;
         }
     }
+    return -1;
+}
 
-    ret = dm_wait_ack(kv->ctx, dm_set_ack_all(kv->ctx));
-    if (unlikely(ret < 0)) {
-        goto out;
-    }
+static inline int find_free_slot(kv_t *kv, void *bucket) {
+    return find_free_slot_n(kv, bucket, kv->bucket_nr_slots);
+}
 
-    item->err = -ENOENT;
+/*
+ * An entry living in table @ht always records its position in the other table
+ * as pair_pos, so a used slot whose pair_pos differs from the key's position in
+ * the other table cannot belong to this key. Stashed entries record their
+ * position in table 0 under the initial geometry, which is stable across resizes.
+ */
+static inline uint32_t get_stash_pair_pos(kv_t *kv, uint32_t poses[2]) {
+    return poses[0] % kv->ht_nr_buckets_per_shard;
+}
 
-    for (i = 0; i < 2; i++) {
-        if (!hdr[i]->used) {
-            continue;
-        }
+static inline bool slot_may_match(kv_t *kv, struct slot_hdr *hdr, uint32_t poses[2], int ht) {
+    return hdr->used && hdr->pair_pos == (ht == STASH_HT ? get_stash_pair_pos(kv, poses) : poses[1 - ht]);
+}
 
-        hdr_addr = addrs[i];
+static inline int get_key_shard(kv_t *kv, uint64_t state) {
+    return (int) (TAB_finalize(&kv->shard_hf, state) % kv->nr_shards);
+}
 
-        update = updater(item->upd_ctx, hdr[i] + 1);
-        if (update == ERR_PTR(-EINVAL)) {
-            pr_debug("kv_upd: %d not match", i);
-            continue;
-        }
+/*
+ * Post a CAS installing @new_hdr into the header word of the slot at @addr, which is
+ * expected to be @hdr. @found receives the word found in remote memory, the CAS
+ * succeeded iff it equals @hdr.
+ */
+static int post_slot_cas(kv_t *kv, dmptr_t addr, const struct slot_hdr *hdr, const struct slot_hdr *new_hdr,
+                         struct slot_hdr **found, dmflag_t flag) {
+    struct slot_hdr *src;
+    int ret;
+
+    *found = dm_push(kv->ctx, hdr, sizeof(*hdr));
+    src = dm_push(kv->ctx, new_hdr, sizeof(*new_hdr));
+    if (unlikely(!*found || !src)) {
+        ret = -ENOMEM;
+        goto out;
+    }
 
-        if (!update) {
-             /* do delete (clear the slot header word) */
-            ret = dm_write(kv->ctx, hdr_addr, (struct slot_hdr) { .used = false }, DMFLAG_ACK);
-            pr_debug("kv_upd: %d do delete", i);
-        } else {
-            /* do update */
-            ret = dm_copy_to_remote(kv->ctx, hdr_addr + sizeof(struct slot_hdr), hdr[i] + 1, kv->val_len, DMFLAG_ACK);
-            pr_debug("kv_upd: %d do update", i);
-        }
-        if (unlikely(ret < 0)) {
-            pr_err("kv_del: failed to delete data");
-            goto out;
-        }
+    ret = dm_cas(kv->ctx, addr, src, *found, sizeof(*hdr), flag);
 
-        /* wait for data write completion */
-        ret = dm_wait_ack(kv->ctx, 1);
-        if (unlikely(ret < 0)) {
-            pr_err("kv_del: failed to wait for data write completion");
-            goto out;
-        }
+out:
+    return ret;
+}
 
-        item->err = 0;
+/* Claim the slot at @addr whose header is @hdr (as read), return -EAGAIN if someone else won. */
+static int claim_slot(kv_t *kv, dmptr_t addr, struct slot_hdr *hdr) {
+    struct slot_hdr new_hdr = *hdr, *found;
+    int ret;
+
+    dm_mark(kv->ctx);
 
-        break;
+    new_hdr.ver++;
+    ret = post_slot_cas(kv, addr, hdr, &new_hdr, &found, DMFLAG_ACK);
+    if (unlikely(ret < 0)) {
+        goto out;
     }
 
-    dmlock_release(kv->locktab, shard);
+    ret = dm_wait_ack(kv->ctx, 1);
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
 
-    cli_id = dm_get_cli_id(kv->ctx);
-    dup = strndup(key, key_len);
-    tracepoint_sample(ethane, kv_op, cli_id, shard, TRACE_KV_OP_UPD, dup, poses[0], poses[1]);
-    free(dup);
+    if (!slot_hdr_eq(found, hdr)) {
+        pr_debug("kv: lost the race on slot %lx", addr);
+        ret = -EAGAIN;
+        goto out;
+    }
 
-out:
-    return ret;
-}
+    hdr->ver = new_hdr.ver;
 
-int kv_upd_batch(kv_t *kv, int vec_len, kv_vec_item_t *kv_vec, void *(*updater)(void *, void *)) {
-    int i, ret = 0;
-    for (i = 0; i < vec_len; i++) {
-        ret = kv_upd_single(kv, kv_vec + i, updater);
-        if (unlikely(ret < 0)) {
-            goto out;
-        }
-    }
 out:
+    dm_pop(kv->ctx);
     return ret;
 }
 
-static int do_kv_get_batch_approx(kv_t *kv, int vec_len, kv_vec_item_t *kv_vec) {
-    struct slot_hdr *hdr1[vec_len][2], *hdr2[vec_len][2];
-    int i, j, shard, ret = 0, valid_cnt = 0, rnd;
-    dmptr_t addrs[vec_len][2];
-    bool valid[vec_len];
-    kv_vec_item_t *item;
-    uint64_t hash;
+/* Write a claimed slot and release it */
+static int write_slot(kv_t *kv, dmptr_t addr, struct slot_hdr *slot, uint32_t pair_pos, uint32_t hash_ext,
+                      const void *val) {
+    int ret;
 
-    /* It's caller's responsibility to mark and pop buffer! */
+    ethane_assert(slot_is_busy(slot));
 
-    memset(valid, 0, sizeof(valid));
+    slot->used = true;
+    slot->ver++;
+    slot->hash_ext = hash_ext;
+    slot->pair_pos = pair_pos;
+    memmove(slot + 1, val, kv->val_len);
+
+    /* atomic put */
+    ret = dm_copy_to_remote(kv->ctx, addr, slot, kv->slot_len, DMFLAG_ACK);
+    if (unlikely(ret < 0)) {
+        pr_err("kv_put: failed to write data");
+        goto out;
+    }
+
+    /* wait for data write completion */
+    ret = dm_wait_ack(kv->ctx, 1);
+    if (unlikely(ret < 0)) {
+        pr_err("kv_put: failed to wait for data write completion");
+    }
+
+out:
+    return ret;
+}
+
+/* Release a claimed slot as free */
+static int release_slot(kv_t *kv, dmptr_t addr, struct slot_hdr *slot) {
+    int ret;
+
+    *slot = (struct slot_hdr) { .used = false, .ver = slot->ver + 1 };
+
+    ret = dm_copy_to_remote(kv->ctx, addr, slot, sizeof(*slot), DMFLAG_ACK);
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
+
+    ret = dm_wait_ack(kv->ctx, 1);
+
+out:
+    return ret;
+}
+
+/* Put into the per-shard stash, the last resort when no cuckoo path is found. */
+static int kv_put_stash(kv_t *kv, uint32_t poses[2], uint32_t hash_ext, const char *root_key, const void *val,
+                        int shard) {
+    dmptr_t stash_addr;
+    void *stash;
+    int ret, i;
+
+    if (unlikely(!kv->stash_nr_slots)) {
+        pr_err("kv_put: no cuckoo path found for %s and stash disabled", root_key);
+        ret = -ENOSPC;
+        goto out;
+    }
+
+    stash_addr = loc_stash(kv, shard);
+
+    stash = dm_push(kv->ctx, NULL, kv->stash_len);
+    if (unlikely(!stash)) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+retry:
+    ret = dm_copy_from_remote(kv->ctx, stash, stash_addr, kv->stash_len, DMFLAG_ACK);
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
+
+    ret = dm_wait_ack(kv->ctx, 1);
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
+
+    i = find_free_slot_n(kv, stash, kv->stash_nr_slots);
+    if (unlikely(i < 0)) {
+        pr_err("kv_put: stash of shard %d is full", shard);
+        ret = -ENOSPC;
+        goto out;
+    }
+
+    ret = claim_slot(kv, stash_addr + i * kv->slot_len, get_slot(kv, stash, i));
+    if (ret == -EAGAIN) {
+        goto retry;
+    }
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
+
+    pr_warn("kv_put: %s goes to stash slot %d of shard %d", root_key, i, shard);
+
+    ret = write_slot(kv, stash_addr + i * kv->slot_len, get_slot(kv, stash, i), get_stash_pair_pos(kv, poses),
+                     hash_ext, val);
+
+out:
+    return ret;
+}
+
+/*
+ * Cuckoo insertion with bounded BFS
+ *
+ * Search the shortest cuckoo path from the two candidate buckets of the key to a
+ * bucket with a free slot, visiting at most max_kick_depth levels. The buckets of
+ * a whole level are fetched in one batch. Once found, the moves are executed in
+ * reverse order (from the free slot back to the root), so that every entry is
+ * always present in at least one slot. If no path is found, the new entry goes to
+ * the per-shard stash.
+ *
+ * Moves are done under the shard lock, but lock-free writers may still touch the
+ * path, so every slot is claimed before written: the free slot first, then each
+ * victim before it is copied, which pins it until its slot is overwritten by the
+ * next move. Losing a claim restarts the search (-EAGAIN).
+ */
+struct bfs_node {
+    int ht;
+    uint32_t pos;
+    dmptr_t addr;
+    void *bucket;
+    /* parent node, and the slot in the parent whose occupant moves into this bucket */
+    int parent, parent_slot;
+};
+
+static int do_kv_put_bfs(kv_t *kv, uint32_t poses[2], uint32_t hash_ext, const char *root_key, const void *val,
+                         int shard) {
+    int nr_nodes = 0, level_start, level_end, depth, i, j, k, free_slot = -1, ret = 0, cli_id;
+    struct bfs_node *nodes, *node, *parent;
+    struct slot_hdr *victim, *dst;
+    dmptr_t src_addr, dst_addr;
+    uint32_t pair_pos;
+
+    nodes = malloc(MAX_BFS_NR_NODES * sizeof(*nodes));
+    if (unlikely(!nodes)) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    /* level 0: two candidate buckets of the key */
+    for (i = 0; i < 2; i++) {
+        nodes[nr_nodes++] = (struct bfs_node) {
+            .ht = i, .pos = poses[i], .addr = loc_by_pos(kv, i, poses[i], shard), .parent = -1
+        };
+    }
+
+    for (depth = 0, level_start = 0; depth <= kv->max_kick_depth; depth++) {
+        level_end = nr_nodes;
+        if (level_start == level_end) {
+            break;
+        }
+
+        /* fetch all the buckets of this level at once */
+        for (i = level_start; i < level_end; i++) {
+            nodes[i].bucket = dm_push(kv->ctx, NULL, kv->bucket_len);
+            if (unlikely(!nodes[i].bucket)) {
+                ret = -ENOMEM;
+                goto out_free;
+            }
+
+            ret = dm_copy_from_remote(kv->ctx, nodes[i].bucket, nodes[i].addr, kv->bucket_len, 0);
+            if (unlikely(ret < 0)) {
+                goto out_free;
+            }
+        }
+
+        ret = dm_wait_ack(kv->ctx, dm_set_ack_all(kv->ctx));
+        if (unlikely(ret < 0)) {
+            goto out_free;
+        }
+
+        for (i = level_start; i < level_end; i++) {
+            free_slot = find_free_slot(kv, nodes[i].bucket);
+            if (free_slot >= 0) {
+                node = &nodes[i];
+                goto found;
+            }
+        }
+
+        if (depth == kv->max_kick_depth) {
+            break;
+        }
+
+        /* expand: every occupant may move to its pair bucket in another table */
+        for (i = level_start; i < level_end; i++) {
+            for (j = 0; j < kv->bucket_nr_slots && nr_nodes < MAX_BFS_NR_NODES; j++) {
+                victim = get_slot(kv, nodes[i].bucket, j);
+
+                /* slots being written by others can not be moved */
+                if (slot_is_busy(victim)) {
+                    continue;
+                }
+
+                node = &nodes[nr_nodes];
+                node->ht = 1 - nodes[i].ht;
+                node->pos = victim->pair_pos;
+                node->addr = loc_by_pos(kv, node->ht, node->pos, shard);
+                node->parent = i;
+                node->parent_slot = j;
+
+                /* do not visit a bucket twice, or a move may clobber another one on the path */
+                for (k = 0; k < nr_nodes; k++) {
+                    if (nodes[k].addr == node->addr) {
+                        break;
+                    }
+                }
+                if (k == nr_nodes) {
+                    nr_nodes++;
+                }
+            }
+        }
+
+        level_start = level_end;
+    }
+
+    pr_debug("kv_put: no cuckoo path within depth %d for %s", kv->max_kick_depth, root_key);
+
+    ret = kv_put_stash(kv, poses, hash_ext, root_key, val, shard);
+    goto out_free;
+
+found:
+    cli_id = dm_get_cli_id(kv->ctx);
+
+    dst_addr = node->addr + free_slot * kv->slot_len;
+    dst = get_slot(kv, node->bucket, free_slot);
+
+    ret = claim_slot(kv, dst_addr, dst);
+    if (unlikely(ret < 0)) {
+        goto out_free;
+    }
+
+    /* execute the moves in reverse order */
+    for (; node->parent >= 0; node = parent) {
+        parent = &nodes[node->parent];
+        src_addr = parent->addr + node->parent_slot * kv->slot_len;
+        victim = get_slot(kv, parent->bucket, node->parent_slot);
+
+        ret = claim_slot(kv, src_addr, victim);
+        if (unlikely(ret < 0)) {
+            release_slot(kv, dst_addr, dst);
+            goto out_free;
+        }
+
+        /* the victim now lives in node, its pair is the bucket it comes from */
+        ret = write_slot(kv, dst_addr, dst, parent->pos, victim->hash_ext, victim + 1);
+        if (unlikely(ret < 0)) {
+            goto out_free;
+        }
+
+        tracepoint_sample(ethane, kv_put_at, cli_id, shard, root_key, node->ht, node->pos, parent->pos);
+
+        /* the victim's old slot is ours now */
+        dst_addr = src_addr;
+        dst = victim;
+    }
+
+    /* finally, put the new entry into the root bucket */
+    pair_pos = poses[1 - node->ht];
+    ret = write_slot(kv, dst_addr, dst, pair_pos, hash_ext, val);
+    if (unlikely(ret < 0)) {
+        goto out_free;
+    }
+
+    tracepoint_sample(ethane, kv_put_at, cli_id, shard, root_key, node->ht, node->pos, pair_pos);
+
+out_free:
+    free(nodes);
+
+out:
+    return ret;
+}
+
+static int kv_put_bfs(kv_t *kv, uint32_t poses[2], uint32_t hash_ext, const char *root_key, const void *val,
+                      int shard) {
+    int ret;
+
+    do {
+        dm_mark(kv->ctx);
+        ret = do_kv_put_bfs(kv, poses, hash_ext, root_key, val, shard);
+        dm_pop(kv->ctx);
+    } while (ret == -EAGAIN);
+
+    return ret;
+}
+
+static inline struct kv_cache_ent *kv_cache_ent(kv_t *kv, const uint64_t hashes[2]) {
+    return kv->cache_nr_ents ? &kv->cache[hashes[0] % kv->cache_nr_ents] : NULL;
+}
+
+static inline void *kv_cache_slot(kv_t *kv, struct kv_cache_ent *ent, int i) {
+    return kv->cache_slots + ((ent - kv->cache) * KV_CACHE_NR_SLOTS + i) * kv->slot_len;
+}
+
+static inline bool kv_cache_hit(kv_t *kv, struct kv_cache_ent *ent, const uint64_t hashes[2], int shard) {
+    return ent && ent->nr_slots && ent->confirmed && ent->hashes[0] == hashes[0] &&
+           ent->hashes[1] == hashes[1] && ent->dir_ver == kv->dirs[shard].ver;
+}
+
+static void kv_cache_drop(kv_t *kv, const uint64_t hashes[2]) {
+    struct kv_cache_ent *ent = kv_cache_ent(kv, hashes);
+    if (ent && ent->hashes[0] == hashes[0] && ent->hashes[1] == hashes[1]) {
+        ent->nr_slots = 0;
+    }
+}
+
+/*
+ * Batched put/update
+ *
+ * Writers do not take the shard lock in the common case. In one round, the buckets of up
+ * to nr_max_outstanding_reqs items are fetched in one doorbell batch along with their shard
+ * directory entries, every item claims its target slot by a CAS on the slot header word
+ * (all the CASes go in one batch), and the claimed slots are written and released in
+ * another batch. A delete is done by the CAS alone. Items losing a CAS go to the next round.
+ *
+ * A migrator marks the directory entry (odd version) before copying the shard, so items
+ * re-read their entries after the writes: a changed version means that the write may have
+ * missed the copy, and the item is redone under the shard lock (puts skip an identical
+ * value, and updaters must be idempotent). Items that need cuckoo moves, or whose shard is
+ * being resized, also fall back to the lock, in groups by shard.
+ */
+
+#define KV_LOCKFREE_MAX_NR_RNDS     8
+
+enum {
+    ENT_PENDING,
+    ENT_DONE,
+    /* applied, waiting for the directory re-read */
+    ENT_CHECK,
+    /* not found, waiting for the bucket re-read */
+    ENT_VERIFY,
+    /* fall back to the shard lock */
+    ENT_NEED_LOCK,
+    /* both buckets full, search a cuckoo path (under the lock) */
+    ENT_NEED_KICK,
+};
+
+struct kv_batch_ent {
+    kv_vec_item_t *item;
+    int shard;
+    uint64_t hashes[2];
+    uint32_t hash_ext;
+    uint32_t poses[2];
+    dmptr_t addrs[MAX_NR_CANDS];
+    void *bucket[MAX_NR_CANDS];
+    void *recheck[MAX_NR_CANDS];
+
+    int state;
+
+    /* directory version the entry is located with, and the entry re-read */
+    uint32_t dir_ver;
+    struct kv_shard_dir *dir;
+
+    /* slot claimed in this round: its table, address, local copy and header word (expected/found) */
+    int slot_ht;
+    dmptr_t slot_addr;
+    struct slot_hdr *slot, expected, *found;
+    bool is_del;
+
+    /* change of the number of items of the shard, and if it has been accounted */
+    int delta;
+    bool counted;
+};
+
+static inline bool shard_is_migrating(struct kv_shard_dir *dir) {
+    return dir->ver & 1;
+}
+
+static int batch_ent_cmp(const void *a, const void *b) {
+    const struct kv_batch_ent *x = a, *y = b;
+    if (x->shard != y->shard) {
+        return (x->shard > y->shard) - (x->shard < y->shard);
+    }
+    /* keep the original order within a shard */
+    return (x->item > y->item) - (x->item < y->item);
+}
+
+static struct kv_batch_ent *prepare_batch(kv_t *kv, int vec_len, kv_vec_item_t *kv_vec) {
+    struct kv_batch_ent *ents, *ent;
+    uint64_t state;
+    int i, j;
+
+    ents = calloc(vec_len, sizeof(*ents));
+    if (unlikely(!ents)) {
+        return NULL;
+    }
+
+    for (i = 0; i < vec_len; i++) {
+        ent = &ents[i];
+        ent->item = &kv_vec[i];
+        state = get_key_state(ent->item);
+        ent->shard = get_key_shard(kv, state);
+        for (j = 0; j < 2; j++) {
+            ent->hashes[j] = get_key_hash(kv, j, state);
+        }
+        ent->hash_ext = get_hash_ext(kv, ent->hashes);
+    }
+
+    qsort(ents, vec_len, sizeof(*ents), batch_ent_cmp);
+
+    return ents;
+}
+
+/* Locate an entry with the cached shard directory */
+static void locate_batch_ent(kv_t *kv, struct kv_batch_ent *ent) {
+    int j;
+
+    for (j = 0; j < 2; j++) {
+        ent->poses[j] = get_pos_by_hash(kv, ent->hashes[j], ent->shard);
+    }
+    for (j = 0; j < kv->nr_cands; j++) {
+        ent->addrs[j] = loc_cand(kv, j, ent->poses, ent->shard);
+    }
+}
+
+/*
+ * Read the first @nr_cands candidate buckets of the pending entries in one batch. Entries
+ * sharing a bucket share the local copy, so that slots claimed by an earlier entry are
+ * visible to later ones.
+ */
+static int fetch_batch_buckets(kv_t *kv, int nr, struct kv_batch_ent *ents, int nr_cands) {
+    int i, j, k, l, ret = 0;
+
+    for (i = 0; i < nr; i++) {
+        if (ents[i].state != ENT_PENDING) {
+            continue;
+        }
+
+        for (j = 0; j < nr_cands; j++) {
+            ents[i].bucket[j] = NULL;
+            for (k = 0; k < i && !ents[i].bucket[j]; k++) {
+                if (ents[k].state != ENT_PENDING) {
+                    continue;
+                }
+                for (l = 0; l < nr_cands; l++) {
+                    if (ents[k].addrs[l] == ents[i].addrs[j]) {
+                        ents[i].bucket[j] = ents[k].bucket[l];
+                        break;
+                    }
+                }
+            }
+            if (ents[i].bucket[j]) {
+                continue;
+            }
+
+            ents[i].bucket[j] = dm_push(kv->ctx, NULL, cand_len(kv, j));
+            if (unlikely(!ents[i].bucket[j])) {
+                ret = -ENOMEM;
+                goto out;
+            }
+
+            ret = dm_copy_from_remote(kv->ctx, ents[i].bucket[j], ents[i].addrs[j], cand_len(kv, j), 0);
+            if (unlikely(ret < 0)) {
+                goto out;
+            }
+        }
+    }
+
+    ret = dm_wait_ack(kv->ctx, dm_set_ack_all(kv->ctx));
+
+out:
+    return ret;
+}
+
+static void trace_batch_ent(kv_t *kv, struct kv_batch_ent *ent, int op) {
+    int cli_id = dm_get_cli_id(kv->ctx);
+    char *dup = strndup(ent->item->key, ent->item->key_len);
+    tracepoint_sample(ethane, kv_op, cli_id, ent->shard, op, dup, ent->poses[0], ent->poses[1]);
+    free(dup);
+}
+
+static void finish_batch_ent(kv_t *kv, struct kv_batch_ent *ent, int err, bool is_upd) {
+    kv_cache_drop(kv, ent->hashes);
+    ent->state = ENT_DONE;
+    ent->item->err = err;
+    trace_batch_ent(kv, ent, is_upd ? TRACE_KV_OP_UPD : TRACE_KV_OP_PUT);
+}
+
+static bool batch_ent_unchanged(kv_t *kv, struct kv_batch_ent *ent) {
+    int j, k;
+
+    for (j = 0; j < kv->nr_cands; j++) {
+        for (k = 0; k < cand_nr_slots(kv, j); k++) {
+            if (get_slot(kv, ent->bucket[j], k)->ver != get_slot(kv, ent->recheck[j], k)->ver) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+/* Post the CAS claiming @hdr (in a local bucket copy) for @ent, and make it busy locally. */
+static int post_ent_claim(kv_t *kv, struct kv_batch_ent *ent, int ht, dmptr_t addr, struct slot_hdr *hdr,
+                          bool is_del) {
+    struct slot_hdr new_hdr = *hdr;
+
+    ent->slot_ht = ht;
+    ent->slot_addr = addr;
+    ent->slot = hdr;
+    ent->expected = *hdr;
+    ent->is_del = is_del;
+
+    if (is_del) {
+        new_hdr = (struct slot_hdr) { .used = false, .ver = hdr->ver + 2 };
+    } else {
+        new_hdr.ver++;
+    }
+
+    /* later entries sharing the bucket copy must not take the same slot */
+    hdr->ver++;
+
+    return post_slot_cas(kv, addr, &ent->expected, &new_hdr, &ent->found, 0);
+}
+
+static int claim_put_slot(kv_t *kv, struct kv_batch_ent *ent, bool locked) {
+    struct slot_hdr *hdr;
+    int ht, slot, j, k;
+
+    /* a redone put may have made it before the shard was copied */
+    for (j = 0; locked && j < kv->nr_cands; j++) {
+        for (k = 0; k < cand_nr_slots(kv, j); k++) {
+            hdr = get_slot(kv, ent->bucket[j], k);
+            if (slot_may_match(kv, hdr, ent->poses, j) && !memcmp(hdr + 1, ent->item->val, kv->val_len)) {
+                pr_debug("kv_put: %d/%d already there", j, k);
+                finish_batch_ent(kv, ent, 0, false);
+                return 0;
+            }
+        }
+    }
+
+    /* choose dst table, prefer a free slot in either bucket */
+    ht = rand_r(&kv->rnd_seed) % 2;
+    slot = find_free_slot(kv, ent->bucket[ht]);
+    if (slot < 0) {
+        ht = 1 - ht;
+        slot = find_free_slot(kv, ent->bucket[ht]);
+    }
+
+    if (slot < 0) {
+        ent->state = locked ? ENT_NEED_KICK : ENT_NEED_LOCK;
+        return 0;
+    }
+
+    hdr = get_slot(kv, ent->bucket[ht], slot);
+    return post_ent_claim(kv, ent, ht, ent->addrs[ht] + slot * kv->slot_len, hdr, false);
+}
+
+static int claim_upd_slot(kv_t *kv, struct kv_batch_ent *ent, void *(*updater)(void *, void *), bool locked) {
+    struct slot_hdr *hdr;
+    bool busy = false;
+    void *update;
+    int j, k;
+
+    for (j = 0; j < kv->nr_cands; j++) {
+        for (k = 0; k < cand_nr_slots(kv, j); k++) {
+            hdr = get_slot(kv, ent->bucket[j], k);
+            if (!slot_may_match(kv, hdr, ent->poses, j)) {
+                continue;
+            }
+
+            if (slot_is_busy(hdr)) {
+                busy = true;
+                continue;
+            }
+
+            update = updater(ent->item->upd_ctx, hdr + 1);
+            if (update == ERR_PTR(-EINVAL)) {
+                pr_debug("kv_upd: %d/%d not match", j, k);
+                continue;
+            }
+
+            if (update && update != hdr + 1) {
+                memcpy(hdr + 1, update, kv->val_len);
+            }
+
+            pr_debug("kv_upd: %d/%d do %s", j, k, update ? "update" : "delete");
+
+            return post_ent_claim(kv, ent, j, ent->addrs[j] + k * kv->slot_len, hdr, !update);
+        }
+    }
+
+    /* the entry may be in a busy slot, retry */
+    if (busy) {
+        return 0;
+    }
+
+    /* cuckoo moves are done under the lock, but may hide the entry from a lock-free read */
+    if (locked) {
+        finish_batch_ent(kv, ent, -ENOENT, true);
+    } else {
+        ent->state = ENT_VERIFY;
+    }
+
+    return 0;
+}
+
+/* Account the items put (deleted) by @ents into the loads of their shards, which drive resizing. */
+static int post_nr_items_faa(kv_t *kv, int nr, struct kv_batch_ent *ents) {
+    int start, end, shard, ret = 0;
+    long delta, *add;
+
+    for (start = 0; start < nr; start = end) {
+        shard = ents[start].shard;
+        delta = 0;
+        for (end = start; end < nr && ents[end].shard == shard; end++) {
+            if (ents[end].delta && !ents[end].counted) {
+                delta += ents[end].delta;
+                ents[end].counted = true;
+            }
+        }
+
+        if (!delta) {
+            continue;
+        }
+
+        add = dm_push(kv->ctx, &delta, sizeof(delta));
+        if (unlikely(!add)) {
+            ret = -ENOMEM;
+            break;
+        }
+
+        ret = dm_faa(kv->ctx, loc_shard_dir(kv, shard) + offsetof(struct kv_shard_dir, nr_items),
+                     add, sizeof(*add), 0);
+        if (unlikely(ret < 0)) {
+            break;
+        }
+    }
+
+    return ret;
+}
+
+/*
+ * One round over the pending entries: fetch, claim, write (and check). With @locked, the
+ * shard lock is held, so that the shard is neither resized nor rearranged by cuckoo moves
+ * meanwhile, and only lock-free writers may race with us. Return the number of entries
+ * left pending.
+ */
+static int do_kv_batch_round(kv_t *kv, int nr, struct kv_batch_ent *ents, void *(*updater)(void *, void *),
+                             bool locked) {
+    int nr_cands = updater || locked ? kv->nr_cands : 2, i, j, ret;
+    struct kv_batch_ent *ent;
+    struct slot_hdr *hdr;
+
+    dm_mark(kv->ctx);
+
+    for (i = 0; i < nr; i++) {
+        ent = &ents[i];
+        if (ent->state != ENT_PENDING) {
+            continue;
+        }
+
+        locate_batch_ent(kv, ent);
+
+        /* the cached directory entry is validated by a read along with the buckets */
+        if (!locked) {
+            ent->dir_ver = kv->dirs[ent->shard].ver;
+            ret = dm_read(kv->ctx, ent->dir, loc_shard_dir(kv, ent->shard), 0);
+            if (unlikely(ret < 0)) {
+                goto out;
+            }
+        }
+    }
+
+    ret = fetch_batch_buckets(kv, nr, ents, nr_cands);
+    if (unlikely(ret < 0)) {
+        pr_err("kv batch: failed to read data");
+        goto out;
+    }
+
+    /* claim the target slots */
+    for (i = 0; i < nr; i++) {
+        ent = &ents[i];
+        if (ent->state != ENT_PENDING) {
+            continue;
+        }
+
+        ent->slot = NULL;
+
+        if (!locked && (ent->dir->ver != ent->dir_ver || shard_is_migrating(ent->dir))) {
+            pr_debug("kv batch: shard %d dir ver=%u->%u", ent->shard, ent->dir_ver, ent->dir->ver);
+            kv->dirs[ent->shard] = *ent->dir;
+            if (shard_is_migrating(ent->dir)) {
+                ent->state = ENT_NEED_LOCK;
+            }
+            continue;
+        }
+
+        ret = updater ? claim_upd_slot(kv, ent, updater, locked) : claim_put_slot(kv, ent, locked);
+        if (unlikely(ret < 0)) {
+            pr_err("kv batch: failed to claim slot");
+            goto out;
+        }
+    }
+
+    ret = dm_wait_ack(kv->ctx, dm_set_ack_all(kv->ctx));
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
+
+    /* write and release the claimed slots */
+    for (i = 0; i < nr; i++) {
+        ent = &ents[i];
+        if (ent->state != ENT_PENDING || !ent->slot) {
+            continue;
+        }
+
+        if (!slot_hdr_eq(ent->found, &ent->expected)) {
+            pr_debug("kv batch: lost the race on slot %lx", ent->slot_addr);
+            ent->slot = NULL;
+            continue;
+        }
+
+        if (ent->is_del) {
+            continue;
+        }
+
+        hdr = ent->slot;
+        if (!updater) {
+            hdr->used = true;
+            hdr->hash_ext = ent->hash_ext;
+            hdr->pair_pos = ent->poses[1 - ent->slot_ht];
+            memcpy(hdr + 1, ent->item->val, kv->val_len);
+        }
+        hdr->ver++;
+
+        ret = dm_copy_to_remote(kv->ctx, ent->slot_addr, hdr, kv->slot_len, 0);
+        if (unlikely(ret < 0)) {
+            pr_err("kv batch: failed to write data");
+            goto out;
+        }
+    }
+
+    ret = dm_wait_ack(kv->ctx, dm_set_ack_all(kv->ctx));
+    if (unlikely(ret < 0)) {
+        pr_err("kv batch: failed to wait for data write completion");
+        goto out;
+    }
+
+    for (i = 0; i < nr; i++) {
+        ent = &ents[i];
+        if (ent->state != ENT_PENDING || !ent->slot) {
+            continue;
+        }
+
+        /* a redone entry has been accounted */
+        if (!ent->delta) {
+            ent->delta = updater ? -ent->is_del : 1;
+        }
+
+        if (locked) {
+            finish_batch_ent(kv, ent, 0, updater != NULL);
+        } else {
+            ent->state = ENT_CHECK;
+        }
+    }
+
+    if (locked) {
+        goto out_pending;
+    }
+
+    /* re-read directory entries (and buckets of missing entries), with the load accounted */
+    ret = post_nr_items_faa(kv, nr, ents);
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
+
+    for (i = 0; i < nr; i++) {
+        ent = &ents[i];
+        if (ent->state != ENT_CHECK && ent->state != ENT_VERIFY) {
+            continue;
+        }
+
+        ret = dm_read(kv->ctx, ent->dir, loc_shard_dir(kv, ent->shard), 0);
+        if (unlikely(ret < 0)) {
+            goto out;
+        }
+
+        for (j = 0; ent->state == ENT_VERIFY && j < kv->nr_cands; j++) {
+            ent->recheck[j] = dm_push(kv->ctx, NULL, cand_len(kv, j));
+            if (unlikely(!ent->recheck[j])) {
+                ret = -ENOMEM;
+                goto out;
+            }
+
+            ret = dm_copy_from_remote(kv->ctx, ent->recheck[j], ent->addrs[j], cand_len(kv, j), 0);
+            if (unlikely(ret < 0)) {
+                goto out;
+            }
+        }
+    }
+
+    ret = dm_wait_ack(kv->ctx, dm_set_ack_all(kv->ctx));
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
+
+    for (i = 0; i < nr; i++) {
+        ent = &ents[i];
+        if (ent->state != ENT_CHECK && ent->state != ENT_VERIFY) {
+            continue;
+        }
+
+        if (ent->dir->ver != ent->dir_ver) {
+            pr_debug("kv batch: shard %d resized under us, redo under the lock", ent->shard);
+            kv->dirs[ent->shard] = *ent->dir;
+            ent->state = ENT_NEED_LOCK;
+            continue;
+        }
+
+        if (ent->state == ENT_CHECK) {
+            finish_batch_ent(kv, ent, 0, updater != NULL);
+            continue;
+        }
+
+        /* missing, unless some slot has changed in between */
+        if (batch_ent_unchanged(kv, ent)) {
+            finish_batch_ent(kv, ent, -ENOENT, true);
+        } else {
+            ent->state = ENT_PENDING;
+        }
+    }
+
+out_pending:
+    ret = 0;
+    for (i = 0; i < nr; i++) {
+        ret += ents[i].state == ENT_PENDING;
+    }
+
+out:
+    dm_pop(kv->ctx);
+    return ret;
+}
+
+/* Try the entries without the lock, leaving those that need it */
+static int do_kv_batch_lockfree(kv_t *kv, int nr, struct kv_batch_ent *ents, void *(*updater)(void *, void *)) {
+    int rnd, i, ret = 0;
+
+    for (rnd = 0; rnd < KV_LOCKFREE_MAX_NR_RNDS; rnd++) {
+        ret = do_kv_batch_round(kv, nr, ents, updater, false);
+        if (ret <= 0) {
+            break;
+        }
+    }
+
+    /* heavily contended, leave them to the lock */
+    for (i = 0; i < nr; i++) {
+        if (ents[i].state == ENT_PENDING) {
+            ents[i].state = ENT_NEED_LOCK;
+        }
+    }
+
+    return ret < 0 ? ret : 0;
+}
+
+/* Process the entries needing the lock of their (same) shard, which is held by the caller */
+static int do_kv_batch_locked(kv_t *kv, int nr, struct kv_batch_ent *ents, void *(*updater)(void *, void *)) {
+    struct kv_batch_ent *ent;
+    int i, ret;
+    char *dup;
+
+    for (i = 0; i < nr; i++) {
+        if (ents[i].state == ENT_NEED_LOCK) {
+            ents[i].state = ENT_PENDING;
+        }
+    }
+
+    /* lock-free writers may still beat us on a slot */
+    do {
+        ret = do_kv_batch_round(kv, nr, ents, updater, true);
+    } while (ret > 0);
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
+
+    /* both buckets full, search a cuckoo path (buckets are re-read since moves may touch them) */
+    for (i = 0; i < nr; i++) {
+        ent = &ents[i];
+        if (ent->state != ENT_NEED_KICK) {
+            continue;
+        }
+
+        dup = strndup(ent->item->key, ent->item->key_len);
+        ret = kv_put_bfs(kv, ent->poses, ent->hash_ext, dup, ent->item->val, ent->shard);
+        free(dup);
+        if (unlikely(ret < 0)) {
+            pr_err("kv_put: failed to put data");
+            goto out;
+        }
+
+        if (!ent->delta) {
+            ent->delta = 1;
+        }
+
+        finish_batch_ent(kv, ent, 0, false);
+    }
+
+    dm_mark(kv->ctx);
+    ret = post_nr_items_faa(kv, nr, ents);
+    if (likely(ret >= 0)) {
+        ret = dm_wait_ack(kv->ctx, dm_set_ack_all(kv->ctx));
+    }
+    dm_pop(kv->ctx);
+
+out:
+    return ret;
+}
+
+static int kv_batch(kv_t *kv, int vec_len, kv_vec_item_t *kv_vec, void *(*updater)(void *, void *)) {
+    int start, end, sub, nr, shard, i, ret = 0;
+    struct kv_batch_ent *ents;
+
+    if (!vec_len) {
+        goto out;
+    }
+
+    ret = kv_ack_dirs(kv);
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
+
+    ents = prepare_batch(kv, vec_len, kv_vec);
+    if (unlikely(!ents)) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    for (sub = 0; sub < vec_len; sub += nr) {
+        nr = min(vec_len - sub, kv->nr_max_outstanding_reqs);
+        ret = do_kv_batch_lockfree(kv, nr, ents + sub, updater);
+        if (unlikely(ret < 0)) {
+            goto out_free;
+        }
+    }
+
+    for (start = 0; start < vec_len; start = end) {
+        shard = ents[start].shard;
+        for (end = start + 1; end < vec_len && ents[end].shard == shard; end++);
+
+        for (i = start; i < end && ents[i].state != ENT_NEED_LOCK; i++);
+        if (i == end) {
+            continue;
+        }
+
+        pr_debug("kv batch: shard=%d falls back to the lock", shard);
+
+        dmlock_acquire(kv->locktab, shard);
+
+        /* the shard may have been resized since we cached its directory entry */
+        ret = refresh_shard_dir(kv, shard);
+
+        for (sub = start; sub < end && ret >= 0; sub += nr) {
+            nr = min(end - sub, kv->nr_max_outstanding_reqs);
+            ret = do_kv_batch_locked(kv, nr, ents + sub, updater);
+        }
+
+        dmlock_release(kv->locktab, shard);
+
+        if (unlikely(ret < 0)) {
+            break;
+        }
+    }
+
+out_free:
+    free(ents);
+
+out:
+    return ret;
+}
+
+int kv_put_batch(kv_t *kv, int vec_len, kv_vec_item_t *kv_vec) {
+    return kv_batch(kv, vec_len, kv_vec, NULL);
+}
+
+int kv_upd_batch(kv_t *kv, int vec_len, kv_vec_item_t *kv_vec, void *(*updater)(void *, void *)) {
+    return kv_batch(kv, vec_len, kv_vec, updater);
+}
+
+/*
+ * Serve items from the slot cache, validated by reading the headers of the cached slots
+ * (or not at all within the staleness window). Return the number of items served.
+ */
+static int kv_cache_serve(kv_t *kv, int vec_len, kv_vec_item_t *kv_vec, uint64_t hashes[][2], int shards[],
+                          bool served[]) {
+    struct slot_hdr *hdrs[vec_len][KV_CACHE_NR_SLOTS];
+    struct kv_shard_dir *dirs[vec_len];
+    int i, j, ret = 0, nr_probes = 0, nr_served = 0;
+    struct kv_cache_ent *ent;
+    kv_vec_item_t *item;
+    bool probe[vec_len];
+
+    for (i = 0; i < vec_len; i++) {
+        served[i] = probe[i] = false;
+
+        ent = kv_cache_ent(kv, hashes[i]);
+        if (!kv_cache_hit(kv, ent, hashes[i], shards[i])) {
+            continue;
+        }
+
+        if (kv->cache_staleness_us && bench_timer_end(&ent->filled) < kv->cache_staleness_us * 1000) {
+            served[i] = true;
+            continue;
+        }
+
+        for (j = 0; j < ent->nr_slots; j++) {
+            ret = dm_read(kv->ctx, hdrs[i][j], ent->addrs[j], 0);
+            if (unlikely(ret < 0)) {
+                goto out;
+            }
+        }
+
+        ret = dm_read(kv->ctx, dirs[i], loc_shard_dir(kv, shards[i]), 0);
+        if (unlikely(ret < 0)) {
+            goto out;
+        }
+
+        probe[i] = true;
+        nr_probes++;
+    }
+
+    if (nr_probes) {
+        ret = dm_wait_ack(kv->ctx, dm_set_ack_all(kv->ctx));
+        if (unlikely(ret < 0)) {
+            goto out;
+        }
+    }
+
+    for (i = 0; i < vec_len; i++) {
+        ent = kv_cache_ent(kv, hashes[i]);
+
+        if (probe[i]) {
+            served[i] = dirs[i]->ver == ent->dir_ver;
+            for (j = 0; j < ent->nr_slots && served[i]; j++) {
+                served[i] = slot_hdr_eq(hdrs[i][j], kv_cache_slot(kv, ent, j));
+            }
+
+            if (!served[i]) {
+                pr_debug("kv_get: cached slots of vec[%d] changed", i);
+                ent->nr_slots = 0;
+                continue;
+            }
+
+            bench_timer_start(&ent->filled);
+        }
+
+        if (!served[i]) {
+            continue;
+        }
+
+        item = &kv_vec[i];
+        for (j = 0; j < KV_NR_POSSIBLE_VALS; j++) {
+            item->possible_vals[j] = NULL;
+            if (j < ent->nr_slots) {
+                item->possible_vals[j] = dm_push(kv->ctx, kv_cache_slot(kv, ent, j) + sizeof(struct slot_hdr),
+                                                 kv->val_len);
+                if (unlikely(!item->possible_vals[j])) {
+                    ret = -ENOMEM;
+                    goto out;
+                }
+            }
+        }
+        item->err = 0;
+
+        nr_served++;
+    }
+
+    ret = nr_served;
+
+out:
+    return ret;
+}
+
+/* Remember the candidate slots found for a key, @vals point to the values in the slots read */
+static void kv_cache_fill(kv_t *kv, const uint64_t hashes[2], int shard, int nr, dmptr_t addrs[], void *vals[]) {
+    struct kv_cache_ent *ent = kv_cache_ent(kv, hashes);
+    int i;
+
+    if (!ent || !nr) {
+        return;
+    }
+
+    if (nr > KV_CACHE_NR_SLOTS) {
+        kv_cache_drop(kv, hashes);
+        return;
+    }
+
+    ent->hashes[0] = hashes[0];
+    ent->hashes[1] = hashes[1];
+    ent->dir_ver = kv->dirs[shard].ver;
+    ent->confirmed = false;
+    ent->nr_slots = nr;
+    for (i = 0; i < nr; i++) {
+        ent->addrs[i] = addrs[i];
+        memcpy(kv_cache_slot(kv, ent, i), vals[i] - sizeof(struct slot_hdr), kv->slot_len);
+    }
+    bench_timer_start(&ent->filled);
+}
+
+void kv_cache_confirm(kv_t *kv, kv_vec_item_t *item) {
+    uint64_t state = get_key_state(item), hashes[2];
+    struct kv_cache_ent *ent;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        hashes[i] = get_key_hash(kv, i, state);
+    }
+
+    ent = kv_cache_ent(kv, hashes);
+    if (ent && ent->hashes[0] == hashes[0] && ent->hashes[1] == hashes[1]) {
+        ent->confirmed = true;
+    }
+}
+
+/*
+ * Is a slot read self-consistent? A slot within a cacheline is read (and written) atomically,
+ * and a slot being written is busy. Larger slots are always validated by a second read.
+ */
+static inline bool slot_read_atomic(kv_t *kv) {
+    return kv->slot_len <= CACHELINE_SIZE;
+}
+
+void kv_set_key_matcher(kv_t *kv, kv_key_matcher_t matcher) {
+    kv->key_matcher = matcher;
+}
+
+/* Does a candidate slot read in @bkts surely hold the key of @item? */
+static bool has_matching_candidate(kv_t *kv, const kv_vec_item_t *item, void *bkts[MAX_NR_CANDS],
+                                   uint32_t poses[2]) {
+    struct slot_hdr *hdr;
+    int j, k;
+
+    if (!kv->key_matcher) {
+        return false;
+    }
+
+    for (j = 0; j < kv->nr_cands; j++) {
+        for (k = 0; k < cand_nr_slots(kv, j); k++) {
+            hdr = get_slot(kv, bkts[j], k);
+            if (slot_may_match(kv, hdr, poses, j) && kv->key_matcher(item, hdr + 1)) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+/* Number of slots read in @bkts that may belong to the key, or -EAGAIN if any of them is busy */
+static int count_candidates(kv_t *kv, void *bkts[MAX_NR_CANDS], uint32_t poses[2]) {
+    struct slot_hdr *hdr;
+    int j, k, n = 0;
+
+    for (j = 0; j < kv->nr_cands; j++) {
+        for (k = 0; k < cand_nr_slots(kv, j); k++) {
+            hdr = get_slot(kv, bkts[j], k);
+            if (slot_is_busy(hdr)) {
+                return -EAGAIN;
+            }
+            n += slot_may_match(kv, hdr, poses, j);
+        }
+    }
+
+    return n;
+}
+
+static int do_kv_get_batch_approx(kv_t *kv, int vec_len, kv_vec_item_t *kv_vec) {
+    int i, j, k, n, shard, ret = 0, valid_cnt, rnd, nr_confirms;
+    void *bkt1[vec_len][MAX_NR_CANDS], *bkt2[vec_len][MAX_NR_CANDS];
+    struct kv_shard_dir *dir1[vec_len], *dir2[vec_len];
+    dmptr_t addrs[vec_len][MAX_NR_CANDS];
+    struct slot_hdr *hdr1, *hdr2;
+    uint32_t poses[vec_len][2], dir_ver[vec_len];
+    uint64_t hashes[vec_len][2], state;
+    bool valid[vec_len], confirm[vec_len], served[vec_len];
+    dmptr_t cand_addrs[KV_NR_POSSIBLE_VALS];
+    int shards[vec_len];
+    kv_vec_item_t *item;
+
+    /* It's caller's responsibility to mark and pop buffer! */
 
     /* Hash calculation */
     for (i = 0; i < vec_len; i++) {
         item = &kv_vec[i];
+        state = get_key_state(item);
+
+        shards[i] = get_key_shard(kv, state);
+        for (j = 0; j < 2; j++) {
+            hashes[i][j] = get_key_hash(kv, j, state);
+        }
+    }
+
+    ret = kv_cache_serve(kv, vec_len, kv_vec, hashes, shards, served);
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
+    valid_cnt = ret;
+    memcpy(valid, served, sizeof(valid));
+
+    /*
+     * Repeat until no version mismatch.
+     */
+    for (rnd = 0; valid_cnt < vec_len; rnd++) {
+        pr_debug("rnd %d", rnd);
+
+        /* Issue the first read, along with the shard directory entry */
+        for (i = 0; i < vec_len; i++) {
+            if (valid[i]) {
+                continue;
+            }
+
+            /* locate with the cached shard directory, validated by the directory read */
+            shard = shards[i];
+            dir_ver[i] = kv->dirs[shard].ver;
+            for (j = 0; j < 2; j++) {
+                poses[i][j] = get_pos_by_hash(kv, hashes[i][j], shard);
+            }
+            for (j = 0; j < kv->nr_cands; j++) {
+                addrs[i][j] = loc_cand(kv, j, poses[i], shard);
+            }
+
+            for (j = 0; j < kv->nr_cands; j++) {
+                bkt1[i][j] = dm_push(kv->ctx, NULL, cand_len(kv, j));
+
+                ret = dm_copy_from_remote(kv->ctx, bkt1[i][j], addrs[i][j], cand_len(kv, j), 0);
+                if (unlikely(ret < 0)) {
+                    goto out;
+                }
+            }
+
+            ret = dm_read(kv->ctx, dir1[i], loc_shard_dir(kv, shard), 0);
+            if (unlikely(ret < 0)) {
+                goto out;
+            }
+        }
+
+        ret = dm_wait_ack(kv->ctx, dm_set_ack_all(kv->ctx));
+        if (unlikely(ret < 0)) {
+            goto out;
+        }
+
+        /*
+         * Single-read validation
+         * Every slot read is consistent by itself, so a found candidate was really there
+         * at the time of the read. A miss, however, may be a key in the middle of a cuckoo
+         * move, seen in neither bucket because the buckets were not read at the same time,
+         * and is confirmed by the second read. So is a get whose candidates may all be foreign,
+         * as they may hide such a miss: only a candidate the key matcher recognizes saves it.
+         */
+        nr_confirms = 0;
+        for (i = 0; i < vec_len; i++) {
+            if (valid[i]) {
+                continue;
+            }
+
+            confirm[i] = false;
+
+            if (dir1[i]->ver != dir_ver[i]) {
+                pr_debug("shard dir mismatch: vec[%d] shard=%d ver=%u->%u", i, shards[i], dir_ver[i], dir1[i]->ver);
+                kv->dirs[shards[i]] = *dir1[i];
+                continue;
+            }
+
+            n = count_candidates(kv, bkt1[i], poses[i]);
+            if (n == -EAGAIN) {
+                continue;
+            }
+
+            if (n > 0 && slot_read_atomic(kv) && has_matching_candidate(kv, &kv_vec[i], bkt1[i], poses[i])) {
+                valid[i] = true;
+                valid_cnt++;
+            } else {
+                confirm[i] = true;
+                nr_confirms++;
+            }
+        }
+
+        if (!nr_confirms) {
+            continue;
+        }
+
+        /* Issue the second read (slot headers are spread over the bucket, so re-read it as a whole) */
+        for (i = 0; i < vec_len; i++) {
+            if (!confirm[i]) {
+                continue;
+            }
+
+            for (j = 0; j < kv->nr_cands; j++) {
+                bkt2[i][j] = dm_push(kv->ctx, NULL, cand_len(kv, j));
+
+                ret = dm_copy_from_remote(kv->ctx, bkt2[i][j], addrs[i][j], cand_len(kv, j), 0);
+                if (unlikely(ret < 0)) {
+                    goto out;
+                }
+            }
+
+            ret = dm_read(kv->ctx, dir2[i], loc_shard_dir(kv, shards[i]), 0);
+            if (unlikely(ret < 0)) {
+                goto out;
+            }
+        }
+
+        ret = dm_wait_ack(kv->ctx, dm_set_ack_all(kv->ctx));
+        if (unlikely(ret < 0)) {
+            goto out;
+        }
+
+        /* Check version match */
+        for (i = 0; i < vec_len; i++) {
+            if (!confirm[i]) {
+                continue;
+            }
+
+            /*
+             * The version checking mechanism is used to ensure that no concurrent modifications
+             * between reading two buckets of a key. It works as follows:
+             * (1) Read two buckets, and version numbers u of all their slots
+             * (2) Read version numbers again v
+             * If u == v for every slot, it's guaranteed that no concurrent modifications to these
+             * buckets.
+             * The shard directory is checked likewise, in case that the shard is resized (moved).
+             */
+            if (dir2[i]->ver != dir_ver[i]) {
+                pr_debug("shard dir mismatch: vec[%d] shard=%d ver=%u->%u", i, shards[i], dir_ver[i], dir2[i]->ver);
+                kv->dirs[shards[i]] = *dir2[i];
+                continue;
+            }
+
+            valid[i] = true;
+            for (j = 0; j < kv->nr_cands && valid[i]; j++) {
+                for (k = 0; k < cand_nr_slots(kv, j); k++) {
+                    hdr1 = get_slot(kv, bkt1[i][j], k);
+                    hdr2 = get_slot(kv, bkt2[i][j], k);
+                    if (hdr1->ver != hdr2->ver) {
+                        pr_debug("version mismatch: vec[%d] ht=%d slot=%d hdr1=%d hdr2=%d",
+                                 i, j, k, hdr1->ver, hdr2->ver);
+                        valid[i] = false;
+                        break;
+                    }
+                }
+            }
+            if (valid[i]) {
+                valid_cnt++;
+            }
+        }
+    }
+
+    /* collect the slots that may belong to the key, filter out those empty or foreign ones */
+    for (i = 0; i < vec_len; i++) {
+        if (served[i]) {
+            continue;
+        }
+
+        item = &kv_vec[i];
+        n = 0;
+        for (j = 0; j < kv->nr_cands; j++) {
+            for (k = 0; k < cand_nr_slots(kv, j); k++) {
+                hdr1 = get_slot(kv, bkt1[i][j], k);
+                if (!slot_may_match(kv, hdr1, poses[i], j)) {
+                    continue;
+                }
+                cand_addrs[n] = addrs[i][j] + k * kv->slot_len;
+                item->possible_vals[n++] = hdr1 + 1;
+            }
+        }
+        kv_cache_fill(kv, hashes[i], shards[i], n, cand_addrs, item->possible_vals);
+        for (; n < KV_NR_POSSIBLE_VALS; n++) {
+            item->possible_vals[n] = NULL;
+        }
+        item->err = 0;
+    }
+
+out:
+    return ret;
+}
+
+int kv_get_batch_approx(kv_t *kv, int vec_len, kv_vec_item_t *kv_vec) {
+    int nr_batches, batch_vec_len, i, ret = 0, err;
+    struct bench_timer timer;
+    long duration;
+
+    pr_debug("kv_get start, vec_len=%d", vec_len);
+    pr_debug_lookup_vec(kv_vec, vec_len);
+
+    ret = kv_ack_dirs(kv);
+    if (unlikely(ret < 0)) {
+        return ret;
+    }
+
+    bench_timer_start(&timer);
+
+    nr_batches = ALIGN_UP(vec_len, kv->nr_max_outstanding_reqs) / kv->nr_max_outstanding_reqs;
+
+    for (i = 0; i < nr_batches; i++) {
+        batch_vec_len = min(vec_len, kv->nr_max_outstanding_reqs);
+
+        err = do_kv_get_batch_approx(kv, batch_vec_len, kv_vec);
+        if (unlikely(err < 0)) {
+            ret = err;
+        }
+
+        vec_len -= batch_vec_len;
+        kv_vec += batch_vec_len;
+    }
+
+    duration = bench_timer_end(&timer);
+    if (kv->nr_get_reqs++ % STAT_GET_INTERVAL == 0) {
+        prom_histogram_observe(prom_get_latency, duration / 1000.0, (const char *[]) { kv->label });
+    }
+
+    return ret;
+}
+
+/*
+ * Scanning
+ *
+ * The tables are cut into chunks, which are read in groups of up to KV_SCAN_NR_INFLIGHT
+ * chunks per MN. Groups are double-buffered: the reads of group i + 1 are posted before
+ * group i is processed. The reads are unsignaled, and a group is waited for by a signaled
+ * 1-byte read per MN posted after it, which completes after all the reads before it on the
+ * same QP. These are posted only once the previous group has been waited for, so that
+ * completions of two groups never mix.
+ */
+
+#define KV_SCAN_CHUNK_SIZE      (128 * 1024ul)
+#define KV_SCAN_NR_INFLIGHT     4
+#define KV_SCAN_GROUP_MAX_NR    (MAX_NR_MNS * KV_SCAN_NR_INFLIGHT)
+
+struct kv_scan_chunk {
+    dmptr_t addr;
+    size_t len;
+    int ht;
+};
+
+struct kv_scan_group {
+    int nr;
+    struct kv_scan_chunk *chunks[KV_SCAN_GROUP_MAX_NR];
+    void *bufs[KV_SCAN_GROUP_MAX_NR];
+};
+
+struct kv_scan_ctx {
+    kv_t *kv;
+    kv_scanner_t scanner;
+    void *priv;
+
+    struct kv_scan_chunk *chunks;
+    int nr_chunks, max_nr_chunks;
+
+    /* next chunk to read of each MN */
+    int cursors[MAX_NR_MNS];
+
+    /* 1-byte buffer of signaled reads */
+    void *marker;
+
+    size_t size, scanned;
+    struct bench_timer timer;
+};
+
+static int kv_scan_add_range(struct kv_scan_ctx *sc, dmptr_t start, size_t size, int ht) {
+    struct kv_scan_chunk *chunks;
+    size_t off;
+
+    ethane_assert(size % sc->kv->slot_len == 0);
+
+    for (off = 0; off < size; off += KV_SCAN_CHUNK_SIZE) {
+        if (sc->nr_chunks == sc->max_nr_chunks) {
+            sc->max_nr_chunks = sc->max_nr_chunks ? sc->max_nr_chunks * 2 : 64;
+            chunks = realloc(sc->chunks, sc->max_nr_chunks * sizeof(*chunks));
+            if (unlikely(!chunks)) {
+                return -ENOMEM;
+            }
+            sc->chunks = chunks;
+        }
+
+        sc->chunks[sc->nr_chunks++] = (struct kv_scan_chunk) {
+            .addr = start + off, .len = min(KV_SCAN_CHUNK_SIZE, size - off), .ht = ht
+        };
+    }
+
+    sc->size += size;
+
+    return 0;
+}
+
+/* Take the next chunks of every MN and post their reads */
+static int kv_scan_post_group(struct kv_scan_ctx *sc, struct kv_scan_group *grp) {
+    struct kv_scan_chunk *chunk;
+    int mn, cnt, ret = 0;
+
+    grp->nr = 0;
+
+    for (mn = 0; mn < MAX_NR_MNS; mn++) {
+        for (cnt = 0; cnt < KV_SCAN_NR_INFLIGHT && sc->cursors[mn] < sc->nr_chunks; sc->cursors[mn]++) {
+            chunk = &sc->chunks[sc->cursors[mn]];
+            if (DMPTR_MN_ID(chunk->addr) != mn) {
+                continue;
+            }
+
+            if (!grp->bufs[grp->nr]) {
+                grp->bufs[grp->nr] = dm_push(sc->kv->ctx, NULL, KV_SCAN_CHUNK_SIZE);
+                if (unlikely(!grp->bufs[grp->nr])) {
+                    ret = -ENOMEM;
+                    goto out;
+                }
+            }
+
+            ret = dm_copy_from_remote(sc->kv->ctx, grp->bufs[grp->nr], chunk->addr, chunk->len, 0);
+            if (unlikely(ret < 0)) {
+                goto out;
+            }
+
+            grp->chunks[grp->nr++] = chunk;
+            cnt++;
+        }
+    }
+
+    ret = dm_barrier(sc->kv->ctx);
+
+out:
+    return ret;
+}
 
-        for (j = 0; j < 2; j++) {
-            hash = TAB_finalize(&kv->hf[j],
-                                TAB_process(&kv->hf[j], (const uint8_t *) item->key, item->key_len, 0));
-            shard = get_key_shard(kv, item->key, item->key_len);
-            addrs[i][j] = loc_by_pos(kv, kv->ht[j], get_pos_by_hash(kv, hash), shard);
+/* Wait for all the reads of a group */
+static int kv_scan_wait_group(struct kv_scan_ctx *sc, struct kv_scan_group *grp) {
+    bool posted[MAX_NR_MNS] = { false };
+    int i, mn, nr_acks = 0, ret;
+
+    for (i = 0; i < grp->nr; i++) {
+        mn = DMPTR_MN_ID(grp->chunks[i]->addr);
+        if (posted[mn]) {
+            continue;
+        }
 
-            // pr_info("vec[%d]: HT%d: key=%s hash=%lu shard=%d hdr_addr=%lx", i, j, item->key, hash, shard, addrs[i][j]);
+        ret = dm_copy_from_remote(sc->kv->ctx, sc->marker, grp->chunks[i]->addr, 1, DMFLAG_ACK);
+        if (unlikely(ret < 0)) {
+            return ret;
         }
+
+        posted[mn] = true;
+        nr_acks++;
     }
 
-    /*
-     * Repeat until no version mismatch.
-     */
-    for (rnd = 0; valid_cnt < vec_len; rnd++) {
-        pr_debug("rnd %d", rnd);
+    return dm_wait_ack(sc->kv->ctx, nr_acks);
+}
 
-        /* Issue the first read */
-        for (i = 0; i < vec_len; i++) {
-            if (valid[i]) {
+static int kv_scan_process_group(struct kv_scan_ctx *sc, struct kv_scan_group *grp) {
+    size_t nr_slots, j;
+    struct slot_hdr *hdr;
+    int i, ret = 0;
+    kv_t *kv = sc->kv;
+
+    for (i = 0; i < grp->nr; i++) {
+        nr_slots = grp->chunks[i]->len / kv->slot_len;
+        for (j = 0; j < nr_slots; j++) {
+            hdr = grp->bufs[i] + j * kv->slot_len;
+            if (!hdr->used) {
                 continue;
             }
 
-            item = &kv_vec[i];
+            pr_debug("ht[%d]:%lx", grp->chunks[i]->ht, grp->chunks[i]->addr + j * kv->slot_len);
 
-            for (j = 0; j < 2; j++) {
-                hdr1[i][j] = dm_push(kv->ctx, NULL, kv->slot_len);
+            ret = sc->scanner(sc->priv, hdr + 1);
+            if (unlikely(ret)) {
+                goto out;
+            }
+        }
 
-                item->possible_vals[j] = hdr1[i][j] + 1;
+        sc->scanned += grp->chunks[i]->len;
+    }
 
-                ret = dm_copy_from_remote(kv->ctx, hdr1[i][j], addrs[i][j], kv->slot_len, 0);
-                if (unlikely(ret < 0)) {
-                    goto out;
-                }
+    if (bench_timer_end(&sc->timer) > DUMP_SHOW_PROGRESS_INTERVAL_US * 1000) {
+        pr_info("%lu/%lu MB", sc->scanned / 1024 / 1024, sc->size / 1024 / 1024);
+        bench_timer_start(&sc->timer);
+    }
 
-                // pr_info("vec[%d] get from HT[%d], hdr_remote_addr=%lx", i, j, addrs[i][j]);
-            }
-        }
+out:
+    return ret;
+}
 
-        ret = dm_wait_ack(kv->ctx, dm_set_ack_all(kv->ctx));
+static int kv_scan_chunks(struct kv_scan_ctx *sc) {
+    struct kv_scan_group grps[2], *cur = &grps[0], *next = &grps[1], *tmp;
+    int ret, err;
+
+    memset(grps, 0, sizeof(grps));
+
+    sc->marker = dm_push(sc->kv->ctx, NULL, 1);
+    if (unlikely(!sc->marker)) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    bench_timer_start(&sc->timer);
+
+    ret = kv_scan_post_group(sc, cur);
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
+
+    ret = kv_scan_wait_group(sc, cur);
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
+
+    while (cur->nr) {
+        /* the next group is being read while this one is processed */
+        ret = kv_scan_post_group(sc, next);
         if (unlikely(ret < 0)) {
             goto out;
         }
 
-        /* Issue the second read */
-        for (i = 0; i < vec_len; i++) {
-            if (valid[i]) {
-                continue;
-            }
+        ret = kv_scan_process_group(sc, cur);
 
-            for (j = 0; j < 2; j++) {
-                hdr2[i][j] = dm_push(kv->ctx, NULL, sizeof(struct slot_hdr));
+        /* drain the reads in flight in any case, their buffers are popped by the caller */
+        err = kv_scan_wait_group(sc, next);
+        if (unlikely(ret)) {
+            goto out;
+        }
+        if (unlikely(err < 0)) {
+            ret = err;
+            goto out;
+        }
+
+        tmp = cur;
+        cur = next;
+        next = tmp;
+    }
 
-                ret = dm_copy_from_remote(kv->ctx, hdr2[i][j], addrs[i][j], sizeof(struct slot_hdr), 0);
+out:
+    return ret;
+}
+
+int kv_scan_part(kv_t *kv, kv_scanner_t scanner, void *priv, int part, int nr_parts) {
+    struct kv_scan_ctx sc = { .kv = kv, .scanner = scanner, .priv = priv };
+    size_t strip_size, len;
+    int i, j, ret = 0;
+    uint32_t pos;
+
+    dm_mark(kv->ctx);
+
+    ret = refresh_all_shard_dirs(kv);
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
+
+    /* hash tables, shard by shard since resized shards live in their own tables */
+    for (i = part; i < kv->nr_shards; i += nr_parts) {
+        for (j = 0; j < 2; j++) {
+            for (pos = 0; pos < kv->dirs[i].nr_buckets; pos += len / kv->bucket_len) {
+                len = contig_len_by_pos(kv, j, pos, i);
+                ret = kv_scan_add_range(&sc, loc_by_pos(kv, j, pos, i), len, j);
                 if (unlikely(ret < 0)) {
                     goto out;
                 }
             }
         }
+    }
 
-        ret = dm_wait_ack(kv->ctx, dm_set_ack_all(kv->ctx));
-        if (unlikely(ret < 0)) {
-            goto out;
+    /* stash, strip by strip */
+    if (kv->stash_nr_slots) {
+        strip_size = dmm_get_strip_size(kv->dmm, kv->nr_shards * kv->stash_len);
+        for (j = part; j < kv->interleave_nr; j += nr_parts) {
+            ret = kv_scan_add_range(&sc, kv->ht[STASH_HT][j], strip_size, STASH_HT);
+            if (unlikely(ret < 0)) {
+                goto out;
+            }
         }
+    }
 
-        /* Check version match */
-        for (i = 0; i < vec_len; i++) {
-            if (valid[i]) {
+    pr_info("scanning part %d/%d: %d chunks, %lu MB", part, nr_parts, sc.nr_chunks, sc.size / 1024 / 1024);
+
+    ret = kv_scan_chunks(&sc);
+
+out:
+    free(sc.chunks);
+    dm_pop(kv->ctx);
+    return ret;
+}
+
+int kv_scan(kv_t *kv, kv_scanner_t scanner, void *priv) {
+    return kv_scan_part(kv, scanner, priv, 0, 1);
+}
+
+/*
+ * Online Resizing
+ *
+ * A shard is doubled by its own: the migrator takes the shard lock, splits every bucket p
+ * of the old tables into buckets p and p + n of the new tables (by the hash bits kept in
+ * slot headers, so no cuckoo moves are needed), then publishes the new tables in the shard
+ * directory. Locked writers are blocked meanwhile, and lock-free writers are turned to the
+ * lock by marking the directory entry first; those already in flight find the entry changed
+ * after their writes and redo them. Readers keep reading the old tables until the directory
+ * is switched; readers holding a stale directory entry detect the switch by its version and
+ * retry. The old tables are freed once every registered client has acknowledged the directory
+ * generation of the doubling (see kv_ack_dirs()), as a client with a stale entry may still
+ * access them until then. Tables still retired when the resizer exits are leaked.
+ */
+static void split_buckets(kv_t *kv, int ht, int k, size_t n, int nr_buckets,
+                          void *src, void *dst[2]) {
+    struct slot_hdr *hdr, *new_hdr;
+    int b, i, bit, fill[2];
+
+    for (b = 0; b < nr_buckets; b++) {
+        fill[0] = fill[1] = 0;
+        for (i = 0; i < kv->bucket_nr_slots; i++) {
+            hdr = get_slot(kv, src + b * kv->bucket_len, i);
+            if (!hdr->used) {
                 continue;
             }
 
-            /*
-             * The version checking mechanism is used to ensure that no concurrent modifications
-             * between reading two slots of a key. It works as follows:
-             * (1) Read two slots, and their version number u1, u2
-             * (2) Read version number again v1, v2
-             * If u1 == v1 && u2 == v2, it's guaranteed that no concurrent modifications to these
-             * slots.
-             */
-            if (hdr1[i][0]->ver == hdr2[i][0]->ver && hdr1[i][1]->ver == hdr2[i][1]->ver) {
-                valid[i] = true;
-                valid_cnt++;
-            } else {
-                pr_debug("version mismatch: vec[%d] hdr1[0]=%d hdr2[0]=%d hdr1[1]=%d hdr2[1]=%d",
-                         i, hdr1[i][0]->ver, hdr2[i][0]->ver, hdr1[i][1]->ver, hdr2[i][1]->ver);
+            bit = hash_ext_bit(hdr->hash_ext, ht, k);
+            new_hdr = get_slot(kv, dst[bit] + b * kv->bucket_len, fill[bit]++);
+            memcpy(new_hdr, hdr, kv->slot_len);
+            new_hdr->pair_pos += n * hash_ext_bit(hdr->hash_ext, 1 - ht, k);
+
+            /* an update in flight, to be redone by its writer */
+            if (slot_is_busy(new_hdr)) {
+                new_hdr->ver++;
             }
         }
     }
+}
 
-    /* filter out those empty slots */
-    for (i = 0; i < vec_len; i++) {
-        // if (!((struct slot_hdr*)((uint64_t)kv_vec[i].possible_vals[1] - sizeof(struct slot_hdr)))->used) {
-        //     kv_vec[i].possible_vals[1] = NULL;
-        // }
-        // if (!((struct slot_hdr*)((uint64_t)kv_vec[i].possible_vals[0] - sizeof(struct slot_hdr)))->used) {
-        //     kv_vec[i].possible_vals[0] = kv_vec[i].possible_vals[1];
-        // }
-        if (!(((unsigned long *) kv_vec[i].possible_vals[1])[-1])) {
-            kv_vec[i].possible_vals[1] = NULL;
-        }
-        if (!(((unsigned long *) kv_vec[i].possible_vals[0])[-1])) {
-            kv_vec[i].possible_vals[0] = kv_vec[i].possible_vals[1];
-        }
-        kv_vec[i].err = 0;
+/* Publish a directory entry, except nr_items */
+static int publish_shard_dir(kv_t *kv, int shard, struct kv_shard_dir *dir) {
+    void *buf;
+    int ret;
+
+    dm_mark(kv->ctx);
+
+    buf = dm_push(kv->ctx, dir, offsetof(struct kv_shard_dir, nr_items));
+    if (unlikely(!buf)) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    ret = dm_copy_to_remote(kv->ctx, loc_shard_dir(kv, shard), buf, offsetof(struct kv_shard_dir, nr_items),
+                            DMFLAG_ACK);
+    if (unlikely(ret < 0)) {
+        goto out;
     }
 
+    ret = dm_wait_ack(kv->ctx, 1);
+
 out:
+    dm_pop(kv->ctx);
     return ret;
 }
 
-int kv_get_batch_approx(kv_t *kv, int vec_len, kv_vec_item_t *kv_vec) {
-    int nr_batches, batch_vec_len, i, ret = 0, err;
-    struct bench_timer timer;
-    long duration;
+/* Free the retired tables of the generations every registered client has acknowledged. */
+static int free_retired_tables(kv_t *kv) {
+    uint64_t *acks, min_ack = UINT64_MAX;
+    int i, j, ret;
 
-    pr_debug("kv_get start, vec_len=%d", vec_len);
-    pr_debug_lookup_vec(kv_vec, vec_len);
+    if (!kv->nr_retired) {
+        return 0;
+    }
 
-    bench_timer_start(&timer);
+    dm_mark(kv->ctx);
 
-    nr_batches = ALIGN_UP(vec_len, kv->nr_max_outstanding_reqs) / kv->nr_max_outstanding_reqs;
+    acks = dm_push(kv->ctx, NULL, KV_DIR_ACKS_SIZE);
+    if (unlikely(!acks)) {
+        ret = -ENOMEM;
+        goto out;
+    }
 
-    for (i = 0; i < nr_batches; i++) {
-        batch_vec_len = min(vec_len, kv->nr_max_outstanding_reqs);
+    ret = dm_copy_from_remote(kv->ctx, acks, kv->dir_acks, KV_DIR_ACKS_SIZE, DMFLAG_ACK);
+    if (likely(ret >= 0)) {
+        ret = dm_wait_ack(kv->ctx, 1);
+    }
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
 
-        err = do_kv_get_batch_approx(kv, batch_vec_len, kv_vec);
-        if (unlikely(err < 0)) {
-            ret = err;
+    for (i = 1; i <= MAX_NR_CLIS; i++) {
+        if (acks[i]) {
+            min_ack = min(min_ack, acks[i]);
         }
-
-        vec_len -= batch_vec_len;
-        kv_vec += batch_vec_len;
     }
 
-    duration = bench_timer_end(&timer);
-    if (kv->nr_get_reqs++ % STAT_GET_INTERVAL == 0) {
-        prom_histogram_observe(prom_get_latency, duration / 1000.0, (const char *[]) { kv->label });
+    for (i = 0, j = 0; i < kv->nr_retired; i++) {
+        if (kv->retired[i].gen > min_ack) {
+            kv->retired[j++] = kv->retired[i];
+            continue;
+        }
+        dmm_bfree(kv->dmm, kv->retired[i].ht[0], kv->retired[i].size);
+        dmm_bfree(kv->dmm, kv->retired[i].ht[1], kv->retired[i].size);
     }
+    kv->nr_retired = j;
 
+out:
+    dm_pop(kv->ctx);
     return ret;
 }
 
-static int kv_scan_range(kv_t *kv, dmptr_t start, size_t size, kv_scanner_t scanner, void *priv, int ht) {
-    size_t read_size = 1024 * 1024ul, nr_slots, off, cur_read_size;
-    struct bench_timer timer;
-    struct slot_hdr *hdr;
-    int ret = 0;
-    void *buf;
+/* Bump the directory generation for the tables just replaced, and queue them for freeing. */
+static int retire_tables(kv_t *kv, const dmptr_t ht[2], size_t size) {
+    struct kv_retired_tabs *retired;
+    uint64_t *gen;
+    int ret;
 
-    dm_mark(kv->ctx);
+    retired = realloc(kv->retired, (kv->nr_retired + 1) * sizeof(*retired));
+    if (unlikely(!retired)) {
+        return -ENOMEM;
+    }
+    kv->retired = retired;
 
-    ethane_assert(size % kv->slot_len == 0);
-    ethane_assert(read_size % kv->slot_len == 0);
+    dm_mark(kv->ctx);
 
-    buf = dm_push(kv->ctx, NULL, read_size);
-    if (unlikely(!buf)) {
+    gen = dm_data(kv->ctx, (uint64_t) 1);
+    if (unlikely(!gen)) {
         ret = -ENOMEM;
         goto out;
     }
 
-    bench_timer_start(&timer);
+    ret = dm_faa(kv->ctx, kv->dir_acks, gen, sizeof(*gen), DMFLAG_ACK);
+    if (likely(ret >= 0)) {
+        ret = dm_wait_ack(kv->ctx, 1);
+    }
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
 
-    for (off = 0; off < size; off += read_size) {
-        cur_read_size = min(read_size, size - off);
-        nr_slots = cur_read_size / kv->slot_len;
+    retired[kv->nr_retired].ht[0] = ht[0];
+    retired[kv->nr_retired].ht[1] = ht[1];
+    retired[kv->nr_retired].size = size;
+    retired[kv->nr_retired].gen = *gen + 1;
+    kv->nr_retired++;
 
-        ret = dm_copy_from_remote(kv->ctx, buf, start + off, cur_read_size, DMFLAG_ACK);
-        if (unlikely(ret < 0)) {
-            goto out;
-        }
+out:
+    dm_pop(kv->ctx);
+    return ret;
+}
 
-        ret = dm_wait_ack(kv->ctx, 1);
-        if (unlikely(ret < 0)) {
-            goto out;
+static int kv_double_shard(kv_t *kv, int shard) {
+    size_t n, len, tab_size, chunk_size = 1024 * 1024ul;
+    struct kv_shard_dir old_dir, new_dir;
+    dmptr_t new_ht[2] = { DMPTR_NULL, DMPTR_NULL };
+    void *src, *dst[2];
+    uint32_t pos, ver;
+    int i, ret = 0;
+
+    dmlock_acquire(kv->locktab, shard);
+
+    ret = refresh_shard_dir(kv, shard);
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
+
+    old_dir = kv->dirs[shard];
+
+    if (unlikely(old_dir.nr_doublings >= MAX_NR_DOUBLINGS)) {
+        pr_warn("kv_resize: shard %d can not grow any more", shard);
+        goto out;
+    }
+
+    n = old_dir.nr_buckets;
+    tab_size = 2 * n * kv->bucket_len;
+
+    pr_info("kv_resize: shard %d: %lu -> %lu buckets (%ld items)", shard, n, 2 * n, old_dir.nr_items);
+
+    /* mark the shard as migrating */
+    new_dir = old_dir;
+    new_dir.ver++;
+    ret = publish_shard_dir(kv, shard, &new_dir);
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
+    kv->dirs[shard] = new_dir;
+
+    for (i = 0; i < 2; i++) {
+        new_ht[i] = dmm_balloc(kv->dmm, tab_size, BLK_SIZE, DMPTR_DUMMY((shard * 2 + i) % kv->interleave_nr));
+        if (unlikely(IS_ERR(new_ht[i]))) {
+            ret = (int) new_ht[i];
+            new_ht[i] = DMPTR_NULL;
+            goto out_unmark;
         }
+        dmm_bzero(kv->dmm, new_ht[i], tab_size, true);
+    }
 
-        for (int i = 0; i < nr_slots; i++) {
-            hdr = buf + i * kv->slot_len;
-            if (!hdr->used) {
-                continue;
+    for (i = 0; i < 2; i++) {
+        for (pos = 0; pos < n; pos += len / kv->bucket_len) {
+            len = min(contig_len_by_pos(kv, i, pos, shard), chunk_size);
+
+            dm_mark(kv->ctx);
+
+            src = dm_push(kv->ctx, NULL, len);
+            dst[0] = dm_push(kv->ctx, NULL, len);
+            dst[1] = dm_push(kv->ctx, NULL, len);
+            if (unlikely(!src || !dst[0] || !dst[1])) {
+                dm_pop(kv->ctx);
+                ret = -ENOMEM;
+                goto out_unmark;
+            }
+
+            ret = dm_copy_from_remote(kv->ctx, src, loc_by_pos(kv, i, pos, shard), len, DMFLAG_ACK);
+            if (likely(ret >= 0)) {
+                ret = dm_wait_ack(kv->ctx, 1);
+            }
+            if (unlikely(ret < 0)) {
+                dm_pop(kv->ctx);
+                goto out_unmark;
             }
 
-            pr_debug("ht[%d]:%lx", ht, start + off + i * kv->slot_len);
+            memset(dst[0], 0, len);
+            memset(dst[1], 0, len);
+            split_buckets(kv, i, old_dir.nr_doublings, n, (int) (len / kv->bucket_len), src, dst);
 
-            ret = scanner(priv, hdr + 1);
-            if (unlikely(ret)) {
-                goto out;
+            ret = dm_copy_to_remote(kv->ctx, new_ht[i] + pos * kv->bucket_len, dst[0], len, 0);
+            if (likely(ret >= 0)) {
+                ret = dm_copy_to_remote(kv->ctx, new_ht[i] + (pos + n) * kv->bucket_len, dst[1], len, 0);
+            }
+            if (likely(ret >= 0)) {
+                ret = dm_wait_ack(kv->ctx, dm_set_ack_all(kv->ctx));
+            }
+
+            dm_pop(kv->ctx);
+
+            if (unlikely(ret < 0)) {
+                goto out_unmark;
             }
         }
+    }
+
+    /* publish */
+    new_dir.ver++;
+    new_dir.nr_doublings++;
+    new_dir.nr_buckets = 2 * n;
+    memcpy(new_dir.ht, new_ht, sizeof(new_ht));
+
+    ret = publish_shard_dir(kv, shard, &new_dir);
+    if (unlikely(ret < 0)) {
+        goto out_unmark;
+    }
+
+    kv->dirs[shard] = new_dir;
+
+    dmlock_release(kv->locktab, shard);
+
+    /* the initial interleaved tables are never freed */
+    if (old_dir.ht[0] != DMPTR_NULL) {
+        ret = retire_tables(kv, old_dir.ht, n * kv->bucket_len);
+    }
+
+    return ret;
 
-        if (bench_timer_end(&timer) > DUMP_SHOW_PROGRESS_INTERVAL_US * 1000) {
-            pr_info("%lu/%lu MB", off / 1024 / 1024, size / 1024 / 1024);
-            bench_timer_start(&timer);
+out_unmark:
+    /* nobody has used the new tables yet, even if the failed publish landed */
+    for (i = 0; i < 2; i++) {
+        if (new_ht[i] != DMPTR_NULL) {
+            dmm_bfree(kv->dmm, new_ht[i], tab_size);
         }
     }
 
+    /* give the shard back as it was, newer than anything published */
+    ver = (new_dir.ver | 1) + 1;
+    new_dir = old_dir;
+    new_dir.ver = ver;
+    if (likely(publish_shard_dir(kv, shard, &new_dir) >= 0)) {
+        kv->dirs[shard] = new_dir;
+    }
+
 out:
-    dm_pop(kv->ctx);
+    dmlock_release(kv->locktab, shard);
     return ret;
 }
 
-int kv_scan(kv_t *kv, kv_scanner_t scanner, void *priv) {
-    size_t strip_size = dmm_get_strip_size(kv->dmm, kv->ht_nr_ents * kv->slot_len);
-    int i, j, ret = 0;
-    dmptr_t ht;
+int kv_resize(kv_t *kv, int max_load_pct) {
+    int shard, ret, nr_resized = 0;
+    struct kv_shard_dir *dir;
+    size_t cap;
 
-    for (i = 0; i < 2; i++) {
-        for (j = 0; j < dmm_get_interleave_nr(kv->dmm); j++) {
-            pr_info("scanning ht=%d,mn=%d", i, j);
-            pr_info("start");
-            ht = kv->ht[i][j];
-            ret = kv_scan_range(kv, ht, strip_size, scanner, priv, i);
-            if (unlikely(ret)) {
-                goto out;
-            }
+    ret = refresh_all_shard_dirs(kv);
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
+
+    for (shard = 0; shard < kv->nr_shards; shard++) {
+        dir = &kv->dirs[shard];
+        cap = 2 * dir->nr_buckets * kv->bucket_nr_slots;
+        if (dir->nr_items * 100 < cap * max_load_pct || dir->nr_doublings >= MAX_NR_DOUBLINGS) {
+            continue;
+        }
+
+        ret = kv_double_shard(kv, shard);
+        if (unlikely(ret < 0)) {
+            pr_err("kv_resize: failed to double shard %d: %d", shard, ret);
+            goto out;
         }
+
+        nr_resized++;
     }
 
+    /* acknowledge for ourselves too, we hold no stale entries between resizes */
+    ret = read_dir_gen(kv, &kv->dir_gen);
+    if (likely(ret >= 0)) {
+        ret = refresh_all_shard_dirs(kv);
+    }
+    if (likely(ret >= 0)) {
+        ret = write_dir_ack(kv, kv->dir_gen);
+    }
+    if (likely(ret >= 0)) {
+        ret = free_retired_tables(kv);
+    }
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
+
+    ret = nr_resized;
+
 out:
     return ret;
 }
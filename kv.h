@@ -22,13 +22,20 @@
 
 #include "coro.h"
 
-#define KV_NR_POSSIBLE_VALS 2
+/* Bounds of the KV geometry; a get returns every slot of the candidate buckets that may match */
+#define KV_MAX_BUCKET_NR_SLOTS  8
+#define KV_MAX_STASH_NR_SLOTS   8
+#define KV_NR_POSSIBLE_VALS     (2 * KV_MAX_BUCKET_NR_SLOTS + KV_MAX_STASH_NR_SLOTS)
 
 typedef struct kv kv_t;
 typedef struct {
     const char *key;
     size_t key_len;
 
+    /* Optional precomputed path state of the key (see pathdesc.h) */
+    bool has_key_state;
+    uint64_t key_state;
+
     union {
         /* For get batch approx */
         void *possible_vals[KV_NR_POSSIBLE_VALS];
@@ -43,13 +50,30 @@ typedef struct {
     int err;
 } kv_vec_item_t;
 typedef int (*kv_scanner_t)(void *priv, const void *val);
+/* Whether @val surely belongs to the key of @item (false if it can't tell) */
+typedef bool (*kv_key_matcher_t)(const kv_vec_item_t *item, const void *val);
 
-dmptr_t kv_create(dmcontext_t *ctx, dmm_cli_t *dmm, size_t size, size_t val_len, int nr_shards);
+dmptr_t kv_create(dmcontext_t *ctx, dmm_cli_t *dmm, size_t size, size_t val_len, int nr_shards,
+                  int bucket_nr_slots, int max_kick_depth, int stash_nr_slots);
 kv_t *kv_init(const char *name, dmcontext_t *ctx, dmm_cli_t *dmm, dmlocktab_t *locktab,
-              dmptr_t kv_info_remote_addr, int nr_max_outstanding_reqs);
+              dmptr_t kv_info_remote_addr, int nr_max_outstanding_reqs,
+              int cache_nr_ents, long cache_staleness_us);
 
 int kv_get_batch_approx(kv_t *kv, int vec_len, kv_vec_item_t *kv_vec);
 
+/*
+ * A get is served by a single read only if one of its candidates is known to hold the key,
+ * otherwise a key in the middle of a cuckoo move could hide behind foreign candidates. With
+ * no matcher set, every get takes the confirming second read.
+ */
+void kv_set_key_matcher(kv_t *kv, kv_key_matcher_t matcher);
+
+/*
+ * Tell the slot cache that one of the values got for @item holds its key. Only such gets
+ * are served from the cache afterwards.
+ */
+void kv_cache_confirm(kv_t *kv, kv_vec_item_t *item);
+
 /* You should guarantee that these keys are NON-EXISTENT!! */
 int kv_put_batch(kv_t *kv, int vec_len, kv_vec_item_t *kv_vec);
 
@@ -60,11 +84,22 @@ int kv_put_batch(kv_t *kv, int vec_len, kv_vec_item_t *kv_vec);
  * (1) ERR_PTR(-EINVAL): This entry is not our target.
  * (2) NULL: Delete this entry.
  * (3) Other valid pointers: The new value of this entry.
+ * The updater may be called again on the same entry if a lock-free attempt is retried
+ * or redone, so it must be idempotent.
  */
 int kv_upd_batch(kv_t *kv, int vec_len, kv_vec_item_t *kv_vec, void *(*updater)(void *, void *));
 
 int kv_scan(kv_t *kv, kv_scanner_t scanner, void *priv);
 
+/*
+ * Scan the shards (and stash strips) whose index is @part modulo @nr_parts, so that a scan can
+ * be split among threads or processes, each with its own kv_t.
+ */
+int kv_scan_part(kv_t *kv, kv_scanner_t scanner, void *priv, int part, int nr_parts);
+
+/* Double the shards whose load factor reaches @max_load_pct, return the number of resized shards */
+int kv_resize(kv_t *kv, int max_load_pct);
+
 #define pr_debug_lookup_vec(vec, vec_len) \
     do { \
         for (int _i = 0; _i < (vec_len); ++_i) { \
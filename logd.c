@@ -184,11 +184,52 @@ static void launch_go_fetcher(ethanefs_t *fs, const char *cli_conf_path, const c
     pthread_create(&worker, NULL, go_fetcher_worker, arg);
 }
 
+struct resize_arg {
+    ethanefs_t *fs;
+    const char *cli_conf_path;
+    ethanefs_logd_config_t *logd_conf;
+};
+
+static void *kv_resizer_worker(void *arg) {
+    struct resize_arg *resize_arg = arg;
+    ethanefs_cli_t *cli;
+
+    pthread_setname_np(pthread_self(), "ethane-rs");
+
+    cli = create_cli(resize_arg->fs, resize_arg->cli_conf_path);
+
+    ethanefs_kv_resize_loop(cli, resize_arg->logd_conf);
+}
+
+static void launch_kv_resizer(ethanefs_t *fs, const char *cli_conf_path, const char *logd_conf_path) {
+    struct resize_arg *arg;
+    pthread_t worker;
+
+    arg = malloc(sizeof(struct resize_arg));
+    if (unlikely(!arg)) {
+        pr_err("failed to allocate memory for workers\n");
+        exit(-1);
+    }
+
+    arg->fs = fs;
+    arg->cli_conf_path = cli_conf_path;
+
+    arg->logd_conf = ethanefs_config_parse_logd(logd_conf_path);
+    if (unlikely(IS_ERR(arg->logd_conf))) {
+        pr_err("failed to parse logd config file: %s\n",
+               strerror((int) -PTR_ERR(arg->logd_conf)));
+        exit(-1);
+    }
+
+    pthread_create(&worker, NULL, kv_resizer_worker, arg);
+}
+
 int main(int argc, const char **argv) {
     const char *zookeeper_ip = "localhost:2181";
     const char *logd_config_path = NULL;
     const char *cli_config_path = NULL;
     int start_go_fetcher = true;
+    int start_kv_resizer = true;
     int nr_chkpt_clis = 4;
     ethanefs_t *fs;
     zhandle_t *zh;
@@ -206,6 +247,9 @@ int main(int argc, const char **argv) {
         OPT_GROUP("Global order array fetching options"),
         OPT_BOOLEAN('g', "go-fetcher", &start_go_fetcher, "start global order array fetching"),
 
+        OPT_GROUP("KV resizing options"),
+        OPT_BOOLEAN('r', "kv-resizer", &start_kv_resizer, "start online KV resizing"),
+
         OPT_END(),
     };
     struct argparse argparse;
@@ -247,6 +291,10 @@ int main(int argc, const char **argv) {
         launch_go_fetcher(fs, cli_config_path, logd_config_path);
     }
 
+    if (start_kv_resizer) {
+        launch_kv_resizer(fs, cli_config_path, logd_config_path);
+    }
+
     /* TODO: wait for all threads to exit */
     for (;;);
 }
@@ -24,6 +24,7 @@
 
 #include "cachefs.h"
 #include "tabhash.h"
+#include "pathdesc.h"
 #include "logger.h"
 #include "trace.h"
 #include "debug.h"
@@ -41,7 +42,13 @@ enum op_type {
     OP_CHOWN,
     OP_WRITE,
     OP_APPEND,
-    OP_TRUNCATE
+    OP_TRUNCATE,
+    OP_RENAME,
+    OP_WRITE_INLINE,
+    OP_WRITE_RANGE,
+    OP_MKDIR_RECURSIVE,
+    OP_RMTREE,
+    OP_CLONE
 };
 
 struct oplogger {
@@ -85,6 +92,11 @@ struct oplog_unlink {
     char path[];
 };
 
+struct oplog_rmtree {
+    struct oplog opl;
+    char path[];
+};
+
 struct oplog_create {
     struct oplog opl;
     dmptr_t dentry_remote_addr;
@@ -128,6 +140,54 @@ struct oplog_truncate {
     char path[];
 };
 
+/* the NUL-terminated path, then the @size bytes of data */
+struct oplog_write_inline {
+    struct oplog opl;
+    dmptr_t remote_dentry_addr;
+    uint16_t offset, size;
+    char path[];
+};
+
+/* the @nr_exts extents, then the NUL-terminated path */
+struct oplog_write_range {
+    struct oplog opl;
+    dmptr_t remote_dentry_addr;
+    int nr_exts;
+    oplogger_extent_t exts[];
+};
+
+/*
+ * the @nr_blks blocks, back to back from offset 0, then the NUL-terminated path; a list
+ * too long for the entry is kept at @blks_remote_addr instead and only the path follows
+ */
+struct oplog_clone {
+    struct oplog opl;
+    dmptr_t remote_dentry_addr;
+    dmptr_t blks_remote_addr;
+    size_t size;
+    int nr_blks;
+    cachefs_blk_t blks[];
+};
+
+static inline const char *clone_path(const struct oplog_clone *op) {
+    return (const char *) (op->blks + (op->blks_remote_addr == DMPTR_NULL ? op->nr_blks : 0));
+}
+
+/* dentries of the components from @first on, then the NUL-terminated path */
+struct oplog_mkdir_recursive {
+    struct oplog opl;
+    mode_t mode;
+    int first, nr;
+    dmptr_t dentry_remote_addrs[];
+};
+
+/* the source path, then the target path, both NUL-terminated */
+struct oplog_rename {
+    struct oplog opl;
+    size_t old_len;
+    char paths[];
+};
+
 oplogger_t *oplogger_init(logger_t *logger, dmcontext_t *ctx, struct cachefs *cfs) {
     oplogger_t *oplogger;
     TAB_generator gen;
@@ -183,20 +243,65 @@ static inline logger_fgprt_t fold_to_fgprt(uint64_t hash) {
     return a ^ b ^ c ^ d;
 }
 
-static inline logger_fgprt_t calc_path_fgprt(oplogger_t *oplogger, const char *path) {
-    uint64_t h = TAB_finalize(&oplogger->hf, TAB_process(&oplogger->hf, (const uint8_t *) path, strlen(path), 0));
-    return fold_to_fgprt(h);
+/* Fingerprints finalize path states (see pathdesc.h), taken from the op's descriptor if possible. */
+static inline logger_fgprt_t calc_fgprt(oplogger_t *oplogger, uint64_t path_state) {
+    return fold_to_fgprt(TAB_finalize(&oplogger->hf, path_state));
+}
+
+static inline logger_fgprt_t calc_path_fgprt(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path) {
+    return calc_fgprt(oplogger, pathdesc_path_state(ctx->pd, path));
 }
 
-static inline logger_fgprt_t calc_path_len_fgprt(oplogger_t *oplogger, const char *path, size_t len) {
-    uint64_t h = TAB_finalize(&oplogger->hf, TAB_process(&oplogger->hf, (const uint8_t *) path, len, 0));
-    return fold_to_fgprt(h);
+static inline logger_fgprt_t calc_path_parent_fgprt(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path) {
+    const char *last_slash;
+
+    if (pathdesc_match(ctx->pd, path)) {
+        return calc_fgprt(oplogger, pathdesc_parent_state(ctx->pd));
+    }
+
+    last_slash = strrchr(path, '/');
+    return calc_fgprt(oplogger, path_state(path, last_slash - path));
 }
 
-static inline logger_fgprt_t calc_path_parent_fgprt(oplogger_t *oplogger, const char *path) {
-    const char *last_slash = strrchr(path, '/');
-    uint64_t h = TAB_finalize(&oplogger->hf, TAB_process(&oplogger->hf, (const uint8_t *) path, last_slash - path, 0));
-    return fold_to_fgprt(h);
+/* Fingerprint of the first @nr_comps components of @path */
+static inline logger_fgprt_t calc_path_prefix_fgprt(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path,
+                                                    int nr_comps) {
+    const char *component, *next;
+    size_t prefix_len = 0;
+    const pathdesc_t *pd;
+    pathdesc_t tmp;
+    int len, i = 0;
+
+    ETHANE_ITER_COMPONENTS(path, component, next, len) {
+        if (i++ == nr_comps) {
+            break;
+        }
+        prefix_len = component + len - path;
+    }
+
+    pd = pathdesc_get(ctx->pd, path, &tmp);
+    return calc_fgprt(oplogger, pathdesc_state(pd, prefix_len));
+}
+
+/*
+ * Both sides of a rename are children of the deepest directory containing the two
+ * parents, so logging with its fingerprint makes every reader of either side replay it.
+ */
+static inline logger_fgprt_t calc_rename_fgprt(oplogger_t *oplogger, const char *old, const char *new) {
+    size_t old_len = strrchr(old, '/') - old, new_len = strrchr(new, '/') - new, common = 0, i;
+
+    for (i = 0; i < old_len && i < new_len && old[i] == new[i]; i++) {
+        if (old[i] == '/') {
+            common = i;
+        }
+    }
+
+    /* one parent contains the other */
+    if ((i == old_len && (i == new_len || new[i] == '/')) || (i == new_len && old[i] == '/')) {
+        common = i;
+    }
+
+    return calc_fgprt(oplogger, path_state(old, common));
 }
 
 static inline void
@@ -257,13 +362,51 @@ oplog_tracepoint(oplogger_t *oplogger, trace_lop_op_type_t log_op_type, struct o
             tracepoint_sample(ethane, log_op, cli_id, log_op_type, TRACE_OP_TRUNCATE, log_pos, op->path);
             break;
         }
+
+        case OP_RENAME: {
+            struct oplog_rename *op = (struct oplog_rename *) oplog;
+            tracepoint_sample(ethane, log_op, cli_id, log_op_type, TRACE_OP_RENAME, log_pos, op->paths);
+            break;
+        }
+
+        case OP_WRITE_INLINE: {
+            struct oplog_write_inline *op = (struct oplog_write_inline *) oplog;
+            tracepoint_sample(ethane, log_op, cli_id, log_op_type, TRACE_OP_WRITE_INLINE, log_pos, op->path);
+            break;
+        }
+
+        case OP_WRITE_RANGE: {
+            struct oplog_write_range *op = (struct oplog_write_range *) oplog;
+            tracepoint_sample(ethane, log_op, cli_id, log_op_type, TRACE_OP_WRITE_RANGE, log_pos,
+                              (const char *) (op->exts + op->nr_exts));
+            break;
+        }
+
+        case OP_CLONE: {
+            struct oplog_clone *op = (struct oplog_clone *) oplog;
+            tracepoint_sample(ethane, log_op, cli_id, log_op_type, TRACE_OP_CLONE, log_pos, clone_path(op));
+            break;
+        }
+
+        case OP_RMTREE: {
+            struct oplog_rmtree *op = (struct oplog_rmtree *) oplog;
+            tracepoint_sample(ethane, log_op, cli_id, log_op_type, TRACE_OP_RMTREE, log_pos, op->path);
+            break;
+        }
+
+        case OP_MKDIR_RECURSIVE: {
+            struct oplog_mkdir_recursive *op = (struct oplog_mkdir_recursive *) oplog;
+            tracepoint_sample(ethane, log_op, cli_id, log_op_type, TRACE_OP_MKDIR_RECURSIVE, log_pos,
+                              (const char *) (op->dentry_remote_addrs + op->nr));
+            break;
+        }
     }
 }
 
 dmptr_t
 oplogger_mkdir(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path, mode_t mode, dmptr_t dentry_remote_addr) {
     struct oplog_mkdir *oplog = (struct oplog_mkdir *) oplogger->buf;
-    logger_fgprt_t fgprt = calc_path_parent_fgprt(oplogger, path);
+    logger_fgprt_t fgprt = calc_path_parent_fgprt(oplogger, ctx, path);
     dmptr_t ret;
     init_op((struct oplog *) oplog, ctx, OP_MKDIR, OP_RESULT_UNDETERMINED);
     oplog->dentry_remote_addr = dentry_remote_addr;
@@ -275,9 +418,35 @@ oplogger_mkdir(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path, mode
     return ret;
 }
 
+/*
+ * All the new directories are below the parent of component @first, so the op is
+ * logged with its fingerprint, like a mkdir of that component.
+ */
+dmptr_t oplogger_mkdir_recursive(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path, mode_t mode,
+                                 int first, int nr, const dmptr_t *dentry_remote_addrs) {
+    struct oplog_mkdir_recursive *oplog = (struct oplog_mkdir_recursive *) oplogger->buf;
+    logger_fgprt_t fgprt = calc_path_prefix_fgprt(oplogger, ctx, path, first);
+    size_t addrs_size = nr * sizeof(*dentry_remote_addrs), path_len = strlen(path);
+    dmptr_t ret;
+    ethane_assert(first > 0);
+    if (unlikely(sizeof(struct oplog_mkdir_recursive) + addrs_size + path_len + 1 > OPLOGGER_BUF_SIZE)) {
+        return (dmptr_t) ERR_PTR(-ENAMETOOLONG);
+    }
+    init_op((struct oplog *) oplog, ctx, OP_MKDIR_RECURSIVE, OP_RESULT_UNDETERMINED);
+    oplog->mode = mode;
+    oplog->first = first;
+    oplog->nr = nr;
+    memcpy(oplog->dentry_remote_addrs, dentry_remote_addrs, addrs_size);
+    memcpy(oplog->dentry_remote_addrs + nr, path, path_len + 1);
+    ret = logger_get_tail_and_append(oplogger->logger, &ctx->target_tail, oplog,
+                                     sizeof(struct oplog_mkdir_recursive) + addrs_size + path_len + 1, fgprt, 0);
+    oplog_tracepoint(oplogger, TRACE_LOG_OP_APPEND, (struct oplog *) oplog, ctx->target_tail);
+    return ret;
+}
+
 dmptr_t oplogger_rmdir(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path) {
     struct oplog_rmdir *oplog = (struct oplog_rmdir *) oplogger->buf;
-    logger_fgprt_t fgprt = calc_path_parent_fgprt(oplogger, path);
+    logger_fgprt_t fgprt = calc_path_parent_fgprt(oplogger, ctx, path);
     dmptr_t ret;
     init_op((struct oplog *) oplog, ctx, OP_RMDIR, OP_RESULT_UNDETERMINED);
     strcpy(oplog->path, path);
@@ -287,9 +456,22 @@ dmptr_t oplogger_rmdir(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *pa
     return ret;
 }
 
+/* Like a rmdir, whatever is below the directory goes along with it */
+dmptr_t oplogger_rmtree(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path) {
+    struct oplog_rmtree *oplog = (struct oplog_rmtree *) oplogger->buf;
+    logger_fgprt_t fgprt = calc_path_parent_fgprt(oplogger, ctx, path);
+    dmptr_t ret;
+    init_op((struct oplog *) oplog, ctx, OP_RMTREE, OP_RESULT_UNDETERMINED);
+    strcpy(oplog->path, path);
+    ret = logger_get_tail_and_append(oplogger->logger, &ctx->target_tail, oplog,
+                                     sizeof(struct oplog_rmtree) + strlen(path) + 1, fgprt, 0);
+    oplog_tracepoint(oplogger, TRACE_LOG_OP_APPEND, (struct oplog *) oplog, ctx->target_tail);
+    return ret;
+}
+
 dmptr_t oplogger_unlink(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path) {
     struct oplog_unlink *oplog = (struct oplog_unlink *) oplogger->buf;
-    logger_fgprt_t fgprt = calc_path_parent_fgprt(oplogger, path);
+    logger_fgprt_t fgprt = calc_path_parent_fgprt(oplogger, ctx, path);
     dmptr_t ret;
     init_op((struct oplog *) oplog, ctx, OP_UNLINK, OP_RESULT_UNDETERMINED);
     strcpy(oplog->path, path);
@@ -299,10 +481,28 @@ dmptr_t oplogger_unlink(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *p
     return ret;
 }
 
+dmptr_t oplogger_rename(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *old_path, const char *new_path) {
+    struct oplog_rename *oplog = (struct oplog_rename *) oplogger->buf;
+    logger_fgprt_t fgprt = calc_rename_fgprt(oplogger, old_path, new_path);
+    size_t old_len = strlen(old_path), new_len = strlen(new_path);
+    dmptr_t ret;
+    if (unlikely(sizeof(struct oplog_rename) + old_len + new_len + 2 > OPLOGGER_BUF_SIZE)) {
+        return (dmptr_t) ERR_PTR(-ENAMETOOLONG);
+    }
+    init_op((struct oplog *) oplog, ctx, OP_RENAME, OP_RESULT_UNDETERMINED);
+    oplog->old_len = old_len;
+    memcpy(oplog->paths, old_path, old_len + 1);
+    memcpy(oplog->paths + old_len + 1, new_path, new_len + 1);
+    ret = logger_get_tail_and_append(oplogger->logger, &ctx->target_tail, oplog,
+                                     sizeof(struct oplog_rename) + old_len + new_len + 2, fgprt, 0);
+    oplog_tracepoint(oplogger, TRACE_LOG_OP_APPEND, (struct oplog *) oplog, ctx->target_tail);
+    return ret;
+}
+
 dmptr_t
 oplogger_create(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path, mode_t mode, dmptr_t dentry_remote_addr) {
     struct oplog_create *oplog = (struct oplog_create *) oplogger->buf;
-    logger_fgprt_t fgprt = calc_path_parent_fgprt(oplogger, path);
+    logger_fgprt_t fgprt = calc_path_parent_fgprt(oplogger, ctx, path);
     dmptr_t ret;
     init_op((struct oplog *) oplog, ctx, OP_CREATE, OP_RESULT_UNDETERMINED);
     oplog->dentry_remote_addr = dentry_remote_addr;
@@ -316,7 +516,7 @@ oplogger_create(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path, mod
 
 dmptr_t oplogger_chmod(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path, mode_t mode) {
     struct oplog_chmod *oplog = (struct oplog_chmod *) oplogger->buf;
-    logger_fgprt_t fgprt = calc_path_fgprt(oplogger, path);
+    logger_fgprt_t fgprt = calc_path_fgprt(oplogger, ctx, path);
     dmptr_t ret;
     init_op((struct oplog *) oplog, ctx, OP_CHMOD, OP_RESULT_UNDETERMINED);
     oplog->mode = mode;
@@ -329,7 +529,7 @@ dmptr_t oplogger_chmod(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *pa
 
 dmptr_t oplogger_chown(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path, uid_t uid, gid_t gid) {
     struct oplog_chown *oplog = (struct oplog_chown *) oplogger->buf;
-    logger_fgprt_t fgprt = calc_path_fgprt(oplogger, path);
+    logger_fgprt_t fgprt = calc_path_fgprt(oplogger, ctx, path);
     dmptr_t ret;
     init_op((struct oplog *) oplog, ctx, OP_CHOWN, OP_RESULT_UNDETERMINED);
     oplog->uid = uid;
@@ -344,7 +544,7 @@ dmptr_t oplogger_chown(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *pa
 dmptr_t oplogger_write(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path, dmptr_t dentry,
                        dmptr_t blk_remote_addr, size_t size, off_t offset) {
     struct oplog_write *oplog = (struct oplog_write *) oplogger->buf;
-    logger_fgprt_t fgprt = calc_path_fgprt(oplogger, path);
+    logger_fgprt_t fgprt = calc_path_fgprt(oplogger, ctx, path);
     dmptr_t ret;
     init_op((struct oplog *) oplog, ctx, OP_WRITE, OP_RESULT_DO_UPDATE);
     oplog->remote_dentry_addr = dentry;
@@ -358,10 +558,75 @@ dmptr_t oplogger_write(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *pa
     return ret;
 }
 
+dmptr_t oplogger_write_range(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path, dmptr_t dentry,
+                             int nr_exts, const oplogger_extent_t *exts) {
+    struct oplog_write_range *oplog = (struct oplog_write_range *) oplogger->buf;
+    logger_fgprt_t fgprt = calc_path_fgprt(oplogger, ctx, path);
+    size_t exts_size = nr_exts * sizeof(*exts), path_len = strlen(path);
+    dmptr_t ret;
+    if (unlikely(sizeof(struct oplog_write_range) + exts_size + path_len + 1 > OPLOGGER_BUF_SIZE)) {
+        return (dmptr_t) ERR_PTR(-E2BIG);
+    }
+    init_op((struct oplog *) oplog, ctx, OP_WRITE_RANGE, OP_RESULT_DO_UPDATE);
+    oplog->remote_dentry_addr = dentry;
+    oplog->nr_exts = nr_exts;
+    memcpy(oplog->exts, exts, exts_size);
+    memcpy(oplog->exts + nr_exts, path, path_len + 1);
+    ret = logger_get_tail_and_append(oplogger->logger, &ctx->target_tail, oplog,
+                                     sizeof(struct oplog_write_range) + exts_size + path_len + 1, fgprt, 1);
+    oplog_tracepoint(oplogger, TRACE_LOG_OP_APPEND, (struct oplog *) oplog, ctx->target_tail);
+    return ret;
+}
+
+dmptr_t oplogger_clone(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path, dmptr_t dentry, size_t size,
+                       int nr_blks, const struct cachefs_blk *blks, dmptr_t blks_remote_addr) {
+    struct oplog_clone *oplog = (struct oplog_clone *) oplogger->buf;
+    logger_fgprt_t fgprt = calc_path_fgprt(oplogger, ctx, path);
+    int nr_inline = blks_remote_addr == DMPTR_NULL ? nr_blks : 0;
+    size_t blks_size = nr_inline * sizeof(*blks), path_len = strlen(path);
+    dmptr_t ret;
+    if (unlikely(sizeof(struct oplog_clone) + blks_size + path_len + 1 > OPLOGGER_BUF_SIZE)) {
+        return (dmptr_t) ERR_PTR(-E2BIG);
+    }
+    init_op((struct oplog *) oplog, ctx, OP_CLONE, OP_RESULT_DO_UPDATE);
+    oplog->remote_dentry_addr = dentry;
+    oplog->blks_remote_addr = blks_remote_addr;
+    oplog->size = size;
+    oplog->nr_blks = nr_blks;
+    memcpy(oplog->blks, blks, blks_size);
+    memcpy(oplog->blks + nr_inline, path, path_len + 1);
+    ret = logger_get_tail_and_append(oplogger->logger, &ctx->target_tail, oplog,
+                                     sizeof(struct oplog_clone) + blks_size + path_len + 1, fgprt, 0);
+    oplog_tracepoint(oplogger, TRACE_LOG_OP_APPEND, (struct oplog *) oplog, ctx->target_tail);
+    return ret;
+}
+
+dmptr_t oplogger_write_inline(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path, dmptr_t dentry,
+                              const void *data, size_t size, off_t offset) {
+    struct oplog_write_inline *oplog = (struct oplog_write_inline *) oplogger->buf;
+    logger_fgprt_t fgprt = calc_path_fgprt(oplogger, ctx, path);
+    size_t path_len = strlen(path);
+    dmptr_t ret;
+    ethane_assert(offset + size <= ETHANE_INLINE_DATA_MAX);
+    if (unlikely(sizeof(struct oplog_write_inline) + path_len + 1 + size > OPLOGGER_BUF_SIZE)) {
+        return (dmptr_t) ERR_PTR(-ENAMETOOLONG);
+    }
+    init_op((struct oplog *) oplog, ctx, OP_WRITE_INLINE, OP_RESULT_DO_UPDATE);
+    oplog->remote_dentry_addr = dentry;
+    oplog->offset = offset;
+    oplog->size = size;
+    memcpy(oplog->path, path, path_len + 1);
+    memcpy(oplog->path + path_len + 1, data, size);
+    ret = logger_get_tail_and_append(oplogger->logger, &ctx->target_tail, oplog,
+                                     sizeof(struct oplog_write_inline) + path_len + 1 + size, fgprt, 1);
+    oplog_tracepoint(oplogger, TRACE_LOG_OP_APPEND, (struct oplog *) oplog, ctx->target_tail);
+    return ret;
+}
+
 dmptr_t oplogger_append(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path, dmptr_t dentry,
                         dmptr_t blk_remote_addr, size_t size) {
     struct oplog_append *oplog = (struct oplog_append *) oplogger->buf;
-    logger_fgprt_t fgprt = calc_path_fgprt(oplogger, path);
+    logger_fgprt_t fgprt = calc_path_fgprt(oplogger, ctx, path);
     dmptr_t ret;
     init_op((struct oplog *) oplog, ctx, OP_APPEND, OP_RESULT_DO_UPDATE);
     oplog->remote_dentry_addr = dentry;
@@ -376,7 +641,7 @@ dmptr_t oplogger_append(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *p
 
 dmptr_t oplogger_truncate(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path, dmptr_t dentry, size_t size) {
     struct oplog_truncate *oplog = (struct oplog_truncate *) oplogger->buf;
-    logger_fgprt_t fgprt = calc_path_fgprt(oplogger, path);
+    logger_fgprt_t fgprt = calc_path_fgprt(oplogger, ctx, path);
     dmptr_t ret;
     init_op((struct oplog *) oplog, ctx, OP_TRUNCATE, OP_RESULT_DO_UPDATE);
     oplog->remote_dentry_addr = dentry;
@@ -431,18 +696,23 @@ enum replay_dep_type {
     DEP_PREFIX,
 };
 
-static int *get_deps(oplogger_t *oplogger, int *nr_deps, const char *path, enum replay_dep_type dep_type) {
+static int *get_deps(oplogger_t *oplogger, oplogger_ctx_t *ctx, int *nr_deps, const char *path,
+                     enum replay_dep_type dep_type) {
     const char *component, *next;
     int *deps, i = 0, len;
+    const pathdesc_t *pd;
     size_t pre_size;
+    pathdesc_t tmp;
+
+    pd = pathdesc_get(ctx->pd, path, &tmp);
 
     switch (dep_type) {
         case DEP_PARENT_PREFIX:
-            *nr_deps = ethane_get_dir_depth(path) - 1;
+            *nr_deps = pd->depth - 1;
             break;
 
         case DEP_PREFIX:
-            *nr_deps = ethane_get_dir_depth(path);
+            *nr_deps = pd->depth;
             break;
 
         default:
@@ -461,16 +731,84 @@ static int *get_deps(oplogger_t *oplogger, int *nr_deps, const char *path, enum
             break;
         }
 
-        deps[i++] = calc_path_len_fgprt(oplogger, path, pre_size);
+        deps[i++] = calc_fgprt(oplogger, pathdesc_state(pd, pre_size));
     }
 
 out:
     return deps;
 }
 
+/* Read the out-of-line extent list of a clone in rounds of what the op buffer holds. */
+static int read_clone_blks(oplogger_t *oplogger, dmptr_t remote_addr, cachefs_blk_t *blks, int nr_blks) {
+    size_t size = nr_blks * sizeof(*blks), off, len;
+    int ret = 0;
+    void *buf;
+
+    for (off = 0; off < size; off += len) {
+        len = min(size - off, IO_SIZE);
+
+        dm_mark(oplogger->dmcontext);
+
+        buf = dm_push(oplogger->dmcontext, NULL, len);
+        if (unlikely(!buf)) {
+            ret = -ENOMEM;
+            goto out_pop;
+        }
+
+        ret = dm_copy_from_remote(oplogger->dmcontext, buf, remote_addr + off, len, DMFLAG_ACK);
+        if (unlikely(ret)) {
+            goto out_pop;
+        }
+
+        ret = dm_wait_ack(oplogger->dmcontext, 1);
+        if (likely(!ret)) {
+            memcpy((char *) blks + off, buf, len);
+        }
+
+out_pop:
+        dm_pop(oplogger->dmcontext);
+
+        if (unlikely(ret)) {
+            break;
+        }
+    }
+
+    return ret;
+}
+
+static int replay_clone(oplogger_t *oplogger, cachefs_ctx_t *ctx, struct oplog_clone *op, size_t log_pos) {
+    const char *path = clone_path(op);
+    cachefs_blk_t *blks;
+    int ret;
+
+    if (op->blks_remote_addr == DMPTR_NULL) {
+        return cachefs_clone(oplogger->cfs, ctx, path, op->remote_dentry_addr, op->size, op->nr_blks, op->blks,
+                             log_pos);
+    }
+
+    blks = malloc(op->nr_blks * sizeof(*blks));
+    if (unlikely(!blks)) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    ret = read_clone_blks(oplogger, op->blks_remote_addr, blks, op->nr_blks);
+    if (unlikely(ret)) {
+        goto out_free;
+    }
+
+    ret = cachefs_clone(oplogger->cfs, ctx, path, op->remote_dentry_addr, op->size, op->nr_blks, blks, log_pos);
+
+out_free:
+    free(blks);
+
+out:
+    return ret;
+}
+
 static int log_replay(oplogger_t *oplogger, struct oplog *oplog, size_t log_pos, dmptr_t log_remote_addr,
-                      bool wait_result) {
-    cachefs_ctx_t ctx = { .uid = oplog->uid, .gid = oplog->gid };
+                      bool wait_result, const pathdesc_t *pd) {
+    cachefs_ctx_t ctx = { .uid = oplog->uid, .gid = oplog->gid, .pd = pd };
     int retry_cnt = 0;
 
     oplog_tracepoint(oplogger, TRACE_LOG_OP_REPLAY, oplog, log_pos);
@@ -557,6 +895,60 @@ static int log_replay(oplogger_t *oplogger, struct oplog *oplog, size_t log_pos,
             return cachefs_truncate(oplogger->cfs, &ctx, op->path, op->remote_dentry_addr, op->size, log_pos);
         }
 
+        case OP_RENAME: {
+            struct oplog_rename *op = (struct oplog_rename *) oplog;
+            if (unlikely(op->opl.result == OP_RESULT_CANCELED)) {
+                return 0;
+            }
+            return cachefs_rename(oplogger->cfs, &ctx, op->paths, op->paths + op->old_len + 1, &oplog->result,
+                                  log_pos);
+        }
+
+        case OP_WRITE_INLINE: {
+            struct oplog_write_inline *op = (struct oplog_write_inline *) oplog;
+            long ret = cachefs_write_inline(oplogger->cfs, &ctx, op->path, op->remote_dentry_addr, op->offset,
+                                            op->path + strlen(op->path) + 1, op->size, log_pos);
+            /* the file has spilled to blocks since, the writer falls back to a block write */
+            return IS_ERR(ret) && ret != -ENODATA ? PTR_ERR(ret) : 0;
+        }
+
+        case OP_WRITE_RANGE: {
+            struct oplog_write_range *op = (struct oplog_write_range *) oplog;
+            const char *path = (const char *) (op->exts + op->nr_exts);
+            cachefs_blk_t blk;
+            long ret = 0;
+            int i;
+            for (i = 0; i < op->nr_exts && !IS_ERR(ret); i++) {
+                blk.size = op->exts[i].size;
+                blk.blk_remote_addr = op->exts[i].blk_remote_addr;
+                ret = cachefs_write(oplogger->cfs, &ctx, path, op->remote_dentry_addr, op->exts[i].off, &blk,
+                                    log_pos);
+            }
+            return IS_ERR(ret) ? PTR_ERR(ret) : 0;
+        }
+
+        case OP_CLONE: {
+            return replay_clone(oplogger, &ctx, (struct oplog_clone *) oplog, log_pos);
+        }
+
+        case OP_RMTREE: {
+            struct oplog_rmtree *op = (struct oplog_rmtree *) oplog;
+            if (unlikely(op->opl.result == OP_RESULT_CANCELED)) {
+                return 0;
+            }
+            return cachefs_rmtree(oplogger->cfs, &ctx, op->path, &oplog->result, log_pos);
+        }
+
+        case OP_MKDIR_RECURSIVE: {
+            struct oplog_mkdir_recursive *op = (struct oplog_mkdir_recursive *) oplog;
+            if (unlikely(op->opl.result == OP_RESULT_CANCELED)) {
+                return 0;
+            }
+            return cachefs_mkdir_recursive(oplogger->cfs, &ctx, (const char *) (op->dentry_remote_addrs + op->nr),
+                                           &oplog->result, op->mode, op->first, op->nr, op->dentry_remote_addrs,
+                                           log_pos);
+        }
+
         default:
             ethane_assert(0);
     }
@@ -566,7 +958,7 @@ static int log_ingest(void *log_data, void *ctx, size_t log_pos, size_t log_remo
     oplogger_ctx_t *c = (oplogger_ctx_t *) ctx;
     struct oplog *oplog = log_data;
     int ret;
-    ret = log_replay(c->oplogger, oplog, log_pos, log_remote_addr, c->wait_check);
+    ret = log_replay(c->oplogger, oplog, log_pos, log_remote_addr, c->wait_check, c->pd);
     if (c->replay_cb) {
         c->replay_cb(c->oplogger, c, c->replay_ctx, log_pos);
     }
@@ -592,7 +984,7 @@ do_replay(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path, enum repl
     cachefs_set_version(oplogger->cfs, logger_get_head(oplogger->logger));
 
     if (path) {
-        deps = get_deps(oplogger, &nr_deps, path, dep_type);
+        deps = get_deps(oplogger, ctx, &nr_deps, path, dep_type);
         if (unlikely(!deps)) {
             ret = -ENOMEM;
             goto out;
@@ -661,14 +1053,37 @@ int oplogger_replay_mkdir(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char
     return do_replay(oplogger, ctx, path, DEP_PARENT_PREFIX, force, off);
 }
 
+/* Every existing prefix may be where the new directories start */
+int oplogger_replay_mkdir_recursive(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path, bool force,
+                                    int off) {
+    return do_replay(oplogger, ctx, path, DEP_PARENT_PREFIX, force, off);
+}
+
 int oplogger_replay_rmdir(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path, bool force, int off) {
     return do_replay(oplogger, ctx, path, DEP_PREFIX, force, off);
 }
 
+int oplogger_replay_rmtree(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path, bool force, int off) {
+    return do_replay(oplogger, ctx, path, DEP_PREFIX, force, off);
+}
+
 int oplogger_replay_unlink(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path, bool force, int off) {
     return do_replay(oplogger, ctx, path, DEP_PARENT_PREFIX, force, off);
 }
 
+int oplogger_replay_rename(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *old_path, const char *new_path,
+                           bool force, int off) {
+    int ret;
+
+    /* the ops on the source itself (and on the children of a directory) go with it */
+    ret = do_replay(oplogger, ctx, old_path, DEP_PREFIX, force, off);
+    if (unlikely(ret < 0)) {
+        return ret;
+    }
+
+    return do_replay(oplogger, ctx, new_path, DEP_PARENT_PREFIX, force, off);
+}
+
 int oplogger_replay_create(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path, bool force, int off) {
     return do_replay(oplogger, ctx, path, DEP_PARENT_PREFIX, force, off);
 }
@@ -693,6 +1108,11 @@ int oplogger_replay_open(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *
     return do_replay(oplogger, ctx, path, DEP_PREFIX, force, off);
 }
 
+/* Children of a directory are logged with its fingerprint, which is its last prefix. */
+int oplogger_replay_readdir(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path, bool force, int off) {
+    return do_replay(oplogger, ctx, path, DEP_PREFIX, force, off);
+}
+
 int oplogger_replay_append(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path, bool force, int off) {
     return do_replay(oplogger, ctx, path, DEP_PREFIX, force, off);
 }
@@ -14,6 +14,15 @@
 typedef struct oplogger oplogger_t;
 typedef struct oplogger_ctx oplogger_ctx_t;
 
+struct pathdesc;
+struct cachefs_blk;
+
+/* An extent written by a write-range op, see oplogger_write_range() */
+typedef struct oplogger_extent {
+    size_t off, size;
+    dmptr_t blk_remote_addr;
+} oplogger_extent_t;
+
 typedef int (*oplogger_replay_cb_t)(oplogger_t *, oplogger_ctx_t *, void *, size_t);
 
 struct oplogger_ctx {
@@ -32,6 +41,9 @@ struct oplogger_ctx {
 
     void *priv;
 
+    /* Optional descriptor of the op's path, reused instead of rehashing it */
+    const struct pathdesc *pd;
+
     /* You may not initialize these fields. */
 
     size_t target_tail;
@@ -45,14 +57,31 @@ void oplogger_snapshot_end(oplogger_t *oplogger, oplogger_ctx_t *ctx, long old_v
 
 dmptr_t
 oplogger_mkdir(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path, mode_t mode, dmptr_t dentry_remote_addr);
+/* Make the directories of components [@first, @first + @nr) of @path, one dentry for each */
+dmptr_t oplogger_mkdir_recursive(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path, mode_t mode,
+                                 int first, int nr, const dmptr_t *dentry_remote_addrs);
 dmptr_t oplogger_rmdir(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path);
+dmptr_t oplogger_rmtree(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path);
 dmptr_t oplogger_unlink(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path);
+dmptr_t oplogger_rename(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *old_path, const char *new_path);
 dmptr_t
 oplogger_create(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path, mode_t mode, dmptr_t dentry_remote_addr);
 dmptr_t oplogger_chmod(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path, mode_t mode);
 dmptr_t oplogger_chown(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path, uid_t uid, gid_t gid);
 dmptr_t oplogger_write(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path, dmptr_t dentry,
                        dmptr_t blk_remote_addr, size_t size, off_t offset);
+/* Writes of several extents in one op, each applied as by oplogger_write() */
+dmptr_t oplogger_write_range(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path, dmptr_t dentry,
+                             int nr_exts, const oplogger_extent_t *exts);
+/*
+ * Replace the data of the file with the @blks back to back and set its size to @size, in one op.
+ * -E2BIG if @blks do not fit in the entry; then pass their copy at @blks_remote_addr, else DMPTR_NULL.
+ */
+dmptr_t oplogger_clone(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path, dmptr_t dentry, size_t size,
+                       int nr_blks, const struct cachefs_blk *blks, dmptr_t blks_remote_addr);
+/* A write of a few bytes into the data kept in the dentry, the log carries the bytes */
+dmptr_t oplogger_write_inline(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path, dmptr_t dentry,
+                              const void *data, size_t size, off_t offset);
 dmptr_t oplogger_append(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path, dmptr_t dentry,
                         dmptr_t blk_remote_addr, size_t size);
 dmptr_t oplogger_truncate(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path, dmptr_t dentry, size_t size);
@@ -66,14 +95,20 @@ size_t oplogger_get_next_replay_from(oplogger_t *oplogger, oplogger_ctx_t *ctx);
 int oplogger_replay_all(oplogger_t *oplogger, oplogger_ctx_t *ctx, bool force, int off);
 int oplogger_replay_getattr(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path, bool force, int off);
 int oplogger_replay_mkdir(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path, bool force, int off);
+int oplogger_replay_mkdir_recursive(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path, bool force,
+                                    int off);
 int oplogger_replay_rmdir(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path, bool force, int off);
+int oplogger_replay_rmtree(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path, bool force, int off);
 int oplogger_replay_unlink(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path, bool force, int off);
+int oplogger_replay_rename(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *old_path, const char *new_path,
+                           bool force, int off);
 int oplogger_replay_create(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path, bool force, int off);
 int oplogger_replay_chmod(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path, bool force, int off);
 int oplogger_replay_chown(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path, bool force, int off);
 int oplogger_replay_write(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path, bool force, int off);
 int oplogger_replay_read(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path, bool force, int off);
 int oplogger_replay_open(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path, bool force, int off);
+int oplogger_replay_readdir(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path, bool force, int off);
 int oplogger_replay_append(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path, bool force, int off);
 int oplogger_replay_truncate(oplogger_t *oplogger, oplogger_ctx_t *ctx, const char *path, bool force, int off);
 
@@ -0,0 +1,201 @@
+/*
+ * Copyright 2023 Regents of Nanjing University of Aeronautics and Astronautics and
+ * Hohai University, Miao Cai <miaocai@nuaa.edu.cn> and Junru Shen <jrshen@hhu.edu.cn>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "pathdesc.h"
+#include "tabhash.h"
+#include "ethane.h"
+
+#define PATH_HASH_SEED      7
+
+static TAB_hash path_hf;
+static pthread_once_t path_hf_once = PTHREAD_ONCE_INIT;
+
+static void init_path_hf() {
+    TAB_generator gen;
+    TAB_init_generator(&gen, TAB_DEFAULT_SEED);
+    TAB_init_hash(&path_hf, &gen, PATH_HASH_SEED);
+}
+
+static inline TAB_hash *get_path_hf() {
+    pthread_once(&path_hf_once, init_path_hf);
+    return &path_hf;
+}
+
+/*
+ * Run @body with @pos set to each position of '/' in path[from, to), in order.
+ * The vector loop never loads beyond @to; the tail is scanned byte by byte.
+ */
+#define FOR_EACH_SLASH(path, from, to, pos, body)                                               \
+    do {                                                                                        \
+        const char *__p = (path);                                                               \
+        size_t __i = (from), __to = (to);                                                       \
+        FOR_EACH_SLASH_VEC(__p, __i, __to, pos, body)                                           \
+        for (; __i < __to; __i++) {                                                             \
+            if (__p[__i] == '/') {                                                              \
+                (pos) = __i;                                                                    \
+                body                                                                            \
+            }                                                                                   \
+        }                                                                                       \
+    } while (0)
+
+#if defined(__AVX2__)
+#define FOR_EACH_SLASH_VEC(p, i, to, pos, body)                                                 \
+    for (; (i) + 32 <= (to); (i) += 32) {                                                       \
+        __m256i __v = _mm256_loadu_si256((const __m256i *) ((p) + (i)));                       \
+        uint32_t __m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(__v, _mm256_set1_epi8('/')));     \
+        for (; __m; __m &= __m - 1) {                                                           \
+            (pos) = (i) + __builtin_ctz(__m);                                                   \
+            body                                                                                \
+        }                                                                                       \
+    }
+#elif defined(__SSE2__)
+#define FOR_EACH_SLASH_VEC(p, i, to, pos, body)                                                 \
+    for (; (i) + 16 <= (to); (i) += 16) {                                                       \
+        __m128i __v = _mm_loadu_si128((const __m128i *) ((p) + (i)));                           \
+        uint32_t __m = _mm_movemask_epi8(_mm_cmpeq_epi8(__v, _mm_set1_epi8('/')));              \
+        for (; __m; __m &= __m - 1) {                                                           \
+            (pos) = (i) + __builtin_ctz(__m);                                                   \
+            body                                                                                \
+        }                                                                                       \
+    }
+#else
+#define FOR_EACH_SLASH_VEC(p, i, to, pos, body)
+#endif
+
+/* Chain the state of path[0, from) through the segments of path[from, to). */
+static uint64_t chain_state(TAB_hash *hf, const char *path, size_t from, size_t to, uint64_t state) {
+    size_t pos, seg = from;
+
+    FOR_EACH_SLASH(path, from, to, pos, {
+        if (pos > seg) {
+            state = TAB_process(hf, (const uint8_t *) path + seg, pos - seg, state);
+        }
+        seg = pos;
+    });
+
+    if (to > seg) {
+        state = TAB_process(hf, (const uint8_t *) path + seg, to - seg, state);
+    }
+
+    return state;
+}
+
+uint64_t path_state(const void *key, size_t len) {
+    return chain_state(get_path_hf(), key, 0, len, 0);
+}
+
+static inline void add_prefix(pathdesc_t *pd, size_t len, uint64_t state) {
+    if (pd->depth < PATHDESC_MAX_DEPTH) {
+        pd->prefix_lens[pd->depth] = len;
+        pd->prefix_states[pd->depth] = state;
+    }
+    pd->depth++;
+}
+
+void pathdesc_init(pathdesc_t *pd, const char *path) {
+    TAB_hash *hf = get_path_hf();
+    uint64_t state = 0;
+    size_t pos, seg = 0;
+
+    pd->path = path;
+    pd->len = strlen(path);
+    pd->depth = 0;
+
+    /* the prefixes end right before each '/' and at the end of the path */
+    FOR_EACH_SLASH(path, 0, pd->len, pos, {
+        if (pos > seg) {
+            state = TAB_process(hf, (const uint8_t *) path + seg, pos - seg, state);
+        }
+        add_prefix(pd, pos, state);
+        seg = pos;
+    });
+
+    if (pd->len > seg) {
+        state = TAB_process(hf, (const uint8_t *) path + seg, pd->len - seg, state);
+    }
+    add_prefix(pd, pd->len, state);
+
+    pd->state = state;
+}
+
+bool pathdesc_match(const pathdesc_t *pd, const char *path) {
+    if (!pd) {
+        return false;
+    }
+    if (pd->path == path) {
+        return true;
+    }
+    /* e.g. the path of our own op read back from the log */
+    return strncmp(pd->path, path, pd->len) == 0 && path[pd->len] == '\0';
+}
+
+const pathdesc_t *pathdesc_get(const pathdesc_t *pd, const char *path, pathdesc_t *tmp) {
+    if (pathdesc_match(pd, path)) {
+        return pd;
+    }
+    pathdesc_init(tmp, path);
+    return tmp;
+}
+
+uint64_t pathdesc_path_state(const pathdesc_t *pd, const char *path) {
+    return pathdesc_match(pd, path) ? pd->state : path_state(path, strlen(path));
+}
+
+uint64_t pathdesc_state(const pathdesc_t *pd, size_t len) {
+    int lo = 0, hi = min(pd->depth, PATHDESC_MAX_DEPTH) - 1, mid;
+
+    if (len == pd->len) {
+        return pd->state;
+    }
+
+    while (lo <= hi) {
+        mid = (lo + hi) / 2;
+        if (pd->prefix_lens[mid] == len) {
+            return pd->prefix_states[mid];
+        }
+        if (pd->prefix_lens[mid] < len) {
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    /* resume from the longest recorded prefix that is shorter */
+    if (hi >= 0) {
+        return chain_state(get_path_hf(), pd->path, pd->prefix_lens[hi], len, pd->prefix_states[hi]);
+    }
+    return chain_state(get_path_hf(), pd->path, 0, len, 0);
+}
+
+uint64_t pathdesc_parent_state(const pathdesc_t *pd) {
+    const char *last_slash;
+
+    if (pd->depth - 2 >= 0 && pd->depth - 2 < PATHDESC_MAX_DEPTH) {
+        return pd->prefix_states[pd->depth - 2];
+    }
+
+    last_slash = strrchr(pd->path, '/');
+    return last_slash ? pathdesc_state(pd, last_slash - pd->path) : 0;
+}
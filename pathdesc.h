@@ -0,0 +1,72 @@
+/*
+ * Copyright 2023 Regents of Nanjing University of Aeronautics and Astronautics and
+ * Hohai University, Miao Cai <miaocai@nuaa.edu.cn> and Junru Shen <jrshen@hhu.edu.cn>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Path Descriptor
+ *   A path is tokenised once per FS operation, and the universal hash state
+ * of each of its prefixes is computed in the same pass by chaining the state
+ * of the previous prefix through the next "/component" segment. Every layer
+ * (oplogger fingerprints, cacheFS ns cache, KV buckets and shards) derives its
+ * own hash by finalizing the shared state with its own hash function, so a
+ * prefix is never hashed twice.
+ *   path_state() computes the same chained state for an arbitrary key, so
+ * states taken from a descriptor and states computed on the fly always agree.
+ */
+
+#ifndef ETHANE_PATHDESC_H
+#define ETHANE_PATHDESC_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define PATHDESC_MAX_DEPTH      64
+
+typedef struct pathdesc pathdesc_t;
+
+struct pathdesc {
+    const char *path;
+    size_t len;
+    uint64_t state;
+
+    /* prefixes beyond PATHDESC_MAX_DEPTH are hashed on demand */
+    int depth;
+    uint32_t prefix_lens[PATHDESC_MAX_DEPTH];
+    uint64_t prefix_states[PATHDESC_MAX_DEPTH];
+};
+
+void pathdesc_init(pathdesc_t *pd, const char *path);
+
+/* Whether @pd (may be NULL) describes a path equal to @path */
+bool pathdesc_match(const pathdesc_t *pd, const char *path);
+
+/* Return @pd if it describes @path, otherwise initialize @tmp for @path and return it. */
+const pathdesc_t *pathdesc_get(const pathdesc_t *pd, const char *path, pathdesc_t *tmp);
+
+/* State of the whole @path, taken from @pd if it describes @path */
+uint64_t pathdesc_path_state(const pathdesc_t *pd, const char *path);
+
+/* State of the first @len bytes of the described path (@len should end a component). */
+uint64_t pathdesc_state(const pathdesc_t *pd, size_t len);
+
+/* State of the path without its last component */
+uint64_t pathdesc_parent_state(const pathdesc_t *pd);
+
+uint64_t path_state(const void *key, size_t len);
+
+#endif //ETHANE_PATHDESC_H
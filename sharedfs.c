@@ -19,6 +19,7 @@
  */
 
 #include <errno.h>
+#include <limits.h>
 
 #include "dmlocktab.h"
 #include "sharedfs.h"
@@ -27,6 +28,9 @@
 
 #include "config.h"
 #include "kv.h"
+#include "hash.h"
+#include "list.h"
+#include "tabhash.h"
 
 struct sharedfs_info {
     dmptr_t ns_root;
@@ -36,15 +40,39 @@ struct sharedfs_info {
 
     int nr_interval_node_sizes;
     int interval_node_nr_blks[MAX_NR_INTERVAL_NODE_BLKN];
+
+    int ns_key_mode;
+    bool ns_inline_dentry;
+
+    int dentry_fmt;
+
+    /* the namespace filter, interleaved across MNs (no filter if ns_filter_nr_blks is 0) */
+    dmptr_t ns_filter[MAX_NR_MNS];
+    size_t ns_filter_nr_blks;
+
+    /* the heads of the per-client queues of removed subtrees, see sharedfs_ns_reclaim() */
+    dmptr_t reclaim_queues;
 };
 
+/* one head per client id */
+#define RECLAIM_QUEUES_SIZE     ALIGN_UP(MAX_NR_CLIS * sizeof(dmptr_t), BLK_SIZE)
+
 struct sharedfs {
     dmcontext_t *ctx;
     dmm_cli_t *dmm;
+    dmlocktab_t *locktab;
 
     /* Namespace KV */
     kv_t *ns_kv;
     dmptr_t ns_root;
+    int ns_key_mode;
+    bool ns_inline_dentry;
+    int dentry_fmt;
+
+    /* Namespace Filter */
+    dmptr_t ns_filter[MAX_NR_MNS];
+    size_t ns_filter_nr_blks;
+    TAB_hash ns_filter_hf;
 
     /* Block Mapping KV */
     kv_t *bm_kv;
@@ -53,24 +81,424 @@ struct sharedfs {
     int *interval_node_nr_blks;
 
     int nr_max_outstanding_updates;
+
+    /* directories detached by rmtree whose descendants are still to be dropped */
+    struct list_head reclaim_dirs;
+    /* the remote head of their queue */
+    dmptr_t reclaim_head;
 };
 
 struct ns_kv_val {
     dmptr_t dentry_remote_addr;
     dmptr_t parent;
     size_t filename_len;
+
+    /*
+     * The hot dentry fields, only stored if the namespace is formatted with inline
+     * values. A lookup then builds the dentries from the KV values without reading
+     * them, and tells colliding names apart by name_hash instead of the filename.
+     */
+    uint64_t name_hash;
+    ethane_de_type_t type;
+    struct ethane_perm perm;
+    size_t file_size;
 };
 
+#define NS_KV_VAL_BASE_SIZE     offsetof(struct ns_kv_val, name_hash)
+
+/*
+ * Dentry Formats
+ *   ETHANE_DENTRY_FMT_FULL dentries are stored as struct ethane_dentry in DENTRY_SIZE
+ * slots, ETHANE_DENTRY_FMT_COMPACT ones as struct ethane_dentry_compact followed by the
+ * filename. A remote dentry is read right before the filename of a struct ethane_dentry
+ * buffer, so its filename lands in place and only the header is converted.
+ */
+#define DENTRY_COMPACT(sfs)             ((sfs)->dentry_fmt == ETHANE_DENTRY_FMT_COMPACT)
+
+#define DENTRY_OFF(sfs, field)          (DENTRY_COMPACT(sfs) ? offsetof(struct ethane_dentry_compact, field) \
+                                                             : offsetof(struct ethane_dentry, field))
+#define DENTRY_FIELD(sfs, addr, field)  ((addr) + DENTRY_OFF(sfs, field))
+
+/* Issue a read of @name_read_len bytes of filename of the dentry at @remote_addr into @de. */
+static inline int read_dentry(sharedfs_t *sfs, struct ethane_dentry *de, dmptr_t remote_addr,
+                              size_t name_read_len, int flag) {
+    size_t hdr_size = DENTRY_OFF(sfs, filename);
+    return dm_copy_from_remote(sfs->ctx, (char *) de->filename - hdr_size, remote_addr,
+                               hdr_size + name_read_len, flag);
+}
+
+/* Convert a dentry read by read_dentry() to the in-memory layout. */
+static inline void unpack_dentry(sharedfs_t *sfs, struct ethane_dentry *de, dmptr_t remote_addr) {
+    struct ethane_dentry_compact hdr;
+
+    if (!DENTRY_COMPACT(sfs)) {
+        return;
+    }
+
+    memcpy(&hdr, (char *) de->filename - sizeof(hdr), sizeof(hdr));
+
+    memset(de, 0, sizeof(*de));
+    de->type = hdr.type;
+    de->remote_addr = remote_addr;
+    de->parent = hdr.parent;
+    de->perm = hdr.perm;
+    de->file_size = hdr.file_size;
+    de->child_index = hdr.child_index;
+    de->index_slot = hdr.index_slot;
+    de->bm_hint = hdr.bm_hint;
+    de->nr_children = hdr.nr_children;
+}
+
+/* Build the remote image of @de named @filename in @dst, return its size. */
+static inline size_t pack_dentry(int dentry_fmt, void *dst, const struct ethane_dentry *de, const char *filename) {
+    struct ethane_dentry_compact *hdr = dst;
+    size_t len = strlen(filename);
+
+    if (dentry_fmt != ETHANE_DENTRY_FMT_COMPACT) {
+        memcpy(dst, de, sizeof(*de));
+        memcpy(((struct ethane_dentry *) dst)->filename, filename, len + 1);
+        return sizeof(*de) + len + 1;
+    }
+
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->parent = de->parent;
+    hdr->file_size = de->file_size;
+    hdr->perm = de->perm;
+    hdr->type = de->type;
+    hdr->version = DENTRY_COMPACT_VERSION;
+    hdr->filename_len = len;
+    hdr->nr_children = de->nr_children;
+    hdr->child_index = de->child_index;
+    hdr->index_slot = de->index_slot;
+    hdr->bm_hint = de->bm_hint;
+    memcpy(hdr->filename, filename, len + 1);
+
+    return sizeof(*hdr) + len + 1;
+}
+
+static inline size_t ns_kv_val_size(bool inline_dentry) {
+    return inline_dentry ? sizeof(struct ns_kv_val) : NS_KV_VAL_BASE_SIZE;
+}
+
+static inline uint64_t ns_name_hash(const char *name, size_t len) {
+    return path_state(name, len);
+}
+
+static inline void ns_kv_val_set_inline(struct ns_kv_val *val, const struct ethane_dentry *dentry,
+                                        const char *filename, size_t filename_len) {
+    val->name_hash = ns_name_hash(filename, filename_len);
+    val->type = dentry->type;
+    val->perm = dentry->perm;
+    val->file_size = dentry->file_size;
+}
+
+/* The fields owned by sharedfs (e.g. the child index) are not known and left zero. */
+static inline void ns_kv_val_to_dentry(const struct ns_kv_val *val, struct ethane_dentry *dentry) {
+    memset(dentry, 0, sizeof(*dentry));
+    dentry->type = val->type;
+    dentry->remote_addr = val->dentry_remote_addr;
+    dentry->parent = val->parent;
+    dentry->perm = val->perm;
+    dentry->file_size = val->file_size;
+    dentry->flags = ETHANE_DENTRY_PARTIAL;
+}
+
 struct ns_lookup_component {
     struct ns_kv_val possible_vals[KV_NR_POSSIBLE_VALS];
     struct ethane_dentry *possible_dentries[KV_NR_POSSIBLE_VALS];
     kv_vec_item_t *vec;
 };
 
+/* SHAREDFS_NS_KEY_PARENT keys are the parent dentry pointer followed by the name */
+#define NS_PARENT_KEY_MAX_LEN       (sizeof(dmptr_t) + DENTRY_SIZE)
+
+static inline void set_parent_key(kv_vec_item_t *item, char *buf, dmptr_t parent, const char *name, size_t len) {
+    memcpy(buf, &parent, sizeof(parent));
+    memcpy(buf + sizeof(parent), name, len);
+    item->key = buf;
+    item->key_len = sizeof(parent) + len;
+    item->has_key_state = false;
+}
+
+/* Point @item at the ns KV key of @update; @buf holds NS_PARENT_KEY_MAX_LEN bytes. */
+static inline void set_update_key(sharedfs_t *sfs, kv_vec_item_t *item, char *buf,
+                                  const sharedfs_ns_update_record_t *update) {
+    const char *filename;
+
+    if (sfs->ns_key_mode == SHAREDFS_NS_KEY_PARENT) {
+        filename = ethane_get_filename(update->full_path);
+        set_parent_key(item, buf, update->dentry->parent, filename, strlen(filename));
+        return;
+    }
+
+    item->key = update->full_path;
+    item->key_len = strlen(update->full_path);
+    item->key_state = update->path_state;
+    item->has_key_state = true;
+}
+
+/*
+ * Namespace Filter
+ *   A blocked counting Bloom filter of the ns KV keys, kept up to date by the checkpoint.
+ * A key owns NS_FILTER_NR_HASHES 8-bit counters of one 64 B block, bumped with CASes, so
+ * a single small read tells that a name surely does not exist and the KV probe for it
+ * can be skipped. Counters are bumped before a key is put and dropped only after it is
+ * deleted, hence they are never zero for a key in the KV. A checkpoint failing halfway
+ * may leave counters too high, which only costs false positives.
+ */
+#define NS_FILTER_BLK_SIZE          64
+#define NS_FILTER_BLK_NR_WORDS      (NS_FILTER_BLK_SIZE / sizeof(uint64_t))
+#define NS_FILTER_NR_HASHES         4
+#define NS_FILTER_HASH_SEED         3
+
+/* at most this many keys per block on average when the ns KV is at its initial size */
+#define NS_FILTER_MAX_KEYS_PER_BLK  32
+
+static inline uint64_t ns_filter_hash(sharedfs_t *sfs, kv_vec_item_t *item) {
+    uint64_t state = item->has_key_state ? item->key_state : path_state(item->key, item->key_len);
+    return TAB_finalize(&sfs->ns_filter_hf, state);
+}
+
+/* The block is picked by the low half of the hash, the counters by the high half. */
+static inline dmptr_t ns_filter_blk(sharedfs_t *sfs, uint64_t hash) {
+    size_t nr_blks = sfs->ns_filter_nr_blks;
+    return dmm_get_ptr_interleaved(sfs->dmm, sfs->ns_filter, nr_blks * NS_FILTER_BLK_SIZE,
+                                   ((uint32_t) hash % nr_blks) * NS_FILTER_BLK_SIZE);
+}
+
+static inline int ns_filter_ctr(uint64_t hash, int k) {
+    return (int) ((hash >> (32 + 6 * k)) % NS_FILTER_BLK_SIZE);
+}
+
+/* Which keys of a batch to add to the filter, after their KV op if any */
+enum ns_filter_sel {
+    NS_FILTER_ALL,
+    NS_FILTER_DONE,
+    NS_FILTER_FAILED
+};
+
+/* A word of counters to move, @cnt holds how many steps for each of its 8 counters */
+struct ns_filter_upd {
+    dmptr_t addr;
+    uint64_t cnt, expected;
+    uint64_t *old, *new;
+    bool done;
+};
+
+#define NS_FILTER_MAX_BATCH_WORDS   64
+
+/* @word with its counters moved by @delta times @cnt, a saturated counter stays as it is */
+static uint64_t ns_filter_apply(uint64_t word, uint64_t cnt, int delta) {
+    int i, c, n;
+
+    for (i = 0; i < 8; i++) {
+        n = (int) ((cnt >> (i * 8)) & UINT8_MAX);
+        c = (int) ((word >> (i * 8)) & UINT8_MAX);
+        if (!n || c == UINT8_MAX) {
+            continue;
+        }
+
+        c = delta > 0 ? min(c + n, UINT8_MAX) : max(c - n, 0);
+        word = (word & ~((uint64_t) UINT8_MAX << (i * 8))) | ((uint64_t) c << (i * 8));
+    }
+
+    return word;
+}
+
+/* Read the words of @upds and CAS the moved counters in, retrying the words that raced. */
+static int ns_filter_update_words(sharedfs_t *sfs, int nr, struct ns_filter_upd *upds, int delta) {
+    int i, nr_pending, ret = 0;
+
+    dm_mark(sfs->ctx);
+
+    for (i = 0; i < nr; i++) {
+        upds[i].old = dm_push(sfs->ctx, NULL, sizeof(uint64_t));
+        upds[i].new = dm_push(sfs->ctx, NULL, sizeof(uint64_t));
+        if (unlikely(!upds[i].old || !upds[i].new)) {
+            ret = -ENOMEM;
+            goto out_wait;
+        }
+
+        ret = dm_copy_from_remote(sfs->ctx, upds[i].old, upds[i].addr, sizeof(uint64_t), 0);
+        if (unlikely(ret < 0)) {
+            goto out_wait;
+        }
+
+        upds[i].done = false;
+    }
+
+    ret = dm_wait_ack(sfs->ctx, dm_set_ack_all(sfs->ctx));
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
+
+    for (;;) {
+        nr_pending = 0;
+
+        for (i = 0; i < nr; i++) {
+            if (upds[i].done) {
+                continue;
+            }
+
+            upds[i].expected = *upds[i].old;
+            *upds[i].new = ns_filter_apply(upds[i].expected, upds[i].cnt, delta);
+            if (*upds[i].new == upds[i].expected) {
+                upds[i].done = true;
+                continue;
+            }
+
+            ret = dm_cas(sfs->ctx, upds[i].addr, upds[i].new, upds[i].old, sizeof(uint64_t), 0);
+            if (unlikely(ret < 0)) {
+                goto out_wait;
+            }
+            nr_pending++;
+        }
+
+        if (!nr_pending) {
+            break;
+        }
+
+        ret = dm_wait_ack(sfs->ctx, dm_set_ack_all(sfs->ctx));
+        if (unlikely(ret < 0)) {
+            goto out;
+        }
+
+        /* @old now holds what the CAS found, it won if that is what it expected */
+        for (i = 0; i < nr; i++) {
+            if (!upds[i].done && *upds[i].old == upds[i].expected) {
+                upds[i].done = true;
+            }
+        }
+    }
+
+    goto out;
+
+out_wait:
+    dm_wait_ack(sfs->ctx, dm_set_ack_all(sfs->ctx));
+
+out:
+    dm_pop(sfs->ctx);
+    return ret;
+}
+
+/*
+ * Move the counters of the keys in @vec selected by @sel by @delta, and wait for it. Counters
+ * saturate at UINT8_MAX and then stay there, as the ns KV may outgrow the filter by doubling
+ * its shards: a saturated counter only costs false positives, where a wrapped one would carry
+ * into its neighbour or read as zero for a key that exists.
+ */
+static int ns_filter_add_batch(sharedfs_t *sfs, int nr, kv_vec_item_t *vec, int delta, enum ns_filter_sel sel) {
+    struct ns_filter_upd upds[NS_FILTER_MAX_BATCH_WORDS];
+    uint64_t cnts[NS_FILTER_BLK_NR_WORDS], hash;
+    int i, k, w, nr_upds = 0, ret = 0;
+    dmptr_t blk;
+
+    if (!sfs->ns_filter_nr_blks) {
+        goto out;
+    }
+
+    for (i = 0; i < nr; i++) {
+        if ((sel == NS_FILTER_DONE && vec[i].err) || (sel == NS_FILTER_FAILED && !vec[i].err)) {
+            continue;
+        }
+
+        hash = ns_filter_hash(sfs, &vec[i]);
+        blk = ns_filter_blk(sfs, hash);
+
+        /* the counters sharing a word are changed by one CAS */
+        memset(cnts, 0, sizeof(cnts));
+        for (k = 0; k < NS_FILTER_NR_HASHES; k++) {
+            cnts[ns_filter_ctr(hash, k) / 8] += 1ul << (ns_filter_ctr(hash, k) % 8 * 8);
+        }
+
+        for (w = 0; w < NS_FILTER_BLK_NR_WORDS; w++) {
+            if (!cnts[w]) {
+                continue;
+            }
+
+            upds[nr_upds].addr = blk + w * sizeof(uint64_t);
+            upds[nr_upds].cnt = cnts[w];
+
+            if (++nr_upds == min(NS_FILTER_MAX_BATCH_WORDS, sfs->nr_max_outstanding_updates)) {
+                ret = ns_filter_update_words(sfs, nr_upds, upds, delta);
+                if (unlikely(ret < 0)) {
+                    goto out;
+                }
+                nr_upds = 0;
+            }
+        }
+    }
+
+    if (nr_upds) {
+        ret = ns_filter_update_words(sfs, nr_upds, upds, delta);
+    }
+
+out:
+    return ret;
+}
+
+int sharedfs_ns_may_exist(sharedfs_t *sfs, const char *full_path, const pathdesc_t *pd, dmptr_t parent) {
+    char key[NS_PARENT_KEY_MAX_LEN];
+    const char *filename;
+    kv_vec_item_t item;
+    uint64_t hash;
+    uint8_t *blk;
+    int k, ret;
+
+    if (!sfs->ns_filter_nr_blks) {
+        return 1;
+    }
+
+    memset(&item, 0, sizeof(item));
+    if (sfs->ns_key_mode == SHAREDFS_NS_KEY_PARENT) {
+        filename = ethane_get_filename(full_path);
+        set_parent_key(&item, key, parent, filename, strlen(filename));
+    } else {
+        item.key = full_path;
+        item.key_len = strlen(full_path);
+        item.key_state = pathdesc_path_state(pd, full_path);
+        item.has_key_state = true;
+    }
+
+    hash = ns_filter_hash(sfs, &item);
+
+    dm_mark(sfs->ctx);
+
+    blk = dm_push(sfs->ctx, NULL, NS_FILTER_BLK_SIZE);
+    if (unlikely(!blk)) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    ret = dm_copy_from_remote(sfs->ctx, blk, ns_filter_blk(sfs, hash), NS_FILTER_BLK_SIZE, DMFLAG_ACK);
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
+
+    ret = dm_wait_ack(sfs->ctx, 1);
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
+
+    ret = 1;
+    for (k = 0; k < NS_FILTER_NR_HASHES; k++) {
+        if (!blk[ns_filter_ctr(hash, k)]) {
+            ret = 0;
+            break;
+        }
+    }
+
+out:
+    dm_pop(sfs->ctx);
+    return ret;
+}
+
 struct bm_extent {
     dmptr_t dentry_remote_addr;
     dmptr_t blk_remote_addr;
     int start_blkn, nr_blks;
+    /* oplog version of the write, the newest extent holding a block wins */
+    size_t version;
 };
 
 struct bm_data_section_key {
@@ -82,9 +510,33 @@ struct bm_data_section {
     struct bm_extent ext;
 };
 
-static dmptr_t create_ns_root(dmcontext_t *ctx, dmm_cli_t *dmm) {
-    struct ethane_dentry *root;
+/* A bm KV value is the extent of exactly the interval node of its key. */
+static bool bm_key_match(const kv_vec_item_t *item, const void *val) {
+    const struct bm_data_section_key *key = (const struct bm_data_section_key *) item->key;
+    const struct bm_extent *ext = val;
+    return ext->dentry_remote_addr == key->dentry_remote_addr &&
+           ext->start_blkn == key->start_blkn && ext->nr_blks == key->nr_blks;
+}
+
+/*
+ * A parent-keyed ns KV value with the inline fields names its parent and (by hash) its name.
+ * Full-path keys can't be told apart by a value, which holds no trace of the parent's path.
+ */
+static bool ns_parent_key_match(const kv_vec_item_t *item, const void *val) {
+    const struct ns_kv_val *v = val;
+    size_t len = item->key_len - sizeof(dmptr_t);
+    dmptr_t parent;
+
+    memcpy(&parent, item->key, sizeof(parent));
+    return v->parent == parent && v->filename_len == len &&
+           v->name_hash == ns_name_hash(item->key + sizeof(parent), len);
+}
+
+static dmptr_t create_ns_root(dmcontext_t *ctx, dmm_cli_t *dmm, int dentry_fmt) {
+    struct ethane_dentry root;
     dmptr_t root_remote_addr;
+    size_t size;
+    void *buf;
     int ret;
 
     root_remote_addr = dmm_balloc(dmm, BLK_SIZE, BLK_SIZE, 0);
@@ -92,21 +544,26 @@ static dmptr_t create_ns_root(dmcontext_t *ctx, dmm_cli_t *dmm) {
         goto out;
     }
 
-    root = dm_push(ctx, NULL, sizeof(*root) + 1);
-    if (unlikely(!root)) {
+    buf = dm_push(ctx, NULL, sizeof(root) + 1);
+    if (unlikely(!buf)) {
         root_remote_addr = -ENOMEM;
         goto out;
     }
 
-    root->remote_addr = root_remote_addr;
-    root->filename[0] = '\0';
-    root->type = ETHANE_DENTRY_DIR;
-    root->nr_children = 0;
-    root->perm.mode = 0755;
-    root->perm.owner.uid = 0;
-    root->perm.owner.gid = 0;
+    memset(&root, 0, sizeof(root));
+    root.remote_addr = root_remote_addr;
+    root.type = ETHANE_DENTRY_DIR;
+    root.parent = DMPTR_NULL;
+    root.child_index = DMPTR_NULL;
+    root.index_slot = DMPTR_NULL;
+    root.nr_children = 0;
+    root.perm.mode = 0755;
+    root.perm.owner.uid = 0;
+    root.perm.owner.gid = 0;
 
-    ret = dm_copy_to_remote(ctx, root_remote_addr, root, sizeof(*root) + 1, DMFLAG_ACK);
+    size = pack_dentry(dentry_fmt, buf, &root, "");
+
+    ret = dm_copy_to_remote(ctx, root_remote_addr, buf, size, DMFLAG_ACK);
     if (unlikely(ret < 0)) {
         root_remote_addr = ret;
         goto out;
@@ -125,7 +582,10 @@ out:
 dmptr_t sharedfs_create(dmcontext_t *ctx, dmm_cli_t *dmm,
                         int nr_internal_node_sizes, int *internal_node_nr_blks,
                         size_t ns_kv_size, size_t bm_kv_size,
-                        int nr_shards) {
+                        int nr_shards, int ns_kv_bucket_nr_slots, int bm_kv_bucket_nr_slots,
+                        int kv_max_kick_depth, int kv_stash_nr_slots, int ns_key_mode, bool ns_inline_dentry,
+                        int dentry_fmt, size_t ns_filter_size) {
+    size_t ns_filter_min_nr_blks;
     struct sharedfs_info *info;
     dmptr_t remote_addr;
     int ret;
@@ -143,27 +603,53 @@ dmptr_t sharedfs_create(dmcontext_t *ctx, dmm_cli_t *dmm,
         goto out;
     }
 
-    info->ns_root = create_ns_root(ctx, dmm);
+    info->ns_root = create_ns_root(ctx, dmm, dentry_fmt);
     if (unlikely(IS_ERR(info->ns_root))) {
         remote_addr = info->ns_root;
         goto out;
     }
 
-    info->ns_kv_remote_addr = kv_create(ctx, dmm, ns_kv_size, sizeof(struct ns_kv_val), nr_shards);
+    info->ns_kv_remote_addr = kv_create(ctx, dmm, ns_kv_size, ns_kv_val_size(ns_inline_dentry), nr_shards,
+                                        ns_kv_bucket_nr_slots, kv_max_kick_depth, kv_stash_nr_slots);
     if (unlikely(IS_ERR(info->ns_kv_remote_addr))) {
         remote_addr = info->ns_kv_remote_addr;
         goto out;
     }
 
-    info->bm_kv_remote_addr = kv_create(ctx, dmm, bm_kv_size, sizeof(struct bm_extent), nr_shards);
+    /* a filter too small for the ns KV could overflow its counters */
+    info->ns_filter_nr_blks = ns_filter_size / NS_FILTER_BLK_SIZE;
+    ns_filter_min_nr_blks = ns_kv_size / ns_kv_val_size(ns_inline_dentry) / NS_FILTER_MAX_KEYS_PER_BLK;
+    if (info->ns_filter_nr_blks && info->ns_filter_nr_blks < ns_filter_min_nr_blks) {
+        pr_warn("namespace filter needs at least %lu bytes, disabled", ns_filter_min_nr_blks * NS_FILTER_BLK_SIZE);
+        info->ns_filter_nr_blks = 0;
+    }
+    memset(info->ns_filter, 0, sizeof(info->ns_filter));
+    if (info->ns_filter_nr_blks) {
+        dmm_balloc_interleaved(dmm, info->ns_filter, info->ns_filter_nr_blks * NS_FILTER_BLK_SIZE, 0);
+        dmm_bzero_interleaved(dmm, info->ns_filter, info->ns_filter_nr_blks * NS_FILTER_BLK_SIZE, true);
+    }
+
+    info->bm_kv_remote_addr = kv_create(ctx, dmm, bm_kv_size, sizeof(struct bm_extent), nr_shards,
+                                        bm_kv_bucket_nr_slots, kv_max_kick_depth, kv_stash_nr_slots);
     if (unlikely(IS_ERR(info->bm_kv_remote_addr))) {
         remote_addr = info->bm_kv_remote_addr;
         goto out;
     }
 
+    info->reclaim_queues = dmm_balloc(dmm, RECLAIM_QUEUES_SIZE, BLK_SIZE, 0);
+    if (unlikely(IS_ERR(info->reclaim_queues))) {
+        remote_addr = info->reclaim_queues;
+        goto out;
+    }
+    dmm_bzero(dmm, info->reclaim_queues, RECLAIM_QUEUES_SIZE, true);
+
     info->nr_interval_node_sizes = nr_internal_node_sizes;
     memcpy(info->interval_node_nr_blks, internal_node_nr_blks, sizeof(*internal_node_nr_blks) * nr_internal_node_sizes);
 
+    info->ns_key_mode = ns_key_mode;
+    info->ns_inline_dentry = ns_inline_dentry;
+    info->dentry_fmt = dentry_fmt;
+
     ret = dm_copy_to_remote(ctx, remote_addr, info, sizeof(*info), DMFLAG_ACK);
     if (unlikely(ret < 0)) {
         remote_addr = ret;
@@ -181,11 +667,15 @@ out:
     return remote_addr;
 }
 
+static int load_reclaim_queue(sharedfs_t *sfs);
+
 sharedfs_t *sharedfs_init(dmcontext_t *ctx, dmm_cli_t *dmm, dmlocktab_t *locktab,
-                          dmptr_t sharedfs_info_remote_addr, int nr_max_outstanding_updates) {
+                          dmptr_t sharedfs_info_remote_addr, int nr_max_outstanding_updates,
+                          int kv_cache_nr_ents, long kv_cache_staleness_us) {
     struct sharedfs_info *info;
+    TAB_generator gen;
     sharedfs_t *sfs;
-    int ret;
+    int i, min_nr_blks, ret;
 
     dm_mark(ctx);
 
@@ -215,23 +705,39 @@ sharedfs_t *sharedfs_init(dmcontext_t *ctx, dmm_cli_t *dmm, dmlocktab_t *locktab
 
     sfs->ctx = ctx;
     sfs->dmm = dmm;
+    sfs->locktab = locktab;
 
     sfs->ns_root = info->ns_root;
+    sfs->ns_key_mode = info->ns_key_mode;
+    sfs->ns_inline_dentry = info->ns_inline_dentry;
+    sfs->dentry_fmt = info->dentry_fmt;
 
-    sfs->ns_kv = kv_init("ns", ctx, dmm, locktab, info->ns_kv_remote_addr, nr_max_outstanding_updates);
+    memcpy(sfs->ns_filter, info->ns_filter, sizeof(sfs->ns_filter));
+    sfs->ns_filter_nr_blks = info->ns_filter_nr_blks;
+    TAB_init_generator(&gen, TAB_DEFAULT_SEED);
+    TAB_init_hash(&sfs->ns_filter_hf, &gen, NS_FILTER_HASH_SEED);
+
+    sfs->ns_kv = kv_init("ns", ctx, dmm, locktab, info->ns_kv_remote_addr, nr_max_outstanding_updates,
+                         kv_cache_nr_ents, kv_cache_staleness_us);
     if (unlikely(IS_ERR(sfs->ns_kv))) {
         free(sfs);
         sfs = ERR_PTR(sfs->ns_kv);
         goto out;
     }
 
-    sfs->bm_kv = kv_init("bm", ctx, dmm, locktab, info->bm_kv_remote_addr, nr_max_outstanding_updates);
+    sfs->bm_kv = kv_init("bm", ctx, dmm, locktab, info->bm_kv_remote_addr, nr_max_outstanding_updates,
+                         kv_cache_nr_ents, kv_cache_staleness_us);
     if (unlikely(IS_ERR(sfs->bm_kv))) {
         free(sfs);
         sfs = ERR_PTR(sfs->bm_kv);
         goto out;
     }
 
+    kv_set_key_matcher(sfs->bm_kv, bm_key_match);
+    if (sfs->ns_key_mode == SHAREDFS_NS_KEY_PARENT && sfs->ns_inline_dentry) {
+        kv_set_key_matcher(sfs->ns_kv, ns_parent_key_match);
+    }
+
     sfs->nr_interval_node_sizes = info->nr_interval_node_sizes;
     sfs->interval_node_nr_blks = malloc(sizeof(*sfs->interval_node_nr_blks) * info->nr_interval_node_sizes);
     if (unlikely(!sfs->interval_node_nr_blks)) {
@@ -242,8 +748,29 @@ sharedfs_t *sharedfs_init(dmcontext_t *ctx, dmm_cli_t *dmm, dmlocktab_t *locktab
     memcpy(sfs->interval_node_nr_blks, info->interval_node_nr_blks,
            sizeof(*info->interval_node_nr_blks) * info->nr_interval_node_sizes);
 
+    /* extents are split into interval nodes, a 1-block one fits any block-aligned write */
+    min_nr_blks = INT_MAX;
+    for (i = 0; i < sfs->nr_interval_node_sizes; i++) {
+        min_nr_blks = min(min_nr_blks, sfs->interval_node_nr_blks[i]);
+    }
+    if (unlikely(min_nr_blks != 1)) {
+        pr_warn("no interval size of 1 block, writes must be aligned to %d blocks", min_nr_blks);
+    }
+
     sfs->nr_max_outstanding_updates = nr_max_outstanding_updates;
 
+    INIT_LIST_HEAD(&sfs->reclaim_dirs);
+    sfs->reclaim_head = info->reclaim_queues + dm_get_cli_id(ctx) * sizeof(dmptr_t);
+
+    /* pick up the subtrees a previous run with our id left */
+    ret = load_reclaim_queue(sfs);
+    if (unlikely(ret < 0)) {
+        free(sfs->interval_node_nr_blks);
+        free(sfs);
+        sfs = ERR_PTR(ret);
+        goto out;
+    }
+
     pr_info("init done");
 
 out:
@@ -251,76 +778,123 @@ out:
     return sfs;
 }
 
-static int get_possible_dentry_ptrs(sharedfs_t *sfs, struct ns_lookup_component *components,
-                                    const char *full_path, struct ethane_dentry **dentries) {
-    struct ns_kv_val ns_root_val = { .dentry_remote_addr = sfs->ns_root };
-    int dir_depth, len, nr_match, vec_len, ret = 0, i, j;
-    struct ns_lookup_component *curr = components;
-    struct ethane_dentry **de = dentries;
-    kv_vec_item_t *vec, *lookup_vec;
+/*
+ * Components of the batch naming the same cacheFS dentry (i.e. a prefix shared by
+ * several paths) are looked up once, by their owner component.
+ */
+static int find_lookup_owners(int nr_comps, struct ethane_dentry **dentries,
+                              struct ns_lookup_component *components, struct ns_lookup_component **owners) {
+    int bits = 1, *table, i, h, ret = 0;
+
+    while ((1 << bits) < 2 * nr_comps) {
+        bits++;
+    }
+
+    table = malloc(sizeof(*table) << bits);
+    if (unlikely(!table)) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    memset(table, -1, sizeof(*table) << bits);
+
+    for (i = 0; i < nr_comps; i++) {
+        for (h = hash_ptr(dentries[i], bits); table[h] >= 0; h = (h + 1) & ((1 << bits) - 1)) {
+            if (dentries[table[h]] == dentries[i]) {
+                break;
+            }
+        }
+        if (table[h] < 0) {
+            table[h] = i;
+        }
+        owners[i] = &components[table[h]];
+    }
+
+    free(table);
+
+out:
+    return ret;
+}
+
+static int get_possible_dentry_ptrs(sharedfs_t *sfs, int nr_paths, const pathdesc_t **pds,
+                                    struct ethane_dentry **dentries, int nr_comps,
+                                    struct ns_lookup_component *components, struct ns_lookup_component **owners) {
+    struct ns_kv_val ns_root_val = { .dentry_remote_addr = sfs->ns_root, .name_hash = ns_name_hash("", 0) };
+    int len, nr_match, vec_len, ret = 0, i, j, n = 0;
+    struct ns_lookup_component *curr;
     const char *component, *next;
+    kv_vec_item_t *vec, root_vec;
+    const char *full_path;
     dmptr_t addr;
 
     dm_mark(sfs->ctx);
 
-    pr_debug("get_possible_dentry_ptrs: %s", full_path);
-
-    dir_depth = ethane_get_dir_depth(full_path);
-
     /* allocate lookup key vector */
-    vec = calloc(1, dir_depth * sizeof(kv_vec_item_t));
+    vec = calloc(1, nr_comps * sizeof(kv_vec_item_t));
     if (unlikely(!vec)) {
         ret = -ENOMEM;
         goto out;
     }
 
+    memset(&root_vec, 0, sizeof(root_vec));
+
     vec_len = 0;
-    ETHANE_ITER_COMPONENTS(full_path, component, next, len) {
-        addr = (*de)->remote_addr;
-        if (addr != DMPTR_NULL) {
-            /* already in cacheFS, we save the remote_addr for parent-filtering */
-            curr->possible_vals[0].dentry_remote_addr = addr;
-            curr->possible_vals[0].filename_len = len;
-            curr->possible_vals[0].parent = (*de)->parent;
-            curr++;
-            de++;
+    for (i = 0; i < nr_paths; i++) {
+        full_path = pds[i]->path;
 
-            pr_debug("cached in cachefs: %.*s", (int) len, component);
+        pr_debug("get_possible_dentry_ptrs: %s", full_path);
 
-            continue;
-        }
-        de++;
+        ETHANE_ITER_COMPONENTS(full_path, component, next, len) {
+            curr = &components[n];
+            addr = dentries[n]->remote_addr;
 
-        /* not cached, put into lookup vector */
-        vec[vec_len].key = full_path;
-        vec[vec_len].key_len = component + len - full_path;
+            if (owners[n++] != curr) {
+                /* looked up by a previous path */
+                continue;
+            }
 
-        curr->vec = &vec[vec_len++];
-        curr++;
+            if (addr != DMPTR_NULL) {
+                /* already in cacheFS, we save the remote_addr for parent-filtering */
+                curr->possible_vals[0].dentry_remote_addr = addr;
+                curr->possible_vals[0].filename_len = len;
+                curr->possible_vals[0].parent = dentries[n - 1]->parent;
+                curr->possible_vals[0].name_hash = ns_name_hash(component, len);
 
-        pr_debug("not cached in cachefs: %.*s, ready to remote lookup", (int) len, component);
-    }
+                pr_debug("cached in cachefs: %.*s", (int) len, component);
 
-    /* do lookup */
-    lookup_vec = vec;
-    if (vec[0].key_len == 0) {
-        /* root dentry, we can get its address directly from sharedFS metadata */
-        vec[0].possible_vals[0] = &ns_root_val;
-        lookup_vec++;
-        vec_len--;
+                continue;
+            }
+
+            if (component + len == full_path) {
+                /* root dentry, we can get its address directly from sharedFS metadata */
+                root_vec.possible_vals[0] = &ns_root_val;
+                curr->vec = &root_vec;
+                continue;
+            }
+
+            /* not cached, put into lookup vector */
+            vec[vec_len].key = full_path;
+            vec[vec_len].key_len = component + len - full_path;
+            vec[vec_len].key_state = pathdesc_state(pds[i], vec[vec_len].key_len);
+            vec[vec_len].has_key_state = true;
+
+            curr->vec = &vec[vec_len++];
+
+            pr_debug("not cached in cachefs: %.*s, ready to remote lookup", (int) len, component);
+        }
     }
 
-    nr_match = kv_get_batch_approx(sfs->ns_kv, vec_len, lookup_vec);
+    /* do lookup */
+    nr_match = kv_get_batch_approx(sfs->ns_kv, vec_len, vec);
     if (unlikely(nr_match < 0)) {
         ret = -EIO;
         goto out_free;
     }
 
     /* copy value to ns_lookup_component */
-    for (i = 0; i < dir_depth; i++) {
+    for (i = 0; i < nr_comps; i++) {
         curr = &components[i];
 
-        if (!curr->vec) {
+        if (!curr->vec || owners[i] != curr) {
             continue;
         }
 
@@ -329,7 +903,13 @@ static int get_possible_dentry_ptrs(sharedfs_t *sfs, struct ns_lookup_component
                 continue;
             }
 
-            curr->possible_vals[j] = *(struct ns_kv_val *) curr->vec->possible_vals[j];
+            memcpy(&curr->possible_vals[j], curr->vec->possible_vals[j], ns_kv_val_size(sfs->ns_inline_dentry));
+        }
+    }
+
+    for (i = 0; i < nr_comps; i++) {
+        if (owners[i] != &components[i]) {
+            components[i] = *owners[i];
         }
     }
 
@@ -386,20 +966,40 @@ static void filter_by_parent_ptr(sharedfs_t *sfs, int dir_depth, struct ns_looku
     }
 }
 
-static int get_possible_dentries(sharedfs_t *sfs, int dir_depth, struct ns_lookup_component *components) {
+static int get_possible_dentries(sharedfs_t *sfs, int nr_comps, struct ethane_dentry **dentries,
+                                 struct ns_lookup_component *components, struct ns_lookup_component **owners) {
     struct ns_kv_val *possible_val;
     size_t read_size;
     int i, j, ret;
 
     pr_debug("get_possible_dentries");
 
-    for (i = 0; i < dir_depth; i++) {
+    for (i = 0; i < nr_comps; i++) {
+        if (owners[i] != &components[i]) {
+            continue;
+        }
+
         for (j = 0; j < KV_NR_POSSIBLE_VALS; j++) {
             possible_val = &components[i].possible_vals[j];
             if (possible_val->dentry_remote_addr == DMPTR_NULL) {
                 continue;
             }
 
+            if (sfs->ns_inline_dentry && possible_val->dentry_remote_addr != sfs->ns_root) {
+                /* a cached component keeps its dentry, the others are built from their values */
+                if (!components[i].vec) {
+                    components[i].possible_dentries[j] = dentries[i];
+                    continue;
+                }
+                components[i].possible_dentries[j] = dm_push(sfs->ctx, NULL, sizeof(struct ethane_dentry));
+                if (unlikely(!components[i].possible_dentries[j])) {
+                    ret = -ENOMEM;
+                    goto out;
+                }
+                ns_kv_val_to_dentry(possible_val, components[i].possible_dentries[j]);
+                continue;
+            }
+
             read_size = sizeof(struct ethane_dentry) + possible_val->filename_len + 1;
 
             components[i].possible_dentries[j] = dm_push(sfs->ctx, NULL, read_size);
@@ -408,8 +1008,8 @@ static int get_possible_dentries(sharedfs_t *sfs, int dir_depth, struct ns_looku
                 goto out;
             }
 
-            ret = dm_copy_from_remote(sfs->ctx, components[i].possible_dentries[j],
-                                      possible_val->dentry_remote_addr, read_size, 0);
+            ret = read_dentry(sfs, components[i].possible_dentries[j], possible_val->dentry_remote_addr,
+                              possible_val->filename_len + 1, 0);
             if (unlikely(ret < 0)) {
                 goto out;
             }
@@ -421,15 +1021,46 @@ static int get_possible_dentries(sharedfs_t *sfs, int dir_depth, struct ns_looku
         goto out;
     }
 
-out:
-    return ret;
-}
-
-static inline void do_pathname_lookup(sharedfs_t *sfs, struct ns_lookup_component *components, const char *full_path,
-                                      struct ethane_dentry **dentries) {
+    for (i = 0; i < nr_comps && DENTRY_COMPACT(sfs); i++) {
+        if (owners[i] != &components[i]) {
+            continue;
+        }
+        for (j = 0; j < KV_NR_POSSIBLE_VALS; j++) {
+            possible_val = &components[i].possible_vals[j];
+            if (possible_val->dentry_remote_addr == DMPTR_NULL ||
+                (sfs->ns_inline_dentry && possible_val->dentry_remote_addr != sfs->ns_root)) {
+                continue;
+            }
+            unpack_dentry(sfs, components[i].possible_dentries[j], possible_val->dentry_remote_addr);
+        }
+    }
+
+    for (i = 0; i < nr_comps; i++) {
+        if (owners[i] != &components[i]) {
+            memcpy(components[i].possible_dentries, owners[i]->possible_dentries,
+                   sizeof(components[i].possible_dentries));
+        }
+    }
+
+out:
+    return ret;
+}
+
+static inline bool ns_name_match(sharedfs_t *sfs, const struct ns_kv_val *val, const struct ethane_dentry *de,
+                                 const char *name, size_t len) {
+    if (sfs->ns_inline_dentry) {
+        return val->filename_len == len && val->name_hash == ns_name_hash(name, len);
+    }
+    return strlen(de->filename) == len && !strncmp(de->filename, name, len);
+}
+
+static inline void do_pathname_lookup(sharedfs_t *sfs, struct ns_lookup_component *components, const pathdesc_t *pd,
+                                      struct ethane_dentry **dentries) {
+    const char *full_path = pd->path;
     struct ethane_dentry *possible_de;
     const char *component, *next;
     dmptr_t parent = DMPTR_NULL;
+    kv_vec_item_t item;
     int i, len;
     bool found;
 
@@ -444,15 +1075,24 @@ static inline void do_pathname_lookup(sharedfs_t *sfs, struct ns_lookup_componen
                 continue;
             }
 
-            pr_debug("parent=%lx,expected_parent=%lx,filename=%s,expected_filename=%.*s",
-                     components->possible_vals[i].parent, parent, possible_de->filename, (int) len, component);
+            pr_debug("parent=%lx,expected_parent=%lx,expected_filename=%.*s",
+                     components->possible_vals[i].parent, parent, (int) len, component);
 
-            if (components->possible_vals[i].parent == parent &&
-                strlen(possible_de->filename) == len &&
-                !strncmp(possible_de->filename, component, len)) {
+            if (components->possible_vals[i].parent == parent && ns_name_match(sfs, &components->possible_vals[i],
+                                                                               possible_de, component, len)) {
                 **(dentries++) = *possible_de;
                 parent = possible_de->remote_addr;
                 found = true;
+
+                /* a component got from the KV (the root is not) */
+                if (components->vec && component + len > full_path) {
+                    memset(&item, 0, sizeof(item));
+                    item.key = full_path;
+                    item.key_len = component + len - full_path;
+                    item.key_state = pathdesc_state(pd, item.key_len);
+                    item.has_key_state = true;
+                    kv_cache_confirm(sfs->ns_kv, &item);
+                }
                 pr_debug("match %.*s (%s)", (int) len, component, get_de_ty_str(possible_de->type));
                 break;
             }
@@ -471,13 +1111,13 @@ int sharedfs_ns_get_dentry(sharedfs_t *sfs, dmptr_t remote_dentry_addr, struct e
     struct ethane_dentry *de;
     int ret;
 
-    pr_debug("ns_get_dentry: %lx %lu", remote_dentry_addr, sizeof(*de) + filename_read_len);
+    pr_debug("ns_get_dentry: %lx %lu", remote_dentry_addr, DENTRY_OFF(sfs, filename) + filename_read_len);
 
     dm_mark(sfs->ctx);
 
     de = dm_push(sfs->ctx, NULL, sizeof(*de) + filename_read_len);
 
-    ret = dm_copy_from_remote(sfs->ctx, de, remote_dentry_addr, sizeof(*de) + filename_read_len, DMFLAG_ACK);
+    ret = read_dentry(sfs, de, remote_dentry_addr, filename_read_len, DMFLAG_ACK);
     if (unlikely(ret < 0)) {
         goto out;
     }
@@ -487,6 +1127,8 @@ int sharedfs_ns_get_dentry(sharedfs_t *sfs, dmptr_t remote_dentry_addr, struct e
         goto out;
     }
 
+    unpack_dentry(sfs, de, remote_dentry_addr);
+
     memcpy(dentry, de, sizeof(*de) + filename_read_len);
 
     if (unlikely(remote_dentry_addr != dentry->remote_addr)) {
@@ -498,76 +1140,341 @@ out:
     return ret;
 }
 
-int sharedfs_ns_lookup_dentries(sharedfs_t *sfs, const char *full_path, struct ethane_dentry **dentries) {
-    struct ns_lookup_component *components;
-    int ret, depth;
+/* Cursor of a path walked one component per round in SHAREDFS_NS_KEY_PARENT mode */
+struct ns_walk {
+    const char *component, *next;
+    int len, idx, end;
+    dmptr_t parent;
+};
 
-    pr_debug("sharedfs_ns_lookup_dentries: %s", full_path);
+static inline bool ns_walk_advance(struct ns_walk *w, struct ethane_dentry **dentries) {
+    /* skip the components already resolved (cached or just looked up) */
+    while (dentries[w->idx]->remote_addr != DMPTR_NULL) {
+        /* nothing lives below a removed directory, though its old children may keep their keys */
+        if (dentries[w->idx]->type == ETHANE_DENTRY_TOMBSTONE) {
+            return false;
+        }
+        w->parent = dentries[w->idx]->remote_addr;
+        if (++w->idx == w->end || !w->next) {
+            return false;
+        }
+        w->component = w->next;
+        w->next = get_component(w->component, &w->len);
+    }
+    return true;
+}
 
-    depth = ethane_get_dir_depth(full_path);
-    components = calloc(1, sizeof(*components) * depth);
-    if (unlikely(!components)) {
+/*
+ * Lookup with (parent, name) keys: each round resolves the next component of every
+ * path with one batch of KV gets and one batch of dentry reads.
+ */
+static int lookup_dentries_by_parent(sharedfs_t *sfs, int nr_paths, const pathdesc_t **pds,
+                                     struct ethane_dentry **dentries, int nr_comps,
+                                     struct ns_lookup_component **owners, struct ns_lookup_component *components) {
+    char root_buf[sizeof(struct ethane_dentry) + 1];
+    struct ns_walk *walks, *w, **vec_walks;
+    struct ethane_dentry **cands, *de;
+    struct ns_kv_val *val;
+    int i, j, k, n, ret = 0, off;
+    int *walk_ids, nr_active;
+    kv_vec_item_t *vec;
+    size_t read_size;
+    char *keys;
+
+    walks = calloc(nr_paths, sizeof(*walks));
+    walk_ids = calloc(nr_paths, sizeof(*walk_ids));
+    vec = calloc(nr_paths, sizeof(*vec));
+    vec_walks = calloc(nr_paths, sizeof(*vec_walks));
+    keys = malloc(nr_paths * NS_PARENT_KEY_MAX_LEN);
+    cands = calloc(nr_paths * KV_NR_POSSIBLE_VALS, sizeof(*cands));
+    if (unlikely(!walks || !walk_ids || !vec || !vec_walks || !keys || !cands)) {
         ret = -ENOMEM;
         goto out;
     }
 
-    ret = get_possible_dentry_ptrs(sfs, components, full_path, dentries);
+    /* the root dentry is known from sharedFS metadata */
+    for (i = 0, off = 0; i < nr_paths; off += pds[i++]->depth) {
+        if (dentries[off]->remote_addr == DMPTR_NULL) {
+            ret = sharedfs_ns_get_dentry(sfs, sfs->ns_root, (struct ethane_dentry *) root_buf, 1);
+            if (unlikely(ret < 0)) {
+                goto out;
+            }
+            *dentries[off] = *(struct ethane_dentry *) root_buf;
+            dentries[off]->parent = DMPTR_NULL;
+        }
+    }
+
+    nr_active = 0;
+    for (i = 0, off = 0; i < nr_paths; off += pds[i++]->depth) {
+        w = &walks[i];
+        w->component = pds[i]->path;
+        w->next = get_component(w->component, &w->len);
+        w->idx = off;
+        w->end = off + pds[i]->depth;
+        if (ns_walk_advance(w, dentries)) {
+            walk_ids[nr_active++] = i;
+        }
+    }
+
+    while (nr_active) {
+        dm_mark(sfs->ctx);
+
+        /* a prefix shared by several paths is looked up by its owner */
+        for (i = 0, n = 0; i < nr_active; i++) {
+            w = &walks[walk_ids[i]];
+            if (owners[w->idx] != &components[w->idx]) {
+                continue;
+            }
+            set_parent_key(&vec[n], keys + n * NS_PARENT_KEY_MAX_LEN, w->parent, w->component, w->len);
+            vec_walks[n++] = w;
+        }
+
+        ret = kv_get_batch_approx(sfs->ns_kv, n, vec);
+        if (unlikely(ret < 0)) {
+            ret = -EIO;
+            goto out_pop;
+        }
+
+        for (i = 0; i < n; i++) {
+            w = vec_walks[i];
+            for (k = 0; k < KV_NR_POSSIBLE_VALS; k++) {
+                val = vec[i].possible_vals[k];
+                cands[i * KV_NR_POSSIBLE_VALS + k] = NULL;
+                if (!val || val->parent != w->parent || val->filename_len != w->len) {
+                    continue;
+                }
+
+                if (sfs->ns_inline_dentry) {
+                    if (val->name_hash == ns_name_hash(w->component, w->len)) {
+                        de = dm_push(sfs->ctx, NULL, sizeof(*de));
+                        ns_kv_val_to_dentry(val, de);
+                        cands[i * KV_NR_POSSIBLE_VALS + k] = de;
+                    }
+                    continue;
+                }
+
+                read_size = sizeof(struct ethane_dentry) + val->filename_len + 1;
+                de = dm_push(sfs->ctx, NULL, read_size);
+                ret = read_dentry(sfs, de, val->dentry_remote_addr, val->filename_len + 1, 0);
+                if (unlikely(ret < 0)) {
+                    goto out_pop;
+                }
+                cands[i * KV_NR_POSSIBLE_VALS + k] = de;
+            }
+        }
+
+        ret = dm_wait_ack(sfs->ctx, dm_set_ack_all(sfs->ctx));
+        if (unlikely(ret < 0)) {
+            goto out_pop;
+        }
+
+        for (i = 0; i < n; i++) {
+            w = vec_walks[i];
+            for (k = 0; k < KV_NR_POSSIBLE_VALS; k++) {
+                de = cands[i * KV_NR_POSSIBLE_VALS + k];
+                if (de && !sfs->ns_inline_dentry) {
+                    val = vec[i].possible_vals[k];
+                    unpack_dentry(sfs, de, val->dentry_remote_addr);
+                }
+                if (de && de->parent == w->parent && (sfs->ns_inline_dentry ||
+                    (!strncmp(de->filename, w->component, w->len) && de->filename[w->len] == '\0'))) {
+                    *dentries[w->idx] = *de;
+                    kv_cache_confirm(sfs->ns_kv, &vec[i]);
+                    pr_debug("match %.*s (%s)", w->len, w->component, get_de_ty_str(de->type));
+                    break;
+                }
+            }
+        }
+
+        dm_pop(sfs->ctx);
+
+        /* paths whose component was not found stop here */
+        for (i = 0, j = 0; i < nr_active; i++) {
+            w = &walks[walk_ids[i]];
+            if (dentries[w->idx]->remote_addr != DMPTR_NULL && ns_walk_advance(w, dentries)) {
+                walk_ids[j++] = walk_ids[i];
+            }
+        }
+        nr_active = j;
+    }
+
+    goto out;
+
+out_pop:
+    dm_pop(sfs->ctx);
+
+out:
+    free(cands);
+    free(keys);
+    free(vec_walks);
+    free(vec);
+    free(walk_ids);
+    free(walks);
+    return ret;
+}
+
+int sharedfs_ns_lookup_dentries_batch(sharedfs_t *sfs, int nr_paths, const pathdesc_t **pds,
+                                      struct ethane_dentry **dentries) {
+    struct ns_lookup_component *components, **owners;
+    int ret, i, nr_comps = 0, off;
+
+    for (i = 0; i < nr_paths; i++) {
+        nr_comps += pds[i]->depth;
+    }
+
+    components = calloc(nr_comps, sizeof(*components));
+    owners = calloc(nr_comps, sizeof(*owners));
+    if (unlikely(!components || !owners)) {
+        ret = -ENOMEM;
+        goto out_free;
+    }
+
+    ret = find_lookup_owners(nr_comps, dentries, components, owners);
+    if (unlikely(ret < 0)) {
+        goto out_free;
+    }
+
+    if (sfs->ns_key_mode == SHAREDFS_NS_KEY_PARENT) {
+        ret = lookup_dentries_by_parent(sfs, nr_paths, pds, dentries, nr_comps, owners, components);
+        goto out_free;
+    }
+
+    ret = get_possible_dentry_ptrs(sfs, nr_paths, pds, dentries, nr_comps, components, owners);
     if (unlikely(ret < 0)) {
         goto out_free;
     }
 
-    filter_by_parent_ptr(sfs, depth, components);
+    for (i = 0, off = 0; i < nr_paths; off += pds[i++]->depth) {
+        filter_by_parent_ptr(sfs, pds[i]->depth, components + off);
+    }
 
     dm_mark(sfs->ctx);
 
-    ret = get_possible_dentries(sfs, depth, components);
+    ret = get_possible_dentries(sfs, nr_comps, dentries, components, owners);
     if (unlikely(ret < 0)) {
-        goto out_free;
+        goto out_pop;
     }
 
-    do_pathname_lookup(sfs, components, full_path, dentries);
+    for (i = 0, off = 0; i < nr_paths; off += pds[i++]->depth) {
+        do_pathname_lookup(sfs, components + off, pds[i], dentries + off);
+    }
 
+out_pop:
     dm_pop(sfs->ctx);
 
 out_free:
+    free(owners);
     free(components);
-
-out:
     return ret;
 }
 
-static int get_extent(sharedfs_t *sfs, struct bm_extent *dst_ext, dmptr_t dentry_remote_addr, int blkn) {
+int sharedfs_ns_lookup_dentries(sharedfs_t *sfs, const char *full_path, const pathdesc_t *pd,
+                                struct ethane_dentry **dentries) {
+    pathdesc_t tmp;
+
+    pr_debug("sharedfs_ns_lookup_dentries: %s", full_path);
+
+    pd = pathdesc_get(pd, full_path, &tmp);
+
+    return sharedfs_ns_lookup_dentries_batch(sfs, 1, &pd, dentries);
+}
+
+/*
+ * Block Mapping Hints
+ *   dentry->bm_hint is a mask of the interval size classes a file has extents in,
+ * tagged with a hash of the dentry address; a word with another tag is no hint.
+ * Classes are only ever added (a word left by an earlier dentry at the same address
+ * only adds more), so a hint is a superset of the classes checkpointed before it was
+ * read, and a lookup probes just those.
+ *   The hint also bounds the blocks the file ever mapped, by the bit length of the end
+ * of its last extent, and flags a file whose blocks a clone shares. Both only grow too,
+ * and tell reclamation which keys to drop and whether the blocks can be freed.
+ */
+#define BM_HINT_TAG(dentry_remote_addr)     ((uint64_t) hash_64(dentry_remote_addr, 32) << 32)
+
+#define BM_HINT_CLASSES_MASK                0xffffu
+#define BM_HINT_END_SHIFT                   16
+#define BM_HINT_END_MASK                    (0xffu << BM_HINT_END_SHIFT)
+#define BM_HINT_SHARED                      (1u << 31)
+
+/* the end field covering blocks [0, @end_blkn) */
+#define BM_HINT_END(end_blkn)               ((uint32_t) (32 - __builtin_clz(end_blkn)) << BM_HINT_END_SHIFT)
+
+static inline uint32_t bm_hint_bits(uint64_t hint, dmptr_t dentry_remote_addr) {
+    return (hint & ~0xffffffffull) == BM_HINT_TAG(dentry_remote_addr) ? (uint32_t) hint : 0;
+}
+
+static inline uint32_t bm_hint_classes(uint64_t hint, dmptr_t dentry_remote_addr) {
+    return bm_hint_bits(hint, dentry_remote_addr) & BM_HINT_CLASSES_MASK;
+}
+
+/* the number of blocks from 0 the file may have mapped */
+static inline int bm_hint_nr_blks(uint32_t bits) {
+    return (int) (1ull << ((bits & BM_HINT_END_MASK) >> BM_HINT_END_SHIFT)) - 1;
+}
+
+static inline uint32_t bm_hint_merge(uint32_t a, uint32_t b) {
+    return ((a | b) & ~BM_HINT_END_MASK) | max(a & BM_HINT_END_MASK, b & BM_HINT_END_MASK);
+}
+
+/*
+ * Probe the interval nodes of the classes in @classes (all if 0) that may hold @blkn.
+ * If @hint is given, the dentry's block mapping hint is read in the same round.
+ */
+static int get_extent(sharedfs_t *sfs, struct bm_extent *dst_ext, dmptr_t dentry_remote_addr, int blkn,
+                      uint32_t classes, uint64_t *hint) {
     struct bm_data_section_key keys[sfs->nr_interval_node_sizes];
     kv_vec_item_t vec[sfs->nr_interval_node_sizes];
     struct bm_extent *ext = NULL;
-    int i, j, ret;
+    uint64_t *remote_hint = NULL;
+    int i, j, n = 0, ret;
 
     dm_mark(sfs->ctx);
 
     memset(vec, 0, sizeof(vec));
 
-    /* enumerate all the possible interval nodes */
+    if (hint) {
+        remote_hint = dm_push(sfs->ctx, NULL, sizeof(*remote_hint));
+        ret = dm_copy_from_remote(sfs->ctx, remote_hint, DENTRY_FIELD(sfs, dentry_remote_addr, bm_hint),
+                                  sizeof(*remote_hint), 0);
+        if (unlikely(ret < 0)) {
+            goto out;
+        }
+    }
+
+    /* enumerate the possible interval nodes */
     for (i = 0; i < sfs->nr_interval_node_sizes; i++) {
-        keys[i].dentry_remote_addr = dentry_remote_addr;
-        keys[i].start_blkn = ALIGN_DOWN(blkn, sfs->interval_node_nr_blks[i]);
-        keys[i].nr_blks = sfs->interval_node_nr_blks[i];
-        vec[i].key = (const char *) &keys[i];
-        vec[i].key_len = sizeof(struct bm_data_section_key);
+        if (classes && !(classes & (1u << i))) {
+            continue;
+        }
+        keys[n].dentry_remote_addr = dentry_remote_addr;
+        keys[n].start_blkn = ALIGN_DOWN(blkn, sfs->interval_node_nr_blks[i]);
+        keys[n].nr_blks = sfs->interval_node_nr_blks[i];
+        vec[n].key = (const char *) &keys[n];
+        vec[n].key_len = sizeof(struct bm_data_section_key);
         pr_debug("get_extent: try[%d]: dentry=%lx blkn=%d nr_blks=%d",
-                    i, keys[i].dentry_remote_addr, keys[i].start_blkn, keys[i].nr_blks);
+                    i, keys[n].dentry_remote_addr, keys[n].start_blkn, keys[n].nr_blks);
+        n++;
     }
 
     /* get from data plane KV */
-    ret = kv_get_batch_approx(sfs->bm_kv, sfs->nr_interval_node_sizes, vec);
+    ret = kv_get_batch_approx(sfs->bm_kv, n, vec);
     if (unlikely(ret < 0)) {
-        ext = ERR_PTR(ret);
         goto out;
     }
 
-    ret = -ENOMEM;
+    if (hint) {
+        ret = dm_wait_ack(sfs->ctx, dm_set_ack_all(sfs->ctx));
+        if (unlikely(ret < 0)) {
+            goto out;
+        }
+        *hint = *remote_hint;
+    }
+
+    ret = -ENOENT;
 
-    /* filter out the possible extents */
-    for (i = 0; i < sfs->nr_interval_node_sizes; i++) {
+    /* filter out the possible extents, a block rewritten in another class has several */
+    for (i = 0; i < n; i++) {
         for (j = 0; j < KV_NR_POSSIBLE_VALS; j++) {
             ext = vec[i].possible_vals[j];
             if (!ext) {
@@ -576,10 +1483,16 @@ static int get_extent(sharedfs_t *sfs, struct bm_extent *dst_ext, dmptr_t dentry
 
             if (ext->dentry_remote_addr == dentry_remote_addr &&
                 ext->start_blkn <= blkn && blkn < ext->start_blkn + ext->nr_blks) {
-                pr_debug("match ext: dentry=%lx blkn=%d nr_blks=%d",
-                         ext->dentry_remote_addr, ext->start_blkn, ext->nr_blks);
+                if (ext->start_blkn == keys[i].start_blkn && ext->nr_blks == keys[i].nr_blks) {
+                    kv_cache_confirm(sfs->bm_kv, &vec[i]);
+                }
 
-                *dst_ext = *ext;
+                pr_debug("match ext: dentry=%lx blkn=%d nr_blks=%d version=%lu",
+                         ext->dentry_remote_addr, ext->start_blkn, ext->nr_blks, ext->version);
+
+                if (ret < 0 || ext->version > dst_ext->version) {
+                    *dst_ext = *ext;
+                }
 
                 ret = 0;
 
@@ -596,224 +1509,1592 @@ out:
     return ret;
 }
 
-int sharedfs_bm_get_extent(sharedfs_t *sfs, dmptr_t *remote_addr, size_t *size,
+int sharedfs_bm_get_extent(sharedfs_t *sfs, dmptr_t *remote_addr, size_t *loff, size_t *size,
                            struct ethane_dentry *dentry, size_t off) {
-    int blkn = (int) (off / BLK_SIZE), ret;
+    int blkn = (int) (off / BLK_SIZE), start, end, win, i, ret;
     struct bm_extent ext;
+    uint32_t classes;
+
+    classes = bm_hint_classes(dentry->bm_hint, dentry->remote_addr);
+    if (classes) {
+        ret = get_extent(sfs, &ext, dentry->remote_addr, blkn, classes, NULL);
+        if (ret == 0) {
+            goto found;
+        }
+    }
 
-    ret = get_extent(sfs, &ext, dentry->remote_addr, blkn);
+    /* no hint yet, or a class added since it was read: probe all and refresh it */
+    ret = get_extent(sfs, &ext, dentry->remote_addr, blkn, 0, &dentry->bm_hint);
+    classes = bm_hint_classes(dentry->bm_hint, dentry->remote_addr);
+    if (ret == -ENOENT) {
+        goto hole;
+    }
     if (unlikely(ret < 0)) {
         goto out;
     }
 
-    *remote_addr = ext.blk_remote_addr;
-    *size = ext.nr_blks * BLK_SIZE;
+found:
+    start = ext.start_blkn;
+    end = ext.start_blkn + ext.nr_blks;
+
+    /*
+     * A newer extent of a smaller class may hide any of its windows but the one
+     * holding @blkn (we would have probed it), so only that window is known valid.
+     */
+    for (i = 0; i < sfs->nr_interval_node_sizes; i++) {
+        win = sfs->interval_node_nr_blks[i];
+        if ((!classes || (classes & (1u << i))) && win < end - start) {
+            start = ALIGN_DOWN(blkn, win);
+            end = start + win;
+        }
+    }
+
+    *remote_addr = sharedfs_blk_addr_add(ext.blk_remote_addr, (size_t) (start - ext.start_blkn) * BLK_SIZE);
+    *loff = (size_t) start * BLK_SIZE;
+    *size = (size_t) (end - start) * BLK_SIZE;
+    goto out;
+
+hole:
+    /*
+     * No node of any class holds @blkn, so the window of the smallest class the file
+     * has extents in is unmapped. A file without any extent is a hole in any window.
+     */
+    win = 0;
+    for (i = 0; i < sfs->nr_interval_node_sizes; i++) {
+        if (!classes) {
+            win = max(win, sfs->interval_node_nr_blks[i]);
+        } else if ((classes & (1u << i)) && (!win || sfs->interval_node_nr_blks[i] < win)) {
+            win = sfs->interval_node_nr_blks[i];
+        }
+    }
+
+    *remote_addr = SHAREDFS_ZERO_BLK_ADDR;
+    *loff = (size_t) ALIGN_DOWN(blkn, win) * BLK_SIZE;
+    *size = (size_t) win * BLK_SIZE;
+    ret = 0;
 
 out:
     return ret;
 }
 
-static void *ns_del_updater(void *del_ctx, void *val) {
-    struct ns_kv_val *ns_kv_val = (struct ns_kv_val *) val;
-    dmptr_t dentry_remote_addr = (dmptr_t) del_ctx;
-    return ns_kv_val->dentry_remote_addr != dentry_remote_addr ? ERR_PTR(-EINVAL) : NULL;
-}
+/*
+ * Directory Child Index
+ *   Each directory keeps the remote addresses of its children in a list of
+ * chunks hanging off dentry->child_index, all full except the head chunk.
+ * A child records the slot holding it in dentry->index_slot, so removing it
+ * only moves the last entry of the head chunk into that slot.
+ *   Children of a directory are logged with the directory's fingerprint, so
+ * its index is mostly updated by the checkpointer owning that shard; renames
+ * across directories are not, hence the per-directory lock. Readers do not take
+ * it, they validate their walk with its ticket word instead.
+ */
 
-int sharedfs_ns_update_batch(sharedfs_t *sfs, int nr_updates, sharedfs_ns_update_record_t *updates) {
-    int ret, i, nr_puts = 0, nr_dels = 0, nr_upds;
-    sharedfs_ns_update_record_t *update;
-    struct ethane_dentry *dentry;
-    struct ns_kv_val *vals;
-    const char *filename;
-    kv_vec_item_t *vec;
-    size_t de_size;
+#define DIR_INDEX_CHUNK_NR_ENTS     126
 
-    /* A. Deletes */
+struct dir_index_chunk {
+    dmptr_t next;
+    int nr_ents;
+    dmptr_t ents[DIR_INDEX_CHUNK_NR_ENTS];
+};
 
-    vec = calloc(1, nr_updates * sizeof(*vec));
-    if (unlikely(!vec)) {
-        ret = -ENOMEM;
-        goto out;
-    }
+#define INDEX_SLOT(chunk, i)        ((chunk) + offsetof(struct dir_index_chunk, ents) + (i) * sizeof(dmptr_t))
 
-    /* collect dels */
-    for (i = 0; i < nr_updates; i++) {
-        if (updates[i].dentry->type == ETHANE_DENTRY_TOMBSTONE && updates[i].dentry->remote_addr) {
-            ethane_assert(!updates[i].is_create);
-            pr_debug("collected del: %s", updates[i].full_path);
-            vec[nr_dels].key = updates[i].full_path;
-            vec[nr_dels].key_len = strlen(updates[i].full_path);
-            vec[nr_dels].upd_ctx = (void *) updates[i].dentry->remote_addr;
-            nr_dels++;
-        }
+struct dir_index_op {
+    dmptr_t parent, child;
+    /* DMPTR_NULL for inserts */
+    dmptr_t slot;
+};
+
+static int dir_index_op_cmp(const void *a, const void *b) {
+    const struct dir_index_op *x = a, *y = b;
+    if (x->parent != y->parent) {
+        return x->parent < y->parent ? -1 : 1;
     }
+    /* removes go first to make room for inserts */
+    if ((x->slot == DMPTR_NULL) != (y->slot == DMPTR_NULL)) {
+        return (x->slot == DMPTR_NULL) - (y->slot == DMPTR_NULL);
+    }
+    return x->child < y->child ? -1 : x->child > y->child;
+}
 
-    /* issue dels */
-    ret = kv_upd_batch(sfs->ns_kv, nr_dels, vec, ns_del_updater);
+static int load_index_chunk(sharedfs_t *sfs, struct dir_index_chunk *chunk, dmptr_t addr) {
+    int ret;
+
+    /* let the in-flight slot writes land first */
+    ret = dm_wait_ack(sfs->ctx, dm_set_ack_all(sfs->ctx));
     if (unlikely(ret < 0)) {
-        goto out_free;
+        goto out;
     }
 
-    /* B. Updates (inserts also include here) */
-    dm_mark(sfs->ctx);
-
-    nr_upds = 0;
+    ret = dm_copy_from_remote(sfs->ctx, chunk, addr, sizeof(*chunk), DMFLAG_ACK);
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
 
-    for (i = 0; i < nr_updates; i++) {
-        update = &updates[i];
+    ret = dm_wait_ack(sfs->ctx, 1);
 
-        /* deletion */
-        if (update->dentry->type == ETHANE_DENTRY_TOMBSTONE) {
-            continue;
-        }
+out:
+    return ret;
+}
 
-        filename = ethane_get_filename(update->full_path);
-        de_size = sizeof(*dentry) + strlen(filename) + 1;
-        dentry = dm_push(sfs->ctx, NULL, de_size);
-        memcpy(dentry, update->dentry, sizeof(*dentry));
-        strcpy(dentry->filename, filename);
+static inline bool slot_in_chunk(dmptr_t slot, dmptr_t chunk) {
+    return chunk <= slot && slot < chunk + sizeof(struct dir_index_chunk);
+}
 
-        pr_debug("collected upd/ins: %s(%s), de_size=%lu, raddr=%lx, type=%s",
-                 update->full_path, filename, de_size, dentry->remote_addr, get_de_ty_str(dentry->type));
+/* Apply @ops (all of the same directory, removes first) to the directory's child index. */
+static int update_dir_index(sharedfs_t *sfs, struct dir_index_op *ops, int nr_ops) {
+    dmptr_t dir = ops[0].parent, head_addr, new_addr, *head_ptr, last, slot;
+    bool dirty = false, head_changed = false;
+    struct dir_index_chunk *head;
+    int i, j, ret;
 
-        /* update the dentry */
-        ret = dm_copy_to_remote(sfs->ctx, update->dentry->remote_addr, dentry, de_size, 0);
-        if (unlikely(ret < 0)) {
-            goto out_free;
-        }
+    dmlock_acquire(sfs->locktab, dir);
 
-        /* No wait for ack here to gain more parallelism for normal cases. */
-        if (++nr_upds % sfs->nr_max_outstanding_updates == 0) {
-            ret = dm_wait_ack(sfs->ctx, dm_set_ack_all(sfs->ctx));
-            if (unlikely(ret < 0)) {
-                goto out_free;
-            }
+    dm_mark(sfs->ctx);
 
-            dm_pop(sfs->ctx);
-            dm_mark(sfs->ctx);
-        }
+    ret = dm_read(sfs->ctx, head_ptr, DENTRY_FIELD(sfs, dir, child_index), DMFLAG_ACK);
+    if (unlikely(ret < 0)) {
+        goto out;
     }
 
-    ret = dm_wait_ack(sfs->ctx, dm_set_ack_all(sfs->ctx));
+    ret = dm_wait_ack(sfs->ctx, 1);
     if (unlikely(ret < 0)) {
-        goto out_free;
+        goto out;
     }
 
-    dm_pop(sfs->ctx);
+    head_addr = *head_ptr;
 
-    /* C. Inserts */
-    vals = malloc(nr_updates * sizeof(*vals));
-    if (unlikely(!vals)) {
-        ret = -ENOMEM;
-        goto out_free;
+    head = dm_push(sfs->ctx, NULL, sizeof(*head));
+    if (head_addr) {
+        ret = load_index_chunk(sfs, head, head_addr);
+        if (unlikely(ret < 0)) {
+            goto out;
+        }
     }
 
-    /* collect puts */
-    for (i = 0; i < nr_updates; i++) {
-        update = &updates[i];
+    for (i = 0; i < nr_ops; i++) {
+        if (ops[i].slot == DMPTR_NULL) {
+            break;
+        }
 
-        if (!update->is_create) {
+        if (unlikely(!head_addr || head->nr_ents == 0)) {
+            pr_warn("dir %lx: child index is empty, drop removal of %lx", dir, ops[i].child);
             continue;
         }
 
-        ethane_assert(update->dentry->type != ETHANE_DENTRY_TOMBSTONE);
+        last = head->ents[--head->nr_ents];
+        slot = ops[i].slot;
+        dirty = true;
 
-        vals[i].dentry_remote_addr = update->dentry->remote_addr;
-        vals[i].filename_len = strlen(ethane_get_filename(update->full_path));
-        vals[i].parent = update->dentry->parent;
-        ethane_assert(update->dentry->parent != DMPTR_NULL);
+        if (last != ops[i].child) {
+            /* move the last entry into the hole */
+            if (slot_in_chunk(slot, head_addr)) {
+                head->ents[(slot - INDEX_SLOT(head_addr, 0)) / sizeof(dmptr_t)] = last;
+            } else {
+                ret = dm_write(sfs->ctx, slot, last, 0);
+                if (unlikely(ret < 0)) {
+                    goto out;
+                }
+            }
 
-        pr_debug("collected insert %s, dentry: %lx, parent: %lx",
-                 update->full_path, vals[i].dentry_remote_addr, vals[i].parent);
+            ret = dm_write(sfs->ctx, DENTRY_FIELD(sfs, last, index_slot), slot, 0);
+            if (unlikely(ret < 0)) {
+                goto out;
+            }
+
+            /* it may be removed later in this batch */
+            for (j = i + 1; j < nr_ops && ops[j].slot != DMPTR_NULL; j++) {
+                if (ops[j].child == last) {
+                    ops[j].slot = slot;
+                }
+            }
+        }
+
+        if (head->nr_ents == 0) {
+            /* all the other chunks are full, pop the head */
+            dmm_bfree(sfs->dmm, head_addr, sizeof(*head));
+            head_addr = head->next;
+            head_changed = true;
+            dirty = false;
+
+            if (head_addr) {
+                ret = load_index_chunk(sfs, head, head_addr);
+                if (unlikely(ret < 0)) {
+                    goto out;
+                }
+            }
+        }
+    }
+
+    for (; i < nr_ops; i++) {
+        if (!head_addr || head->nr_ents == DIR_INDEX_CHUNK_NR_ENTS) {
+            new_addr = dmm_balloc_near(sfs->dmm, sizeof(*head), CACHELINE_SIZE, dir);
+            if (unlikely(IS_ERR(new_addr))) {
+                ret = PTR_ERR(new_addr);
+                goto out;
+            }
+
+            if (dirty) {
+                ret = dm_copy_to_remote(sfs->ctx, head_addr, head, sizeof(*head), 0);
+                if (unlikely(ret < 0)) {
+                    goto out;
+                }
+            }
+
+            head = dm_push(sfs->ctx, NULL, sizeof(*head));
+            head->next = head_addr;
+            head->nr_ents = 0;
+            head_addr = new_addr;
+            head_changed = true;
+        }
+
+        slot = INDEX_SLOT(head_addr, head->nr_ents);
+        head->ents[head->nr_ents++] = ops[i].child;
+        dirty = true;
+
+        ret = dm_write(sfs->ctx, DENTRY_FIELD(sfs, ops[i].child, index_slot), slot, 0);
+        if (unlikely(ret < 0)) {
+            goto out;
+        }
+    }
+
+    if (dirty) {
+        ret = dm_copy_to_remote(sfs->ctx, head_addr, head, INDEX_SLOT(0, head->nr_ents), 0);
+        if (unlikely(ret < 0)) {
+            goto out;
+        }
+    }
+
+    if (head_changed) {
+        ret = dm_write(sfs->ctx, DENTRY_FIELD(sfs, dir, child_index), head_addr, 0);
+        if (unlikely(ret < 0)) {
+            goto out;
+        }
+    }
+
+    ret = dm_wait_ack(sfs->ctx, dm_set_ack_all(sfs->ctx));
+
+out:
+    dm_pop(sfs->ctx);
+    dmlock_release(sfs->locktab, dir);
+    return ret;
+}
+
+/*
+ * Collect the index slots of the removed children in @updates, before their dentries are
+ * rewritten. The remote dentry of a child created and removed within one checkpoint was
+ * never written, so a slot is only trusted if it still holds the child.
+ */
+static int collect_index_removes(sharedfs_t *sfs, int nr_updates, sharedfs_ns_update_record_t *updates,
+                                 struct dir_index_op *ops, int *nr_ops) {
+    int i, j, nr = 0, ret = 0, from;
+    struct ethane_dentry **hdrs;
+    dmptr_t child, **slot_vals;
+
+    hdrs = calloc(nr_updates, sizeof(*hdrs));
+    slot_vals = calloc(nr_updates, sizeof(*slot_vals));
+    if (unlikely(!hdrs || !slot_vals)) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    for (from = 0; from < nr_updates; from = i) {
+        dm_mark(sfs->ctx);
+
+        for (i = from; i < nr_updates && i - from < sfs->nr_max_outstanding_updates; i++) {
+            if (updates[i].dentry->type != ETHANE_DENTRY_TOMBSTONE || !updates[i].dentry->remote_addr) {
+                continue;
+            }
+            hdrs[i] = dm_push(sfs->ctx, NULL, offsetof(struct ethane_dentry, flags));
+            ret = dm_copy_from_remote(sfs->ctx, hdrs[i], updates[i].dentry->remote_addr,
+                                      offsetof(struct ethane_dentry, flags), 0);
+            if (unlikely(ret < 0)) {
+                goto out_pop;
+            }
+        }
+
+        ret = dm_wait_ack(sfs->ctx, dm_set_ack_all(sfs->ctx));
+        if (unlikely(ret < 0)) {
+            goto out_pop;
+        }
+
+        for (j = from; j < i; j++) {
+            if (!hdrs[j] || hdrs[j]->remote_addr != updates[j].dentry->remote_addr) {
+                hdrs[j] = NULL;
+                continue;
+            }
+            /* a tombstone replayed without a lookup does not know where its key lives */
+            if (!updates[j].dentry->parent) {
+                updates[j].dentry->parent = hdrs[j]->parent;
+            }
+            if (!hdrs[j]->index_slot) {
+                hdrs[j] = NULL;
+                continue;
+            }
+            ret = dm_read(sfs->ctx, slot_vals[j], hdrs[j]->index_slot, 0);
+            if (unlikely(ret < 0)) {
+                goto out_pop;
+            }
+        }
+
+        ret = dm_wait_ack(sfs->ctx, dm_set_ack_all(sfs->ctx));
+        if (unlikely(ret < 0)) {
+            goto out_pop;
+        }
+
+        for (j = from; j < i; j++) {
+            child = updates[j].dentry->remote_addr;
+            if (!hdrs[j] || *slot_vals[j] != child) {
+                continue;
+            }
+            ops[nr].parent = hdrs[j]->parent;
+            ops[nr].child = child;
+            ops[nr].slot = hdrs[j]->index_slot;
+            nr++;
+        }
+
+        dm_pop(sfs->ctx);
+    }
+
+    *nr_ops = nr;
+    goto out;
+
+out_pop:
+    dm_pop(sfs->ctx);
+
+out:
+    free(slot_vals);
+    free(hdrs);
+    return ret;
+}
+
+/* Add the created (or moved) children in @updates to @ops (holding the removes) and apply them. */
+static int update_child_index(sharedfs_t *sfs, int nr_updates, sharedfs_ns_update_record_t *updates,
+                              struct dir_index_op *ops, int nr_ops) {
+    int i, j, n, ret = 0;
+
+    for (i = 0; i < nr_updates; i++) {
+        if (updates[i].is_create) {
+            ops[nr_ops].parent = updates[i].dentry->parent;
+            ops[nr_ops].child = updates[i].dentry->remote_addr;
+            ops[nr_ops].slot = DMPTR_NULL;
+            nr_ops++;
+        }
+    }
+
+    qsort(ops, nr_ops, sizeof(*ops), dir_index_op_cmp);
+
+    /* a dentry moved and then removed has two tombstones */
+    for (i = 0, n = 0; i < nr_ops; i++) {
+        if (n && !dir_index_op_cmp(&ops[n - 1], &ops[i]) && ops[i].slot != DMPTR_NULL) {
+            continue;
+        }
+        ops[n++] = ops[i];
+    }
+    nr_ops = n;
+
+    for (i = 0; i < nr_ops; i = j) {
+        for (j = i + 1; j < nr_ops && ops[j].parent == ops[i].parent; j++);
+
+        ret = update_dir_index(sfs, &ops[i], j - i);
+        if (unlikely(ret < 0)) {
+            goto out;
+        }
+    }
+
+out:
+    return ret;
+}
+
+/*
+ * Collect the child addresses of the directory into *@addrs, the caller frees them. This
+ * runs without the directory lock, while update_dir_index() may move entries and free the
+ * emptied head chunk under it: a chunk is only used once the lock word shows that no
+ * writer came in since the walk started, and the walk starts over otherwise.
+ */
+static int read_child_index(sharedfs_t *sfs, dmptr_t dir_remote_addr, dmptr_t **addrs) {
+    struct dir_index_chunk *chunk;
+    dmptr_t addr, *head_ptr, *arr = NULL, *tmp;
+    int nr, cap = 0, ret;
+    uint64_t seq, now;
+
+    dm_mark(sfs->ctx);
+
+    head_ptr = dm_push(sfs->ctx, NULL, sizeof(*head_ptr));
+    chunk = dm_push(sfs->ctx, NULL, sizeof(*chunk));
+
+retry:
+    nr = 0;
+
+    do {
+        ret = dmlock_read_seq(sfs->locktab, dir_remote_addr, &seq);
+    } while (ret == -EBUSY);
+    if (unlikely(ret < 0)) {
+        goto out_free;
+    }
+
+    ret = dm_copy_from_remote(sfs->ctx, head_ptr, DENTRY_FIELD(sfs, dir_remote_addr, child_index),
+                              sizeof(*head_ptr), DMFLAG_ACK);
+    if (unlikely(ret < 0)) {
+        goto out_free;
+    }
+
+    ret = dm_wait_ack(sfs->ctx, 1);
+    if (unlikely(ret < 0)) {
+        goto out_free;
+    }
+
+    for (addr = *head_ptr; addr; addr = chunk->next) {
+        ret = load_index_chunk(sfs, chunk, addr);
+        if (unlikely(ret < 0)) {
+            goto out_free;
+        }
+
+        /* the chunk may have been changed, or freed and reused, under us */
+        ret = dmlock_read_seq(sfs->locktab, dir_remote_addr, &now);
+        if (ret == -EBUSY || (!ret && now != seq)) {
+            goto retry;
+        }
+        if (unlikely(ret < 0)) {
+            goto out_free;
+        }
+
+        if (cap - nr < chunk->nr_ents) {
+            cap = nr + DIR_INDEX_CHUNK_NR_ENTS;
+            tmp = realloc(arr, cap * sizeof(*arr));
+            if (unlikely(!tmp)) {
+                ret = -ENOMEM;
+                goto out_free;
+            }
+            arr = tmp;
+        }
+
+        memcpy(arr + nr, chunk->ents, chunk->nr_ents * sizeof(*arr));
+        nr += chunk->nr_ents;
+    }
+
+    *addrs = arr;
+    ret = nr;
+    goto out;
+
+out_free:
+    free(arr);
+
+out:
+    dm_pop(sfs->ctx);
+    return ret;
+}
+
+/* Call @fn on each child dentry of the directory, until it returns non-zero. */
+static int for_each_child(sharedfs_t *sfs, dmptr_t dir_remote_addr,
+                          int (*fn)(void *priv, struct ethane_dentry *de), void *priv) {
+    /* the name bytes in the smallest slot, and the most a buffer holds */
+    size_t name_read_len = ethane_dentry_size(sfs->dentry_fmt, 0) - DENTRY_OFF(sfs, filename);
+    size_t name_max_len = DENTRY_SIZE - sizeof(struct ethane_dentry);
+    struct ethane_dentry *des[DIR_INDEX_CHUNK_NR_ENTS];
+    struct ethane_dentry_compact *hdr;
+    int i, n, nr, nr_long, ret = 0;
+    dmptr_t *addrs, *ents;
+
+    nr = read_child_index(sfs, dir_remote_addr, &addrs);
+    if (unlikely(nr < 0)) {
+        ret = nr;
+        goto out;
+    }
+
+    for (ents = addrs; ents < addrs + nr; ents += n) {
+        n = min(addrs + nr - ents, DIR_INDEX_CHUNK_NR_ENTS);
+
+        dm_mark(sfs->ctx);
+
+        /* fetch a chunk's worth of children in one round trip */
+        for (i = 0; i < n; i++) {
+            des[i] = dm_push(sfs->ctx, NULL, DENTRY_SIZE);
+            ret = read_dentry(sfs, des[i], ents[i], name_read_len, 0);
+            if (unlikely(ret < 0)) {
+                goto out_pop;
+            }
+        }
+
+        ret = dm_wait_ack(sfs->ctx, dm_set_ack_all(sfs->ctx));
+        if (unlikely(ret < 0)) {
+            goto out_pop;
+        }
+
+        if (DENTRY_COMPACT(sfs)) {
+            /* longer names than the smallest slot holds take one more round */
+            nr_long = 0;
+            for (i = 0; i < n; i++) {
+                hdr = (struct ethane_dentry_compact *) (des[i]->filename - sizeof(*hdr));
+                if (hdr->filename_len + 1 > name_read_len) {
+                    ret = read_dentry(sfs, des[i], ents[i], min(hdr->filename_len + 1, name_max_len), 0);
+                    if (unlikely(ret < 0)) {
+                        goto out_pop;
+                    }
+                    nr_long++;
+                }
+            }
+
+            if (nr_long) {
+                ret = dm_wait_ack(sfs->ctx, dm_set_ack_all(sfs->ctx));
+                if (unlikely(ret < 0)) {
+                    goto out_pop;
+                }
+            }
+
+            for (i = 0; i < n; i++) {
+                unpack_dentry(sfs, des[i], ents[i]);
+            }
+        }
+
+        for (i = 0; i < n; i++) {
+            /* removed since the index was read, and its slot reused */
+            if (unlikely(des[i]->remote_addr != ents[i])) {
+                continue;
+            }
+            ((char *) des[i])[DENTRY_SIZE - 1] = '\0';
+            ret = fn(priv, des[i]);
+            if (ret) {
+                goto out_pop;
+            }
+        }
+
+        dm_pop(sfs->ctx);
+    }
+
+    goto out_free;
+
+out_pop:
+    dm_pop(sfs->ctx);
+
+out_free:
+    free(addrs);
+
+out:
+    return ret;
+}
+
+struct filldir_ctx {
+    sharedfs_filldir_t filler;
+    void *priv;
+};
+
+static int fill_child_name(void *priv, struct ethane_dentry *de) {
+    struct filldir_ctx *ctx = priv;
+    return ctx->filler(ctx->priv, de->filename);
+}
+
+int sharedfs_ns_read_dir(sharedfs_t *sfs, dmptr_t dir_remote_addr, sharedfs_filldir_t filler, void *priv) {
+    struct filldir_ctx ctx = { .filler = filler, .priv = priv };
+    return for_each_child(sfs, dir_remote_addr, fill_child_name, &ctx);
+}
+
+/*
+ * Subtree Reclamation
+ *   A subtree removed by rmtree is detached by dropping the key of its root, which makes
+ * everything below unreachable at once (keys are (parent, name) pairs). The checkpointer
+ * queues the root, and sharedfs_ns_reclaim() then takes its descendants apart a directory
+ * chunk at a time: their keys are dropped through the ordinary update path, so that the
+ * child index chunks are freed as they get empty, then the block mapping keys, data blocks
+ * and dentries of the files go, and the dentry of a directory once it is empty.
+ *   The queue of a checkpointer is a remote list headed by its slot of reclaim_queues, so
+ * a restart with the same client id picks it up. A queued directory waits until the log
+ * head passes its fence, the log tail when it was first seen: the ops logged below it
+ * before the rmtree (writes checkpointed by other shards included) are all applied by
+ * then. Each step persists its progress before freeing anything, so a crash may leak
+ * but never frees twice.
+ */
+struct reclaim_rec {
+    dmptr_t next;
+    dmptr_t dir;
+    size_t name_len;
+    /* 0 until the first reclamation step on it */
+    size_t fence;
+};
+
+struct reclaim_dir {
+    struct list_head node;
+    dmptr_t remote_addr;
+    struct reclaim_rec rec;
+};
+
+static int load_reclaim_queue(sharedfs_t *sfs) {
+    struct reclaim_dir *dir;
+    struct reclaim_rec *rec;
+    int ret;
+
+    dm_mark(sfs->ctx);
+
+    rec = dm_push(sfs->ctx, NULL, sizeof(*rec));
+    ret = dm_copy_from_remote(sfs->ctx, &rec->next, sfs->reclaim_head, sizeof(rec->next), DMFLAG_ACK);
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
+
+    ret = dm_wait_ack(sfs->ctx, 1);
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
+
+    while (rec->next) {
+        dir = malloc(sizeof(*dir));
+        if (unlikely(!dir)) {
+            ret = -ENOMEM;
+            goto out;
+        }
+
+        dir->remote_addr = rec->next;
+        list_add_tail(&dir->node, &sfs->reclaim_dirs);
+
+        ret = dm_copy_from_remote(sfs->ctx, rec, dir->remote_addr, sizeof(*rec), DMFLAG_ACK);
+        if (unlikely(ret < 0)) {
+            goto out;
+        }
+
+        ret = dm_wait_ack(sfs->ctx, 1);
+        if (unlikely(ret < 0)) {
+            goto out;
+        }
+
+        dir->rec = *rec;
+    }
+
+    if (!list_empty(&sfs->reclaim_dirs)) {
+        pr_info("resumed reclaim of removed subtrees");
+    }
+
+out:
+    dm_pop(sfs->ctx);
+    return ret;
+}
+
+static int queue_reclaim_dir(sharedfs_t *sfs, dmptr_t addr, size_t name_len, size_t fence) {
+    struct reclaim_dir *dir, *tail = NULL;
+    dmptr_t link;
+    int ret;
+
+    dir = malloc(sizeof(*dir));
+    if (unlikely(!dir)) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    dir->remote_addr = dmm_balloc(sfs->dmm, sizeof(dir->rec), CACHELINE_SIZE, 0);
+    if (unlikely(IS_ERR(dir->remote_addr))) {
+        ret = PTR_ERR(dir->remote_addr);
+        goto out_free;
+    }
+
+    dir->rec.next = DMPTR_NULL;
+    dir->rec.dir = addr;
+    dir->rec.name_len = name_len;
+    dir->rec.fence = fence;
+
+    if (list_empty(&sfs->reclaim_dirs)) {
+        link = sfs->reclaim_head;
+    } else {
+        tail = list_last_entry(&sfs->reclaim_dirs, struct reclaim_dir, node);
+        link = tail->remote_addr + offsetof(struct reclaim_rec, next);
+    }
+
+    dm_mark(sfs->ctx);
+
+    /* the record lands before the link to it */
+    ret = dm_copy_to_remote(sfs->ctx, dir->remote_addr, dm_push(sfs->ctx, &dir->rec, sizeof(dir->rec)),
+                            sizeof(dir->rec), 0);
+    if (unlikely(ret < 0)) {
+        goto out_pop;
+    }
+
+    ret = dm_write(sfs->ctx, link, dir->remote_addr, 0);
+    if (unlikely(ret < 0)) {
+        goto out_pop;
+    }
+
+    ret = dm_wait_ack(sfs->ctx, dm_set_ack_all(sfs->ctx));
+    if (unlikely(ret < 0)) {
+        goto out_pop;
+    }
+
+    dm_pop(sfs->ctx);
+
+    if (tail) {
+        tail->rec.next = dir->remote_addr;
+    }
+    list_add_tail(&dir->node, &sfs->reclaim_dirs);
+    goto out;
+
+out_pop:
+    dm_pop(sfs->ctx);
+    dmm_bfree(sfs->dmm, dir->remote_addr, sizeof(dir->rec));
+
+out_free:
+    free(dir);
+
+out:
+    return ret;
+}
+
+/* Unlink the head @dir of the queue, for good before anything it names is freed. */
+static int pop_reclaim_dir(sharedfs_t *sfs, struct reclaim_dir *dir) {
+    int ret;
+
+    dm_mark(sfs->ctx);
+
+    ret = dm_write(sfs->ctx, sfs->reclaim_head, dir->rec.next, DMFLAG_ACK);
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
+
+    ret = dm_wait_ack(sfs->ctx, 1);
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
+
+    dmm_bfree(sfs->dmm, dir->remote_addr, sizeof(dir->rec));
+    list_del(&dir->node);
+    free(dir);
+
+out:
+    dm_pop(sfs->ctx);
+    return ret;
+}
+
+static int set_reclaim_fence(sharedfs_t *sfs, struct reclaim_dir *dir, size_t fence) {
+    int ret;
+
+    dm_mark(sfs->ctx);
+
+    ret = dm_write(sfs->ctx, dir->remote_addr + offsetof(struct reclaim_rec, fence), fence, DMFLAG_ACK);
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
+
+    ret = dm_wait_ack(sfs->ctx, 1);
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
+
+    dir->rec.fence = fence;
+
+out:
+    dm_pop(sfs->ctx);
+    return ret;
+}
+
+static void *ns_del_updater(void *del_ctx, void *val) {
+    struct ns_kv_val *ns_kv_val = (struct ns_kv_val *) val;
+    dmptr_t dentry_remote_addr = (dmptr_t) del_ctx;
+    return ns_kv_val->dentry_remote_addr != dentry_remote_addr ? ERR_PTR(-EINVAL) : NULL;
+}
+
+static void *ns_inline_updater(void *upd_ctx, void *val) {
+    sharedfs_ns_update_record_t *update = upd_ctx;
+    struct ns_kv_val *ns_kv_val = val;
+    const char *filename;
+
+    if (ns_kv_val->dentry_remote_addr != update->dentry->remote_addr) {
+        return ERR_PTR(-EINVAL);
+    }
+
+    filename = ethane_get_filename(update->full_path);
+    ns_kv_val_set_inline(ns_kv_val, update->dentry, filename, strlen(filename));
+    return ns_kv_val;
+}
+
+/* Bring the inline values of the dentries updated in place up to date. */
+static int refresh_inline_vals(sharedfs_t *sfs, int nr_updates, sharedfs_ns_update_record_t *updates,
+                               kv_vec_item_t *vec, char *keys) {
+    char *key = NULL;
+    int i, nr = 0;
+
+    for (i = 0; i < nr_updates; i++) {
+        if (updates[i].is_create || updates[i].dentry->type == ETHANE_DENTRY_TOMBSTONE) {
+            continue;
+        }
+        if (keys) {
+            key = keys + nr * NS_PARENT_KEY_MAX_LEN;
+        }
+        set_update_key(sfs, &vec[nr], key, &updates[i]);
+        vec[nr].upd_ctx = &updates[i];
+        nr++;
+    }
+
+    return kv_upd_batch(sfs->ns_kv, nr, vec, ns_inline_updater);
+}
+
+int sharedfs_ns_update_batch(sharedfs_t *sfs, int nr_updates, sharedfs_ns_update_record_t *updates) {
+    int ret, i, nr_puts = 0, nr_dels = 0, nr_upds, nr_index_ops;
+    sharedfs_ns_update_record_t *update;
+    size_t de_size, hint_end, hdr_end, name_off, inline_off, inline_end;
+    struct dir_index_op *index_ops;
+    char *keys = NULL, *key = NULL;
+    struct ethane_dentry dentry;
+    struct ns_kv_val *vals;
+    const char *filename;
+    kv_vec_item_t *vec;
+    char *image;
+
+    index_ops = calloc(nr_updates, sizeof(*index_ops));
+    if (unlikely(!index_ops)) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    ret = collect_index_removes(sfs, nr_updates, updates, index_ops, &nr_index_ops);
+    if (unlikely(ret < 0)) {
+        goto out_free_ops;
+    }
+
+    /* A. Deletes */
+
+    vec = calloc(1, nr_updates * sizeof(*vec));
+    if (unlikely(!vec)) {
+        ret = -ENOMEM;
+        goto out_free_ops;
+    }
+
+    if (sfs->ns_key_mode == SHAREDFS_NS_KEY_PARENT) {
+        keys = malloc(nr_updates * NS_PARENT_KEY_MAX_LEN);
+        if (unlikely(!keys)) {
+            ret = -ENOMEM;
+            goto out_free;
+        }
+    }
+
+    /* collect dels */
+    for (i = 0; i < nr_updates; i++) {
+        if (updates[i].dentry->type == ETHANE_DENTRY_TOMBSTONE && updates[i].dentry->remote_addr) {
+            ethane_assert(!updates[i].is_create);
+            pr_debug("collected del: %s", updates[i].full_path);
+            if (keys) {
+                key = keys + nr_dels * NS_PARENT_KEY_MAX_LEN;
+            }
+            set_update_key(sfs, &vec[nr_dels], key, &updates[i]);
+            vec[nr_dels].upd_ctx = (void *) updates[i].dentry->remote_addr;
+            nr_dels++;
+        }
+    }
+
+    /* issue dels */
+    ret = kv_upd_batch(sfs->ns_kv, nr_dels, vec, ns_del_updater);
+    if (unlikely(ret < 0)) {
+        goto out_free;
+    }
+
+    /* the deleted keys leave the filter */
+    ret = ns_filter_add_batch(sfs, nr_dels, vec, -1, NS_FILTER_DONE);
+    if (unlikely(ret < 0)) {
+        goto out_free;
+    }
+
+    /* B. Updates (inserts also include here) */
+    dm_mark(sfs->ctx);
+
+    nr_upds = 0;
+
+    for (i = 0; i < nr_updates; i++) {
+        update = &updates[i];
+
+        /* deletion */
+        if (update->dentry->type == ETHANE_DENTRY_TOMBSTONE) {
+            continue;
+        }
+
+        filename = ethane_get_filename(update->full_path);
+        image = dm_push(sfs->ctx, NULL, sizeof(dentry) + strlen(filename) + 1);
+
+        dentry = *update->dentry;
+        dentry.flags &= ~ETHANE_DENTRY_PARTIAL;
+        if (update->is_create && !update->is_move) {
+            dentry.child_index = DMPTR_NULL;
+            dentry.index_slot = DMPTR_NULL;
+        }
+        de_size = pack_dentry(sfs->dentry_fmt, image, &dentry, filename);
+
+        pr_debug("collected upd/ins: %s(%s), de_size=%lu, raddr=%lx, type=%s",
+                 update->full_path, filename, de_size, dentry.remote_addr, get_de_ty_str(dentry.type));
+
+        /*
+         * Update the dentry. cacheFS only changes the fields before the child index (and
+         * the name, on a move), and its copy of the rest may not even be read in.
+         */
+        hint_end = DENTRY_OFF(sfs, bm_hint) + sizeof(dentry.bm_hint);
+        name_off = DENTRY_OFF(sfs, filename);
+        if (DENTRY_COMPACT(sfs)) {
+            hdr_end = update->is_move ? offsetof(struct ethane_dentry_compact, nr_children)
+                                      : offsetof(struct ethane_dentry_compact, filename_len);
+        } else {
+            hdr_end = offsetof(struct ethane_dentry, child_index);
+        }
+
+        if (update->is_create && !update->is_move) {
+            /* the block mapping hint may already be set by an earlier data checkpoint */
+            ret = dm_copy_to_remote(sfs->ctx, dentry.remote_addr, image, DENTRY_OFF(sfs, bm_hint), 0);
+            if (unlikely(ret < 0)) {
+                goto out_free;
+            }
+            ret = dm_copy_to_remote(sfs->ctx, dentry.remote_addr + hint_end, image + hint_end,
+                                    de_size - hint_end, 0);
+        } else {
+            ret = dm_copy_to_remote(sfs->ctx, dentry.remote_addr, image, hdr_end, 0);
+            if (unlikely(ret < 0)) {
+                goto out_free;
+            }
+            if (update->is_move) {
+                ret = dm_copy_to_remote(sfs->ctx, dentry.remote_addr + name_off, image + name_off,
+                                        de_size - name_off, 0);
+                if (unlikely(ret < 0)) {
+                    goto out_free;
+                }
+            }
+            if (update->inline_dirty && !DENTRY_COMPACT(sfs)) {
+                inline_off = offsetof(struct ethane_dentry, flags);
+                inline_end = offsetof(struct ethane_dentry, inline_data) + ETHANE_INLINE_DATA_MAX;
+                ret = dm_copy_to_remote(sfs->ctx, dentry.remote_addr + inline_off, image + inline_off,
+                                        inline_end - inline_off, 0);
+            }
+        }
+        if (unlikely(ret < 0)) {
+            goto out_free;
+        }
+
+        /* No wait for ack here to gain more parallelism for normal cases. */
+        if (++nr_upds % sfs->nr_max_outstanding_updates == 0) {
+            ret = dm_wait_ack(sfs->ctx, dm_set_ack_all(sfs->ctx));
+            if (unlikely(ret < 0)) {
+                goto out_free;
+            }
+
+            dm_pop(sfs->ctx);
+            dm_mark(sfs->ctx);
+        }
+    }
+
+    ret = dm_wait_ack(sfs->ctx, dm_set_ack_all(sfs->ctx));
+    if (unlikely(ret < 0)) {
+        goto out_free;
+    }
+
+    dm_pop(sfs->ctx);
+
+    /* C. Inserts */
+    vals = malloc(nr_updates * sizeof(*vals));
+    if (unlikely(!vals)) {
+        ret = -ENOMEM;
+        goto out_free;
+    }
+
+    /* collect puts */
+    for (i = 0; i < nr_updates; i++) {
+        update = &updates[i];
+
+        if (!update->is_create) {
+            continue;
+        }
+
+        ethane_assert(update->dentry->type != ETHANE_DENTRY_TOMBSTONE);
+
+        filename = ethane_get_filename(update->full_path);
+        vals[i].dentry_remote_addr = update->dentry->remote_addr;
+        vals[i].filename_len = strlen(filename);
+        vals[i].parent = update->dentry->parent;
+        ethane_assert(update->dentry->parent != DMPTR_NULL);
+        if (sfs->ns_inline_dentry) {
+            ns_kv_val_set_inline(&vals[i], update->dentry, filename, vals[i].filename_len);
+        }
+
+        pr_debug("collected insert %s, dentry: %lx, parent: %lx",
+                 update->full_path, vals[i].dentry_remote_addr, vals[i].parent);
+
+        if (keys) {
+            key = keys + nr_puts * NS_PARENT_KEY_MAX_LEN;
+        }
+        set_update_key(sfs, &vec[nr_puts], key, update);
+        vec[nr_puts].val = &vals[i];
+        vec[nr_puts].err = 0;
+
+        nr_puts++;
+    }
+
+    /* the new keys enter the filter before they can be found */
+    ret = ns_filter_add_batch(sfs, nr_puts, vec, 1, NS_FILTER_ALL);
+    if (unlikely(ret < 0)) {
+        free(vals);
+        goto out_free;
+    }
+
+    /* issue puts */
+    ret = kv_put_batch(sfs->ns_kv, nr_puts, vec);
+    free(vals);
+    if (unlikely(ret < 0)) {
+        goto out_free;
+    }
+
+    /* take back the keys which could not be put */
+    ret = ns_filter_add_batch(sfs, nr_puts, vec, -1, NS_FILTER_FAILED);
+    if (unlikely(ret < 0)) {
+        goto out_free;
+    }
+
+    /* Inline values of the updated dentries */
+    if (sfs->ns_inline_dentry) {
+        ret = refresh_inline_vals(sfs, nr_updates, updates, vec, keys);
+        if (unlikely(ret < 0)) {
+            goto out_free;
+        }
+    }
 
-        vec[nr_puts].key = update->full_path;
-        vec[nr_puts].key_len = strlen(update->full_path);
-        vec[nr_puts].val = &vals[i];
+    /* D. Child index */
+    ret = update_child_index(sfs, nr_updates, updates, index_ops, nr_index_ops);
+    if (unlikely(ret < 0)) {
+        goto out_free;
+    }
 
-        nr_puts++;
+    /* E. Removed subtrees, reclaimed in the background */
+    for (i = 0; i < nr_updates; i++) {
+        if (updates[i].is_rmtree && updates[i].dentry->remote_addr) {
+            ret = queue_reclaim_dir(sfs, updates[i].dentry->remote_addr,
+                                    strlen(ethane_get_filename(updates[i].full_path)), 0);
+            if (unlikely(ret < 0)) {
+                goto out_free;
+            }
+        }
     }
 
-    /* issue puts */
-    ret = kv_put_batch(sfs->ns_kv, nr_puts, vec);
+out_free:
+    free(keys);
+    free(vec);
+
+out_free_ops:
+    free(index_ops);
+
+out:
+    return ret;
+}
+
+/* Children of a removed directory collected for one reclamation step */
+struct reclaim_batch {
+    struct ethane_dentry *dentries;
+    ethane_de_type_t *types;
+    sharedfs_ns_update_record_t *updates;
+    char *names;
+    size_t name_size;
+    int nr, max;
+};
+
+static int collect_reclaim_child(void *priv, struct ethane_dentry *de) {
+    struct reclaim_batch *batch = priv;
+    char *path = batch->names + batch->nr * batch->name_size;
+
+    /* only the name is needed for the (parent, name) key */
+    snprintf(path, batch->name_size, "/%s", de->filename);
+    batch->dentries[batch->nr] = *de;
+    batch->updates[batch->nr].full_path = path;
+    batch->updates[batch->nr].dentry = &batch->dentries[batch->nr];
+    return ++batch->nr == batch->max;
+}
+
+/* Whether @addr holds a checkpointed directory, a subtree removed before it reached us does not */
+static int is_checkpointed_dir(sharedfs_t *sfs, dmptr_t addr) {
+    struct ethane_dentry *de;
+    int ret;
+
+    dm_mark(sfs->ctx);
+
+    de = dm_push(sfs->ctx, NULL, sizeof(*de));
+    ret = read_dentry(sfs, de, addr, 0, DMFLAG_ACK);
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
+
+    ret = dm_wait_ack(sfs->ctx, 1);
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
+
+    unpack_dentry(sfs, de, addr);
+    ret = de->remote_addr == addr && de->type == ETHANE_DENTRY_DIR;
+
+out:
+    dm_pop(sfs->ctx);
+    return ret;
+}
+
+#define RECLAIM_BM_NR_KEYS      128
+
+static void *bm_del_updater(void *del_ctx, void *val) {
+    struct bm_extent *del = (struct bm_extent *) del_ctx;
+    struct bm_extent *ext = (struct bm_extent *) val;
+
+    if (ext->dentry_remote_addr == del->dentry_remote_addr &&
+        ext->start_blkn == del->start_blkn && ext->nr_blks == del->nr_blks) {
+        /* keep the blocks for the caller to free */
+        del->blk_remote_addr = ext->blk_remote_addr;
+        return NULL;
+    }
+
+    return ERR_PTR(-EINVAL);
+}
+
+/* Drop the @n interval nodes of @exts, and free their blocks if @free_blks. */
+static int drop_bm_nodes(sharedfs_t *sfs, int n, struct bm_data_section_key *keys, struct bm_extent *exts,
+                         kv_vec_item_t *vec, bool free_blks) {
+    int i, ret;
+
+    memset(vec, 0, n * sizeof(*vec));
+    for (i = 0; i < n; i++) {
+        keys[i].dentry_remote_addr = exts[i].dentry_remote_addr;
+        keys[i].start_blkn = exts[i].start_blkn;
+        keys[i].nr_blks = exts[i].nr_blks;
+        vec[i].key = (const char *) &keys[i];
+        vec[i].key_len = sizeof(struct bm_data_section_key);
+        vec[i].upd_ctx = &exts[i];
+    }
+
+    ret = kv_upd_batch(sfs->bm_kv, n, vec, bm_del_updater);
+    if (unlikely(ret < 0)) {
+        return ret;
+    }
+
+    for (i = 0; free_blks && i < n; i++) {
+        if (exts[i].blk_remote_addr != DMPTR_NULL && exts[i].blk_remote_addr != SHAREDFS_ZERO_BLK_ADDR) {
+            dmm_bfree(sfs->dmm, exts[i].blk_remote_addr, (size_t) exts[i].nr_blks * BLK_SIZE);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Drop the block mapping keys of the removed file @de (every node of its hint's classes
+ * within its hint's end) and free its blocks, unless a clone shares them, and its dentry.
+ */
+static int reclaim_file(sharedfs_t *sfs, const struct ethane_dentry *de, size_t name_len) {
+    uint32_t bits = bm_hint_bits(de->bm_hint, de->remote_addr);
+    int nr_blks = bm_hint_nr_blks(bits), win, blkn, i, n = 0, ret = 0;
+    bool free_blks = !(bits & BM_HINT_SHARED);
+    struct bm_data_section_key *keys;
+    struct bm_extent *exts;
+    kv_vec_item_t *vec;
+
+    keys = malloc(RECLAIM_BM_NR_KEYS * sizeof(*keys));
+    exts = malloc(RECLAIM_BM_NR_KEYS * sizeof(*exts));
+    vec = malloc(RECLAIM_BM_NR_KEYS * sizeof(*vec));
+    if (unlikely(!keys || !exts || !vec)) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    for (i = 0; i < sfs->nr_interval_node_sizes; i++) {
+        if (!(bits & (1u << i))) {
+            continue;
+        }
+
+        win = sfs->interval_node_nr_blks[i];
+        for (blkn = 0; blkn < nr_blks; blkn += win) {
+            exts[n].dentry_remote_addr = de->remote_addr;
+            exts[n].blk_remote_addr = DMPTR_NULL;
+            exts[n].start_blkn = blkn;
+            exts[n].nr_blks = win;
+
+            if (++n == RECLAIM_BM_NR_KEYS) {
+                ret = drop_bm_nodes(sfs, n, keys, exts, vec, free_blks);
+                if (unlikely(ret < 0)) {
+                    goto out;
+                }
+                n = 0;
+            }
+        }
+    }
+
+    if (n) {
+        ret = drop_bm_nodes(sfs, n, keys, exts, vec, free_blks);
+        if (unlikely(ret < 0)) {
+            goto out;
+        }
+    }
+
+    dmm_bfree(sfs->dmm, de->remote_addr, ethane_dentry_size(sfs->dentry_fmt, name_len));
+
+out:
+    free(vec);
+    free(exts);
+    free(keys);
+    return ret;
+}
+
+int sharedfs_ns_reclaim(sharedfs_t *sfs, int max_nr_children, size_t head, size_t tail) {
+    struct reclaim_batch batch = { .max = max_nr_children };
+    bool done = false, checkpointed;
+    struct reclaim_dir *dir;
+    dmptr_t dir_addr;
+    size_t name_len;
+    int ret = 0, err, i;
+
+    if (list_empty(&sfs->reclaim_dirs)) {
+        goto out;
+    }
+
+    dir = list_first_entry(&sfs->reclaim_dirs, struct reclaim_dir, node);
+    dir_addr = dir->rec.dir;
+
+    if (!dir->rec.fence) {
+        ret = set_reclaim_fence(sfs, dir, tail);
+        if (unlikely(ret < 0)) {
+            goto out;
+        }
+    }
+
+    /* ops logged below it before the rmtree may still be checkpointed */
+    if (head <= dir->rec.fence) {
+        goto out;
+    }
+
+    ret = is_checkpointed_dir(sfs, dir_addr);
     if (unlikely(ret < 0)) {
+        goto out;
+    }
+    checkpointed = ret;
+    ret = 0;
+    if (!checkpointed) {
+        goto out_done;
+    }
+
+    batch.name_size = DENTRY_SIZE - sizeof(struct ethane_dentry) + 2;
+    batch.dentries = calloc(batch.max, sizeof(*batch.dentries));
+    batch.types = calloc(batch.max, sizeof(*batch.types));
+    batch.updates = calloc(batch.max, sizeof(*batch.updates));
+    batch.names = malloc(batch.max * batch.name_size);
+    if (unlikely(!batch.dentries || !batch.types || !batch.updates || !batch.names)) {
+        ret = -ENOMEM;
         goto out_free;
     }
 
-    free(vals);
+    ret = for_each_child(sfs, dir_addr, collect_reclaim_child, &batch);
+    if (unlikely(ret < 0)) {
+        goto out_free;
+    }
+
+    for (i = 0; i < batch.nr; i++) {
+        batch.types[i] = batch.dentries[i].type;
+        batch.dentries[i].type = ETHANE_DENTRY_TOMBSTONE;
+        batch.dentries[i].parent = dir_addr;
+    }
+
+    if (batch.nr) {
+        ret = sharedfs_ns_update_batch(sfs, batch.nr, batch.updates);
+        if (unlikely(ret < 0)) {
+            goto out_free;
+        }
+    }
+
+    /* out of the index now, a crash from here on leaks what is left */
+    for (i = 0; i < batch.nr; i++) {
+        name_len = strlen(batch.updates[i].full_path) - 1;
+        if (batch.types[i] == ETHANE_DENTRY_DIR) {
+            ret = queue_reclaim_dir(sfs, batch.dentries[i].remote_addr, name_len, dir->rec.fence);
+        } else {
+            ret = reclaim_file(sfs, &batch.dentries[i], name_len);
+        }
+        if (unlikely(ret < 0)) {
+            goto out_free;
+        }
+    }
+
+    pr_debug("reclaimed %d children of %lx", batch.nr, dir_addr);
+
+    /* a full batch may have left more children to the next step */
+    ret = batch.nr;
+    done = batch.nr < batch.max;
 
 out_free:
-    free(vec);
+    free(batch.names);
+    free(batch.updates);
+    free(batch.types);
+    free(batch.dentries);
+    if (!done) {
+        goto out;
+    }
+
+out_done:
+    name_len = dir->rec.name_len;
+    err = pop_reclaim_dir(sfs, dir);
+    if (unlikely(err < 0)) {
+        ret = err;
+        goto out;
+    }
+
+    /* a subtree removed before it reached us may have never written its root */
+    if (checkpointed) {
+        dmm_bfree(sfs->dmm, dir_addr, ethane_dentry_size(sfs->dentry_fmt, name_len));
+    }
 
 out:
     return ret;
 }
 
 static void *bm_updater(void *upd_ctx, void *val) {
-    sharedfs_bm_update_record_t *upd = (sharedfs_bm_update_record_t *) upd_ctx;
+    struct bm_extent *upd = (struct bm_extent *) upd_ctx;
     struct bm_extent *ext = (struct bm_extent *) val;
 
-    if (ext->dentry_remote_addr == upd->dentry_remote_addr && ext->start_blkn == upd->loff / BLK_SIZE) {
-        pr_debug("bm update: dentry=%lx blkn=%lx old_blk=%lx new_blk=%lx",
-                 upd->dentry_remote_addr, upd->loff / BLK_SIZE,
+    if (ext->dentry_remote_addr == upd->dentry_remote_addr &&
+        ext->start_blkn == upd->start_blkn && ext->nr_blks == upd->nr_blks) {
+        pr_debug("bm update: dentry=%lx blkn=%d nr_blks=%d old_blk=%lx new_blk=%lx",
+                 upd->dentry_remote_addr, upd->start_blkn, upd->nr_blks,
                  ext->blk_remote_addr, upd->blk_remote_addr);
-        ext->blk_remote_addr = upd->blk_remote_addr;
+        /* keep a newer extent checkpointed by someone else */
+        if (upd->version >= ext->version) {
+            ext->blk_remote_addr = upd->blk_remote_addr;
+            ext->version = upd->version;
+        }
         return ext;
     }
 
     return ERR_PTR(-EINVAL);
 }
 
-int sharedfs_bm_update_batch(sharedfs_t *sfs, int nr_updates, sharedfs_bm_update_record_t *updates) {
-    kv_vec_item_t vec[nr_updates], new_vec[nr_updates];
-    struct bm_data_section_key keys[nr_updates];
-    struct bm_data_section vals[nr_updates];
-    int i, ret, cnt;
+/*
+ * Split the extent of @upd into the largest interval nodes aligned to their size,
+ * filling @vals and their @classes if given. Return the number of nodes.
+ */
+static int split_extent(sharedfs_t *sfs, struct bm_data_section *vals, uint32_t *classes,
+                        const sharedfs_bm_update_record_t *upd) {
+    int start = (int) (upd->loff / BLK_SIZE), blkn = start, end, best, i, n = 0;
 
-    memset(vec, 0, sizeof(vec));
-    memset(new_vec, 0, sizeof(new_vec));
+    ethane_assert(upd->loff % BLK_SIZE == 0);
+
+    end = (int) (ALIGN_UP(upd->loff + upd->size, BLK_SIZE) / BLK_SIZE);
+
+    while (blkn < end) {
+        best = -1;
+        for (i = 0; i < sfs->nr_interval_node_sizes; i++) {
+            if (blkn % sfs->interval_node_nr_blks[i] == 0 && blkn + sfs->interval_node_nr_blks[i] <= end &&
+                (best < 0 || sfs->interval_node_nr_blks[i] > sfs->interval_node_nr_blks[best])) {
+                best = i;
+            }
+        }
+
+        if (unlikely(best < 0)) {
+            pr_err("extent [%d, %d) of dentry %lx does not fit any interval size", blkn, end,
+                   upd->dentry_remote_addr);
+            return -EINVAL;
+        }
+
+        if (vals) {
+            vals[n].ext.dentry_remote_addr = upd->dentry_remote_addr;
+            vals[n].ext.blk_remote_addr = sharedfs_blk_addr_add(upd->blk_remote_addr,
+                                                                (size_t) (blkn - start) * BLK_SIZE);
+            vals[n].ext.start_blkn = blkn;
+            vals[n].ext.nr_blks = sfs->interval_node_nr_blks[best];
+            vals[n].ext.version = upd->version;
+            classes[n] = 1u << best;
+        }
+
+        blkn += sfs->interval_node_nr_blks[best];
+        n++;
+    }
+
+    return n;
+}
+
+/* Merge @bits into the hints of the @n dentries at @addrs (cleared on the way). */
+static int merge_bm_hints(sharedfs_t *sfs, int n, dmptr_t *addrs, const uint32_t *bits) {
+    uint64_t *olds, *srcs, *expected;
+    int i, nr_pending, ret = 0;
+
+    expected = malloc(n * sizeof(*expected));
+    if (unlikely(!expected)) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    dm_mark(sfs->ctx);
+
+    olds = dm_push(sfs->ctx, NULL, n * sizeof(*olds));
+    srcs = dm_push(sfs->ctx, NULL, n * sizeof(*srcs));
+    if (unlikely(!olds || !srcs)) {
+        ret = -ENOMEM;
+        goto out_pop;
+    }
+
+    for (i = 0; i < n; i++) {
+        ret = dm_copy_from_remote(sfs->ctx, &olds[i], DENTRY_FIELD(sfs, addrs[i], bm_hint), sizeof(*olds), 0);
+        if (unlikely(ret < 0)) {
+            goto out_pop;
+        }
+    }
+
+    ret = dm_wait_ack(sfs->ctx, dm_set_ack_all(sfs->ctx));
+    if (unlikely(ret < 0)) {
+        goto out_pop;
+    }
+
+    /* CAS the bits in, retrying the ones raced with another checkpointer */
+    do {
+        nr_pending = 0;
+        for (i = 0; i < n; i++) {
+            if (!addrs[i]) {
+                continue;
+            }
+            srcs[i] = BM_HINT_TAG(addrs[i]) | bm_hint_merge(bm_hint_bits(olds[i], addrs[i]), bits[i]);
+            if (srcs[i] == olds[i]) {
+                addrs[i] = DMPTR_NULL;
+                continue;
+            }
+            expected[i] = olds[i];
+            ret = dm_cas(sfs->ctx, DENTRY_FIELD(sfs, addrs[i], bm_hint), &srcs[i], &olds[i], sizeof(*olds), 0);
+            if (unlikely(ret < 0)) {
+                goto out_pop;
+            }
+            nr_pending++;
+        }
+
+        ret = dm_wait_ack(sfs->ctx, dm_set_ack_all(sfs->ctx));
+        if (unlikely(ret < 0)) {
+            goto out_pop;
+        }
+
+        for (i = 0; i < n; i++) {
+            if (addrs[i] && olds[i] == expected[i]) {
+                addrs[i] = DMPTR_NULL;
+            }
+        }
+    } while (nr_pending);
+
+out_pop:
+    dm_pop(sfs->ctx);
+    free(expected);
+
+out:
+    return ret;
+}
+
+/* Add the classes and ends of the checkpointed extents to the hints of their files. */
+static int update_bm_hints(sharedfs_t *sfs, int nr_exts, struct bm_data_section *vals, uint32_t *classes) {
+    uint32_t *bits, ext_bits;
+    int i, n = 0, ret = 0;
+    dmptr_t *addrs;
+
+    if (!nr_exts) {
+        goto out;
+    }
+
+    addrs = malloc(nr_exts * sizeof(*addrs));
+    bits = malloc(nr_exts * sizeof(*bits));
+    if (unlikely(!addrs || !bits)) {
+        ret = -ENOMEM;
+        goto out_free;
+    }
+
+    /* the extents come sorted by dentry (a repeated one would only cost a failed CAS) */
+    for (i = 0; i < nr_exts; i++) {
+        if (!n || addrs[n - 1] != vals[i].ext.dentry_remote_addr) {
+            addrs[n] = vals[i].ext.dentry_remote_addr;
+            bits[n++] = 0;
+        }
+        ext_bits = classes[i] | BM_HINT_END(vals[i].ext.start_blkn + vals[i].ext.nr_blks);
+        bits[n - 1] = bm_hint_merge(bits[n - 1], ext_bits);
+    }
+
+    ret = merge_bm_hints(sfs, n, addrs, bits);
+
+out_free:
+    free(bits);
+    free(addrs);
+
+out:
+    return ret;
+}
+
+int sharedfs_bm_mark_shared(sharedfs_t *sfs, int nr, const dmptr_t *dentry_remote_addrs) {
+    dmptr_t addrs[nr];
+    uint32_t bits[nr];
+    int i;
+
+    for (i = 0; i < nr; i++) {
+        addrs[i] = dentry_remote_addrs[i];
+        bits[i] = BM_HINT_SHARED;
+    }
+
+    return merge_bm_hints(sfs, nr, addrs, bits);
+}
 
-    /* enumerate all the possible interval nodes */
+int sharedfs_bm_update_batch(sharedfs_t *sfs, int nr_updates, sharedfs_bm_update_record_t *updates) {
+    struct bm_data_section_key *keys = NULL;
+    kv_vec_item_t *vec = NULL, *new_vec = NULL;
+    struct bm_data_section *vals = NULL;
+    uint32_t *classes = NULL;
+    int i, n = 0, ret, cnt;
+
+    /* count the interval nodes the extents are split into */
     for (i = 0; i < nr_updates; i++) {
-        keys[i].dentry_remote_addr = updates[i].dentry_remote_addr;
-        keys[i].start_blkn = (int) (updates[i].loff / BLK_SIZE);
-        /* FIXME: */
-        ethane_assert(updates[i].size == IO_SIZE && updates[i].loff % IO_SIZE == 0);
-        keys[i].nr_blks = IO_SIZE / BLK_SIZE;
+        ret = split_extent(sfs, NULL, NULL, &updates[i]);
+        if (unlikely(ret < 0)) {
+            goto out;
+        }
+        n += ret;
+    }
+
+    keys = malloc(n * sizeof(*keys));
+    vals = malloc(n * sizeof(*vals));
+    classes = malloc(n * sizeof(*classes));
+    vec = calloc(n, sizeof(*vec));
+    new_vec = calloc(n, sizeof(*new_vec));
+    if (unlikely(!keys || !vals || !classes || !vec || !new_vec)) {
+        ret = -ENOMEM;
+        goto out_free;
+    }
+
+    for (i = 0, n = 0; i < nr_updates; i++) {
+        n += split_extent(sfs, &vals[n], &classes[n], &updates[i]);
+    }
+
+    /* enumerate all the interval nodes */
+    for (i = 0; i < n; i++) {
+        keys[i].dentry_remote_addr = vals[i].ext.dentry_remote_addr;
+        keys[i].start_blkn = vals[i].ext.start_blkn;
+        keys[i].nr_blks = vals[i].ext.nr_blks;
         vec[i].key = (const char *) &keys[i];
         vec[i].key_len = sizeof(struct bm_data_section_key);
-        vec[i].upd_ctx = &updates[i];
+        vec[i].upd_ctx = &vals[i].ext;
     }
 
     /* try update */
-    ret = kv_upd_batch(sfs->bm_kv, nr_updates, vec, bm_updater);
+    ret = kv_upd_batch(sfs->bm_kv, n, vec, bm_updater);
     if (unlikely(ret < 0)) {
-        goto out;
+        goto out_free;
     }
 
     /* process new entries */
     cnt = 0;
 
-    for (i = 0; i < nr_updates; i++) {
+    for (i = 0; i < n; i++) {
         if (vec[i].err != -ENOENT) {
             continue;
         }
 
-        vals[i].ext.dentry_remote_addr = updates[i].dentry_remote_addr;
-        vals[i].ext.start_blkn = (int) (updates[i].loff / BLK_SIZE);
-        vals[i].ext.nr_blks = IO_SIZE / BLK_SIZE;
-        vals[i].ext.blk_remote_addr = updates[i].blk_remote_addr;
         vec[i].val = &vals[i];
         new_vec[cnt++] = vec[i];
 
-        pr_debug("bm insert: dentry=%lx blkn=%lx blk=%lx", updates[i].dentry_remote_addr,
-                 updates[i].loff / BLK_SIZE, updates[i].blk_remote_addr);
+        pr_debug("bm insert: dentry=%lx blkn=%d nr_blks=%d blk=%lx", vals[i].ext.dentry_remote_addr,
+                 vals[i].ext.start_blkn, vals[i].ext.nr_blks, vals[i].ext.blk_remote_addr);
     }
 
     ret = kv_put_batch(sfs->bm_kv, cnt, new_vec);
     if (unlikely(ret < 0)) {
-        goto out;
+        goto out_free;
     }
 
+    ret = update_bm_hints(sfs, n, vals, classes);
+
+out_free:
+    free(new_vec);
+    free(vec);
+    free(classes);
+    free(vals);
+    free(keys);
+
 out:
     return ret;
 }
@@ -847,8 +3128,8 @@ out:
 
 static int bm_dump(void *priv, const void *val) {
     struct bm_data_section *v = (struct bm_data_section *) val;
-    pr_info("bm dentry: %lx; start_blkn: %d; nr_blks: %d; blk: %lx",
-            v->ext.dentry_remote_addr, v->ext.start_blkn, v->ext.nr_blks, v->ext.blk_remote_addr);
+    pr_info("bm dentry: %lx; start_blkn: %d; nr_blks: %d; blk: %lx; version: %lu",
+            v->ext.dentry_remote_addr, v->ext.start_blkn, v->ext.nr_blks, v->ext.blk_remote_addr, v->ext.version);
     return 0;
 }
 
@@ -870,3 +3151,32 @@ int sharedfs_dump(sharedfs_t *rfs) {
 out:
     return ret;
 }
+
+int sharedfs_get_ns_key_mode(sharedfs_t *sfs) {
+    return sfs->ns_key_mode;
+}
+
+int sharedfs_get_dentry_format(sharedfs_t *sfs) {
+    return sfs->dentry_fmt;
+}
+
+int sharedfs_resize(sharedfs_t *rfs, int max_load_pct) {
+    int ret, nr_resized;
+
+    ret = kv_resize(rfs->ns_kv, max_load_pct);
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
+    nr_resized = ret;
+
+    ret = kv_resize(rfs->bm_kv, max_load_pct);
+    if (unlikely(ret < 0)) {
+        goto out;
+    }
+    nr_resized += ret;
+
+    ret = nr_resized;
+
+out:
+    return ret;
+}
@@ -9,17 +9,37 @@
 #include "ethane.h"
 #include "dmpool.h"
 #include "dmm.h"
+#include "pathdesc.h"
 
 typedef struct sharedfs sharedfs_t;
 
 typedef struct sharedfs_ns_update_record {
     const char *full_path;
+    /* path state of full_path, see pathdesc.h */
+    uint64_t path_state;
     struct ethane_dentry *dentry;
     bool is_create;
+    /* an existing dentry linked under a new name (rename) */
+    bool is_move;
+    /* the flags and inline data changed, see ETHANE_DENTRY_INLINE_DATA */
+    bool inline_dirty;
+    /* the tombstone of a directory removed with everything below it */
+    bool is_rmtree;
 } sharedfs_ns_update_record_t;
 
+/* Namespace KV key modes, chosen at format time */
+#define SHAREDFS_NS_KEY_FULL_PATH   0
+/* (parent dentry pointer, name) keys: renames are O(1), lookups walk one level per round trip */
+#define SHAREDFS_NS_KEY_PARENT      1
+
+/* The "data block" of a hole: reads as zeros, never read from or written to */
 #define SHAREDFS_ZERO_BLK_ADDR      ((dmptr_t) (0x1000))
 
+/* Address of the data @delta bytes into the block at @addr, a hole stays a hole. */
+static inline dmptr_t sharedfs_blk_addr_add(dmptr_t addr, size_t delta) {
+    return addr == SHAREDFS_ZERO_BLK_ADDR ? addr : addr + delta;
+}
+
 /*
  * The caller should guarantee that these records are **ORDERED**
  * by <remote_dentry_addr, loff>.
@@ -28,12 +48,17 @@ typedef struct sharedfs_bm_update_record {
     dmptr_t dentry_remote_addr;
     size_t loff, size;
     dmptr_t blk_remote_addr;
+    size_t version;
 } sharedfs_bm_update_record_t;
 
 dmptr_t sharedfs_create(dmcontext_t *ctx, dmm_cli_t *dmm, int nr_internal_node_sizes, int *internal_node_nr_blks,
-                        size_t ns_kv_size, size_t bm_kv_size, int nr_shards);
+                        size_t ns_kv_size, size_t bm_kv_size, int nr_shards,
+                        int ns_kv_bucket_nr_slots, int bm_kv_bucket_nr_slots,
+                        int kv_max_kick_depth, int kv_stash_nr_slots, int ns_key_mode, bool ns_inline_dentry,
+                        int dentry_fmt, size_t ns_filter_size);
 sharedfs_t *sharedfs_init(dmcontext_t *ctx, dmm_cli_t *dmm, dmlocktab_t *locktab,
-                          dmptr_t sharedfs_info_remote_addr, int nr_max_outstanding_updates);
+                          dmptr_t sharedfs_info_remote_addr, int nr_max_outstanding_updates,
+                          int kv_cache_nr_ents, long kv_cache_staleness_us);
 
 /* sharedfs Read Functions */
 
@@ -45,17 +70,57 @@ sharedfs_t *sharedfs_init(dmcontext_t *ctx, dmm_cli_t *dmm, dmlocktab_t *locktab
  * The initial value of each @file's remote_file field should be DMPTR_NULL. If cached, then
  * you can set it to the corresponding address. sharedfs will skip the lookup of cached prefix.
  */
-int sharedfs_ns_lookup_dentries(sharedfs_t *rfs, const char *full_path, struct ethane_dentry **dentries);
+/* @pd (optional) describes @full_path; its prefix states are reused as KV key states. */
+int sharedfs_ns_lookup_dentries(sharedfs_t *rfs, const char *full_path, const pathdesc_t *pd,
+                                struct ethane_dentry **dentries);
+/*
+ * Lookup several paths at once: @dentries holds the per-component dentries of each path
+ * in turn (pds[i]->depth each). Prefixes shared by the paths should point to the same
+ * dentry, they are then looked up only once.
+ */
+int sharedfs_ns_lookup_dentries_batch(sharedfs_t *rfs, int nr_paths, const pathdesc_t **pds,
+                                      struct ethane_dentry **dentries);
 int sharedfs_ns_get_dentry(sharedfs_t *rfs, dmptr_t remote_dentry_addr, struct ethane_dentry *dentry, size_t filename_read_len);
 
-int sharedfs_bm_get_extent(sharedfs_t *rfs, dmptr_t *remote_addr, size_t *size,
+/*
+ * Whether @full_path (in directory @parent) may be in the namespace KV: 0 means it surely is
+ * not, without a KV probe. Always 1 if the namespace is formatted without a filter.
+ */
+int sharedfs_ns_may_exist(sharedfs_t *rfs, const char *full_path, const pathdesc_t *pd, dmptr_t parent);
+
+/* Called for each child of a directory; a non-zero return stops the walk and is returned. */
+typedef int (*sharedfs_filldir_t)(void *priv, const char *filename);
+
+/* Walk the checkpointed children of the directory at @dir_remote_addr. */
+int sharedfs_ns_read_dir(sharedfs_t *rfs, dmptr_t dir_remote_addr, sharedfs_filldir_t filler, void *priv);
+
+/*
+ * Get the mapped range [*loff, *loff + *size) holding @off, whose data starts at *remote_addr.
+ * An unmapped @off gets a hole range with *remote_addr set to SHAREDFS_ZERO_BLK_ADDR.
+ */
+int sharedfs_bm_get_extent(sharedfs_t *rfs, dmptr_t *remote_addr, size_t *loff, size_t *size,
                            struct ethane_dentry *dentry, size_t off);
 
 /* sharedfs Batch Update Functions */
 
 int sharedfs_ns_update_batch(sharedfs_t *rfs, int nr_updates, sharedfs_ns_update_record_t *updates);
+/*
+ * Reclaim up to @max_nr_children descendants of the subtrees removed by the checkpoints of
+ * this client id: their keys, block mappings, data blocks and dentries. @head and @tail are
+ * the log head and tail, a subtree is only taken apart once the head passes the tail seen
+ * when it came up. Return the number of descendants reclaimed.
+ */
+int sharedfs_ns_reclaim(sharedfs_t *rfs, int max_nr_children, size_t head, size_t tail);
 int sharedfs_bm_update_batch(sharedfs_t *rfs, int nr_updates, sharedfs_bm_update_record_t *updates);
+/* Flag the files at @dentry_remote_addrs as sharing their blocks, which are then never freed. */
+int sharedfs_bm_mark_shared(sharedfs_t *rfs, int nr, const dmptr_t *dentry_remote_addrs);
 
 int sharedfs_dump(sharedfs_t *rfs);
 
+int sharedfs_get_ns_key_mode(sharedfs_t *rfs);
+
+int sharedfs_get_dentry_format(sharedfs_t *rfs);
+
+int sharedfs_resize(sharedfs_t *rfs, int max_load_pct);
+
 #endif //ETHANE_SHAREDFS_H
@@ -33,7 +33,13 @@ typedef enum {
     TRACE_OP_READ = 7,
     TRACE_OP_TRUNCATE = 8,
     TRACE_OP_APPEND = 9,
-    TRACE_OP_READDIR = 10
+    TRACE_OP_READDIR = 10,
+    TRACE_OP_RENAME = 11,
+    TRACE_OP_WRITE_INLINE = 12,
+    TRACE_OP_WRITE_RANGE = 13,
+    TRACE_OP_MKDIR_RECURSIVE = 14,
+    TRACE_OP_RMTREE = 15,
+    TRACE_OP_CLONE = 16
 } trace_op_class_t;
 
 typedef enum {
@@ -178,6 +184,12 @@ TRACEPOINT_ENUM(
         ctf_enum_value("TRUNCATE", TRACE_OP_TRUNCATE)
         ctf_enum_value("APPEND", TRACE_OP_APPEND)
         ctf_enum_value("READDIR", TRACE_OP_READDIR)
+        ctf_enum_value("RENAME", TRACE_OP_RENAME)
+        ctf_enum_value("WRITE_INLINE", TRACE_OP_WRITE_INLINE)
+        ctf_enum_value("WRITE_RANGE", TRACE_OP_WRITE_RANGE)
+        ctf_enum_value("MKDIR_RECURSIVE", TRACE_OP_MKDIR_RECURSIVE)
+        ctf_enum_value("RMTREE", TRACE_OP_RMTREE)
+        ctf_enum_value("CLONE", TRACE_OP_CLONE)
     )
 )
 